@@ -9,6 +9,10 @@
 #include "NME.h"
 
 #define kMaxNesting 8	///< maximum nesting of lists
+#define kMaxDeferred 64	///< maximum number of slots reserved with NMEAddDeferred
+
+/// Bit of autoconverts[k] in dispatch tables (shared by k >= 30)
+#define autoconvertBit(k) ((NMEInt)1 << ((k) < 30 ? (k) : 30))
 
 /** Special codes for list items (positive values are item numbers for OL) */
 enum
@@ -39,7 +43,7 @@ enum
 	(((c) & 0x80) == 0 || ((c) & 0xe0) == 0xc0 || ((c) & 0xf0) == 0xe0)
 
 /// Maximum number of numbered heading levels
-#define kMaxNumberedHeadingLevels 2
+#define kMaxNumberedHeadingLevels kNMEMaxNumberedHeadingLevels
 
 /// Maximum number of heading-separated section levels
 #define kMaxSectionLevels 4
@@ -47,6 +51,15 @@ enum
 /// Tabulator width
 #define kTabWidth 4
 
+/// Minimum size by which the buffers of an output sink are grown
+#define kNMESinkMinSize 1024
+
+/// Output size above which NMEProcessToSink flushes complete lines
+#define kNMESinkFlushSize 4096
+
+/// Number of bytes of output kept before reparsed text (for lookbehind)
+#define kNMEReparseLookbehind 2
+
 /// Assign return value to err and return it unless kNMEErrOk
 #define CheckError(c) \
 	do { err = (c); if (err != kNMEErrOk) return err; } while (0)
@@ -107,13 +120,25 @@ typedef enum NMEStyle
 	kNMEStylesCount	///< number of different styles (max. nesting)
 } NMEStyle;
 
+/** Slot of output reserved with NMEAddDeferred */
+typedef struct
+{
+	NMEInt outputIndex;	///< index in output (including flushed output)
+	NMEDeferredFun fun;	///< callback which fills the slot
+	NMEInt id;	///< value passed to fun
+	void *data;	///< value passed to fun
+} NMEDeferredSlot;
+
 /** Context used by NMEAddString */
 struct NMEContextStruct
 {
 	NMEText dest;	///< address of encoded text
 	NMEInt destLen;	///< current length of dest
 	
-	NMEInt destLenUCS16;	///< destLen in UCS16 (16-bit unicode), assuming UTF-8 input
+	NMEInt destOffsetUCS16;	///< length in UCS16 of output flushed before dest[0]
+	NMEInt countedLen;	///< length of the beginning of dest already counted in UCS16
+	NMEInt countedUCS16;	///< length of dest[0..countedLen-1] in UCS16
+	NMEBoolean countFlushedUCS16;	///< TRUE to count output in UCS16 before flushing it
 	
 	NMEText src;	///< NME source text
 	NMEInt srcIndex;	///< index in src[]
@@ -122,16 +147,32 @@ struct NMEContextStruct
 	
 	NMEInt bufSize;	///< size of dest and src
 	
+	NMEInt destOffset;	///< number of bytes of output already flushed before dest[0]
+	NMEOutputSink const *sink;	///< output sink (NULL for fixed-size buffer)
+	NMEText *sinkBuf;	///< address of sink buffer (dest), grown with sink->growFun
+	NMEInt *sinkBufSize;	///< address of size of sink buffer
+	NMEText *scratch;	///< address of buffer for reparsed source in sink mode
+	NMEInt *scratchSize;	///< address of size of scratch buffer
+	NMEInt flushRetryLen;	///< destLen from which flushOutput is tried again after a failure
+	NMEInt peakSize;	///< max. size of src or dest NMEProcess would have needed so far
+	NMEBoolean destFull;	///< TRUE once output hasn't fit in dest (even if ignored)
+	
 	NMEInt currentIndent;	///< current indenting (0=none, 1=next one, etc.)
 	NMEInt col;	///< current column
+	NMEInt wrapLine;	///< index in dest of the beginning of the line scanned for wordwrap
+	NMEInt wrapScanned;	///< index in dest of the first byte not checked yet for wordwrap
+	NMEInt wrapPoint;	///< last wordwrap point found in dest[wrapLine..wrapScanned-1], or -1
+	NMEWordwrapPermission wrapPerm;	///< kind of wordwrap at wrapPoint
 	
 	NMEInt listNum[kMaxNesting];	///< current number or kNMEListNumUL/DT/DD/Indented
 	NMEInt nesting;	///< level of list nesting (0 outside)
+	NMEChar listNesting[kMaxNesting + 1];	///< string returned by NMECurrentListNesting
 	
 	NMEOutputFormat const *outputFormat;	///< output format strings
 	NMEConstText eol;	///< null-terminated string used for end-of-line
 	NMEChar ctrlChar;	///< control character for embedded expressions (usually %)
 	NMEInt options;	///< kNMEProcessOptDefault or sum of options
+	NMEChar markupChars[256];	///< markupChar specialized for options (see initMarkupChars)
 	
 	NMEInt fontSize;	///< font size of text in points
 	
@@ -141,11 +182,34 @@ struct NMEContextStruct
 	NMEInt linkLength;///< length of link/image in src for the current kNMEStyleLink/kNMEStyleImage
 	
 	NMEBoolean xref;	///< TRUE if headings should have labels for hyperlink targets
+	
+	NMEInt *dependencies;	/**< kDependOutput etc. are added when output
+		depends on the text around the segment (NULL if not tracked) */
+	
+	NMEDeferredSlot deferred[kMaxDeferred];	///< slots reserved with NMEAddDeferred
+	NMEInt deferredCount;	///< number of slots in deferred
 };
 
 /// Set the context level and item number
 #define setContext(c, l, i) do { (c).level = l; (c).item = (i) < 0 ? 0 : (i); } while (0)
 
+/// Dependencies of the output of a segment on the text around it
+enum
+{
+	kDependOutput = 1,	///< output of previous segments
+	kDependOutputIndex = 2,	///< output index written to output (%{p})
+	kDependSrcIndex = 4,	///< source index written to output (%{o})
+	kDependIndexQuery = 8,	///< output index passed to hooks or plugins
+	kDependFollowing = 16,	///< following text (segment not ended between paragraphs)
+	kDependPlugin = 32,	///< plugin output (may depend on the whole document)
+	kDependContext = 64	///< conversion state queried by hooks, plugins or autoconverts
+};
+
+/// Record that output depends on the text around the segment (see
+/// NMEProcessParallel and NMEIncrementalEdit)
+#define addDependency(c, d) \
+	do { if ((c)->dependencies) *(c)->dependencies |= (d); } while (0)
+
 /** Skip spaces and tabs
 	@param[in] src source text with markup
 	@param[in] srcLen source text length
@@ -157,6 +221,180 @@ static void skipBlanks(NMEConstText src, NMEInt srcLen, NMEInt *i)
 		(*i)++;
 }
 
+/** Check that dest has room for some more bytes, growing it with the output
+	sink if there is one.
+	@param[in,out] context current context
+	@param[in] len number of bytes which will be appended to dest
+	@return TRUE for success, FALSE for failure (not enough space)
+*/
+static NMEBoolean checkDestSize(NMEContext *context, NMEInt len)
+{
+	NMEInt size;
+	
+	if (context->destOffset + context->destLen + len > context->peakSize)
+		context->peakSize = context->destOffset + context->destLen + len;
+	
+	if (context->destLen + len <= context->bufSize)
+		return TRUE;
+	if (!context->sink)
+	{
+		context->destFull = TRUE;
+		return FALSE;
+	}
+	
+	size = 2 * context->bufSize;
+	if (size < context->destLen + len + kNMESinkMinSize)
+		size = context->destLen + len + kNMESinkMinSize;
+	if (context->sink->growFun(context->sinkBuf, context->sinkBufSize, size,
+				context->sink->data) != kNMEErrOk
+			|| *context->sinkBufSize < context->destLen + len)
+	{
+		context->destFull = TRUE;
+		return FALSE;
+	}
+	context->dest = *context->sinkBuf;
+	context->bufSize = *context->sinkBufSize;
+	return TRUE;
+}
+
+/** Count UCS16 (16-bit unicode) characters in UTF-8 text.
+	@param[in] str UTF-8 text
+	@param[in] len length of str in bytes
+	@return length of str in UCS16
+*/
+static NMEInt countUCS16(NMEConstText str, NMEInt len)
+{
+	NMEInt i, n;
+	
+	// branchless, so that the compiler can vectorize it
+	for (i = n = 0; i < len; i++)
+		n += isFirstUTF8Byte(str[i]);
+	return n;
+}
+
+/** Get the current output index in UCS16, counting output written since the
+	last call.
+	@param[in,out] context current context
+	@return length of output in UCS16
+*/
+static NMEInt outputIndexUCS16(NMEContext *context)
+{
+	context->countedUCS16 += countUCS16(context->dest + context->countedLen,
+			context->destLen - context->countedLen);
+	context->countedLen = context->destLen;
+	return context->destOffsetUCS16 + context->countedUCS16;
+}
+
+/** Forget the UCS16 count of output from some index, before it is modified
+	or discarded.
+	@param[in,out] context current context
+	@param[in] index index in dest of the first byte which will change
+*/
+static void discardUCS16(NMEContext *context, NMEInt index)
+{
+	if (index < context->countedLen)
+	{
+		context->countedUCS16 -= countUCS16(context->dest + index,
+				context->countedLen - index);
+		context->countedLen = index;
+	}
+}
+
+/** Forget what has been computed about output from some index (UCS16 length,
+	wordwrap points), before it is modified or discarded.
+	@param[in,out] context current context
+	@param[in] index index in dest of the first byte which will change
+*/
+static void invalidateOutput(NMEContext *context, NMEInt index)
+{
+	NMEInt k;
+	
+	discardUCS16(context, index);
+	
+	// wordwrap permission at index-1 may depend on dest[index]
+	if (index - 1 < context->wrapScanned)
+	{
+		if (index - 1 >= context->wrapLine && context->wrapPoint < index - 1)
+			context->wrapScanned = index - 1;	// wrapPoint is still valid
+		else
+		{
+			// scan again the line from its beginning
+			if (index < context->wrapLine)
+			{
+				for (k = index; k > 0 && !isEol(context->dest[k - 1]); k--)
+					;
+				context->wrapLine = k;
+			}
+			context->wrapScanned = context->wrapLine;
+			context->wrapPoint = -1;
+		}
+	}
+}
+
+/** Pass complete lines of output (or the whole output) to the flush
+	callback of the output sink and remove them from dest.
+	@param[in,out] context current context
+	@param[in] all TRUE to flush the whole output, FALSE to keep the current line
+	and the reparse lookbehind before it
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr flushOutput(NMEContext *context, NMEBoolean all)
+{
+	NMEInt n, i;
+	NMEErr err;
+	
+	// find end of last complete line
+	for (n = context->destLen; !all && n > 0 && !isEol(context->dest[n - 1]); n--)
+		;
+	if (!all)
+		n -= kNMEReparseLookbehind;
+	// output from the first deferred slot is kept until it's filled
+	if (context->deferredCount > 0
+			&& n > context->deferred[0].outputIndex - context->destOffset)
+		n = context->deferred[0].outputIndex - context->destOffset;
+	if (n <= 0)
+	{
+		// don't scan the output again before it has grown enough (at least
+		// doubled, so that the cost of scanning long lines remains linear)
+		if (!all)
+			context->flushRetryLen = context->destLen
+					+ (context->destLen > kNMESinkFlushSize
+						? context->destLen : kNMESinkFlushSize);
+		return kNMEErrOk;
+	}
+	
+	err = context->sink->flushFun(context->dest, n, context->sink->data);
+	if (err != kNMEErrOk)
+		return err;
+	
+	// keep UCS16 length of flushed output only if it will be needed
+	if (context->countFlushedUCS16)
+	{
+		discardUCS16(context, n);
+		context->destOffsetUCS16 += context->countedUCS16
+				+ countUCS16(context->dest + context->countedLen,
+					n - context->countedLen);
+	}
+	context->countedLen = context->countedUCS16 = 0;
+	
+	// move current line to the beginning of dest
+	for (i = n; i < context->destLen; i++)
+		context->dest[i - n] = context->dest[i];
+	context->destLen -= n;
+	context->wrapLine -= n;
+	context->wrapScanned -= n;
+	context->wrapPoint = context->wrapPoint >= n ? context->wrapPoint - n : -1;
+	if (context->wrapLine < 0)
+	{
+		context->wrapLine = context->wrapScanned = 0;
+		context->wrapPoint = -1;
+	}
+	context->destOffset += n;
+	context->flushRetryLen = 0;
+	
+	return kNMEErrOk;
+}
+
 /** Execute operator.
 	@param[in,out] stack operand stack
 	@param[in,out] stackDepth operand stack depth
@@ -202,18 +440,111 @@ static void execOperator(NMEInt stack[], NMEInt *stackDepth, NMEChar op)
 	(*stackDepth)--;
 }
 
-/** Evaluate expression (Are supported: + - * / = !(ne) > < & |, parenthesis,
-	integers, l=level, i=item, s=size).
+#define kExprStackSize 16	///< size of operand and operator stacks
+#define kExprErrorValue 1	///< default value if error
+
+/// Kinds of items of expressions, in the order they are evaluated (postfix)
+enum
+{
+	kExprNumber = 0,	///< integer
+	kExprVariable,	///< variable (name as value)
+	kExprOperator	///< operator (character as value)
+};
+
+/** State of expression parser. Items are either evaluated as they are
+	parsed, or stored in postfix order by NMECompileOutputFormat.
+*/
+typedef struct
+{
+	NMEContext const *context;	///< context for variables
+	NMEInt stack[kExprStackSize];	///< stack of operands (intermediate results)
+	NMEInt stackDepth;	///< depth of stack
+	NMEInt *code;	///< compiled items (pairs of kind and value), or NULL to evaluate
+	NMEInt codeSize;	///< size of code
+	NMEInt codeLen;	///< current length of code
+	NMEBoolean overflow;	///< TRUE if code is too small
+	NMEBoolean constant;	///< TRUE if code has no variable
+} ExprParser;
+
+/** Get the value of a variable in expressions.
+	@param[in] name variable name
+	@param[in] context context for variables
+	@return value
+*/
+static NMEInt variableValue(NMEChar name, NMEContext const *context)
+{
+	switch (name)
+	{
+		case 'l':
+			return context->level;
+		case 'i':
+			return context->item;
+		case 's':
+			return context->fontSize;
+		case 'o':
+			addDependency(context, kDependSrcIndex);
+			return context->srcIndexOffset + context->srcIndex;
+		case 'p':
+			addDependency(context, kDependOutputIndex);
+			return context->destOffset + context->destLen;
+		case 'x':
+			return context->xref;
+		default:
+			// custom variable
+			return context->outputFormat && context->outputFormat->getVarFun
+					? context->outputFormat->getVarFun(name,
+							context->outputFormat->getVarData)
+					: 0;
+	}
+}
+
+/** Evaluate or compile an expression item.
+	@param[in,out] parser parser state
+	@param[in] kind kExprNumber, kExprVariable or kExprOperator
+	@param[in] value number, variable name or operator
+	@return TRUE for success, FALSE if operand stack overflow
+*/
+static NMEBoolean exprItem(ExprParser *parser, NMEInt kind, NMEInt value)
+{
+	if (parser->code)
+	{
+		// parameters which are constant during a conversion are replaced with their value
+		if (kind == kExprVariable && (value == 's' || value == 'x'))
+		{
+			kind = kExprNumber;
+			value = variableValue((NMEChar)value, parser->context);
+		}
+		if (kind == kExprVariable)
+			parser->constant = FALSE;
+		if (parser->codeLen + 2 > parser->codeSize)
+			parser->overflow = TRUE;
+		else
+		{
+			parser->code[parser->codeLen++] = kind;
+			parser->code[parser->codeLen++] = value;
+		}
+	}
+	else if (kind == kExprOperator)
+		execOperator(parser->stack, &parser->stackDepth, (NMEChar)value);
+	else if (parser->stackDepth >= kExprStackSize)
+		return FALSE;
+	else
+		parser->stack[parser->stackDepth++] = kind == kExprNumber
+				? value
+				: variableValue((NMEChar)value, parser->context);
+	return TRUE;
+}
+
+/** Parse expression (Are supported: + - * / = !(ne) > < & |, parenthesis,
+	integers, l=level, i=item, s=size), evaluating or compiling its items.
 	@param[in] src source code
 	@param[in] srcLen length of source code
-	@param[in] context context for variables
-	@return result, or 1 if error
+	@param[in,out] parser parser state
+	@return TRUE for success, FALSE if error
 */
-static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
-		NMEContext const *context)
+static NMEBoolean parseExpression(NMEConstText src, NMEInt srcLen,
+		ExprParser *parser)
 {
-#define kExprStackSize 16	///< size of operand and operator stacks
-#define kExprErrorValue 1	///< default value if error
 	static struct
 	{
 		NMEChar op;	///< operator character (nul for end of list)
@@ -227,19 +558,17 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 		{'*', 5}, {'/', 5},
 		{'\0', 0}
 	};
-	NMEInt stack[kExprStackSize];	// stack of operands (intermediate results)
-	NMEInt stackDepth;
 	NMEInt opStack[kExprStackSize];
 		// stack of waiting operators (index in opList, -1=parenthesis)
 	NMEInt opStackDepth;
-	NMEInt i, j;
+	NMEInt i, j, n;
 	
-	for (i = stackDepth = opStackDepth = 0; ; )
+	for (i = opStackDepth = 0; ; )
 	{
 		skipBlanks(src, srcLen, &i);
 		
 		if (i >= srcLen)
-			return 1;	// unexpected end of expression
+			return FALSE;	// unexpected end of expression
 		
 		// decode opening parenthesis
 		while (i < srcLen && src[i] == '(' && opStackDepth < kExprStackSize)
@@ -251,44 +580,21 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 		
 		// decode number or variable
 		if (isDigit(src[i]))
-			for (stack[stackDepth] = 0; i < srcLen && isDigit(src[i]); i++)
-				stack[stackDepth] = 10 * stack[stackDepth] + src[i] - '0';
+		{
+			for (n = 0; i < srcLen && isDigit(src[i]); i++)
+				n = 10 * n + src[i] - '0';
+			if (!exprItem(parser, kExprNumber, n))
+				return FALSE;
+		}
+		else if (src[i] == 'l' || src[i] == 'i' || src[i] == 's'
+				|| src[i] == 'o' || src[i] == 'p' || src[i] == 'x'
+				|| src[i] >= 'A' && src[i] <= 'Z')
+		{
+			if (!exprItem(parser, kExprVariable, src[i++]))
+				return FALSE;
+		}
 		else
-			switch (src[i++])
-			{
-				case 'l':
-					stack[stackDepth] = context->level;
-					break;
-				case 'i':
-					stack[stackDepth] = context->item;
-					break;
-				case 's':
-					stack[stackDepth] = context->fontSize;
-					break;
-				case 'o':
-					stack[stackDepth] = context->srcIndex;
-					break;
-				case 'p':
-					stack[stackDepth] = context->destLen;
-					break;
-				case 'x':
-					stack[stackDepth] = context->xref;
-					break;
-				default:
-					if (src[i - 1] >= 'A' && src[i - 1] <= 'Z')
-					{
-						// custom variable
-						if (context->outputFormat->getVarFun)
-							stack[stackDepth]
-									= context->outputFormat->getVarFun(src[i - 1],
-											context->outputFormat->getVarData);
-						else
-							stack[stackDepth] = 0;
-					}
-					else
-						return kExprErrorValue;	// unknown variable, or garbage
-			}
-		stackDepth++;
+			return FALSE;	// unknown variable, or garbage
 		
 		skipBlanks(src, srcLen, &i);
 		
@@ -298,9 +604,8 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 			// flush all waiting operators, including parenthesis not closed
 			for ( ; opStackDepth > 0; opStackDepth--)
 				if (opStack[opStackDepth - 1] >= 0)
-					execOperator(stack, &stackDepth,
-							opList[opStack[opStackDepth - 1]].op);
-			return stack[0];
+					exprItem(parser, kExprOperator, opList[opStack[opStackDepth - 1]].op);
+			return TRUE;
 		}
 		
 		// decode closing parenthesis (those without matching opening parenthesis are ignored)
@@ -308,8 +613,7 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 		{
 			// flush waiting operators until matching opening parenthesis
 			for ( ; opStackDepth > 0 && opStack[opStackDepth - 1] >= 0; opStackDepth--)
-				execOperator(stack, &stackDepth,
-						opList[opStack[opStackDepth - 1]].op);
+				exprItem(parser, kExprOperator, opList[opStack[opStackDepth - 1]].op);
 			if (opStackDepth > 0)
 				opStackDepth--;	// opening parenthesis
 			
@@ -322,18 +626,18 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 		for (j = 0; opList[j].op && src[i] != opList[j].op; j++)
 			;
 		if (!opList[j].op)
-			return kExprErrorValue;	// unknown operator, or garbage
+			return FALSE;	// unknown operator, or garbage
 		
 		// execute operators with higher priority
 		for ( ; opStackDepth > 0
 					&& opStack[opStackDepth - 1] >= 0
 					&& opList[j].priority <= opList[opStack[opStackDepth - 1]].priority;
 				opStackDepth--)
-			execOperator(stack, &stackDepth, opList[opStack[opStackDepth - 1]].op);
+			exprItem(parser, kExprOperator, opList[opStack[opStackDepth - 1]].op);
 		
 		// give up if op stack is full
 		if (opStackDepth >= kExprStackSize)
-			return kExprErrorValue;
+			return FALSE;
 		
 		// store operator in opStack
 		opStack[opStackDepth++] = j;
@@ -343,142 +647,484 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 	}
 }
 
-NMEBoolean NMEAddString(NMEConstText str,
-		NMEInt strLen,
-		NMEChar ctrlChar,
-		NMEContext *context)
+/** Evaluate expression.
+	@param[in] src source code
+	@param[in] srcLen length of source code
+	@param[in] context context for variables
+	@return result, or 1 if error
+*/
+static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
+		NMEContext const *context)
 {
-	NMEInt k;
+	ExprParser parser;
 	
-	if (!str)
-		return TRUE;	// no op if str is NULL
+	parser.context = context;
+	parser.stackDepth = 0;
+	parser.code = NULL;
+	return parseExpression(src, srcLen, &parser) ? parser.stack[0] : kExprErrorValue;
+}
+
+/** Evaluate compiled expression.
+	@param[in] code items of expression (pairs of kind and value)
+	@param[in] codeLen length of code
+	@param[in] context context for variables
+	@return result
+*/
+static NMEInt evalCompiledExpression(NMEInt const *code, NMEInt codeLen,
+		NMEContext const *context)
+{
+	ExprParser parser;
+	NMEInt i;
 	
-	if (strLen < 0)
-		for (strLen = 0; str[strLen]; strLen++)
-			;
+	parser.context = context;
+	parser.stackDepth = 0;
+	parser.code = NULL;
+	for (i = 0; i < codeLen; i += 2)
+		if (!exprItem(&parser, code[i], code[i + 1]))
+			return kExprErrorValue;
+	return parser.stack[0];
+}
+
+/// Operations of compiled format strings (see NMECompileOutputFormat)
+enum
+{
+	kOpEnd = 0,	///< end of string
+	kOpText,	///< literal text (offset in string, length)
+	kOpEol,	///< end of line followed by indenting
+	kOpNumber,	///< result of expression (length of expression, expression)
+	kOpRepeat,	/**< replicated string (length of expression, expression,
+		length of ops of string, ops of string ending with kOpEnd) */
+	kOpListNesting	///< current list nesting
+};
+
+/** Write end of line followed by indenting (space must have been checked).
+	@param[in,out] context current context
+*/
+static void writeEol(NMEContext *context)
+{
+	NMEInt i;
 	
-	for (k = 0; k < strLen; )
-		if (context->destLen
-					+ (str[k] == '\n' ? (context->eol[1] ? 1 : 0)
-						+ context->currentIndent : 0)
-				>= context->bufSize)
-			return FALSE;
-		else if (str[k] == '\n')
+	context->dest[context->destLen++] = context->eol[0];
+	if (context->eol[1])
+		context->dest[context->destLen++] = context->eol[1];
+	for (i = 0; i < context->currentIndent; i++)
+		context->dest[context->destLen++] = ' ';
+	context->col = context->currentIndent;
+}
+
+/** Write the result of an expression (space for 12 bytes must have been checked).
+	@param[in,out] context current context
+	@param[in] result number to write
+*/
+static void writeNumber(NMEContext *context, NMEInt result)
+{
+	NMEInt i;
+	
+	if (result < 0)
+	{
+		context->dest[context->destLen++] = '-';
+		result = -result;
+		context->col++;
+	}
+	for (i = 1000000000; i >= 1; i /= 10)
+		if (result >= i || i == 1)
 		{
-			NMEInt i;
-			
-			context->dest[context->destLen++] = context->eol[0];
-			context->destLenUCS16++;
-			if (context->eol[1])
-			{
-				context->dest[context->destLen++] = context->eol[1];
-				context->destLenUCS16++;
-			}
-			k++;
-			for (i = 0; i < context->currentIndent; i++)
-			{
-				context->dest[context->destLen++] = ' ';
-				context->destLenUCS16++;
-			}
-			context->col = context->currentIndent;
+			context->dest[context->destLen++] = '0' + (result / i) % 10;
+			context->col++;
 		}
-		else if (k + 2 < strLen
-				&& str[k] == ctrlChar
-				&& (str[k + 1] == '{' || str[k + 1] == ctrlChar && str[k + 2] == '{'))
+}
+
+/** Get the NME markup character of a level of list nesting.
+	@param[in] context current context
+	@param[in] i level of list nesting (0 = outermost)
+	@return markup character
+*/
+static NMEChar listNestingChar(NMEContext const *context, NMEInt i)
+{
+	return context->listNum[i] == kNMEListNumUL ? '*'
+			: context->listNum[i] == kNMEListNumDT ? ';'
+			: context->listNum[i] == kNMEListNumDD ? ':'
+			: context->listNum[i] == kNMEListIndented ? ':' : '#';
+}
+
+/** Write the current list nesting (space for kMaxNesting bytes must have
+	been checked).
+	@param[in,out] context current context
+*/
+static void writeListNesting(NMEContext *context)
+{
+	NMEInt i;
+	
+	for (i = 0; i < context->level; i++)
+		context->dest[context->destLen++] = listNestingChar(context, i);
+	context->col += context->level;
+}
+
+/** Replicate the string which has just been written at the end of dest.
+	@param[in,out] context current context
+	@param[in] repStr offset of string in dest
+	@param[in] col0 value of col before the string was written
+	@param[in] result number of times the string is replicated
+	@return TRUE for success, FALSE for failure (not enough space)
+*/
+static NMEBoolean replicateString(NMEContext *context,
+		NMEInt repStr, NMEInt col0, NMEInt result)
+{
+	NMEInt i, repStrLen, eolEnd = 0;
+	
+	repStrLen = context->destLen - repStr;
+	invalidateOutput(context, repStr);
+	context->destLen = repStr;
+	context->col = col0;
+	
+	// copy result times dest[*destLen..*destLen+len-1]
+	if (result > 100)
+		result = 100;	// avoid overflows
+	if (result > 0 && !checkDestSize(context, result * repStrLen))
+		return FALSE;
+	for (i = 0; i < repStrLen; i++)
+		if (isEol(context->dest[repStr + i]))
+			eolEnd = i + 1;
+	for (; result > 0; result--)
+	{
+		for (i = 0; i < repStrLen; i++)
+			context->dest[context->destLen++] = context->dest[repStr + i];
+		// column restarts after an end of line in the replicated string
+		context->col = eolEnd > 0 ? repStrLen - eolEnd : context->col + repStrLen;
+	}
+	return TRUE;
+}
+
+/** Add a compiled format string to output.
+	@param[in] str format string
+	@param[in] code ops of str, ending with kOpEnd
+	@param[in,out] context current context
+	@return TRUE for success, FALSE for failure (not enough space)
+*/
+static NMEBoolean addCompiledString(NMEConstText str, NMEInt const *code,
+		NMEContext *context)
+{
+	NMEInt i, result, repStr, col0;
+	
+	for (;;)
+		switch (*code)
 		{
-			NMEBoolean replicate;
-			NMEText repStr;
-			NMEInt len, result, i, repStrLen, col0, destLenUCS160;
-			
-			replicate = str[k + 1] == ctrlChar;
-			if (replicate)
-				k++;
-			for (k += 2, len = 0; k + len < strLen && str[k + len] != '}'; len++)
-				;
-			if (k + len >= strLen)	// unexpected end of string
-				return TRUE;	// don't report error (enough space)
-			result = evalExpression(str + k, len, context);
-			k += len + 1;	// skip after }
-			if (replicate)
-			{
-				// find string, until double-ctrlChar
-				for (len = 0;
-						k + len + 1 < strLen
-							&& (str[k + len] != ctrlChar
-									|| str[k + len + 1] != ctrlChar);
-						len++)
-					;
-				// copy once, evaluating expressions
-				// (cannot have more recursive calls, because they occur only when
-				// the string contains double-ctrlChar which cannot happen here)
-				repStr = context->dest + context->destLen;	// repl. string after expr substitutions
-				destLenUCS160 = context->destLenUCS16;
-				col0 = context->col;
-				if (!NMEAddString(str + k, len, context->ctrlChar, context))
+			case kOpText:
+				if (!checkDestSize(context, code[2]))
 					return FALSE;
-				repStrLen = context->dest + context->destLen - repStr;
-				context->destLen = repStr - context->dest;
-				context->destLenUCS16 = destLenUCS160;
-				context->col = col0;
-				
-				// copy result times dest[*destLen..*destLen+len-1]
-				if (result > 100)
-					result = 100;	// avoid overflows
-				if (result > 0 && context->destLen + result * repStrLen > context->bufSize)
+				for (i = 0; i < code[2]; i++)
+					context->dest[context->destLen++] = str[code[1] + i];
+				context->col += code[2];
+				code += 3;
+				break;
+			case kOpEol:
+				if (!checkDestSize(context,
+						1 + (context->eol[1] ? 1 : 0) + context->currentIndent))
 					return FALSE;
-				for (; result > 0; result--)
-				{
-					for (i = 0; i < repStrLen; i++)
-					{
-						context->dest[context->destLen++] = repStr[i];
-						if (isFirstUTF8Byte(repStr[i]))
-							context->destLenUCS16++;
-					}
-					context->col += repStrLen;
+				writeEol(context);
+				code++;
+				break;
+			case kOpNumber:
+				if (!checkDestSize(context, 12))
+					return FALSE;
+				writeNumber(context, evalCompiledExpression(code + 2, code[1], context));
+				code += 2 + code[1];
+				break;
+			case kOpRepeat:
+				result = evalCompiledExpression(code + 2, code[1], context);
+				code += 2 + code[1];
+				repStr = context->destLen;
+				col0 = context->col;
+				// nothing to evaluate if the string isn't replicated (e.g. false
+				// condition), so that %{o} or %{p} inside it isn't a dependency
+				if (result > 0
+						&& (!addCompiledString(str, code + 1, context)
+							|| !replicateString(context, repStr, col0, result)))
+					return FALSE;
+				code += 1 + code[0];
+				break;
+			case kOpListNesting:
+				if (!checkDestSize(context, kMaxNesting))
+					return FALSE;
+				writeListNesting(context);
+				code++;
+				break;
+			default:	// kOpEnd
+				return TRUE;
+		}
+}
+
+/** Add bytes to a hash (32-bit FNV-1a).
+	@param[in] hash hash of the previous bytes
+	@param[in] bytes bytes to add
+	@param[in] len number of bytes
+	@return hash
+*/
+static unsigned long hashBytes(unsigned long hash, void const *bytes, NMEInt len)
+{
+	unsigned char const *p = (unsigned char const *)bytes;
+	NMEInt i;
+	
+	for (i = 0; i < len; i++)
+		hash = ((hash ^ p[i]) * 16777619UL) & 0xffffffffUL;
+	return hash;
+}
+
+/** Find the slot of a format string in a compiled output format.
+	@param[in] compiled compiled output format
+	@param[in] str format string
+	@return index of slot of str, or of empty slot where str should be stored
+*/
+static NMEInt findCompiledString(NMECompiledOutputFormat const *compiled,
+		NMEConstText str)
+{
+	NMEInt i;
+	
+	for (i = (NMEInt)(((unsigned long)str ^ (unsigned long)str >> 7)
+				& (kNMECompiledFormatSlots - 1));
+			compiled->slot[i].str && compiled->slot[i].str != str;
+			i = (i + 1) & (kNMECompiledFormatSlots - 1))
+		;
+	return i;
+}
+
+/** Find the slot of a plugin name in the hash table of a compiled output
+	format.
+	@param[in] compiled compiled output format
+	@param[in] plugins array of plugins
+	@param[in] name plugin name
+	@param[in] nameLen length of name
+	@param[in] isPlaceholder TRUE for triple angle brackets
+	@return index of slot of plugin, or of empty slot where it should be stored
+*/
+static NMEInt findCompiledPluginSlot(NMECompiledOutputFormat const *compiled,
+		NMEPlugin const *plugins,
+		NMEConstText name, NMEInt nameLen,
+		NMEBoolean isPlaceholder)
+{
+	NMEInt i, j, k;
+	
+	for (i = (NMEInt)((hashBytes(2166136261UL, name, nameLen)
+				^ (isPlaceholder ? 0x55555555UL : 0))
+				& (kNMECompiledPluginSlots - 1));
+			(j = compiled->pluginSlot[i]) >= 0;
+			i = (i + 1) & (kNMECompiledPluginSlots - 1))
+	{
+		if (isPlaceholder
+				^ (plugins[j].options & kNMEPluginOptTripleAngleBrackets) == 0)
+		{
+			for (k = 0; k < nameLen && plugins[j].name[k] == name[k]; k++)
+				;
+			if (k == nameLen && plugins[j].name[k] == '\0')
+				break;
+		}
+	}
+	return i;
+}
+
+/** Index the plugins of an output format by name, in a hash table for
+	names and a trie for partial names (kNMEPluginOptPartialName). Plugins
+	aren't indexed if there are too many of them.
+	@param[in] plugins array of plugins, terminated by name=NULL
+	@param[in,out] compiled compiled output format
+*/
+static void compilePlugins(NMEPlugin const *plugins,
+		NMECompiledOutputFormat *compiled)
+{
+	NMEBoolean isPlaceholder;
+	NMEInt i, j, k, n, len, node, child;
+	
+	compiled->plugins = NULL;
+	if (!plugins)
+		return;
+	
+	for (i = 0; i < kNMECompiledPluginSlots; i++)
+		compiled->pluginSlot[i] = -1;
+	// root nodes: 0 for <<, 1 for <<<
+	for (i = 0; i < 2; i++)
+	{
+		compiled->pluginNode[i].child = compiled->pluginNode[i].next = -1;
+		compiled->pluginNode[i].plugin = -1;
+	}
+	compiled->pluginNodeCount = 2;
+	
+	for (j = n = 0; plugins[j].name; j++)
+	{
+		isPlaceholder = (plugins[j].options & kNMEPluginOptTripleAngleBrackets) != 0;
+		for (len = 0; plugins[j].name[len]; len++)
+			;
+		if (plugins[j].options & kNMEPluginOptPartialName)
+		{
+			// add name to trie
+			node = isPlaceholder ? 1 : 0;
+			for (k = 0; k < len; k++)
+			{
+				for (child = compiled->pluginNode[node].child;
+						child >= 0 && compiled->pluginNode[child].ch != plugins[j].name[k];
+						child = compiled->pluginNode[child].next)
+					;
+				if (child < 0)
+				{
+					if (compiled->pluginNodeCount >= kNMECompiledPluginNodes)
+						return;
+					child = compiled->pluginNodeCount++;
+					compiled->pluginNode[child].ch = plugins[j].name[k];
+					compiled->pluginNode[child].child = -1;
+					compiled->pluginNode[child].next = compiled->pluginNode[node].child;
+					compiled->pluginNode[child].plugin = -1;
+					compiled->pluginNode[node].child = child;
 				}
+				node = child;
+			}
+			if (compiled->pluginNode[node].plugin < 0)
+				compiled->pluginNode[node].plugin = j;	// first one has precedence
+		}
+		else if (len > 0)
+		{
+			// add name to hash table, keeping at least half of it empty
+			if (++n > kNMECompiledPluginSlots / 2)
+				return;
+			i = findCompiledPluginSlot(compiled, plugins,
+					plugins[j].name, len, isPlaceholder);
+			if (compiled->pluginSlot[i] < 0)
+				compiled->pluginSlot[i] = j;	// first one has precedence
+		}
+	}
+	
+	compiled->plugins = plugins;
+}
+
+/** Find a plugin by name in a compiled output format.
+	@param[in] compiled compiled output format, with indexed plugins
+	@param[in] name plugin name
+	@param[in] nameLen length of name
+	@param[in] isPlaceholder TRUE for triple angle brackets
+	@return index of first matching plugin, or -1 if not found
+*/
+static NMEInt findCompiledPlugin(NMECompiledOutputFormat const *compiled,
+		NMEConstText name, NMEInt nameLen,
+		NMEBoolean isPlaceholder)
+{
+	NMEInt j, k, node;
+	
+	// name
+	j = compiled->pluginSlot[findCompiledPluginSlot(compiled, compiled->plugins,
+			name, nameLen, isPlaceholder)];
+	
+	// partial names which are a prefix of name
+	node = isPlaceholder ? 1 : 0;
+	for (k = 0; ; k++)
+	{
+		if (compiled->pluginNode[node].plugin >= 0
+				&& (j < 0 || compiled->pluginNode[node].plugin < j))
+			j = compiled->pluginNode[node].plugin;
+		if (k >= nameLen)
+			break;
+		for (node = compiled->pluginNode[node].child;
+				node >= 0 && compiled->pluginNode[node].ch != name[k];
+				node = compiled->pluginNode[node].next)
+			;
+		if (node < 0)
+			break;
+	}
+	
+	return j;
+}
+
+NMEBoolean NMEAddString(NMEConstText str,
+		NMEInt strLen,
+		NMEChar ctrlChar,
+		NMEContext *context)
+{
+	NMEInt k;
+	
+	if (!str)
+		return TRUE;	// no op if str is NULL
+	
+	if (strLen < 0)
+	{
+		NMECompiledOutputFormat const *compiled = context->outputFormat
+				? context->outputFormat->compiled : NULL;
+		
+		if (compiled && ctrlChar == compiled->ctrlChar
+				&& context->ctrlChar == compiled->ctrlChar
+				&& context->fontSize == compiled->fontSize
+				&& context->xref == compiled->xref)
+		{
+			k = findCompiledString(compiled, str);
+			if (compiled->slot[k].str)
+				return addCompiledString(str, compiled->code + compiled->slot[k].code,
+						context);
+		}
+		
+		for (strLen = 0; str[strLen]; strLen++)
+			;
+	}
+	
+	for (k = 0; k < strLen; )
+		if (!checkDestSize(context,
+				1 + (str[k] == '\n' ? (context->eol[1] ? 1 : 0)
+						+ context->currentIndent : 0)))
+			return FALSE;
+		else if (str[k] == '\n')
+		{
+			writeEol(context);
+			k++;
+		}
+		else if (k + 2 < strLen
+				&& str[k] == ctrlChar
+				&& (str[k + 1] == '{' || str[k + 1] == ctrlChar && str[k + 2] == '{'))
+		{
+			NMEBoolean replicate;
+			NMEInt len, result, repStr, col0;
+			
+			replicate = str[k + 1] == ctrlChar;
+			if (replicate)
+				k++;
+			for (k += 2, len = 0; k + len < strLen && str[k + len] != '}'; len++)
+				;
+			if (k + len >= strLen)	// unexpected end of string
+				return TRUE;	// don't report error (enough space)
+			result = evalExpression(str + k, len, context);
+			k += len + 1;	// skip after }
+			if (replicate)
+			{
+				// find string, until double-ctrlChar
+				for (len = 0;
+						k + len + 1 < strLen
+							&& (str[k + len] != ctrlChar
+									|| str[k + len + 1] != ctrlChar);
+						len++)
+					;
+				// copy once, evaluating expressions
+				// (cannot have more recursive calls, because they occur only when
+				// the string contains double-ctrlChar which cannot happen here)
+				repStr = context->destLen;	// repl. string after expr substitutions
+				col0 = context->col;
+				if (result > 0
+						&& (!NMEAddString(str + k, len, context->ctrlChar, context)
+							|| !replicateString(context, repStr, col0, result)))
+					return FALSE;
 				// skip rep string and double ctrlChar
 				k += len + 2;
 			}
 			else
 			{
 				// write result
-				if (context->destLen + 12 > context->bufSize)
+				if (!checkDestSize(context, 12))
 					return FALSE;
-				if (result < 0)
-				{
-					context->dest[context->destLen++] = '-';
-					context->destLenUCS16++;
-					result = -result;
-					context->col++;
-				}
-				for (i = 1000000000; i >= 1; i /= 10)
-					if (result >= i || i == 1)
-					{
-						context->dest[context->destLen++] = '0' + (result / i) % 10;
-						context->destLenUCS16++;
-						context->col++;
-					}
+				writeNumber(context, result);
 			}
 		}
 		else if (k + 2 < strLen && str[k] == ctrlChar && str[k + 1] == 'L')
 		{
-			NMEConstText str = NMECurrentListNesting(context);
-			NMEInt i;
-			
-			if (context->destLen + kMaxNesting > context->bufSize)
+			if (!checkDestSize(context, kMaxNesting))
 				return FALSE;
-			for (i = 0; str[i]; i++)
-			{
-				context->dest[context->destLen++] = str[i];
-				context->destLenUCS16++;
-				context->col++;
-			}
+			writeListNesting(context);
 			k += 2;
 		}
 		else
 		{
-			if (isFirstUTF8Byte(str[k]))
-				context->destLenUCS16++;
 			context->dest[context->destLen++] = str[k++];
 			context->col++;
 		}
@@ -486,19 +1132,325 @@ NMEBoolean NMEAddString(NMEConstText str,
 	return TRUE;
 }
 
+/** State of format string compiler */
+typedef struct
+{
+	NMEContext context;	///< context with parameters which are constant during a conversion
+	NMEInt *code;	///< compiled ops
+	NMEInt codeSize;	///< size of code
+	NMEInt codeLen;	///< current length of code
+	NMEBoolean overflow;	///< TRUE if code is too small
+	NMEBoolean simple;	///< TRUE if ops are only text, numbers and list nesting
+} FormatCompiler;
+
+/** Append a value to compiled code.
+	@param[in,out] compiler compiler state
+	@param[in] value value to append
+*/
+static void emitCode(FormatCompiler *compiler, NMEInt value)
+{
+	if (compiler->codeLen >= compiler->codeSize)
+		compiler->overflow = TRUE;
+	else
+		compiler->code[compiler->codeLen++] = value;
+}
+
+/** Compile an expression, folding it if it is constant.
+	@param[in] src source code of expression
+	@param[in] srcLen length of src
+	@param[in,out] compiler compiler state
+	@param[out] value value if constant
+	@return TRUE if expression is constant
+*/
+static NMEBoolean compileExpression(NMEConstText src, NMEInt srcLen,
+		FormatCompiler *compiler, NMEInt *value)
+{
+	ExprParser parser;
+	NMEInt lenIx;
+	
+	lenIx = compiler->codeLen;
+	emitCode(compiler, 0);	// length of expression
+	if (compiler->overflow)
+		return FALSE;
+	
+	parser.context = &compiler->context;
+	parser.stackDepth = 0;
+	parser.code = compiler->code + compiler->codeLen;
+	parser.codeSize = compiler->codeSize - compiler->codeLen;
+	parser.codeLen = 0;
+	parser.overflow = FALSE;
+	parser.constant = TRUE;
+	if (!parseExpression(src, srcLen, &parser))
+	{
+		*value = kExprErrorValue;
+		parser.constant = TRUE;
+	}
+	else if (parser.overflow)
+	{
+		compiler->overflow = TRUE;
+		return FALSE;
+	}
+	else if (parser.constant)
+		*value = evalCompiledExpression(parser.code, parser.codeLen, &compiler->context);
+	
+	if (parser.constant)
+	{
+		if (parser.codeSize < 2)
+		{
+			compiler->overflow = TRUE;
+			return FALSE;
+		}
+		parser.code[0] = kExprNumber;
+		parser.code[1] = *value;
+		parser.codeLen = 2;
+	}
+	compiler->code[lenIx] = parser.codeLen;
+	compiler->codeLen += parser.codeLen;
+	return parser.constant;
+}
+
+/** Compile a format string into ops (same syntax as NMEAddString).
+	@param[in] str format string
+	@param[in] begin index of beginning of part of str to compile
+	@param[in] end index of end of part of str to compile
+	@param[in] ctrlChar control character for embedded expressions
+	@param[in,out] compiler compiler state (kOpEnd is not appended)
+*/
+static void compileString(NMEConstText str, NMEInt begin, NMEInt end,
+		NMEChar ctrlChar, FormatCompiler *compiler)
+{
+	NMEInt k, text;
+	
+	for (k = begin, text = -1; k < end && !compiler->overflow; )
+		if (str[k] == '\n')
+		{
+			emitCode(compiler, kOpEol);
+			compiler->simple = FALSE;
+			text = -1;
+			k++;
+		}
+		else if (k + 2 < end
+				&& str[k] == ctrlChar
+				&& (str[k + 1] == '{' || str[k + 1] == ctrlChar && str[k + 2] == '{'))
+		{
+			NMEBoolean replicate, constant, simple;
+			NMEInt len, result, op, bodyIx;
+			
+			text = -1;
+			replicate = str[k + 1] == ctrlChar;
+			if (replicate)
+				k++;
+			for (k += 2, len = 0; k + len < end && str[k + len] != '}'; len++)
+				;
+			if (k + len >= end)	// unexpected end of string
+			{
+				emitCode(compiler, kOpEnd);
+				compiler->simple = FALSE;
+				return;
+			}
+			op = compiler->codeLen;
+			emitCode(compiler, replicate ? kOpRepeat : kOpNumber);
+			constant = compileExpression(str + k, len, compiler, &result);
+			k += len + 1;	// skip after }
+			if (replicate)
+			{
+				// find string, until double-ctrlChar
+				for (len = 0;
+						k + len + 1 < end
+							&& (str[k + len] != ctrlChar
+									|| str[k + len + 1] != ctrlChar);
+						len++)
+					;
+				bodyIx = compiler->codeLen;
+				emitCode(compiler, 0);	// length of ops of string
+				simple = compiler->simple;
+				compiler->simple = TRUE;
+				compileString(str, k, k + len, compiler->context.ctrlChar, compiler);
+				emitCode(compiler, kOpEnd);
+				if (compiler->overflow)
+					return;
+				compiler->code[bodyIx] = compiler->codeLen - bodyIx - 1;
+				
+				if (constant && result <= 0)
+					compiler->codeLen = op;	// never output
+				else if (constant && result == 1 && compiler->simple)
+				{
+					NMEInt i;
+					
+					// output once: keep ops of string without kOpEnd
+					for (i = bodyIx + 1; i < compiler->codeLen - 1; i++)
+						compiler->code[op + i - bodyIx - 1] = compiler->code[i];
+					compiler->codeLen = op + compiler->codeLen - bodyIx - 2;
+				}
+				else
+					simple = FALSE;
+				compiler->simple = simple;
+				
+				// skip rep string and double ctrlChar
+				k += len + 2;
+			}
+		}
+		else if (k + 2 < end && str[k] == ctrlChar && str[k + 1] == 'L')
+		{
+			emitCode(compiler, kOpListNesting);
+			text = -1;
+			k += 2;
+		}
+		else
+		{
+			if (text < 0)
+			{
+				// new text op
+				text = compiler->codeLen;
+				emitCode(compiler, kOpText);
+				emitCode(compiler, k);
+				emitCode(compiler, 0);
+				if (compiler->overflow)
+					return;
+			}
+			compiler->code[text + 2]++;
+			k++;
+		}
+}
+
+/// Number of format strings of NMEOutputFormat compiled by NMECompileOutputFormat
+#define kFormatStringCount 60
+
+NMEErr NMECompileOutputFormat(NMEOutputFormat *outputFormat,
+		NMEInt fontSize,
+		NMEInt options,
+		NMECompiledOutputFormat *compiled)
+{
+	NMEConstText str[kFormatStringCount];
+	FormatCompiler compiler;
+	NMEInt i, j, n, len;
+	
+	outputFormat->compiled = NULL;
+	
+	// format strings (assigned one by one: C90 initializers must be constant)
+	n = 0;
+	str[n++] = outputFormat->space;
+	str[n++] = outputFormat->beginDoc;
+	str[n++] = outputFormat->endDoc;
+	str[n++] = outputFormat->beginHeading;
+	str[n++] = outputFormat->endHeading;
+	str[n++] = outputFormat->beginPar;
+	str[n++] = outputFormat->endPar;
+	str[n++] = outputFormat->lineBreak;
+	str[n++] = outputFormat->beginPre;
+	str[n++] = outputFormat->endPre;
+	str[n++] = outputFormat->beginPreLine;
+	str[n++] = outputFormat->endPreLine;
+	str[n++] = outputFormat->beginUL;
+	str[n++] = outputFormat->endUL;
+	str[n++] = outputFormat->beginULItem;
+	str[n++] = outputFormat->endULItem;
+	str[n++] = outputFormat->beginOL;
+	str[n++] = outputFormat->endOL;
+	str[n++] = outputFormat->beginOLItem;
+	str[n++] = outputFormat->endOLItem;
+	str[n++] = outputFormat->beginDL;
+	str[n++] = outputFormat->endDL;
+	str[n++] = outputFormat->beginDT;
+	str[n++] = outputFormat->endDT;
+	str[n++] = outputFormat->emptyDT;
+	str[n++] = outputFormat->beginDD;
+	str[n++] = outputFormat->endDD;
+	str[n++] = outputFormat->beginIndented;
+	str[n++] = outputFormat->endIndented;
+	str[n++] = outputFormat->beginIndentedPar;
+	str[n++] = outputFormat->endIndentedPar;
+	str[n++] = outputFormat->beginTable;
+	str[n++] = outputFormat->endTable;
+	str[n++] = outputFormat->beginTableRow;
+	str[n++] = outputFormat->endTableRow;
+	str[n++] = outputFormat->beginTableHCell;
+	str[n++] = outputFormat->endTableHCell;
+	str[n++] = outputFormat->beginTableCell;
+	str[n++] = outputFormat->endTableCell;
+	str[n++] = outputFormat->horRule;
+	str[n++] = outputFormat->beginBold;
+	str[n++] = outputFormat->endBold;
+	str[n++] = outputFormat->beginItalic;
+	str[n++] = outputFormat->endItalic;
+	str[n++] = outputFormat->beginUnderline;
+	str[n++] = outputFormat->endUnderline;
+	str[n++] = outputFormat->beginStrike;
+	str[n++] = outputFormat->endStrike;
+	str[n++] = outputFormat->beginSuperscript;
+	str[n++] = outputFormat->endSuperscript;
+	str[n++] = outputFormat->beginSubscript;
+	str[n++] = outputFormat->endSubscript;
+	str[n++] = outputFormat->beginCode;
+	str[n++] = outputFormat->endCode;
+	str[n++] = outputFormat->beginLink;
+	str[n++] = outputFormat->endLink;
+	str[n++] = outputFormat->sepLink;
+	str[n++] = outputFormat->beginImage;
+	str[n++] = outputFormat->endImage;
+	str[n++] = outputFormat->sepImage;
+	
+	compiled->ctrlChar = outputFormat->ctrlChar;
+	compiled->fontSize = fontSize > 0 ? fontSize : outputFormat->defFontSize;
+	compiled->xref = (options & kNMEProcessOptXRef) != 0;
+	compilePlugins(outputFormat->plugins, compiled);
+	for (i = 0; i < kNMECompiledFormatSlots; i++)
+		compiled->slot[i].str = NULL;
+	
+	compiler.context.fontSize = compiled->fontSize;
+	compiler.context.xref = compiled->xref;
+	compiler.context.ctrlChar = compiled->ctrlChar;
+	compiler.context.outputFormat = outputFormat;
+	compiler.code = compiled->code;
+	compiler.codeSize = kNMECompiledFormatCodeSize;
+	compiler.codeLen = 0;
+	compiler.overflow = FALSE;
+	
+	for (i = n = 0; i < kFormatStringCount; i++)
+		if (str[i])
+		{
+			j = findCompiledString(compiled, str[i]);
+			if (compiled->slot[j].str)
+				continue;	// already compiled
+			if (++n >= kNMECompiledFormatSlots)
+				return kNMEErrNotEnoughMemory;	// keep at least one empty slot
+			compiled->slot[j].str = str[i];
+			compiled->slot[j].code = compiler.codeLen;
+			for (len = 0; str[i][len]; len++)
+				;
+			compiler.simple = TRUE;
+			compileString(str[i], 0, len, compiled->ctrlChar, &compiler);
+			emitCode(&compiler, kOpEnd);
+			if (compiler.overflow)
+				return kNMEErrNotEnoughMemory;
+		}
+	compiled->codeLen = compiler.codeLen;
+	
+	outputFormat->compiled = compiled;
+	return kNMEErrOk;
+}
+
 NMEErr NMECopySource(NMEInt length,
 		NMEBoolean copy,
 		NMEBoolean encodeChar,
 		NMEContext *context)
 {
-	if (context->srcIndexOffset + context->srcIndex + length > context->srcLen)
-		length = context->srcLen - (context->srcIndexOffset + context->srcIndex);
+	if (context->srcIndex + length > context->srcLen)
+		length = context->srcLen - context->srcIndex;
 	if (copy)
 	{
 		NMEInt i;
 		NMEErr err;
 		
-		if (encodeChar && context->outputFormat->encodeCharFun)
+		if (encodeChar && context->outputFormat->encodeRunFun)
+		{
+			i = context->srcIndex;
+			CheckError(context->outputFormat->encodeRunFun(context->src, context->srcLen,
+					&i, context->srcIndex + length,
+					context,
+					context->outputFormat->encodeCharData));
+		}
+		else if (encodeChar && context->outputFormat->encodeCharFun)
 		{
 			NMEEncodeCharFun fun = context->outputFormat->encodeCharFun;
 			void *data = context->outputFormat->encodeCharData;
@@ -509,17 +1461,14 @@ NMEErr NMECopySource(NMEInt length,
 		else
 		{
 			NMEConstText s = context->src + context->srcIndex;
-			NMEText d = context->dest + context->destLen;
+			NMEText d;
 			
-			if (context->destLen + length > context->bufSize)
+			if (!checkDestSize(context, length))
 				return kNMEErrNotEnoughMemory;
 			
+			d = context->dest + context->destLen;
 			for (i = 0; i < length; i++)
-			{
 				d[i] = s[i];
-				if (isFirstUTF8Byte(s[i]))
-					context->destLenUCS16++;
-			}
 			context->srcIndex += length;
 			context->destLen += length;
 		}
@@ -530,8 +1479,27 @@ NMEErr NMECopySource(NMEInt length,
 	return kNMEErrOk;
 }
 
+/** Get the wordwrap permission at some position of dest.
+	@param[in] context current context
+	@param[in] outputFormat format strings
+	@param[in] i index in dest
+	@return wordwrap kind (kNMEWordwrapNo if not permitted here)
+*/
+static NMEWordwrapPermission wordwrapPermission(NMEContext const *context,
+		NMEOutputFormat const *outputFormat,
+		NMEInt i)
+{
+	if (outputFormat->wordwrapPermFun)
+		return outputFormat->wordwrapPermFun(context->dest, context->destLen, i,
+				outputFormat->wordwrapPermData);
+	else
+		return isBlank(context->dest[i]) ? kNMEWordwrapReplaceChar : kNMEWordwrapNo;
+}
+
 /** Check wordwrap, inserting an end-of-line and spaces for indenting if
-	required.
+	required. Wordwrap points are found incrementally: each byte of output
+	is checked once, except the last one whose permission may depend on
+	the next byte.
 	@param[in,out] context current context
 	@param[in] outputFormat format strings (can be NULL)
 	@return error code (kNMEErrOk for success)
@@ -547,36 +1515,39 @@ static NMEErr checkWordwrap(NMEContext *context,
 		NMEInt i, j, dist;
 		NMEWordwrapPermission perm;
 		
-		perm = kNMEWordwrapNo;
-		if (outputFormat->wordwrapPermFun)
-		{
-			// find last wordwrap point on current line
-			for (i = context->destLen - 1;
-					i >= 0 && !isEol(context->dest[i]);
-					i--)
+		if (context->destLen <= 0 || isEol(context->dest[context->destLen - 1]))
+			return kNMEErrOk;
+		
+		// find new wordwrap points, except at the last byte
+		for (i = context->wrapScanned; i < context->destLen - 1; i++)
+			if (isEol(context->dest[i]))
 			{
-				perm = outputFormat->wordwrapPermFun(context->dest, context->destLen, i,
-						outputFormat->wordwrapPermData);
-				if (perm != kNMEWordwrapNo)
-					break;
+				context->wrapLine = i + 1;
+				context->wrapPoint = -1;
 			}
-		}
-		else
-		{
-			// find last space on current line
-			for (i = context->destLen - 1;
-					i >= 0 && !isEol(context->dest[i]);
-					i--)
-				if (isBlank(context->dest[i]))
+			else
+			{
+				perm = wordwrapPermission(context, outputFormat, i);
+				if (perm != kNMEWordwrapNo)
 				{
-					perm = kNMEWordwrapReplaceChar;
-					break;
+					context->wrapPoint = i;
+					context->wrapPerm = perm;
 				}
+			}
+		context->wrapScanned = i;
+		
+		// last wordwrap point on current line
+		perm = wordwrapPermission(context, outputFormat, i);
+		if (perm == kNMEWordwrapNo && context->wrapPoint >= 0)
+		{
+			i = context->wrapPoint;
+			perm = context->wrapPerm;
 		}
 		
 		// ret. if none
 		if (perm == kNMEWordwrapNo)
 			return kNMEErrOk;
+		invalidateOutput(context, i);
 		
 		// if eol has two char or spaceBeforeWordWrap, insert enough space
 		dist = (context->eol[1] ? 2 : 1)
@@ -584,12 +1555,11 @@ static NMEErr checkWordwrap(NMEContext *context,
 				+ context->currentIndent;
 		if (dist > 0)
 		{
-			if (context->destLen + dist > context->bufSize)
+			if (!checkDestSize(context, dist))
 				return kNMEErrNotEnoughMemory;
 			for (j = context->destLen - 1; j > i; j--)
 				context->dest[j + dist] = context->dest[j];
 			context->destLen += dist;
-			context->destLenUCS16 += dist;
 		}
 		
 		// insert eol
@@ -598,6 +1568,11 @@ static NMEErr checkWordwrap(NMEContext *context,
 		context->dest[i++] = context->eol[0];
 		if (context->eol[1])
 			context->dest[i++] = context->eol[1];
+		
+		// new line (indenting included, like after any end of line)
+		context->wrapLine = context->wrapScanned = i;
+		context->wrapPoint = -1;
+		
 		for (j = 0; j < context->currentIndent; j++)
 			context->dest[i++] = ' ';
 		context->col = context->destLen - i + context->currentIndent;
@@ -606,37 +1581,58 @@ static NMEErr checkWordwrap(NMEContext *context,
 	return kNMEErrOk;
 }
 
-/** Table of character substitutions for HTML or XML */
-static NMEEncodeCharDict const htmlCharDict[] =
-{
-	{'<', "&lt;"},
-	{'>', "&gt;"},
-	{'"', "&quot;"},
-	{'&', "&amp;"},
-	{0, NULL}
-};
+/** Table of character substitutions for HTML or XML (entries after '>' are NULL) */
+static NMEEncodeCharTable const htmlCharTable =
+{{
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x00
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x08
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x10
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x18
+	NULL, NULL, "&quot;", NULL, NULL, NULL, "&amp;", NULL,	// 0x20
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x28
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x30
+	NULL, NULL, NULL, NULL, "&lt;", NULL, "&gt;"	// 0x38
+}};
 
-/** Table of character substitutions for LaTeX */
-static NMEEncodeCharDict const latexCharDict[] =
-{
-	{'#', "\\#"},
-	{'^', "$\\,\\hat{}\\,$"},
-	{'~', "$\\,\\tilde{}\\,$"},
-	{'\\', "$\\backslash$"},
-	{'|', "$|$"},
-	{'\'', "\'{}"},
-	{'`', "`{}"},
-	{'<', "$<$"},
-	{'>', "$>$"},
-	{'{', "\\{"},
-	{'}', "\\}"},
-	{0, NULL}
-};
+/** Table of character substitutions for LaTeX (entries after '~' are NULL) */
+static NMEEncodeCharTable const latexCharTable =
+{{
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x00
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x08
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x10
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x18
+	NULL, NULL, NULL, "\\#", NULL, NULL, NULL, "\'{}",	// 0x20
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x28
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x30
+	NULL, NULL, NULL, NULL, "$<$", NULL, "$>$", NULL,	// 0x38
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x40
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x48
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x50
+	NULL, NULL, NULL, NULL, "$\\backslash$", NULL, "$\\,\\hat{}\\,$", NULL,	// 0x58
+	"`{}", NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x60
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x68
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x70
+	NULL, NULL, NULL, "\\{", "$|$", "\\}", "$\\,\\tilde{}\\,$"	// 0x78
+}};
 
-NMEErr NMEEncodeCharFunDict(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
-		NMEContext *context, void *data)
+/** Copy a single character to output.
+	@param[in,out] context current context
+	@param[in] c character
+	@return TRUE for success, FALSE for failure (not enough space)
+*/
+static NMEBoolean addChar(NMEContext *context, NMEChar c)
 {
-	NMEInt i;
+	if (!checkDestSize(context, 1))
+		return FALSE;
+	context->dest[context->destLen++] = c;
+	context->col++;
+	return TRUE;
+}
+
+NMEErr NMEEncodeCharFunDict(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
+		NMEContext *context, void *data)
+{
+	NMEInt i;
 	(void)srcLen;
 	
 	for (i = 0; ((NMEEncodeCharDict const *)data)[i].str; i++)
@@ -648,8 +1644,70 @@ NMEErr NMEEncodeCharFunDict(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 			(*srcIx)++;
 			return kNMEErrOk;
 		}
-	if (!NMEAddString(&src[(*srcIx)++], 1, context->ctrlChar, context))
+	if (!addChar(context, src[(*srcIx)++]))
+		return kNMEErrNotEnoughMemory;
+	return kNMEErrOk;
+}
+
+void NMEMakeEncodeCharTable(NMEEncodeCharDict const *dict,
+		NMEEncodeCharTable *table)
+{
+	NMEInt i;
+	
+	for (i = 0; i < 256; i++)
+		table->str[i] = NULL;
+	// in reverse order, so that the first entry wins like with NMEEncodeCharFunDict
+	for (i = 0; dict[i].str; i++)
+		;
+	while (i-- > 0)
+		table->str[(unsigned char)dict[i].ch] = dict[i].str;
+}
+
+NMEErr NMEEncodeCharFunTable(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
+		NMEContext *context, void *data)
+{
+	NMEConstText str = ((NMEEncodeCharTable const *)data)->str[(unsigned char)src[*srcIx]];
+	(void)srcLen;
+	
+	if (str ? !NMEAddString(str, -1, context->ctrlChar, context)
+			: !addChar(context, src[*srcIx]))
 		return kNMEErrNotEnoughMemory;
+	(*srcIx)++;
+	return kNMEErrOk;
+}
+
+NMEErr NMEEncodeRunFunTable(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
+		NMEInt runEnd,
+		NMEContext *context, void *data)
+{
+	NMEEncodeCharTable const *table = (NMEEncodeCharTable const *)data;
+	NMEInt i, n;
+	(void)srcLen;
+	
+	while (*srcIx < runEnd)
+	{
+		// span of characters without substitution
+		for (n = *srcIx; n < runEnd && !table->str[(unsigned char)src[n]]; n++)
+			;
+		if (n > *srcIx)
+		{
+			if (!checkDestSize(context, n - *srcIx))
+				return kNMEErrNotEnoughMemory;
+			context->col += n - *srcIx;
+			for (i = context->destLen; *srcIx < n; )
+				context->dest[i++] = src[(*srcIx)++];
+			context->destLen = i;
+		}
+		
+		// substitution
+		if (*srcIx < runEnd)
+		{
+			if (!NMEAddString(table->str[(unsigned char)src[*srcIx]], -1,
+					context->ctrlChar, context))
+				return kNMEErrNotEnoughMemory;
+			(*srcIx)++;
+		}
+	}
 	return kNMEErrOk;
 }
 
@@ -773,7 +1831,8 @@ NMEOutputFormat const NMEOutputFormatText =
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	NULL, NULL	// run encoders
 };
 
 NMEOutputFormat const NMEOutputFormatTextCompact =
@@ -822,7 +1881,8 @@ NMEOutputFormat const NMEOutputFormatTextCompact =
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	NULL, NULL	// run encoders
 };
 
 /** NMEEncodeURLFun function which encodes link to a URL for null output,
@@ -857,6 +1917,25 @@ static NMEErr encodeCharFunNull(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 	return kNMEErrOk;
 }
 
+/** NMEEncodeRunFun function which skips a run of characters.
+	@param[in] src input characters
+	@param[in] srcLen size of src in bytes
+	@param[in,out] srcIx index in src (updated to runEnd)
+	@param[in] runEnd index in src of the end of the run
+	@param[in,out] context current context
+	@param[in,out] data ignored
+	@return error code (kNMEErrOk for success)
+	@see NMEOutputFormat
+*/
+static NMEErr encodeRunFunNull(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
+		NMEInt runEnd,
+		NMEContext *context,
+		void *data)
+{
+	*srcIx = runEnd;
+	return kNMEErrOk;
+}
+
 NMEOutputFormat const NMEOutputFormatNull =
 {
 	"",	// space
@@ -903,7 +1982,8 @@ NMEOutputFormat const NMEOutputFormatNull =
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	encodeRunFunNull, encodeRunFunNull	// run encoders
 };
 
 /** NMEWordwrapCheckFun function to check valid wordwrap point for NME
@@ -976,7 +2056,8 @@ NMEOutputFormat const NMEOutputFormatNME =
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	NULL, NULL	// run encoders
 };
 
 NMEOutputFormat const NMEOutputFormatHTML =
@@ -1025,14 +2106,15 @@ NMEOutputFormat const NMEOutputFormatHTML =
 	"<img src=\"", "\" />", "\" alt=\"", FALSE, TRUE,	// image
 	NULL,	// interwiki
 	NULL, NULL,	// encodeURLFun
-	NMEEncodeCharFunDict, (void *)htmlCharDict,	// char encoder
-	NMEEncodeCharFunDict, (void *)htmlCharDict,	// char pre encoder
+	NMEEncodeCharFunTable, (void *)&htmlCharTable,	// char encoder
+	NMEEncodeCharFunTable, (void *)&htmlCharTable,	// char pre encoder
 	70, NULL, NULL,	// wordwrap
 	NULL, NULL,	// char hook
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	NMEEncodeRunFunTable, NMEEncodeRunFunTable	// run encoders
 };
 
 /** NMEEncodeCharFun function which encodes characters for RTF. Special
@@ -1056,15 +2138,13 @@ static NMEErr encodeCharRTFFun(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 	
 	if ((src[*srcIx] & 0x80) == 0)	// one byte, ASCII
 	{
-		if (context->destLen + 1 >= context->bufSize)
+		if (!checkDestSize(context, 2))
 			return kNMEErrNotEnoughMemory;
 		if (src[*srcIx] == '\\' || src[*srcIx] == '{' || src[*srcIx] == '}')
 		{
 			context->dest[context->destLen++] = '\\';	// \, { and } must be escaped
-			context->destLenUCS16++;
 		}
 		context->dest[context->destLen++] = src[(*srcIx)++];
-		context->destLenUCS16++;
 		return kNMEErrOk;
 	}
 	else if (*srcIx + 1 < srcLen && (src[*srcIx] & 0xe0) == 0xc0	// two bytes
@@ -1086,7 +2166,7 @@ static NMEErr encodeCharRTFFun(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 		return kNMEErrOk;
 	}
 	
-	if (context->destLen + 9 >= context->bufSize)	// worst case (\u-30000?)
+	if (!checkDestSize(context, 10))	// worst case (\u-30000?)
 		return kNMEErrNotEnoughMemory;
 	
 	// unsigned -> signed
@@ -1098,22 +2178,57 @@ static NMEErr encodeCharRTFFun(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 	if (ch < 0)
 	{
 		context->dest[context->destLen++] = '-';
-		context->destLenUCS16++;
 		ch = -ch;
 	}
 	for (i = 1; i < ch; i *= 10)
 		;
 	for (i /= 10; i > 0; i /= 10)
-	{
 		context->dest[context->destLen++] = '0' + (ch / i) % 10;
-		context->destLenUCS16++;
-	}
 	context->dest[context->destLen++] = '?';	// ANSI representation
-	context->destLenUCS16 += 3;	// \u?
 	
 	return kNMEErrOk;
 }
 
+/** NMEEncodeRunFun function matching encodeCharRTFFun, which copies spans of
+	ASCII characters without escaping at once.
+	@param[in] src input characters
+	@param[in] srcLen size of src in bytes
+	@param[in,out] srcIx index in src (updated to runEnd or after it)
+	@param[in] runEnd index in src of the end of the run
+	@param[in,out] context current context
+	@param[in,out] data value specific to the callback (ignored)
+	@return error code (kNMEErrOk for success)
+	@see NMEOutputFormat
+*/
+static NMEErr encodeRunRTFFun(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
+		NMEInt runEnd,
+		NMEContext *context, void *data)
+{
+	NMEInt i, n;
+	NMEErr err;
+	
+	while (*srcIx < runEnd)
+	{
+		// span of ASCII characters which needn't be escaped
+		for (n = *srcIx;
+				n < runEnd && (src[n] & 0x80) == 0
+					&& src[n] != '\\' && src[n] != '{' && src[n] != '}';
+				n++)
+			;
+		if (n > *srcIx)
+		{
+			if (!checkDestSize(context, n - *srcIx))
+				return kNMEErrNotEnoughMemory;
+			for (i = context->destLen; *srcIx < n; )
+				context->dest[i++] = src[(*srcIx)++];
+			context->destLen = i;
+		}
+		else
+			CheckError(encodeCharRTFFun(src, srcLen, srcIx, context, data));
+	}
+	return kNMEErrOk;
+}
+
 /** NMEEncodeURLFun function which encodes link to a URL for RTF output.
 	@param[in] link input characters
 	@param[in] linkLen length of link
@@ -1124,14 +2239,11 @@ static NMEErr encodeCharRTFFun(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 static NMEErr encodeURLFunRTF(NMEConstText link, NMEInt linkLen,
 		NMEContext *context, void *data)
 {
-	NMEInt i;
-	NMEErr err;
+	NMEInt i = 0;
 	(void)data;
 	
-	// encode each character with encodeCharRTFFun 
-	for (i = 0; i < linkLen; )
-		CheckError(encodeCharRTFFun(link, linkLen, &i, context, NULL));
-	return kNMEErrOk;
+	// encode characters like encodeCharRTFFun
+	return encodeRunRTFFun(link, linkLen, &i, linkLen, context, NULL);
 }
 
 /** NMEWordwrapCheckFun function to check valid wordwrap point for RTF (keep space)
@@ -1226,7 +2338,8 @@ NMEOutputFormat const NMEOutputFormatRTF =
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	encodeRunRTFFun, encodeRunRTFFun	// run encoders
 #undef SIZE
 #undef SIZEH
 };
@@ -1290,14 +2403,15 @@ NMEOutputFormat const NMEOutputFormatLaTeX =
 	"", "", NULL, FALSE, FALSE,	// image
 	NULL,	// interwiki
 	NULL, NULL,	// encodeURLFun
-	NMEEncodeCharFunDict, (void *)latexCharDict,	// char encoder
+	NMEEncodeCharFunTable, (void *)&latexCharTable,	// char encoder
 	NULL, NULL,	// char pre encoder
 	70, NULL, NULL,	// wordwrap
 	NULL, NULL,	// char hook
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	NMEEncodeRunFunTable, NULL	// run encoders
 };
 
 NMEOutputFormat const NMEOutputFormatMan =
@@ -1346,9 +2460,96 @@ NMEOutputFormat const NMEOutputFormatMan =
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	NULL, NULL	// run encoders
 };
 
+/// Edge of NMEInterwikiTrie, in a hash table indexed by parent node and char
+typedef struct
+{
+	NMEInt parent;	///< parent node (-1 for empty slot)
+	NMEInt child;	///< child node
+	NMEChar ch;	///< character
+} InterwikiTrieEdge;
+
+/** Find the slot of an edge of an interwiki trie.
+	@param[in] edges hash table of edges
+	@param[in] edgeSlots number of slots in edges (power of 2)
+	@param[in] parent parent node
+	@param[in] ch character
+	@return index of slot of edge, or of empty slot where it should be stored
+*/
+static NMEInt findInterwikiTrieEdge(InterwikiTrieEdge const *edges,
+		NMEInt edgeSlots,
+		NMEInt parent, NMEChar ch)
+{
+	NMEInt i;
+	
+	for (i = (NMEInt)(((unsigned long)parent * 257 + (unsigned char)ch)
+				* 2654435761UL >> 8 & (edgeSlots - 1));
+			edges[i].parent >= 0
+				&& (edges[i].parent != parent || edges[i].ch != ch);
+			i = (i + 1) & (edgeSlots - 1))
+		;
+	return i;
+}
+
+/** Find the first interwiki (in table order) whose alias begins a link.
+	@param[in] outputFormat format strings
+	@param[in] link link
+	@param[in] linkLen length of link
+	@param[out] aliasLen length of alias
+	@return index of interwiki, or -1 if not found
+*/
+static NMEInt findInterwiki(NMEOutputFormat const *outputFormat,
+		NMEConstText link, NMEInt linkLen,
+		NMEInt *aliasLen)
+{
+	NMEInterwikiTrie const *trie = outputFormat->interwikiTrie;
+	InterwikiTrieEdge const *edges;
+	NMEInt const *nodes;
+	NMEInt i, iw, node, slot;
+	
+	if (trie && trie->interwikis == outputFormat->interwikis)
+	{
+		// walk the trie along link, keeping the first interwiki of aliases
+		nodes = (NMEInt const *)trie->nodes;
+		edges = (InterwikiTrieEdge const *)trie->edges;
+		iw = -1;
+		for (i = node = 0; ; i++)
+		{
+			if (nodes[node] >= 0 && (iw < 0 || nodes[node] < iw))
+			{
+				iw = nodes[node];
+				*aliasLen = i;
+			}
+			if (i >= linkLen)
+				break;
+			slot = findInterwikiTrieEdge(edges, trie->edgeSlots, node, link[i]);
+			if (edges[slot].parent < 0)
+				break;
+			node = edges[slot].child;
+		}
+		return iw;
+	}
+	
+	for (iw = 0; outputFormat->interwikis[iw].alias; iw++)
+	{
+		for (i = 0;
+				i < linkLen
+					&& outputFormat->interwikis[iw].alias[i] != '\0'
+					&& link[i] == outputFormat->interwikis[iw].alias[i];
+				i++)
+			;
+		if (outputFormat->interwikis[iw].alias[i] == '\0')
+		{
+			*aliasLen = i;
+			return iw;
+		}
+	}
+	return -1;
+}
+
 /** Add link to dest, substituting interwiki if necessary.
 	@param[in,out] context current context where link position and source is stored
 	@param[in] outputFormat format strings, or NULL for default
@@ -1367,25 +2568,15 @@ static NMEErr addLink(NMEContext *context,
 		NMEInt iw;
 		
 		// find interwiki whose alias matches the beginning of link
-		for (iw = 0; outputFormat->interwikis[iw].alias; iw++)
+		iw = findInterwiki(outputFormat, link, linkLen, &i);
+		if (iw >= 0)
 		{
-			for (i = 0;
-					i < linkLen
-						&& outputFormat->interwikis[iw].alias[i] != '\0'
-						&& link[i] == outputFormat->interwikis[iw].alias[i];
-					i++)
-				;
-			if (outputFormat->interwikis[iw].alias[i] == '\0')
-			{
-				// found
-				if (!NMEAddString(outputFormat->interwikis[iw].urlPrefix, -1,
-							context->ctrlChar, context))
-					return kNMEErrNotEnoughMemory;
-				CheckError(checkWordwrap(context, outputFormat));
-				link += i;
-				linkLen -= i;
-				break;
-			}
+			if (!NMEAddString(outputFormat->interwikis[iw].urlPrefix, -1,
+						context->ctrlChar, context))
+				return kNMEErrNotEnoughMemory;
+			CheckError(checkWordwrap(context, outputFormat));
+			link += i;
+			linkLen -= i;
 		}
 	}
 	
@@ -1396,13 +2587,10 @@ static NMEErr addLink(NMEContext *context,
 	else
 	{
 		// copy link as is
-		if (context->destLen + linkLen > context->bufSize)
+		if (!checkDestSize(context, linkLen))
 			return kNMEErrNotEnoughMemory;
 		for (i = 0; i < linkLen; i++)
-		{
 			context->dest[context->destLen++] = link[i];
-			context->destLenUCS16++;
-		}
 	}
 	
 	return kNMEErrOk;
@@ -1950,6 +3138,11 @@ static NMEInt findPlugin(NMEConstText src, NMEInt srcLen, NMEInt i,
 	
 	// find plugin
 	if (outputFormat->plugins && nameLen > 0)
+	{
+		if (outputFormat->compiled
+				&& outputFormat->compiled->plugins == outputFormat->plugins)
+			return findCompiledPlugin(outputFormat->compiled,
+					name, nameLen, isPlaceholder);
 		for (j = 0; outputFormat->plugins[j].name; j++)
 			if (isPlaceholder
 					^ (outputFormat->plugins[j].options & kNMEPluginOptTripleAngleBrackets) == 0)
@@ -1967,12 +3160,14 @@ static NMEInt findPlugin(NMEConstText src, NMEInt srcLen, NMEInt i,
 continueMainLoop:
 				;
 			}
+	}
 	
 	// not found
 	return -1;
 }
 
 /** Parse and process a plugin tag.
+	@param[in] pluginIndex index of plugin found by findPlugin, or -1
 	@param[in] isBlock if TRUE, end tag must be alone in a line
 	@param[in] isPlaceholder if TRUE, end tag must be triple right angle brackets
 	@param[in] options kNMEProcessOptDefault or sum of options
@@ -1981,7 +3176,8 @@ continueMainLoop:
 	@param[out] reparseOutput TRUE if plugin's output is NME which should be parsed again
 	@return error code (kNMEErrOk for success)
 */
-static NMEErr addPlugin(NMEBoolean isBlock,
+static NMEErr addPlugin(NMEInt pluginIndex,
+		NMEBoolean isBlock,
 		NMEBoolean isPlaceholder,
 		NMEInt options,
 		NMEOutputFormat const *outputFormat,
@@ -1990,9 +3186,11 @@ static NMEErr addPlugin(NMEBoolean isBlock,
 {
 	NMEConstText name, data;
 	NMEInt nameLen, dataLen;
-	NMEInt j, k;
+	NMEInt j;
 	NMEErr err;
 	
+	*reparseOutput = FALSE;
+	
 	// find name
 	skipBlanks(context->src, context->srcLen, &context->srcIndex);
 	name = context->src + context->srcIndex;
@@ -2039,6 +3237,8 @@ static NMEErr addPlugin(NMEBoolean isBlock,
 								&& context->src[context->srcIndex + dataLen + 2] != '>');
 				dataLen++)
 			;
+	if (context->srcIndex + dataLen + (isPlaceholder ? 2 : 1) >= context->srcLen)
+		addDependency(context, kDependFollowing);	// no end marker in segment
 	context->srcIndex += dataLen;
 	if (context->srcIndex + (isPlaceholder ? 3 : 2) <= context->srcLen)
 		context->srcIndex += isPlaceholder ? 3 : 2;	// skip >>> or >>
@@ -2049,36 +3249,18 @@ static NMEErr addPlugin(NMEBoolean isBlock,
 	if (dataLen > 0 && data[dataLen - 1] == '\r')
 		dataLen--;
 	
-	// find plugin
-	if (outputFormat->plugins && nameLen > 0)
-		for (j = 0; outputFormat->plugins[j].name; j++)
-			if (isPlaceholder
-					^ (outputFormat->plugins[j].options & kNMEPluginOptTripleAngleBrackets) == 0)
-			{
-				// compare plugin name
-				for (k = 0; k < nameLen && outputFormat->plugins[j].name[k]; k++)
-					if (name[k] != outputFormat->plugins[j].name[k])
-						goto continueMainLoop;
-				if (outputFormat->plugins[j].name[k] != '\0'
-						|| k < nameLen
-							&& !(outputFormat->plugins[j].options & kNMEPluginOptPartialName))
-					goto continueMainLoop;
-				
-				// execute plugin
-				CheckError(outputFormat->plugins[j].cb(name, nameLen,
-						data, dataLen,
-						context,
-						outputFormat->plugins[j].userData));
-				
-				*reparseOutput
-						= (outputFormat->plugins[j].options & kNMEPluginOptReparseOutput) != 0;
-				
-				return kNMEErrOk;
-continueMainLoop:
-				;
-			}
+	// execute plugin
+	if (pluginIndex >= 0)
+	{
+		addDependency(context, kDependPlugin);
+		CheckError(outputFormat->plugins[pluginIndex].cb(name, nameLen,
+				data, dataLen,
+				context,
+				outputFormat->plugins[pluginIndex].userData));
+		*reparseOutput = (outputFormat->plugins[pluginIndex].options
+				& kNMEPluginOptReparseOutput) != 0;
+	}
 	
-	// not found: ignore
 	return kNMEErrOk;
 }
 
@@ -2254,7 +3436,8 @@ static NMEBoolean parseNextToken(NMEConstText src, NMEInt srcLen,
 				case kNMEStateBetweenPar:
 				case kNMEStateParAfterEol:
 					if (nesting == 0
-							|| src[*i] == (listNum[0] == kNMEListNumUL ? '*' : '#')
+							|| (listNum[0] == kNMEListNumUL ? src[*i] == '*'
+								: listNum[0] > 0 && src[*i] == '#')
 								&& (nesting == 1 || *i + 1 >= srcLen || src[*i] != src[*i + 1]
 									|| (src[*i] == '*'
 										? options & kNMEProcessOptNoBold || listNum[1] == kNMEListNumUL
@@ -2549,7 +3732,8 @@ static NMEBoolean parseNextToken(NMEConstText src, NMEInt srcLen,
 			} else {
 				if (verbatim
 						|| options & kNMEProcessOptNoStrike && src[*i] == '-'
-						|| src[*i + 2] == ' ' && src[*i - 1] == ' ')
+						|| *i > 0 && *i + 2 < srcLen
+							&& src[*i + 2] == ' ' && src[*i - 1] == ' ')
 					break;	// plain character, or mdash
 				switch (state)
 				{
@@ -2607,195 +3791,803 @@ tokenLI:
 	return TRUE;
 }
 
-/** Swap source and destination buffers after some plugin or autoconvert
-	output must be reparsed.
-	@param[in,out] src input characters
-	@param[in,out] srcLen length of src in bytes
-	@param[in,out] context current context
-	@param[in,out] commonLen number of bytes at beginning of dest already copied in src
-	@param[in] destLen0 value of destLen before plugin or autoconvert call
-	@return error code (kNMEErrOk for success)
-	@see NMEProcess
+/** Characters which can begin markup or end a word (nonzero), indexed by
+	character code (see parseNextToken) */
+static char const markupChar[256] =
+{
+	0,0,0,0,0,0,0,0,0,1,1,0,0,1,0,0,	// 0x00: tab lf cr
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,0,0,1,0,0,0,0,0,0,1,0,1,1,0,1,	// 0x20: space # * , - /
+	0,0,0,0,0,0,0,0,0,0,1,1,1,1,0,0,	// 0x30: : ; < =
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,	// 0x50: [ \ ] ^ _
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,0,	// 0x70: { | } ~
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+/** Specialize markupChar for the options of a conversion: characters whose
+	markup is disabled are always parsed as kNMETokenChar in paragraphs, so
+	that they're copied with the plain text around them.
+	@param[out] markupChars array of 256 values, nonzero for characters which
+	can begin markup or end a word
+	@param[in] options kNMEProcessOptDefault or sum of options
 */
-static NMEErr swapBuffers(NMEText *src, NMEInt *srcLen,
-		NMEContext *context,
-		NMEInt *commonLen,
-		NMEInt destLen0)
+static void initMarkupChars(NMEChar markupChars[], NMEInt options)
 {
-	NMEInt k;
-	NMEText tmp;
+	NMEInt c;
 	
-	// check size
-	if (*srcLen + context->destLen - context->srcIndex > context->bufSize
-			|| destLen0 > context->bufSize)
-		return kNMEErrNotEnoughMemory;
-	
-	// see comment at beginning of NMEProcess
-	for (k = 0; k < *srcLen - context->srcIndex; k++)
-		context->dest[context->destLen + k] = (*src)[context->srcIndex + k];
-	for (k = 0; k < destLen0 - *commonLen; k++)
-		(*src)[*commonLen + k] = context->dest[*commonLen + k];
-	*commonLen = destLen0;
-	*srcLen += context->destLen - context->srcIndex;
-	context->srcIndexOffset -= context->destLen - context->srcIndex;
-	context->srcIndex = context->destLen = destLen0;
-	tmp = *src; *src = context->dest; context->dest = tmp;
-	
-	return kNMEErrOk;
+	for (c = 0; c < 256; c++)
+		markupChars[c] = markupChar[c];
+	if (options & kNMEProcessOptNoBold)
+		markupChars['*'] = 0;
+	if (options & kNMEProcessOptNoMonospace)
+		markupChars['#'] = 0;
+	if (options & kNMEProcessOptNoItalic)
+		markupChars['/'] = 0;
+	if (options & kNMEProcessOptNoUnderline)
+		markupChars['_'] = 0;
+	if (options & kNMEProcessOptNoSubSuperscript)
+		markupChars['^'] = markupChars[','] = 0;
+	if (options & kNMEProcessOptNoStrike)
+		markupChars['-'] = 0;	// hrule isn't parsed in paragraphs
+	if (options & kNMEProcessOptNoLink)
+		markupChars['['] = markupChars[']'] = 0;
+	if (options & kNMEProcessOptNoTable)
+		markupChars['|'] = 0;
+	if (options & kNMEProcessOptNoPlugin)
+		markupChars['<'] = 0;
+	if (options & kNMEProcessOptNoEscape)
+		markupChars['~'] = 0;
 }
 
-NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
-		NMEText buf, NMEInt bufSize,
-		NMEInt options,
-		NMEConstText eol,
+/// Check if a character is always parsed as kNMETokenChar in paragraphs
+#define isPlainChar(context, c) (!(context)->markupChars[(unsigned char)(c)])
+
+/// Bit of the characters where autoconverts can match in stopChars of copyPlainText
+#define kStopCharTrigger 2
+
+/** Copy the plain characters and single spaces which follow in a paragraph
+	or a heading, with the same result as if they were parsed one at a time
+	(kNMETokenChar and kNMETokenSpace in state kNMEStatePar or
+	kNMEStateHeading), stopping before the first
+	character which could begin markup. Runs are encoded with encodeRunFun
+	if there is one, as long as no wordwrap is required.
+	@param[in,out] context current context
+	@param[in] outputFormat format strings
+	@param[in] end index in src where copy must stop (e.g. for autoconverts)
+	@param[in] stopChars array of 256 values, nonzero for characters where
+	copy must stop: context->markupChars, or a copy with kStopCharTrigger
+	set for triggers of autoconverts (a single lookup per character)
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr copyPlainText(NMEContext *context,
 		NMEOutputFormat const *outputFormat,
-		NMEInt fontSize,
-		NMEText *output,
-		NMEInt *outputLen,
-		NMEInt *outputUCS16Len)
+		NMEInt end,
+		NMEChar const *stopChars)
 {
-	/*
-	NMEProcess uses two buffers for input and output and swaps them when
-	it must reprocess output, be it for plugins or autoconvert.
-	src[0..commonLen-1]: partial copy of processed output, same as dest[0..commonLen-1]
-	src[commonLen..i0-1]: processed input, can be discarded
-	src[i0..srcLen-1]: input still to be processed
-	dest[0..destLen0-1]: processed output
-	When having to consume src[i0..i-1] and replace it with dest[destLen0..destLen-1] which must
-	be processed again, the following steps occur:
-	- copy src[i..srcLen-1] to dest[destLen..destLen+srcLen-i-1]
-	- copy dest[commonLen..destLen0-1] to src[commonLen..destLen0-1]
-	- set commonLen to destLen0
-	- set srcLen to srcLen + destLen - i
-	- set i to destLen0
-	- set destLen to destLen0
-	- swap src and dest
-	*/
-	NMEInt destLenTmp;	// temp. destLen used with plugins and autoconvert
-	NMEInt commonLen;	// length of processed text shared in src and dest
-	NMEInt i0;	// value of srcIndex before parsing current token
-	NMEInt noAutoOrPluginLen;	// initial span of src protected against autoconvert and plugins
-	NMEBoolean reparseOutput;	// TRUE if plugin's output must be parsed again
-	NMEState state;	// current state
-	NMEToken token;	// next token
-	NMEInt headingNum[kMaxNumberedHeadingLevels];	// last heading number
-	NMEInt headingFlags;	// bit i-1 is 1 if currently in a section at level i
-	NMEInt currentIndent;	// number of spaces to prepend to each line
-	NMEStyle styleStack[kNMEStylesCount];	// stack of styles
-	NMEInt styleNesting;	// number of styles in styleStack
-	NMEStyle newStyle = (NMEStyle)0;
-	NMEInt itemNesting = 0;
-	NMEInt headingLevel = 0;	// current heading level (1=top-level heading)
-	NMEInt headingLevel0 = 0;	// heading level before current token
-	NMEContext context;	// context used for expressions in output strings
+	NMEInt i, n;
 	NMEErr err;
 	
-#define HOOK(cb, l, it, e, m) \
-	do { \
-		if (outputFormat->cb) \
-		{ \
-			err = outputFormat->cb(l, it, e, m, i0 + context.srcIndexOffset, \
-					&context, \
-					outputFormat->hookData); \
-			if (err != kNMEErrOk) \
-				return err; \
-		} \
-	} while (0)
-	
-	// set up format
-	if (!outputFormat)
-		outputFormat = &NMEOutputFormatText;
-	context.fontSize = fontSize > 0 ? fontSize : outputFormat->defFontSize;
-	context.options = options;
-	context.eol = eol;
-	context.ctrlChar = outputFormat->ctrlChar;
-	context.xref = (options & kNMEProcessOptXRef) != 0;
-	setContext(context, 0, 0);
-	
-	// set up buffers
-	if (nmeTextLen > bufSize / 2)
-		return kNMEErrNotEnoughMemory;
-	context.src = buf;
-	context.srcLen = nmeTextLen;
-	for (i0 = 0; i0 < nmeTextLen; i0++)
-		buf[i0] = nmeText[i0];
-	context.dest = buf + bufSize / 2;
-	context.bufSize = bufSize / 2;
-	
-	// set up parser state
-	context.outputFormat = outputFormat;
-	context.destLen = context.col = 0;
-	context.destLenUCS16 = 0;
-	commonLen = noAutoOrPluginLen = 0;
-	context.currentIndent = 0;
-	state = kNMEStateBetweenPar;
-	context.nesting = 0;
-	styleNesting = 0;
-	headingNum[0] = -1;
-	nextHeading(&headingFlags, headingNum, 1);
-	headingFlags = 0;
-	
-	// beginning of doc
-	if (!(options & kNMEProcessOptNoPreAndPost)
-			&& !NMEAddString(outputFormat->beginDoc, -1, context.ctrlChar, &context))
-		return kNMEErrNotEnoughMemory;
+	if (end > context->srcLen)
+		end = context->srcLen;
 	
-	// single pass main loop
-	for (context.srcIndex = context.srcIndexOffset = 0; context.srcIndex < context.srcLen; )
+	for (;;)
 	{
-		// check enough memory for worst case
-		if (context.destLen + kNMETokenTab >= context.bufSize)
-			return kNMEErrNotEnoughMemory;
+		// find run of plain characters
+		for (n = context->srcIndex;
+				n < end && !stopChars[(unsigned char)context->src[n]];
+				n++)
+			;
 		
-		// autoconvert
-		if (state != kNMEStatePre && state != kNMEStatePreAfterEol
-				&& context.srcIndex >= noAutoOrPluginLen
-				&& !(options & kNMEProcessOptNoPlugin)
-				&& outputFormat->autoconverts)
+		if (outputFormat->encodeRunFun && n > context->srcIndex
+				&& (outputFormat->textWidth <= 0 || context->col < outputFormat->textWidth))
 		{
-			NMEInt k;
+			NMEInt srcIndex0 = context->srcIndex;
+			NMEInt destLen0 = context->destLen;
+			NMEInt col0 = context->col;
 			
-			for (k = 0; outputFormat->autoconverts[k].cb; k++)
+			CheckError(outputFormat->encodeRunFun(context->src, context->srcLen,
+					&context->srcIndex, n,
+					context,
+					outputFormat->encodeCharData));
+			if (outputFormat->textWidth > 0 && context->col >= outputFormat->textWidth)
 			{
-				destLenTmp = context.destLen;
-				if (outputFormat->autoconverts[k].cb(context.src, context.srcLen, &context.srcIndex,
-						&context,
-						outputFormat->autoconverts[k].userData))
-				{
-					noAutoOrPluginLen = context.destLen;
-					CheckError(swapBuffers(&context.src, &context.srcLen,
-							&context,
-							&commonLen,
-							destLenTmp));
-					break;
-				}
+				// wordwrap needed: encode again one character at a time
+				context->srcIndex = srcIndex0;
+				invalidateOutput(context, destLen0);
+				context->destLen = destLen0;
+				context->col = col0;
 			}
 		}
 		
-		// parse token (sensitive to context)
-		i0 = context.srcIndex;
-		headingLevel0 = headingLevel;
-		if (!parseNextToken(context.src, context.srcLen, &context.srcIndex,
-				state,
-				styleNesting > 0 && styleStack[styleNesting - 1] == kNMEStyleVerbatim,
-				context.nesting, context.listNum,
-				styleStack, styleNesting,
-				outputFormat,
-				&token,
-				&headingLevel,
-				&itemNesting,
-				&newStyle,
-				options))
-			break;	// nothing more on line: ignore
+		if (outputFormat->encodeCharFun || outputFormat->textWidth > 0)
+			while (context->srcIndex < n)
+			{
+				if (outputFormat->encodeCharFun)
+					CheckError(outputFormat->encodeCharFun(context->src, context->srcLen,
+							&context->srcIndex,
+							context,
+							outputFormat->encodeCharData));
+				else
+				{
+					if (!checkDestSize(context, 1))
+						return kNMEErrNotEnoughMemory;
+					context->dest[context->destLen++] = context->src[context->srcIndex];
+					context->srcIndex++;
+					context->col++;
+				}
+				CheckError(checkWordwrap(context, outputFormat));
+			}
+		else if (n > context->srcIndex)
+		{
+			// no wordwrap: copy the whole run
+			if (!checkDestSize(context, n - context->srcIndex))
+				return kNMEErrNotEnoughMemory;
+			context->col += n - context->srcIndex;
+			for (i = context->destLen; context->srcIndex < n; )
+				context->dest[i++] = context->src[context->srcIndex++];
+			context->destLen = i;
+		}
 		
-		// state machine
-		switch (state)
+		// single space before more plain characters
+		if (context->srcIndex + 1 >= end
+				|| context->src[context->srcIndex] != ' '
+				|| stopChars[' '] & kStopCharTrigger
+				|| !isPlainChar(context, context->src[context->srcIndex + 1]))
+			return kNMEErrOk;
+		if (!NMEAddString(outputFormat->space, -1, context->ctrlChar, context))
+			return kNMEErrNotEnoughMemory;
+		CheckError(checkWordwrap(context, outputFormat));
+		context->srcIndex++;
+	}
+}
+
+/** Copy the characters which follow in a preformatted block up to the next
+	tab or end of line, with the same result as if they were parsed one at a
+	time (kNMETokenChar and kNMETokenSpace in state kNMEStatePre).
+	@param[in,out] context current context
+	@param[in] outputFormat format strings
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr copyPreText(NMEContext *context,
+		NMEOutputFormat const *outputFormat)
+{
+	NMEInt i, n;
+	
+	// spaces are encoded separately by encodeCharPreFun
+	for (n = context->srcIndex;
+			n < context->srcLen && !isEol(context->src[n]) && context->src[n] != '\t'
+				&& (context->src[n] != ' ' || !outputFormat->encodeCharPreFun
+					|| outputFormat->encodeRunPreFun);
+			n++)
+		;
+	if (n <= context->srcIndex)
+		return kNMEErrOk;
+	
+	if (outputFormat->encodeRunPreFun)
+		return outputFormat->encodeRunPreFun(context->src, context->srcLen,
+				&context->srcIndex, n,
+				context,
+				outputFormat->encodeCharPreData);
+	else if (outputFormat->encodeCharPreFun)
+	{
+		NMEErr err;
+		
+		while (context->srcIndex < n)
+			CheckError(outputFormat->encodeCharPreFun(context->src, context->srcLen,
+					&context->srcIndex,
+					context,
+					outputFormat->encodeCharPreData));
+	}
+	else
+	{
+		if (!checkDestSize(context, n - context->srcIndex))
+			return kNMEErrNotEnoughMemory;
+		context->col += n - context->srcIndex;
+		for (i = context->destLen; context->srcIndex < n; )
+			context->dest[i++] = context->src[context->srcIndex++];
+		context->destLen = i;
+	}
+	return kNMEErrOk;
+}
+
+/** Find where the autoconverts which have a scan function can match next,
+	scanning again from srcIndex those whose position has been passed.
+	Positions are kept as index + srcIndexOffset, which doesn't change when
+	the remaining source is moved or when autoconvert output (protected
+	against autoconverts) is inserted before it.
+	@param[in] context current context
+	@param[in] autoconverts table of autoconverts
+	@param[in] scannedCount number of autoconverts whose scan function is used
+	@param[in,out] next position where autoconverts[k] can match (< 0 initially)
+	@param[out] end index in src of the first position where one can match
+	@return mask of the bits of the autoconverts which can match at srcIndex
+*/
+static NMEInt scanAutoconverts(NMEContext const *context,
+		NMEAutoconvert const *autoconverts,
+		NMEInt scannedCount,
+		NMEInt *next,
+		NMEInt *end)
+{
+	NMEInt i = context->srcIndex + context->srcIndexOffset;
+	NMEInt k, mask;
+	
+	*end = context->srcLen;
+	for (k = mask = 0; k < scannedCount; k++)
+		if (autoconverts[k].scan)
 		{
-			case kNMEStateBetweenPar:
-				switch (token)
+			if (next[k] < i)
+				next[k] = autoconverts[k].scan(context->src, context->srcLen,
+						context->srcIndex, autoconverts[k].userData)
+						+ context->srcIndexOffset;
+			if (next[k] == i)
+				mask |= autoconvertBit(k);
+			if (next[k] - context->srcIndexOffset < *end)
+				*end = next[k] - context->srcIndexOffset;
+		}
+	return mask;
+}
+
+/** Forget the positions found by scanAutoconverts, when text which must be
+	scanned (e.g. plugin output) is inserted before the remaining source.
+	@param[out] next position where autoconverts[k] can match
+	@param[in] scannedCount number of autoconverts whose scan function is used
+*/
+static void resetAutoconvertScans(NMEInt *next, NMEInt scannedCount)
+{
+	NMEInt k;
+	
+	for (k = 0; k < scannedCount; k++)
+		next[k] = -1;
+}
+
+/** Move the remaining source to the end of a writable source buffer, so that
+	text to be reparsed can be inserted before it: src is copied to the scratch
+	buffer the first time with an output sink (nmeText is read-only), or moved
+	within the first half of buf with NMEProcess.
+	@param[in,out] context current context
+	@param[in] size minimum size of text to reparse, lookbehind and remaining source
+	@param[in,out] noAutoOrPluginLen initial span of src protected against autoconvert
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr makeRoomBeforeSource(NMEContext *context, NMEInt size,
+		NMEInt *noAutoOrPluginLen)
+{
+	NMEInt restLen = context->srcLen - context->srcIndex;
+	NMEInt newIndex, k;
+	NMEText newSrc;
+	
+	if (context->sink)
+	{
+		NMEBoolean srcInScratch = context->src == *context->scratch;
+		
+		// grow by at least 50% so that the source isn't moved too often
+		if (size > *context->scratchSize)
+		{
+			if (context->sink->growFun(context->scratch, context->scratchSize,
+						size + size / 2 + kNMESinkMinSize, context->sink->data) != kNMEErrOk
+					|| *context->scratchSize < size)
+				return kNMEErrNotEnoughMemory;
+			if (srcInScratch)
+				context->src = *context->scratch;
+		}
+		newSrc = *context->scratch;
+		newIndex = *context->scratchSize - restLen;	// all free space before
+	}
+	else
+	{
+		if (size > context->bufSize)
+			return kNMEErrNotEnoughMemory;
+		newSrc = context->src;
+		// half the free space before, half left for NMEGetTempMemory
+		newIndex = size - restLen + (context->bufSize - size) / 2;
+	}
+	
+	// move remaining source (may overlap)
+	if (newSrc + newIndex > context->src + context->srcIndex)
+		for (k = restLen - 1; k >= 0; k--)
+			newSrc[newIndex + k] = context->src[context->srcIndex + k];
+	else
+		for (k = 0; k < restLen; k++)
+			newSrc[newIndex + k] = context->src[context->srcIndex + k];
+	
+	if (*noAutoOrPluginLen > context->srcIndex)
+		*noAutoOrPluginLen += newIndex - context->srcIndex;
+	context->srcIndexOffset -= newIndex - context->srcIndex;
+	context->src = newSrc;
+	context->srcLen = newIndex + restLen;
+	context->srcIndex = newIndex;
+	
+	return kNMEErrOk;
+}
+
+/** Insert plugin or autoconvert output which must be parsed again before the
+	remaining source; the cost is proportional to the length of the inserted
+	text, except when there isn't enough processed source to overwrite.
+	@param[in,out] context current context
+	@param[in] destLen0 value of destLen before plugin or autoconvert call
+	@param[in] col0 value of col before plugin or autoconvert call
+	@param[in,out] noAutoOrPluginLen initial span of src protected against
+	autoconvert
+	@return error code (kNMEErrOk for success)
+	@see NMEProcess
+*/
+static NMEErr insertReparsedText(NMEContext *context,
+		NMEInt destLen0,
+		NMEInt col0,
+		NMEInt *noAutoOrPluginLen)
+{
+	/*
+	src[0..start-1]: free (processed source)
+	src[start..start+lb-1]: last lb bytes of output before destLen0 (lookbehind)
+	src[start+lb..srcIndex-1]: dest[destLen0..destLen-1], to be reparsed
+	src[srcIndex..srcLen-1]: remaining source
+	*/
+	NMEInt lb = destLen0 < kNMEReparseLookbehind ? destLen0 : kNMEReparseLookbehind;
+	NMEInt insLen = context->destLen - destLen0;
+	NMEInt size = lb + insLen + context->srcLen - context->srcIndex;
+	NMEInt start, k;
+	NMEErr err;
+	
+	if (lb < kNMEReparseLookbehind)
+		addDependency(context, kDependOutput);
+	
+	// text to be reparsed hasn't been output yet
+	context->col = col0;
+	invalidateOutput(context, destLen0);
+	
+	// NMEProcess needs room for it in the first half of buf
+	if (size > context->peakSize)
+		context->peakSize = size;
+	
+	// nmeText is read-only with an output sink
+	if ((context->sink && context->src != *context->scratch)
+			|| context->srcIndex < lb + insLen)
+		CheckError(makeRoomBeforeSource(context, size, noAutoOrPluginLen));
+	
+	// copy lookbehind and text to reparse
+	start = context->srcIndex - lb - insLen;
+	for (k = 0; k < lb + insLen; k++)
+		context->src[start + k] = context->dest[destLen0 - lb + k];
+	
+	if (*noAutoOrPluginLen <= context->srcIndex)
+		*noAutoOrPluginLen = 0;
+	context->srcIndex -= insLen;
+	context->destLen = destLen0;
+	
+	// slots reserved in the reparsed text are moved before it
+	for (k = 0; k < context->deferredCount; k++)
+		if (context->deferred[k].outputIndex > context->destOffset + destLen0)
+			context->deferred[k].outputIndex = context->destOffset + destLen0;
+	
+	return kNMEErrOk;
+}
+
+/** Pass a part of dest to the flush callback of the output sink.
+	@param[in,out] context current context
+	@param[in] index index of the part in dest
+	@param[in] len length of the part
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr flushPart(NMEContext *context, NMEInt index, NMEInt len)
+{
+	NMEErr err;
+	
+	if (len <= 0)
+		return kNMEErrOk;
+	err = context->sink->flushFun(context->dest + index, len, context->sink->data);
+	if (err != kNMEErrOk)
+		return err;
+	if (context->countFlushedUCS16)
+		context->destOffsetUCS16 += countUCS16(context->dest + index, len);
+	return kNMEErrOk;
+}
+
+/** Fill the slots reserved with NMEAddDeferred. The output of all callbacks
+	is added at the end of dest; then, with a flush callback, output is passed
+	to it piece by piece in order, without moving what follows the slots;
+	without flush callback, each piece is moved once to its final position.
+	@param[in,out] context current context
+	@param[in] all TRUE if the whole output will be flushed
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr fillDeferred(NMEContext *context, NMEBoolean all)
+{
+	NMEInt count = context->deferredCount;
+	NMEInt col0 = context->col;
+	NMEInt fill[kMaxDeferred + 1];	// index of callback output in dest
+	NMEInt slot[kMaxDeferred];	// index of slot in dest
+	NMEInt k, i, len, end, shift, fillLen;
+	NMEErr err;
+	
+	if (count == 0)
+		return kNMEErrOk;
+	
+	context->deferredCount = kMaxDeferred;	// callbacks can't reserve slots
+	for (k = 0; k < count; k++)
+	{
+		slot[k] = context->deferred[k].outputIndex - context->destOffset;
+		fill[k] = context->destLen;
+		CheckError(context->deferred[k].fun(context->deferred[k].id, context,
+				context->deferred[k].data));
+	}
+	fill[count] = context->destLen;
+	fillLen = fill[count] - fill[0];
+	context->deferredCount = 0;
+	context->col = col0;
+	
+	if (context->sink && context->sink->flushFun)
+	{
+		// flush output up to the last slot, and after it if all
+		discardUCS16(context, 0);
+		for (k = i = 0; k < count; i = slot[k++])
+		{
+			CheckError(flushPart(context, i, slot[k] - i));
+			CheckError(flushPart(context, fill[k], fill[k + 1] - fill[k]));
+		}
+		len = fill[0] - i;
+		if (all)
+		{
+			CheckError(flushPart(context, i, len));
+			i += len;
+			len = 0;
+		}
+		
+		// keep the rest at the beginning of dest
+		for (k = 0; k < len; k++)
+			context->dest[k] = context->dest[i + k];
+		context->destLen = len;
+		context->destOffset += i + fillLen;
+		context->wrapLine = context->wrapScanned = 0;
+		context->wrapPoint = -1;
+	}
+	else if (fillLen > 0)
+	{
+		// keep callback output after its final position
+		if (!checkDestSize(context, fillLen))
+			return kNMEErrNotEnoughMemory;
+		invalidateOutput(context, slot[0]);
+		for (i = fillLen; i-- > 0; )
+			context->dest[fill[0] + fillLen + i] = context->dest[fill[0] + i];
+		
+		// from the end, move text after each slot, then callback output
+		end = fill[0];
+		shift = fillLen;
+		for (k = count - 1; k >= 0; k--)
+		{
+			for (i = end; i-- > slot[k]; )
+				context->dest[i + shift] = context->dest[i];
+			len = fill[k + 1] - fill[k];
+			shift -= len;
+			for (i = 0; i < len; i++)
+				context->dest[slot[k] + shift + i]
+						= context->dest[fill[k] + fillLen + i];
+			end = slot[k];
+		}
+	}
+	
+	return kNMEErrOk;
+}
+
+/** Convert NME text, with a fixed-size buffer or an output sink.
+	@param[in] nmeText input text
+	@param[in] nmeTextLen length of nmeText in bytes
+	@param[in] buf buffer for classic processing (ignored if sink is not NULL)
+	@param[in] bufSize size of buf
+	@param[in] sink output sink, or NULL for classic processing in buf
+	@param[in,out] sinkBuf address of output buffer managed by sink
+	@param[in,out] sinkBufSize address of size of *sinkBuf
+	@param[in,out] scratch address of source buffer for reparsing, managed by sink
+	@param[in,out] scratchSize address of size of *scratch
+	@param[in] options sum of options
+	@param[in] eol end-of-line sequence
+	@param[in] outputFormat format strings
+	@param[in] fontSize default font size
+	@param[out] output address of output (not flushed yet)
+	@param[out] outputLen total length of output in bytes
+	@param[out] outputUCS16Len length of output in UCS-16 units (NULL if not needed)
+	@param[in,out] segment state carried from the previous segment and to the next
+	one if nmeText is a segment of a larger document split at block boundaries,
+	or NULL for a whole document (requires a sink)
+	@param[out] peakSize half of the size of buf NMEProcess would need for the
+	same conversion (NULL if not needed)
+	@return error code (kNMEErrOk for success)
+	@see NMEProcess
+	@see NMEProcessToSink
+*/
+static NMEErr processText(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText buf, NMEInt bufSize,
+		NMEOutputSink const *sink,
+		NMEText *sinkBuf, NMEInt *sinkBufSize,
+		NMEText *scratch, NMEInt *scratchSize,
+		NMESegmentState *segment,
+		NMEInt *peakSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	/*
+	NMEProcess uses the first half of buf for input and the second half for
+	output; NMEProcessToSink reads nmeText in place and writes output to the
+	sink buffer, which may be grown or flushed at any time.
+	When plugin or autoconvert output dest[destLen0..destLen-1] must be
+	processed again, it's copied to src just before the remaining input,
+	over processed input, and destLen is reset to destLen0 (see
+	insertReparsedText). With an output sink, the remaining input is first
+	copied to a separate scratch buffer, since nmeText cannot be modified.
+	*/
+	NMEInt destLenTmp;	// temp. destLen used with plugins and autoconvert
+	NMEInt colTmp;	// temp. col used with plugins and autoconvert
+	NMEInt i0;	// value of srcIndex before parsing current token
+	NMEInt noAutoOrPluginLen;	// initial span of src protected against autoconvert and plugins
+	NMEInt autoconvertTriggers[256];	// bit k set if autoconverts[k] can match at char
+	NMEInt const *triggers;	// autoconvertTriggers, or NULL if no autoconvert is called
+	NMEChar triggerStopChars[256];	// markupChars with kStopCharTrigger for triggers
+	NMEInt autoconvertNext[kNMEMaxScannedAutoconverts];	// see scanAutoconverts
+	NMEInt scannedCount = 0;	// number of autoconverts whose scan is used
+	NMEInt scanEnd;	// index where an autoconvert with scan can match next
+	NMEBoolean anyNotInLinks = FALSE;	// TRUE if some autoconverts have notInLinks
+	NMEBoolean reparseOutput;	// TRUE if plugin's output must be parsed again
+	NMEState state;	// current state
+	NMEToken token;	// next token
+	NMEInt headingNum[kMaxNumberedHeadingLevels];	// last heading number
+	NMEInt headingFlags;	// bit i-1 is 1 if currently in a section at level i
+	NMEInt currentIndent;	// number of spaces to prepend to each line
+	NMEStyle styleStack[kNMEStylesCount];	// stack of styles
+	NMEInt styleNesting;	// number of styles in styleStack
+	NMEStyle newStyle = (NMEStyle)0;
+	NMEInt itemNesting = 0;
+	NMEInt headingLevel = 0;	// current heading level (1=top-level heading)
+	NMEInt headingLevel0 = 0;	// heading level before current token
+	NMEContext context;	// context used for expressions in output strings
+	NMEErr err;
+	
+#define HOOK(cb, l, it, e, m) \
+	do { \
+		if (outputFormat->cb) \
+		{ \
+			err = outputFormat->cb(l, it, e, m, i0 + context.srcIndexOffset, \
+					&context, \
+					outputFormat->hookData); \
+			if (err != kNMEErrOk) \
+				return err; \
+		} \
+	} while (0)
+	
+	// copy the plain text which follows a character in a paragraph or a
+	// heading (char hook needs every single character), up to where an
+	// autoconvert can match after the protected span
+#define COPY_PLAIN_TEXT() \
+	do { \
+		if (!outputFormat->charHookFun) \
+		{ \
+			CheckError(copyPlainText(&context, outputFormat, \
+					triggers ? noAutoOrPluginLen : context.srcLen, \
+					context.markupChars)); \
+			if (triggers && context.srcIndex >= noAutoOrPluginLen) \
+			{ \
+				(void)scanAutoconverts(&context, outputFormat->autoconverts, \
+						scannedCount, autoconvertNext, &scanEnd); \
+				CheckError(copyPlainText(&context, outputFormat, \
+						scanEnd, triggerStopChars)); \
+			} \
+		} \
+	} while (0)
+	
+	// set up format
+	if (!outputFormat)
+		outputFormat = &NMEOutputFormatText;
+	context.fontSize = fontSize > 0 ? fontSize : outputFormat->defFontSize;
+	context.options = options;
+	initMarkupChars(context.markupChars, options);
+	context.eol = eol;
+	context.ctrlChar = outputFormat->ctrlChar;
+	context.xref = (options & kNMEProcessOptXRef) != 0;
+	setContext(context, 0, 0);
+	
+	// set up buffers
+	context.sink = sink;
+	context.destOffset = 0;
+	context.peakSize = nmeTextLen;
+	context.destFull = FALSE;
+	context.flushRetryLen = 0;
+	if (sink)
+	{
+		// input is read in place; it is never written to in this mode
+		context.src = (NMEText)nmeText;
+		context.srcLen = nmeTextLen;
+		context.sinkBuf = sinkBuf;
+		context.sinkBufSize = sinkBufSize;
+		context.scratch = scratch;
+		context.scratchSize = scratchSize;
+		context.dest = *sinkBuf;
+		context.bufSize = *sinkBufSize;
+	}
+	else
+	{
+		if (nmeTextLen > bufSize / 2)
+			return kNMEErrNotEnoughMemory;
+		context.src = buf;
+		context.srcLen = nmeTextLen;
+		for (i0 = 0; i0 < nmeTextLen; i0++)
+			buf[i0] = nmeText[i0];
+		context.dest = buf + bufSize / 2;
+		context.bufSize = bufSize / 2;
+	}
+	
+	// set up parser state
+	context.outputFormat = outputFormat;
+	context.destLen = context.col = 0;
+	context.destOffsetUCS16 = context.countedLen = context.countedUCS16 = 0;
+	context.wrapLine = context.wrapScanned = 0;
+	context.wrapPoint = -1;
+	context.countFlushedUCS16 = outputUCS16Len || segment
+			|| outputFormat->charHookFun
+			|| outputFormat->divHookFun || outputFormat->parHookFun
+			|| outputFormat->spanHookFun
+			|| outputFormat->plugins || outputFormat->autoconverts;
+	noAutoOrPluginLen = 0;
+	triggers = NULL;
+	if (outputFormat->autoconverts && !(options & kNMEProcessOptNoPlugin))
+	{
+		NMEInt c, k;
+		
+		// dispatch table of the characters where each autoconvert can match
+		for (c = 0; c < 256; c++)
+			autoconvertTriggers[c] = 0;
+		for (k = 0; outputFormat->autoconverts[k].cb; k++)
+		{
+			if (outputFormat->autoconverts[k].notInLinks)
+				anyNotInLinks = TRUE;
+			if (k < kNMEMaxScannedAutoconverts && outputFormat->autoconverts[k].scan)
+			{
+				// found by scan instead
+				autoconvertNext[k] = -1;
+				scannedCount = k + 1;
+			}
+			else if (outputFormat->autoconverts[k].triggers)
+				for (c = 0; outputFormat->autoconverts[k].triggers[c]; c++)
+					autoconvertTriggers[(unsigned char)outputFormat->autoconverts[k].triggers[c]]
+							|= autoconvertBit(k);
+			else
+				for (c = 0; c < 256; c++)
+					autoconvertTriggers[c] |= autoconvertBit(k);
+		}
+		triggers = autoconvertTriggers;
+		for (c = 0; c < 256; c++)
+			triggerStopChars[c] = context.markupChars[c]
+					| (autoconvertTriggers[c] ? kStopCharTrigger : 0);
+	}
+	context.currentIndent = 0;
+	state = kNMEStateBetweenPar;
+	context.nesting = 0;
+	styleNesting = 0;
+	headingNum[0] = -1;
+	nextHeading(&headingFlags, headingNum, 1);
+	headingFlags = 0;
+	context.srcIndexOffset = 0;
+	context.dependencies = NULL;
+	context.deferredCount = 0;
+	if (segment)
+	{
+		// continue where the previous segment stopped
+		context.destLen = segment->keptLen;
+		context.destOffset = segment->outputLen - segment->keptLen;
+		context.countedLen = segment->keptLen;	// counted in outputUCS16Len
+		context.destOffsetUCS16 = segment->outputUCS16Len;
+		for (i0 = segment->keptLen; i0 > 0 && !isEol(context.dest[i0 - 1]); i0--)
+			;
+		context.wrapLine = context.wrapScanned = i0;
+		context.col = segment->col;
+		context.srcIndexOffset = segment->srcOffset;
+		context.dependencies = &segment->dependencies;
+		for (i0 = 0; i0 < kMaxNumberedHeadingLevels; i0++)
+			headingNum[i0] = segment->headingNum[i0];
+		headingFlags = segment->headingFlags;
+		headingLevel = segment->headingLevel;
+	}
+	
+	// beginning of doc
+	if (!(options & kNMEProcessOptNoPreAndPost)
+			&& !(segment && segment->begun)
+			&& !NMEAddString(outputFormat->beginDoc, -1, context.ctrlChar, &context))
+		return kNMEErrNotEnoughMemory;
+	
+	// single pass main loop
+	for (context.srcIndex = 0; context.srcIndex < context.srcLen; )
+	{
+		// pass complete lines to the output sink
+		if (sink && sink->flushFun
+				&& (context.destLen >= kNMESinkFlushSize
+					|| context.destLen > context.bufSize / 2)
+				&& context.destLen >= context.flushRetryLen)
+			CheckError(flushOutput(&context, FALSE));
+		
+		// check enough memory for worst case, and that output of callbacks
+		// which ignore errors (such as autoconverts) hasn't been truncated
+		if (context.destFull || !checkDestSize(&context, kNMETokenTab + 1))
+			return kNMEErrNotEnoughMemory;
+		
+		// autoconvert (at the beginning or where one can match)
+		if (state != kNMEStatePre && state != kNMEStatePreAfterEol
+				&& context.srcIndex >= noAutoOrPluginLen
+				&& triggers)
+		{
+			NMEInt k, mask;
+			NMEBoolean inLink = FALSE;
+			
+			mask = triggers[(unsigned char)context.src[context.srcIndex]]
+					| scanAutoconverts(&context, outputFormat->autoconverts,
+							scannedCount, autoconvertNext, &scanEnd);
+			if (context.srcIndex == 0)
+				mask = ~(NMEInt)0;
+			// autoconverts with notInLinks not in the text of links or images,
+			// unless the paragraph (and its unterminated links) ends here
+			if (anyNotInLinks && mask
+					&& (state != kNMEStateParAfterEol
+						|| !isEol(context.src[context.srcIndex])))
+				for (k = 0; k < styleNesting; k++)
+					if (styleStack[k] == kNMEStyleLink || styleStack[k] == kNMEStyleImage)
+						inLink = TRUE;
+			for (k = 0; mask && outputFormat->autoconverts[k].cb; k++)
+			{
+				if (!(mask & autoconvertBit(k))
+						|| inLink && outputFormat->autoconverts[k].notInLinks)
+					continue;
+
+				destLenTmp = context.destLen;
+				colTmp = context.col;
+				if (outputFormat->autoconverts[k].cb(context.src, context.srcLen, &context.srcIndex,
+						&context,
+						outputFormat->autoconverts[k].userData))
 				{
-					case kNMETokenChar:
-						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "p");
+					NMEInt len = context.destLen - destLenTmp;
+					
+					CheckError(insertReparsedText(&context,
+							destLenTmp, colTmp,
+							&noAutoOrPluginLen));
+					noAutoOrPluginLen = context.srcIndex + len;
+					break;
+				}
+			}
+		}
+		
+		// parse token (sensitive to context)
+		i0 = context.srcIndex;
+		headingLevel0 = headingLevel;
+		if (!parseNextToken(context.src, context.srcLen, &context.srcIndex,
+				state,
+				styleNesting > 0 && styleStack[styleNesting - 1] == kNMEStyleVerbatim,
+				context.nesting, context.listNum,
+				styleStack, styleNesting,
+				outputFormat,
+				&token,
+				&headingLevel,
+				&itemNesting,
+				&newStyle,
+				options))
+			break;	// nothing more on line: ignore
+		
+		// state machine
+		switch (state)
+		{
+			case kNMEStateBetweenPar:
+				switch (token)
+				{
+					case kNMETokenChar:
+						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "p");
 						if (!NMEAddString(outputFormat->beginPar, -1,
 								context.ctrlChar, &context))
 							return kNMEErrNotEnoughMemory;
@@ -2813,13 +4605,14 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 						}
 						else
 						{
+							if (!checkDestSize(&context, 1))
+								return kNMEErrNotEnoughMemory;
 							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
 							context.col++;
 						}
 						CheckError(checkWordwrap(&context, outputFormat));
 						state = kNMEStatePar;
+						COPY_PLAIN_TEXT();
 						break;
 					case kNMETokenSpace:
 					case kNMETokenTab:
@@ -3002,7 +4795,9 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 								state = kNMEStatePar;
 							}
 							destLenTmp = context.destLen;
-							CheckError(addPlugin(token == kNMETokenPluginBlock
+							colTmp = context.col;
+							CheckError(addPlugin(pluginIndex,
+									token == kNMETokenPluginBlock
 										|| token == kNMETokenPlaceholderBlock,
 									token == kNMETokenPlaceholder
 										|| token == kNMETokenPlaceholderBlock,
@@ -3010,10 +4805,10 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 									&reparseOutput));
 							if (reparseOutput)
 							{
-								CheckError(swapBuffers(&context.src, &context.srcLen,
-										&context,
-										&commonLen,
-										destLenTmp));
+								CheckError(insertReparsedText(&context,
+										destLenTmp, colTmp,
+										&noAutoOrPluginLen));
+								resetAutoconvertScans(autoconvertNext, scannedCount);
 								// noAutoOrPluginLen = context.destLen;
 							}
 						}
@@ -3042,12 +4837,13 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 						}
 						else
 						{
+							if (!checkDestSize(&context, 1))
+								return kNMEErrNotEnoughMemory;
 							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
 							context.col++;
 						}
 						CheckError(checkWordwrap(&context, outputFormat));
+						COPY_PLAIN_TEXT();
 						break;
 					case kNMETokenSpace:
 					case kNMETokenTab:
@@ -3088,10 +4884,10 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 					case kNMETokenTableHCell:
 						// gobble back spaces (keep tabs)
 						while (context.destLen > 0 && context.dest[context.destLen - 1] == ' ')
-						{
 							context.destLen--;
-							context.destLenUCS16--;
-						}
+						if (context.destLen <= 0)
+							addDependency(&context, kDependOutput);
+						invalidateOutput(&context, context.destLen);
 						// end last cell and begin new one
 						context.level = context.nesting;
 						CheckError(flushStyleTags(styleStack, &styleNesting,
@@ -3160,7 +4956,9 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 								state = kNMEStateBetweenPar;
 							}
 							destLenTmp = context.destLen;
-							CheckError(addPlugin(token == kNMETokenPluginBlock
+							colTmp = context.col;
+							CheckError(addPlugin(pluginIndex,
+									token == kNMETokenPluginBlock
 										|| token == kNMETokenPlaceholderBlock,
 									token == kNMETokenPlaceholder
 										|| token == kNMETokenPlaceholderBlock,
@@ -3168,10 +4966,10 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 									&reparseOutput));
 							if (reparseOutput)
 							{
-								CheckError(swapBuffers(&context.src, &context.srcLen,
-										&context,
-										&commonLen,
-										destLenTmp));
+								CheckError(insertReparsedText(&context,
+										destLenTmp, colTmp,
+										&noAutoOrPluginLen));
+								resetAutoconvertScans(autoconvertNext, scannedCount);
 								// noAutoOrPluginLen = context.destLen;
 							}
 						}
@@ -3221,9 +5019,9 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 						}
 						else
 						{
+							if (!checkDestSize(&context, 1))
+								return kNMEErrNotEnoughMemory;
 							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
 							context.col++;
 						}
 						state = kNMEStatePar;
@@ -3511,7 +5309,9 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 								state = kNMEStatePar;
 							}
 							destLenTmp = context.destLen;
-							CheckError(addPlugin(token == kNMETokenPluginBlock
+							colTmp = context.col;
+							CheckError(addPlugin(pluginIndex,
+									token == kNMETokenPluginBlock
 										|| token == kNMETokenPlaceholderBlock,
 									token == kNMETokenPlaceholder
 										|| token == kNMETokenPlaceholderBlock,
@@ -3519,10 +5319,10 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 									&reparseOutput));
 							if (reparseOutput)
 							{
-								CheckError(swapBuffers(&context.src, &context.srcLen,
-										&context,
-										&commonLen,
-										destLenTmp));
+								CheckError(insertReparsedText(&context,
+										destLenTmp, colTmp,
+										&noAutoOrPluginLen));
+								resetAutoconvertScans(autoconvertNext, scannedCount);
 								// noAutoOrPluginLen = context.destLen;
 							}
 						}
@@ -3532,260 +5332,2525 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 			case kNMEStatePreAfterEol:
 				if (token == kNMETokenPre)	// end of pre
 				{
-					if (!NMEAddString(outputFormat->endPre, -1,
-							context.ctrlChar, &context))
-						return kNMEErrNotEnoughMemory;
-					HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "{{{");
-					state = kNMEStateBetweenPar;
-					break;
+					if (!NMEAddString(outputFormat->endPre, -1,
+							context.ctrlChar, &context))
+						return kNMEErrNotEnoughMemory;
+					HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "{{{");
+					state = kNMEStateBetweenPar;
+					break;
+				}
+				// beginning of pre line
+				if (!NMEAddString(outputFormat->beginPreLine, -1,
+						context.ctrlChar, &context))
+					return kNMEErrNotEnoughMemory;
+				state = kNMEStatePre;
+				
+				if (token == kNMETokenSpace)
+				{
+					// followed by spaces and three closing braces?
+					NMEInt k;
+					
+					for (k = context.srcIndex; k < context.srcLen && context.src[k] == ' '; k++)
+						;
+					if (k + 3 <= context.srcLen && context.src[k] == '}'
+							&& context.src[k + 1] == '}' && context.src[k + 2] == '}')
+						break;	// yes: ignore first space
+				}				
+				// continue
+			case kNMEStatePre:
+				switch (token)
+				{
+					case kNMETokenChar:
+						if (outputFormat->encodeCharPreFun)
+						{
+							context.srcIndex--;
+							CheckError(outputFormat->encodeCharPreFun(context.src, context.srcLen, &context.srcIndex,
+									&context,
+									outputFormat->encodeCharPreData));
+						}
+						else
+						{
+							if (!checkDestSize(&context, 1))
+								return kNMEErrNotEnoughMemory;
+							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
+							context.col++;
+						}
+						
+						// rest of the line
+						CheckError(copyPreText(&context, outputFormat));
+						break;
+					case kNMETokenSpace:
+						if (outputFormat->encodeCharPreFun)
+						{
+							NMEInt tmp = 0;
+							
+							CheckError(outputFormat->encodeCharPreFun(" ", 1, &tmp,
+									&context,
+									outputFormat->encodeCharPreData));
+						}
+						else
+						{
+							if (!checkDestSize(&context, 1))
+								return kNMEErrNotEnoughMemory;
+							context.dest[context.destLen++] = ' ';
+							context.col++;
+						}
+						break;
+					case kNMETokenTab:
+						{
+							NMEInt col;	// col isn't updated by encodeCharPreFun
+							
+							col = context.col;
+							do
+							{
+								if (outputFormat->encodeCharPreFun)
+								{
+									NMEInt tmp = 0;
+									
+									CheckError(outputFormat->encodeCharPreFun(" ", 1, &tmp,
+											&context,
+											outputFormat->encodeCharPreData));
+								}
+								else
+								{
+									if (!checkDestSize(&context, 1))
+										return kNMEErrNotEnoughMemory;
+									context.dest[context.destLen++] = ' ';
+									context.col++;
+								}
+							} while (++col % kTabWidth != 0);
+						}
+						break;
+					case kNMETokenEOL:
+						if (!NMEAddString(outputFormat->endPreLine, -1,
+								context.ctrlChar, &context))
+							return kNMEErrNotEnoughMemory;
+						state = kNMEStatePreAfterEol;
+						break;
+					default:
+						// should never occur in preformatted blocks
+						return kNMEErrInternal;
+				}
+				break;
+			case kNMEStateHeading:
+				switch (token)
+				{
+					case kNMETokenChar:
+						if (outputFormat->charHookFun)
+							CheckError(outputFormat->charHookFun(i0 + context.srcIndexOffset,
+									&context,
+									outputFormat->charHookData));
+						if (outputFormat->encodeCharFun)
+						{
+							context.srcIndex--;
+							CheckError(outputFormat->encodeCharFun(context.src, context.srcLen, &context.srcIndex,
+									&context,
+									outputFormat->encodeCharData));
+						}
+						else
+						{
+							if (!checkDestSize(&context, 1))
+								return kNMEErrNotEnoughMemory;
+							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
+							context.col++;
+						}
+						CheckError(checkWordwrap(&context, outputFormat));
+						COPY_PLAIN_TEXT();
+						break;
+					case kNMETokenSpace:
+					case kNMETokenTab:
+						if (state == kNMEStatePar)	// pack multiple spaces for par
+							skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						// single space provided not last of line
+						if (context.srcIndex < context.srcLen && !isEol(context.src[context.srcIndex]))
+						{
+							if (!NMEAddString(outputFormat->space, -1,
+									context.ctrlChar, &context))
+								return kNMEErrNotEnoughMemory;
+							CheckError(checkWordwrap(&context, outputFormat));
+						}
+						break;
+					case kNMETokenHeading:
+						// end of heading
+						skipBlanks(context.src, context.srcLen, &context.srcIndex);
+					case kNMETokenEOL:
+						context.level = headingLevel;
+						CheckError(flushStyleTags(styleStack, &styleNesting,
+								i0,
+								outputFormat, &context));
+						if (!NMEAddString(outputFormat->endHeading, -1,
+									context.ctrlChar, &context))
+							return kNMEErrNotEnoughMemory;
+						CheckError(checkWordwrap(&context, outputFormat));
+						HOOK(parHookFun, context.level, 0, FALSE, "=");
+						context.level = 0;
+						state = kNMEStateBetweenPar;
+						break;
+					case kNMETokenLineBreak:
+						if (!NMEAddString(outputFormat->lineBreak, -1,
+								context.ctrlChar, &context))
+							return kNMEErrNotEnoughMemory;
+						CheckError(checkWordwrap(&context, outputFormat));
+						break;
+					case kNMETokenStyle:
+					case kNMETokenLinkEnd:
+					case kNMETokenImageEnd:
+						CheckError(processStyleTag(styleStack, &styleNesting,
+								token == kNMETokenLinkEnd
+									? kNMEStyleLink
+									: token == kNMETokenImageEnd
+										? kNMEStyleImage : newStyle,
+								i0,
+								outputFormat, &context));
+						break;
+					case kNMETokenLinkBegin:
+					case kNMETokenImageBegin:
+						CheckError(addLinkBegin(token == kNMETokenImageBegin,
+								styleStack, &styleNesting,
+								i0, outputFormat, &context));
+						break;
+					case kNMETokenPlugin:
+					case kNMETokenPluginBlock:
+					case kNMETokenPlaceholder:
+					case kNMETokenPlaceholderBlock:
+						destLenTmp = context.destLen;
+						colTmp = context.col;
+						CheckError(addPlugin(findPlugin(context.src, context.srcLen,
+										context.srcIndex,
+										token == kNMETokenPlaceholder
+											|| token == kNMETokenPlaceholderBlock,
+										outputFormat),
+									token == kNMETokenPluginBlock
+										|| token == kNMETokenPlaceholderBlock,
+									token == kNMETokenPlaceholder
+										|| token == kNMETokenPlaceholderBlock,
+								options, outputFormat, &context,
+								&reparseOutput));
+						if (reparseOutput)
+						{
+							CheckError(insertReparsedText(&context,
+									destLenTmp, colTmp,
+									&noAutoOrPluginLen));
+							resetAutoconvertScans(autoconvertNext, scannedCount);
+							// noAutoOrPluginLen = context.destLen;
+						}
+						break;
+					case kNMETokenLI:
+					case kNMETokenDD:
+					case kNMETokenTableCell:
+					case kNMETokenTableHCell:
+					case kNMETokenHR:
+					case kNMETokenPre:
+						// should never occur in a heading
+						return kNMEErrInternal;
+				}
+				break;
+		}
+	}
+	
+	// a segment which doesn't end between paragraphs wasn't split at a block
+	// boundary: the parser would have continued with the following text
+	if (segment && !segment->last
+			&& (state != kNMEStateBetweenPar || context.nesting > 0 || styleNesting > 0))
+		addDependency(&context, kDependFollowing);
+	
+	// end: flush pending constructs
+	switch (state)
+	{
+		case kNMEStatePar:
+		case kNMEStateParAfterEol:
+			CheckError(flushStyleTags(styleStack, &styleNesting,
+					i0,
+					outputFormat, &context));
+			CheckError(addEndPar(TRUE, outputFormat, &context));
+			break;
+		case kNMEStatePre:
+			if (!NMEAddString(outputFormat->endPre, -1,
+					context.ctrlChar, &context))
+				return kNMEErrNotEnoughMemory;
+			HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "{{{");
+			break;
+		case kNMEStateHeading:
+			context.level = headingLevel;
+			CheckError(flushStyleTags(styleStack, &styleNesting,
+					i0,
+					outputFormat, &context));
+			if (!NMEAddString(outputFormat->endHeading, -1,
+							context.ctrlChar, &context))
+				return kNMEErrNotEnoughMemory;
+			CheckError(checkWordwrap(&context, outputFormat));
+			HOOK(parHookFun, context.level, 0, FALSE, "=");
+			context.level = 0;
+			break;
+		default:
+			break;
+	}
+	
+	// end of doc
+	if (!(options & kNMEProcessOptNoPreAndPost)
+			&& !(segment && !segment->last)
+			&& !NMEAddString(outputFormat->endDoc, -1,
+					context.ctrlChar, &context))
+		return kNMEErrNotEnoughMemory;
+	CheckError(fillDeferred(&context, !segment || segment->last));
+	if (context.destFull)
+		return kNMEErrNotEnoughMemory;
+	if (sink && sink->flushFun)
+		CheckError(flushOutput(&context, !segment || segment->last));
+	else
+	{
+		if (!checkDestSize(&context, 2))
+			return kNMEErrNotEnoughMemory;
+		context.dest[context.destLen] = '\0';
+	}
+	
+	// save state for next segment
+	if (segment)
+	{
+		segment->srcOffset += nmeTextLen;
+		segment->outputLen = context.destOffset + context.destLen;
+		segment->keptLen = context.destLen;
+		segment->outputUCS16Len = outputIndexUCS16(&context);
+		segment->col = context.col;
+		for (i0 = 0; i0 < kMaxNumberedHeadingLevels; i0++)
+			segment->headingNum[i0] = headingNum[i0];
+		segment->headingFlags = headingFlags;
+		segment->headingLevel = headingLevel;
+		segment->begun = TRUE;
+	}
+	
+	// set result
+	*output = context.dest;
+	*outputLen = context.destOffset + context.destLen;
+	if (peakSize)
+		*peakSize = context.peakSize;
+	if (outputUCS16Len)
+		*outputUCS16Len = outputIndexUCS16(&context);
+	return kNMEErrOk;
+}
+
+/// Fixed memory used by the output sink of NMEProcessInPlace and requiredBufSize
+typedef struct
+{
+	NMEText dest;	///< output buffer passed to processText
+	NMEInt destSize;	///< size of dest
+	NMEText scratch;	///< scratch buffer passed to processText
+	NMEInt scratchSize;	///< size of scratch
+	NMEText destMem;	///< memory available for dest
+	NMEInt destMemSize;	///< size of destMem
+	NMEText scratchMem;	///< memory available for scratch (may be NULL)
+	NMEInt scratchMemSize;	///< size of scratchMem
+} FixedSinkData;
+
+/** Grow function of output sinks with fixed memory, which gives all the
+	memory available to dest or scratch at once, even if minSize is larger
+	(processText checks the size it really needs; see NMESinkGrowFun).
+*/
+static NMEErr fixedSinkGrow(NMEText *buf,
+		NMEInt *bufSize,
+		NMEInt minSize,
+		void *data)
+{
+	FixedSinkData *d = (FixedSinkData *)data;
+	
+	if (minSize == 0)
+	{
+		*buf = NULL;
+		*bufSize = 0;
+		return kNMEErrOk;
+	}
+	
+	if (buf == &d->dest)
+	{
+		*buf = d->destMem;
+		*bufSize = d->destMemSize;
+	}
+	else if (buf == &d->scratch && d->scratchMem)
+	{
+		*buf = d->scratchMem;
+		*bufSize = d->scratchMemSize;
+	}
+	else
+		return kNMEErrNotEnoughMemory;	// no scratch, or not a buffer of processText
+	return kNMEErrOk;
+}
+
+/** Flush function of the output sink of requiredBufSize, which discards
+	output (its length is still counted by processText).
+*/
+static NMEErr countingSinkFlush(NMEConstText output,
+		NMEInt outputLen,
+		void *data)
+{
+	(void)output;
+	(void)outputLen;
+	(void)data;
+	
+	return kNMEErrOk;
+}
+
+/** Set up an output sink with fixed memory.
+	@param[out] sink output sink
+	@param[out] data data of sink
+	@param[in] dest memory for output
+	@param[in] destSize size of dest
+	@param[in] scratch memory for reparsed source (NULL if none)
+	@param[in] scratchSize size of scratch
+	@param[in] flushFun flush function (NULL to keep the whole output in dest)
+*/
+static void initFixedSink(NMEOutputSink *sink,
+		FixedSinkData *data,
+		NMEText dest, NMEInt destSize,
+		NMEText scratch, NMEInt scratchSize,
+		NMESinkFlushFun flushFun)
+{
+	data->dest = data->scratch = NULL;
+	data->destSize = data->scratchSize = 0;
+	data->destMem = dest;
+	data->destMemSize = destSize;
+	data->scratchMem = scratch;
+	data->scratchMemSize = scratchSize;
+	sink->growFun = fixedSinkGrow;
+	sink->flushFun = flushFun;
+	sink->data = (void *)data;
+}
+
+/** Find the size of the buffer NMEProcess requires to convert text, by
+	converting it again in counting-only mode where output is discarded as
+	soon as lines are complete.
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen source text length
+	@param[in] buf memory used for current lines and reparsed text
+	@param[in] bufSize size of buf
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings
+	@param[in] fontSize font size of plain text in points
+	@return required size of buf, or 0 if it cannot be determined
+*/
+static NMEInt requiredBufSize(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText buf, NMEInt bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize)
+{
+	FixedSinkData data;
+	NMEOutputSink sink;
+	NMEText output;
+	NMEInt outputLen, peakSize, destSize, k;
+	NMEErr err = kNMEErrNotEnoughMemory;
+	
+	// scratch must hold the remaining source when reparsing, while dest
+	// usually only holds a few lines; peakSize doesn't depend on how buf
+	// is split, provided the conversion succeeds (output which doesn't fit
+	// in dest is an error, even if ignored by autoconverts)
+	for (k = 1; k <= 3 && err == kNMEErrNotEnoughMemory; k++)
+	{
+		destSize = k * (bufSize / 4);
+		initFixedSink(&sink, &data,
+				buf + bufSize - destSize, destSize,
+				buf, bufSize - destSize,
+				countingSinkFlush);
+		err = processText(nmeText, nmeTextLen, NULL, 0,
+				&sink, &data.dest, &data.destSize, &data.scratch, &data.scratchSize,
+				NULL, &peakSize,
+				options, eol, outputFormat, fontSize,
+				&output, &outputLen, NULL);
+	}
+	if (err != kNMEErrOk)
+		return 0;
+	
+	// final null byte (NMEProcess checks room for 2 bytes)
+	if (outputLen + 2 > peakSize)
+		peakSize = outputLen + 2;
+	
+	// buf has been too small, so something which isn't counted (such as
+	// the temporary memory of plugins) may be involved otherwise
+	return 2 * peakSize > bufSize ? 2 * peakSize : 0;
+}
+
+NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText buf, NMEInt bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEErr err;
+	
+	err = processText(nmeText, nmeTextLen, buf, bufSize,
+			NULL, NULL, NULL, NULL, NULL,
+			NULL, NULL,
+			options, eol, outputFormat, fontSize,
+			output, outputLen, outputUCS16Len);
+	if (err == kNMEErrNotEnoughMemory)
+		*outputLen = requiredBufSize(nmeText, nmeTextLen, buf, bufSize,
+				options, eol, outputFormat, fontSize);
+	return err;
+}
+
+NMEErr NMEProcessInPlace(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText buf, NMEInt bufSize,
+		NMEText scratch, NMEInt scratchSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	FixedSinkData data;
+	NMEOutputSink sink;
+	
+	initFixedSink(&sink, &data, buf, bufSize, scratch, scratchSize, NULL);
+	return processText(nmeText, nmeTextLen, NULL, 0,
+			&sink, &data.dest, &data.destSize, &data.scratch, &data.scratchSize,
+			NULL, NULL,
+			options, eol, outputFormat, fontSize,
+			output, outputLen, outputUCS16Len);
+}
+
+NMEErr NMEProcessToSink(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText *buf, NMEInt *bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEText scratch = NULL;
+	NMEInt scratchSize = 0;
+	NMEErr err, err1;
+	
+	err = processText(nmeText, nmeTextLen, NULL, 0,
+			sink, buf, bufSize, &scratch, &scratchSize,
+			NULL, NULL,
+			options, eol, outputFormat, fontSize,
+			output, outputLen, outputUCS16Len);
+	if (scratch)
+	{
+		err1 = sink->growFun(&scratch, &scratchSize, 0, sink->data);
+		if (err == kNMEErrOk)
+			err = err1;
+	}
+	return err;
+}
+
+/** Check if a line has the specified 3-character markup (such as "{{{"),
+	possibly surrounded by blanks, and nothing else.
+	@param[in] line line without eol
+	@param[in] lineLen length of line
+	@param[in] markup 3-character markup
+	@return TRUE if line contains markup alone
+*/
+static NMEBoolean isLineMarkup(NMEConstText line, NMEInt lineLen,
+		NMEConstText markup)
+{
+	NMEInt i = 0;
+	
+	skipBlanks(line, lineLen, &i);
+	if (i + 3 > lineLen
+			|| line[i] != markup[0] || line[i + 1] != markup[1] || line[i + 2] != markup[2])
+		return FALSE;
+	i += 3;
+	skipBlanks(line, lineLen, &i);
+	return i >= lineLen;
+}
+
+/** Initialize the state of the first segment of a document.
+	@param[out] segment segment state
+*/
+static void initSegmentState(NMESegmentState *segment)
+{
+	segment->srcOffset = 0;
+	segment->outputLen = segment->keptLen = 0;
+	segment->outputUCS16Len = 0;
+	segment->col = 0;
+	segment->headingNum[0] = -1;
+	segment->headingFlags = 0;
+	nextHeading(&segment->headingFlags, segment->headingNum, 1);
+	segment->headingFlags = 0;
+	segment->headingLevel = 0;
+	segment->begun = segment->last = FALSE;
+	segment->dependencies = 0;
+}
+
+/// Plugin scanned by scanBlockLine
+enum
+{
+	kScanNoPlugin = 0,	///< not in a plugin
+	kScanPlugin,	///< inline plugin, until >>
+	kScanPlaceholder,	///< inline placeholder, until >>>
+	kScanPluginBlock,	///< block plugin, until >> alone at the beginning of a line
+	kScanPlaceholderBlock	///< block placeholder, until >>> alone at the beginning of a line
+};
+
+/** Check if a line begins with the end marker of a block plugin like addPlugin.
+	@param[in] line line without eol
+	@param[in] lineLen length of line
+	@param[in] markerLen length of end marker (2 for >>, 3 for >>>)
+	@return TRUE if the line is the end marker
+*/
+static NMEBoolean isPluginBlockEnd(NMEConstText line, NMEInt lineLen,
+		NMEInt markerLen)
+{
+	NMEInt i;
+	
+	for (i = 0; i < markerLen; i++)
+		if (i >= lineLen || line[i] != '>')
+			return FALSE;
+	skipBlanks(line, lineLen, &i);
+	return i >= lineLen;
+}
+
+/** Scan a line to track preformatted blocks and plugins and find block
+	boundaries, i.e. empty lines outside preformatted blocks and plugins,
+	after which the parser is always between paragraphs (lines with blanks
+	don't stop links). Predictions can be wrong (e.g. with markup in inline
+	verbatim); then processText adds kDependFollowing to the segment.
+	@param[in] line line without eol
+	@param[in] lineLen length of line
+	@param[in] eolLen length of the eol after line (2 for cr lf)
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] outputFormat format strings
+	@param[in,out] inPre TRUE inside a preformatted block
+	@param[in,out] plugin kScanNoPlugin, or kind of plugin the line is in
+	@return TRUE if the line is a block boundary
+*/
+static NMEBoolean scanBlockLine(NMEConstText line, NMEInt lineLen,
+		NMEInt eolLen,
+		NMEInt options,
+		NMEOutputFormat const *outputFormat,
+		NMEBoolean *inPre, NMEInt *plugin)
+{
+	NMEInt j = 0, k, markerLen;
+	
+	if (*plugin == kScanPluginBlock || *plugin == kScanPlaceholderBlock)
+	{
+		if (isPluginBlockEnd(line, lineLen, *plugin == kScanPluginBlock ? 2 : 3))
+			*plugin = kScanNoPlugin;
+		return FALSE;
+	}
+	else if (*inPre)
+	{
+		// like parseNextToken, "}}}" (not "}}}}") at the beginning of the
+		// line ends a preformatted block, even if followed by other text
+		if (lineLen < 3 || line[0] != '}' || line[1] != '}' || line[2] != '}'
+				|| lineLen > 3 && line[3] == '}')
+			return FALSE;
+		*inPre = FALSE;
+		j = 3;
+	}
+	else if (*plugin == kScanNoPlugin
+			&& (isLineMarkup(line, lineLen, "{{{") || isLineMarkup(line, lineLen, "}}}")))
+	{
+		// like parseNextToken, both begin a preformatted block
+		*inPre = TRUE;
+		return FALSE;
+	}
+	
+	// track plugins (conservatively, ignoring escapes and verbatim)
+	for (; j < lineLen; j++)
+	{
+		if (options & kNMEProcessOptNoPlugin || j + 1 >= lineLen)
+			continue;
+		markerLen = j + 2 < lineLen && line[j + 2] == line[j] ? 3 : 2;
+		if (*plugin == kScanNoPlugin && line[j] == '<' && line[j + 1] == '<')
+		{
+			// block syntax if nothing else on the line (or maybe inline)
+			k = j + markerLen;
+			skipBlanks(line, lineLen, &k);
+			if (k >= lineLen)
+			{
+				*plugin = markerLen == 3 ? kScanPlaceholderBlock : kScanPluginBlock;
+				return FALSE;
+			}
+			*plugin = markerLen == 3 ? kScanPlaceholder : kScanPlugin;
+			j += markerLen - 1;
+		}
+		else if (*plugin == kScanPlugin && line[j] == '>' && line[j + 1] == '>'
+				|| *plugin == kScanPlaceholder && markerLen == 3 && line[j] == '>'
+					&& line[j + 1] == '>')
+		{
+			j += (*plugin == kScanPlaceholder ? 3 : 2) - 1;
+			*plugin = kScanNoPlugin;
+		}
+	}
+	// autoconverts aren't called after cr lf, which is a single token, but
+	// they are at the beginning of a segment, where they can't see the eol
+	return lineLen == 0 && *plugin == kScanNoPlugin
+			&& !(eolLen == 2 && outputFormat->autoconverts);
+}
+
+/** Scan complete lines of the pending input of a stream to find the last
+	block boundary.
+	@param[in,out] stream stream
+*/
+static void scanStreamBlocks(NMEStream *stream)
+{
+	NMEConstText src = stream->input;
+	NMEInt i, lineEnd, next;
+	
+	for (i = stream->scanIndex; i < stream->inputLen; i = next)
+	{
+		// find end of line, from where the previous feed stopped in the same
+		// line; a final cr could be followed by lf in next chunk
+		for (lineEnd = i > stream->scanLineEnd ? i : stream->scanLineEnd;
+				lineEnd < stream->inputLen && !isEol(src[lineEnd]);
+				lineEnd++)
+			;
+		if (lineEnd >= stream->inputLen
+				|| src[lineEnd] == '\r' && lineEnd + 1 >= stream->inputLen)
+		{
+			stream->scanLineEnd = lineEnd;
+			break;	// incomplete line
+		}
+		next = lineEnd + (src[lineEnd] == '\r' && src[lineEnd + 1] == '\n' ? 2 : 1);
+		
+		if (scanBlockLine(src + i, lineEnd - i, next - lineEnd,
+				stream->options, stream->outputFormat,
+				&stream->inPre, &stream->plugin))
+			stream->blockEnd = next;
+	}
+	stream->scanIndex = i;
+}
+
+/** Pass the output of the segments of a stream to its sink, keeping the
+	current line and the reparse lookbehind before it like flushOutput.
+	@param[in,out] stream stream
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr flushStreamOutput(NMEStream *stream)
+{
+	NMEText output = *stream->buf;
+	NMEInt n, i;
+	NMEErr err;
+	
+	// find end of last complete line
+	for (n = stream->segment.keptLen; n > 0 && !isEol(output[n - 1]); n--)
+		;
+	n -= kNMEReparseLookbehind;
+	if (n <= 0)
+		return kNMEErrOk;
+	
+	err = stream->sink->flushFun(output, n, stream->sink->data);
+	if (err != kNMEErrOk)
+		return err;
+	
+	// move current line to the beginning of buf
+	for (i = n; i < stream->segment.keptLen; i++)
+		output[i - n] = output[i];
+	stream->segment.keptLen -= n;
+	return kNMEErrOk;
+}
+
+/** Convert the first len bytes of the pending input of a stream and remove
+	them. If the segment doesn't end between paragraphs (the block boundary
+	was mispredicted), its output is discarded and its input is kept, to be
+	converted again with the following input.
+	@param[in,out] stream stream
+	@param[in] len number of bytes (should end at a block boundary)
+	@param[in] last TRUE for the last segment of the document
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr processStreamSegment(NMEStream *stream, NMEInt len,
+		NMEBoolean last)
+{
+	NMESegmentState entry = stream->segment;
+	NMEOutputSink sink = *stream->sink;
+	NMEText output;
+	NMEInt outputLen, i, line;
+	NMEErr err;
+	
+	// keep output until the segment is known to end between paragraphs
+	if (!last)
+		sink.flushFun = NULL;
+	
+	// save the current line, which wordwrap can change
+	for (line = entry.keptLen; line > 0 && !isEol((*stream->buf)[line - 1]); line--)
+		;
+	if (last || stream->outputFormat->textWidth <= 0)
+		line = entry.keptLen;
+	else if (entry.keptLen - line > stream->lineSize)
+	{
+		err = stream->sink->growFun(&stream->line, &stream->lineSize,
+				entry.keptLen - line + kNMESinkMinSize, stream->sink->data);
+		if (err == kNMEErrOk && stream->lineSize < entry.keptLen - line)
+			err = kNMEErrNotEnoughMemory;
+		if (err != kNMEErrOk)
+			return err;
+	}
+	for (i = line; i < entry.keptLen; i++)
+		stream->line[i - line] = (*stream->buf)[i];
+	
+	stream->segment.last = last;
+	stream->segment.dependencies = 0;
+	err = processText(stream->input, len, NULL, 0,
+			&sink, stream->buf, stream->bufSize,
+			&stream->scratch, &stream->scratchSize,
+			&stream->segment, NULL,
+			stream->options, stream->eol, stream->outputFormat, stream->fontSize,
+			&output, &outputLen, NULL);
+	if (err != kNMEErrOk)
+		return err;
+	stream->blockEnd = 0;
+	
+	if (!last && stream->segment.dependencies & kDependFollowing)
+	{
+		// convert again with the input up to the next block boundary
+		for (i = line; i < entry.keptLen; i++)
+			(*stream->buf)[i] = stream->line[i - line];
+		stream->segment = entry;
+		return kNMEErrOk;
+	}
+	if (!last && stream->sink->flushFun)
+		CheckError(flushStreamOutput(stream));
+	
+	// discard processed input
+	for (i = len; i < stream->inputLen; i++)
+		stream->input[i - len] = stream->input[i];
+	stream->inputLen -= len;
+	stream->scanIndex -= len;
+	stream->scanLineEnd -= len;
+	
+	return kNMEErrOk;
+}
+
+/** Release the memory used by a stream, except for the output buffer.
+	@param[in,out] stream stream
+*/
+static void releaseStream(NMEStream *stream)
+{
+	if (stream->input)
+		(void)stream->sink->growFun(&stream->input, &stream->inputSize, 0,
+				stream->sink->data);
+	if (stream->scratch)
+		(void)stream->sink->growFun(&stream->scratch, &stream->scratchSize, 0,
+				stream->sink->data);
+	if (stream->line)
+		(void)stream->sink->growFun(&stream->line, &stream->lineSize, 0,
+				stream->sink->data);
+	stream->input = stream->scratch = stream->line = NULL;
+	stream->inputLen = stream->inputSize = stream->scratchSize = stream->lineSize = 0;
+}
+
+NMEErr NMEStreamBegin(NMEStream *stream,
+		NMEText *buf, NMEInt *bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink)
+{
+	stream->buf = buf;
+	stream->bufSize = bufSize;
+	stream->options = options;
+	stream->eol = eol;
+	stream->outputFormat = outputFormat ? outputFormat : &NMEOutputFormatText;
+	stream->fontSize = fontSize;
+	stream->sink = sink;
+	stream->input = stream->scratch = stream->line = NULL;
+	stream->inputLen = stream->inputSize = stream->scratchSize = stream->lineSize = 0;
+	stream->scanIndex = stream->scanLineEnd = stream->blockEnd = 0;
+	stream->inPre = FALSE;
+	stream->plugin = kScanNoPlugin;
+	stream->err = kNMEErrOk;
+	
+	initSegmentState(&stream->segment);
+	
+	return kNMEErrOk;
+}
+
+NMEErr NMEStreamFeed(NMEStream *stream,
+		NMEConstText input, NMEInt inputLen)
+{
+	NMEInt i;
+	
+	if (stream->err != kNMEErrOk)
+		return stream->err;
+	
+	// append input
+	if (stream->inputLen + inputLen > stream->inputSize)
+	{
+		NMEInt size = 2 * stream->inputSize;
+		
+		if (size < stream->inputLen + inputLen + kNMESinkMinSize)
+			size = stream->inputLen + inputLen + kNMESinkMinSize;
+		stream->err = stream->sink->growFun(&stream->input, &stream->inputSize, size,
+				stream->sink->data);
+		if (stream->err == kNMEErrOk && stream->inputSize < stream->inputLen + inputLen)
+			stream->err = kNMEErrNotEnoughMemory;
+		if (stream->err != kNMEErrOk)
+		{
+			releaseStream(stream);
+			return stream->err;
+		}
+	}
+	for (i = 0; i < inputLen; i++)
+		stream->input[stream->inputLen + i] = input[i];
+	stream->inputLen += inputLen;
+	
+	// convert complete blocks
+	scanStreamBlocks(stream);
+	if (stream->blockEnd > 0)
+	{
+		stream->err = processStreamSegment(stream, stream->blockEnd, FALSE);
+		if (stream->err != kNMEErrOk)
+			releaseStream(stream);
+	}
+	
+	return stream->err;
+}
+
+NMEErr NMEStreamEnd(NMEStream *stream,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	if (stream->err == kNMEErrOk)
+		stream->err = processStreamSegment(stream, stream->inputLen, TRUE);
+	releaseStream(stream);
+	if (stream->err != kNMEErrOk)
+		return stream->err;
+	
+	if (output)
+		*output = *stream->buf;
+	if (outputLen)
+		*outputLen = stream->segment.outputLen;
+	if (outputUCS16Len)
+		*outputUCS16Len = stream->segment.outputUCS16Len;
+	return kNMEErrOk;
+}
+
+/// Segment of a document converted by NMEProcessParallel
+typedef struct
+{
+	NMEInt srcBegin;	///< beginning of segment in source
+	NMEInt srcEnd;	///< end of segment in source
+	NMESegmentState entry;	///< predicted state at the beginning of the segment
+	NMESegmentState exit;	///< state at the end of the segment
+	NMEText buf;	///< output buffer
+	NMEInt bufSize;	///< size of buf
+	NMEText scratch;	///< buffer for reparsed source
+	NMEInt scratchSize;	///< size of scratch
+	NMEErr err;	///< result of conversion
+} ParallelSegment;
+
+/// Conversion shared by the jobs of NMEProcessParallel
+typedef struct
+{
+	NMEConstText nmeText;	///< source text
+	NMEInt options;	///< kNMEProcessOptDefault or sum of options
+	NMEConstText eol;	///< end-of-line sequence
+	NMEOutputFormat const *outputFormat;	///< format strings
+	NMEInt fontSize;	///< font size
+	NMEOutputSink const *sink;	///< output sink
+	NMEOutputSink jobSink;	///< output sink without flush function used by jobs
+	NMEText segBuf;	///< memory for segments
+	NMEInt segBufSize;	///< size of segBuf
+	ParallelSegment *segments;	///< segments (in segBuf)
+	NMEInt segmentCount;	///< number of segments
+	NMEText pending;	///< output not flushed yet (current line and reparse lookbehind)
+	NMEInt pendingLen;	///< length of pending output
+	NMEInt pendingSize;	///< size of pending
+} ParallelConversion;
+
+/** Add a segment to a parallel conversion.
+	@param[in,out] p parallel conversion
+	@param[in] srcBegin beginning of segment in source
+	@param[in] srcEnd end of segment in source
+	@param[in] entry predicted state at the beginning of the segment
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addParallelSegment(ParallelConversion *p,
+		NMEInt srcBegin, NMEInt srcEnd,
+		NMESegmentState const *entry)
+{
+	ParallelSegment *segment;
+	NMEInt size;
+	NMEErr err;
+	
+	if ((p->segmentCount + 1) * (NMEInt)sizeof(ParallelSegment) > p->segBufSize)
+	{
+		size = 2 * p->segBufSize;
+		if (size < 16 * (NMEInt)sizeof(ParallelSegment))
+			size = 16 * (NMEInt)sizeof(ParallelSegment);
+		err = p->sink->growFun(&p->segBuf, &p->segBufSize, size, p->sink->data);
+		if (err != kNMEErrOk)
+			return err;
+		if (p->segBufSize < size)
+			return kNMEErrNotEnoughMemory;
+		p->segments = (ParallelSegment *)p->segBuf;
+	}
+	
+	segment = &p->segments[p->segmentCount];
+	segment->srcBegin = srcBegin;
+	segment->srcEnd = srcEnd;
+	segment->entry = *entry;
+	segment->entry.srcOffset = srcBegin;
+	segment->entry.begun = p->segmentCount > 0;
+	segment->entry.last = FALSE;
+	segment->buf = segment->scratch = NULL;
+	segment->bufSize = segment->scratchSize = 0;
+	segment->err = kNMEErrOk;
+	p->segmentCount++;
+	
+	return kNMEErrOk;
+}
+
+/** Split the source of a parallel conversion into segments at block
+	boundaries, predicting the state at the beginning of each segment
+	(headings are assumed to be lines beginning with = outside preformatted
+	blocks and plugins).
+	@param[in,out] p parallel conversion
+	@param[in] nmeTextLen source text length
+	@param[in] segmentSize approximate size of segments in bytes
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr splitParallelSegments(ParallelConversion *p,
+		NMEInt nmeTextLen, NMEInt segmentSize)
+{
+	NMEConstText src = p->nmeText;
+	NMESegmentState state, entry;
+	NMEInt i, j, lineEnd, next, begin, level;
+	NMEBoolean inPre = FALSE, wasInPre;
+	NMEInt plugin = kScanNoPlugin, wasInPlugin;
+	NMEBoolean boundary;
+	NMEErr err;
+	
+	initSegmentState(&state);
+	entry = state;
+	for (i = begin = 0; i < nmeTextLen; i = next)
+	{
+		for (lineEnd = i; lineEnd < nmeTextLen && !isEol(src[lineEnd]); lineEnd++)
+			;
+		next = lineEnd + (lineEnd + 1 < nmeTextLen
+				&& src[lineEnd] == '\r' && src[lineEnd + 1] == '\n' ? 2 : 1);
+		
+		wasInPre = inPre;
+		wasInPlugin = plugin;
+		boundary = scanBlockLine(src + i, lineEnd - i, next - lineEnd,
+				p->options, p->outputFormat, &inPre, &plugin);
+		
+		// predict headings like parseNextToken
+		if (!wasInPre && !inPre && wasInPlugin == kScanNoPlugin)
+		{
+			j = i;
+			skipBlanks(src, lineEnd, &j);
+			for (level = 0; j < lineEnd && src[j] == '='; j++, level++)
+				;
+			if (level > 0)
+			{
+				if (p->options & kNMEProcessOptNoH1 && level == 1)
+					level = 2;
+				if (level > p->outputFormat->maxHeadingLevel)
+					level = p->outputFormat->maxHeadingLevel;
+				nextHeading(&state.headingFlags, state.headingNum, level);
+				state.headingLevel = level;
+			}
+		}
+		
+		// end segment at a block boundary once it's large enough
+		if (boundary && next - begin >= segmentSize && next < nmeTextLen)
+		{
+			CheckError(addParallelSegment(p, begin, next, &entry));
+			begin = next;
+			entry = state;
+		}
+	}
+	CheckError(addParallelSegment(p, begin, nmeTextLen, &entry));
+	p->segments[p->segmentCount - 1].entry.last = TRUE;
+	
+	return kNMEErrOk;
+}
+
+/** Convert a segment of a parallel conversion (NMEJobFun).
+	@param[in] job index of segment
+	@param[in,out] jobData parallel conversion
+*/
+static void convertParallelSegment(NMEInt job, void *jobData)
+{
+	ParallelConversion *p = (ParallelConversion *)jobData;
+	ParallelSegment *segment = &p->segments[job];
+	NMEText output;
+	NMEInt outputLen;
+	
+	segment->exit = segment->entry;
+	segment->err = processText(p->nmeText + segment->srcBegin,
+			segment->srcEnd - segment->srcBegin, NULL, 0,
+			&p->jobSink, &segment->buf, &segment->bufSize,
+			&segment->scratch, &segment->scratchSize,
+			&segment->exit, NULL,
+			p->options, p->eol, p->outputFormat, p->fontSize,
+			&output, &outputLen, NULL);
+}
+
+/** Check if a segment converted as a parallel job has the same output as
+	if it had been converted after the previous segments.
+	@param[in] p parallel conversion
+	@param[in] segment segment
+	@param[in] state state at the end of the previous segments
+	@return TRUE if the output is valid
+*/
+static NMEBoolean isParallelSegmentValid(ParallelConversion const *p,
+		ParallelSegment const *segment,
+		NMESegmentState const *state)
+{
+	NMEInt i;
+	
+	if (segment->err != kNMEErrOk)
+		return FALSE;
+	if (segment->srcBegin == 0)
+		return TRUE;	// nothing to predict
+	
+	// output of previous segments, which isn't available to jobs, must end
+	// with a complete line, and the predicted state must be right
+	if (segment->exit.dependencies
+				& (kDependOutput | kDependOutputIndex | kDependIndexQuery)
+			|| state->col != 0
+			|| p->pendingLen > 0 && !isEol(p->pending[p->pendingLen - 1])
+			|| state->headingFlags != segment->entry.headingFlags
+			|| state->headingLevel != segment->entry.headingLevel)
+		return FALSE;
+	for (i = 0; i < kMaxNumberedHeadingLevels; i++)
+		if (state->headingNum[i] != segment->entry.headingNum[i])
+			return FALSE;
+	return TRUE;
+}
+
+/** Convert again a segment of a parallel conversion after the previous
+	ones, with a copy of the pending output (to be discarded by the caller).
+	@param[in,out] p parallel conversion
+	@param[in,out] segment segment
+	@param[in] state state at the end of the previous segments
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr convertParallelSegmentAgain(ParallelConversion *p,
+		ParallelSegment *segment,
+		NMESegmentState const *state)
+{
+	NMEText output;
+	NMEInt outputLen, i;
+	NMEErr err;
+	
+	// pending output is kept at the beginning of the output buffer
+	if (segment->bufSize < p->pendingLen + kNMESinkMinSize)
+	{
+		err = p->sink->growFun(&segment->buf, &segment->bufSize,
+				p->pendingLen + kNMESinkMinSize, p->sink->data);
+		if (err != kNMEErrOk)
+			return err;
+		if (segment->bufSize < p->pendingLen)
+			return kNMEErrNotEnoughMemory;
+	}
+	for (i = 0; i < p->pendingLen; i++)
+		segment->buf[i] = p->pending[i];
+	
+	segment->exit = *state;
+	segment->exit.keptLen = p->pendingLen;
+	segment->exit.last = segment->entry.last;
+	segment->exit.dependencies = 0;
+	return processText(p->nmeText + segment->srcBegin,
+			segment->srcEnd - segment->srcBegin, NULL, 0,
+			&p->jobSink, &segment->buf, &segment->bufSize,
+			&segment->scratch, &segment->scratchSize,
+			&segment->exit, NULL,
+			p->options, p->eol, p->outputFormat, p->fontSize,
+			&output, &outputLen, NULL);
+}
+
+/** Pass the output of a segment of a parallel conversion to the sink,
+	keeping the current line and the reparse lookbehind pending like
+	flushOutput, in case the next segment must be converted again.
+	@param[in,out] p parallel conversion
+	@param[in] output output of segment
+	@param[in] outputLen length of output
+	@param[in] last TRUE for the last segment, to flush everything
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr flushParallelOutput(ParallelConversion *p,
+		NMEConstText output, NMEInt outputLen,
+		NMEBoolean last)
+{
+	NMEInt n, i, size;
+	NMEErr err;
+	
+	// find end of last complete line
+	for (n = outputLen; !last && n > 0 && !isEol(output[n - 1]); n--)
+		;
+	if (!last)
+		n -= kNMEReparseLookbehind;
+	if (n < 0)
+		n = 0;
+	
+	if (n > 0 || last)
+	{
+		if (p->pendingLen > 0)
+		{
+			err = p->sink->flushFun(p->pending, p->pendingLen, p->sink->data);
+			if (err != kNMEErrOk)
+				return err;
+			p->pendingLen = 0;
+		}
+		if (n > 0)
+		{
+			err = p->sink->flushFun(output, n, p->sink->data);
+			if (err != kNMEErrOk)
+				return err;
+		}
+	}
+	
+	// keep the rest pending
+	if (p->pendingLen + outputLen - n > p->pendingSize)
+	{
+		size = p->pendingLen + outputLen - n + kNMESinkMinSize;
+		err = p->sink->growFun(&p->pending, &p->pendingSize, size, p->sink->data);
+		if (err != kNMEErrOk)
+			return err;
+		if (p->pendingSize < size)
+			return kNMEErrNotEnoughMemory;
+	}
+	for (i = n; i < outputLen; i++)
+		p->pending[p->pendingLen++] = output[i];
+	
+	return kNMEErrOk;
+}
+
+/** Release the buffers of a segment of a parallel conversion.
+	@param[in] p parallel conversion
+	@param[in,out] segment segment
+*/
+static void releaseParallelSegment(ParallelConversion const *p,
+		ParallelSegment *segment)
+{
+	if (segment->buf)
+		(void)p->sink->growFun(&segment->buf, &segment->bufSize, 0, p->sink->data);
+	if (segment->scratch)
+		(void)p->sink->growFun(&segment->scratch, &segment->scratchSize, 0,
+				p->sink->data);
+	segment->buf = segment->scratch = NULL;
+	segment->bufSize = segment->scratchSize = 0;
+}
+
+/** Merge a segment of a parallel conversion with the next one, when the
+	predicted block boundary between them was wrong.
+	@param[in,out] p parallel conversion
+	@param[in] k index of segment
+*/
+static void mergeParallelSegments(ParallelConversion *p, NMEInt k)
+{
+	NMEInt i;
+	
+	releaseParallelSegment(p, &p->segments[k + 1]);
+	p->segments[k].srcEnd = p->segments[k + 1].srcEnd;
+	p->segments[k].entry.last = p->segments[k + 1].entry.last;
+	for (i = k + 1; i + 1 < p->segmentCount; i++)
+		p->segments[i] = p->segments[i + 1];
+	p->segmentCount--;
+}
+
+NMEErr NMEProcessParallel(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt segmentSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMERunJobsFun runJobsFun, void *runJobsData,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	ParallelConversion p;
+	ParallelSegment *segment;
+	NMESegmentState state, previous;
+	NMEInt k, len, lenUCS16;
+	NMEBoolean converted;
+	NMEErr err;
+	
+	p.nmeText = nmeText;
+	p.options = options;
+	p.eol = eol;
+	p.outputFormat = outputFormat ? outputFormat : &NMEOutputFormatText;
+	p.fontSize = fontSize;
+	p.sink = sink;
+	p.jobSink.growFun = sink->growFun;
+	p.jobSink.flushFun = NULL;
+	p.jobSink.data = sink->data;
+	p.segBuf = p.pending = NULL;
+	p.segBufSize = p.pendingSize = p.pendingLen = 0;
+	p.segments = NULL;
+	p.segmentCount = 0;
+	
+	// convert segments in parallel
+	err = splitParallelSegments(&p, nmeTextLen, segmentSize);
+	if (err == kNMEErrOk)
+		err = runJobsFun(p.segmentCount, convertParallelSegment, &p, runJobsData);
+	
+	// output segments in order, converting them again if needed
+	initSegmentState(&state);
+	for (k = 0; err == kNMEErrOk && k < p.segmentCount; k++)
+	{
+		segment = &p.segments[k];
+		previous = state;
+		converted = !isParallelSegmentValid(&p, segment, &state);
+		if (!converted)
+		{
+			len = state.outputLen + segment->exit.outputLen;
+			lenUCS16 = state.outputUCS16Len + segment->exit.outputUCS16Len;
+			state = segment->exit;
+			state.outputLen = len;
+			state.outputUCS16Len = lenUCS16;
+		}
+		else
+		{
+			err = convertParallelSegmentAgain(&p, segment, &previous);
+			state = segment->exit;
+		}
+		// convert with the next segment if the boundary was mispredicted
+		while (err == kNMEErrOk && segment->exit.dependencies & kDependFollowing
+				&& k + 1 < p.segmentCount)
+		{
+			mergeParallelSegments(&p, k);
+			err = convertParallelSegmentAgain(&p, segment, &previous);
+			state = segment->exit;
+			converted = TRUE;
+		}
+		if (err != kNMEErrOk)
+			break;
+		if (converted)
+			p.pendingLen = 0;	// copied at the beginning of segment->buf
+		err = flushParallelOutput(&p, segment->buf, segment->exit.keptLen,
+				segment->entry.last);
+		releaseParallelSegment(&p, segment);
+	}
+	
+	// release memory
+	for (k = 0; k < p.segmentCount; k++)
+		releaseParallelSegment(&p, &p.segments[k]);
+	if (p.segBuf)
+		(void)sink->growFun(&p.segBuf, &p.segBufSize, 0, sink->data);
+	if (p.pending)
+		(void)sink->growFun(&p.pending, &p.pendingSize, 0, sink->data);
+	if (err != kNMEErrOk)
+		return err;
+	
+	if (outputLen)
+		*outputLen = state.outputLen;
+	if (outputUCS16Len)
+		*outputUCS16Len = state.outputUCS16Len;
+	return kNMEErrOk;
+}
+
+/// Block of a document converted by NMEIncremental
+typedef struct
+{
+	NMESegmentState entry;	///< state at the beginning of the block
+	NMEInt dependencies;	///< kDependOutput etc. (what entry can't capture)
+} IncrementalBlock;
+
+/** Find the end of the block which begins at some index in the source,
+	i.e. the end of the next block boundary line.
+	@param[in] src source text
+	@param[in] srcLen source text length
+	@param[in] i index of the beginning of the block
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] outputFormat format strings
+	@return index of the end of the block
+*/
+static NMEInt findBlockEnd(NMEConstText src, NMEInt srcLen, NMEInt i,
+		NMEInt options,
+		NMEOutputFormat const *outputFormat)
+{
+	NMEInt lineEnd, next, plugin = kScanNoPlugin;
+	NMEBoolean inPre = FALSE;
+	
+	for (; i < srcLen; i = next)
+	{
+		for (lineEnd = i; lineEnd < srcLen && !isEol(src[lineEnd]); lineEnd++)
+			;
+		next = lineEnd + (lineEnd + 1 < srcLen
+				&& src[lineEnd] == '\r' && src[lineEnd + 1] == '\n' ? 2 : 1);
+		if (scanBlockLine(src + i, lineEnd - i, next - lineEnd,
+				options, outputFormat, &inPre, &plugin))
+			return next < srcLen ? next : srcLen;
+	}
+	return srcLen;
+}
+
+/** Grow a buffer with the growFun of a sink if needed, with the same
+	slack as checkDestSize.
+	@param[in] sink sink
+	@param[in,out] buf address of buffer
+	@param[in,out] size address of size of buffer
+	@param[in] minSize minimum size
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr growSinkBuffer(NMEOutputSink const *sink,
+		NMEText *buf, NMEInt *size, NMEInt minSize)
+{
+	NMEInt newSize;
+	NMEErr err;
+	
+	if (minSize <= *size)
+		return kNMEErrOk;
+	newSize = 2 * *size;
+	if (newSize < minSize + kNMESinkMinSize)
+		newSize = minSize + kNMESinkMinSize;
+	err = sink->growFun(buf, size, newSize, sink->data);
+	if (err != kNMEErrOk)
+		return err;
+	return *size < minSize ? kNMEErrNotEnoughMemory : kNMEErrOk;
+}
+
+/** Check if the output of a block converted previously is still valid at
+	a new position.
+	@param[in] block block converted previously
+	@param[in] oldOutput output when block was converted
+	@param[in] state state of the new conversion at the beginning of block
+	@param[in] output output of the new conversion
+	@param[in] srcShift shift of the source of block
+	@return TRUE if the output of block can be reused
+*/
+static NMEBoolean isIncrementalBlockValid(IncrementalBlock const *block,
+		NMEConstText oldOutput,
+		NMESegmentState const *state,
+		NMEConstText output,
+		NMEInt srcShift)
+{
+	NMEInt oldBegin = block->entry.outputLen;
+	NMEInt i;
+	
+	if (block->dependencies & kDependOutput
+			|| block->dependencies & kDependOutputIndex && state->outputLen != oldBegin
+			|| block->dependencies & kDependSrcIndex && srcShift != 0
+			|| state->begun != block->entry.begun
+			|| state->col != block->entry.col
+			|| state->headingFlags != block->entry.headingFlags
+			|| state->headingLevel != block->entry.headingLevel)
+		return FALSE;
+	for (i = 0; i < kMaxNumberedHeadingLevels; i++)
+		if (state->headingNum[i] != block->entry.headingNum[i])
+			return FALSE;
+	
+	// previous output, which can be read back by reparsing or to the
+	// beginning of the last line by encoders, must end with the same line
+	if (oldBegin < kNMEReparseLookbehind || state->outputLen < kNMEReparseLookbehind)
+		return FALSE;
+	for (i = 1; i <= kNMEReparseLookbehind; i++)
+		if (oldOutput[oldBegin - i] != output[state->outputLen - i])
+			return FALSE;
+	return isEol(output[state->outputLen - 1]);
+}
+
+/** Convert the text of an incremental conversion after an edit, from the
+	block before the edit until the output of previous blocks can be reused.
+	@param[in,out] incremental incremental conversion
+	@param[in] nmeText whole source text after the edit
+	@param[in] nmeTextLen source text length
+	@param[in] editIndex index in source of the edit
+	@param[in] removedLen number of bytes removed at editIndex
+	@param[in] insertedLen number of bytes inserted at editIndex
+	@param[out] changedIndex index in output of the first change
+	@param[out] changedRemovedLen number of bytes of previous output replaced
+	@param[out] changedInsertedLen number of bytes which replace them
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr convertIncremental(NMEIncremental *incremental,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt editIndex, NMEInt removedLen, NMEInt insertedLen,
+		NMEInt *changedIndex, NMEInt *changedRemovedLen, NMEInt *changedInsertedLen)
+{
+	NMEInt next = 1 - incremental->current;
+	IncrementalBlock const *oldBlocks
+			= (IncrementalBlock const *)incremental->blocks[incremental->current];
+	NMEConstText oldOutput = incremental->output[incremental->current];
+	NMEInt oldCount = incremental->blockCount;
+	IncrementalBlock *blocks;
+	IncrementalBlock block;
+	NMESegmentState state;
+	NMESegmentState const *oldExit;
+	NMEText output;
+	NMEInt count, first, m, i, k, end, srcShift, outShift, ucs16Shift;
+	NMEInt oldBegin, oldEnd, changedOldEnd, changedNewEnd, outputLen;
+	NMEBoolean converting;
+	NMEErr err;
+	
+	// first block to convert: the one where the edit is, or the one just
+	// before, whose last line could be merged with the edit
+	for (first = oldCount; first > 0 && oldBlocks[first - 1].entry.srcOffset >= editIndex;
+			first--)
+		;
+	if (first > 0)
+		first--;
+	if (first < oldCount)
+		state = oldBlocks[first].entry;
+	else
+		initSegmentState(&state);
+	
+	// keep blocks and output before it
+	CheckError(growSinkBuffer(&incremental->sink, &incremental->blocks[next],
+			&incremental->blocksSize[next],
+			(first + 16) * (NMEInt)sizeof(IncrementalBlock)));
+	blocks = (IncrementalBlock *)incremental->blocks[next];
+	for (count = 0; count < first; count++)
+		blocks[count] = oldBlocks[count];
+	CheckError(growSinkBuffer(&incremental->sink, &incremental->output[next],
+			&incremental->outputSize[next], state.outputLen + kNMESinkMinSize));
+	for (i = 0; i < state.outputLen; i++)
+		incremental->output[next][i] = oldOutput[i];
+	*changedIndex = changedOldEnd = changedNewEnd = state.outputLen;
+	converting = TRUE;
+	
+	srcShift = insertedLen - removedLen;
+	m = first;
+	for (i = state.srcOffset; i < nmeTextLen || count == 0; )
+	{
+		if ((count + 1) * (NMEInt)sizeof(IncrementalBlock) > incremental->blocksSize[next])
+		{
+			CheckError(growSinkBuffer(&incremental->sink, &incremental->blocks[next],
+					&incremental->blocksSize[next],
+					(count + 1) * (NMEInt)sizeof(IncrementalBlock)));
+			blocks = (IncrementalBlock *)incremental->blocks[next];
+		}
+		
+		// reuse output of a block after the edit if it's still valid
+		if (i >= editIndex + insertedLen)
+		{
+			while (m < oldCount && oldBlocks[m].entry.srcOffset + srcShift < i)
+				m++;
+			if (m < oldCount && oldBlocks[m].entry.srcOffset + srcShift == i
+					&& isIncrementalBlockValid(&oldBlocks[m], oldOutput,
+						&state, incremental->output[next], srcShift))
+			{
+				oldBegin = oldBlocks[m].entry.outputLen;
+				oldExit = m + 1 < oldCount ? &oldBlocks[m + 1].entry : &incremental->end;
+				oldEnd = oldExit->outputLen;
+				if (converting)
+				{
+					changedOldEnd = oldBegin;
+					changedNewEnd = state.outputLen;
+					converting = FALSE;
 				}
-				// beginning of pre line
-				if (!NMEAddString(outputFormat->beginPreLine, -1,
-						context.ctrlChar, &context))
-					return kNMEErrNotEnoughMemory;
-				state = kNMEStatePre;
 				
-				if (token == kNMETokenSpace)
-				{
-					// followed by spaces and three closing braces?
-					NMEInt k;
-					
-					for (k = context.srcIndex; k < context.srcLen && context.src[k] == ' '; k++)
-						;
-					if (k + 3 <= context.srcLen && context.src[k] == '}'
-							&& context.src[k + 1] == '}' && context.src[k + 2] == '}')
-						break;	// yes: ignore first space
-				}				
-				// continue
-			case kNMEStatePre:
-				switch (token)
-				{
-					case kNMETokenChar:
-						if (outputFormat->encodeCharPreFun)
-						{
-							context.srcIndex--;
-							CheckError(outputFormat->encodeCharPreFun(context.src, context.srcLen, &context.srcIndex,
-									&context,
-									outputFormat->encodeCharPreData));
-						}
-						else
-						{
-							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
-							context.col++;
-						}
-						break;
-					case kNMETokenSpace:
-						if (outputFormat->encodeCharPreFun)
-						{
-							NMEInt tmp = 0;
-							
-							CheckError(outputFormat->encodeCharPreFun(" ", 1, &tmp,
-									&context,
-									outputFormat->encodeCharPreData));
-						}
-						else
-						{
-							context.dest[context.destLen++] = ' ';
-							context.destLenUCS16++;
-							context.col++;
-						}
-						break;
-					case kNMETokenTab:
-						do
-						{
-							if (outputFormat->encodeCharPreFun)
-							{
-								NMEInt tmp = 0;
-								
-								CheckError(outputFormat->encodeCharPreFun(" ", 1, &tmp,
-										&context,
-										outputFormat->encodeCharPreData));
-							}
-							else
-							{
-								context.dest[context.destLen++] = ' ';
-								context.destLenUCS16++;
-								context.col++;
-							}
-						} while (context.col % kTabWidth != 0);
-						break;
-					case kNMETokenEOL:
-						if (!NMEAddString(outputFormat->endPreLine, -1,
-								context.ctrlChar, &context))
-							return kNMEErrNotEnoughMemory;
-						state = kNMEStatePreAfterEol;
-						break;
-					default:
-						// should never occur in preformatted blocks
-						return kNMEErrInternal;
-				}
+				CheckError(growSinkBuffer(&incremental->sink, &incremental->output[next],
+						&incremental->outputSize[next],
+						state.outputLen + oldEnd - oldBegin + 1));
+				output = incremental->output[next] + state.outputLen;
+				for (k = 0; k < oldEnd - oldBegin; k++)
+					output[k] = oldOutput[oldBegin + k];
+				
+				outShift = state.outputLen - oldBegin;
+				ucs16Shift = state.outputUCS16Len - oldBlocks[m].entry.outputUCS16Len;
+				blocks[count] = oldBlocks[m];
+				blocks[count].entry.srcOffset += srcShift;
+				blocks[count].entry.outputLen += outShift;
+				blocks[count].entry.outputUCS16Len += ucs16Shift;
+				blocks[count].entry.keptLen = blocks[count].entry.outputLen;
+				count++;
+				state = *oldExit;
+				state.srcOffset += srcShift;
+				state.outputLen += outShift;
+				state.outputUCS16Len += ucs16Shift;
+				state.keptLen = state.outputLen;
+				i = state.srcOffset;
+				m++;
+				continue;
+			}
+		}
+		
+		// convert next block, extended until its end is a block boundary
+		state.keptLen = state.outputLen;
+		state.dependencies = 0;
+		block.entry = state;
+		for (end = i; ; )
+		{
+			end = findBlockEnd(nmeText, nmeTextLen, end,
+					incremental->options, incremental->outputFormat);
+			state = block.entry;
+			state.last = end >= nmeTextLen;
+			CheckError(processText(nmeText + i, end - i, NULL, 0,
+					&incremental->sink,
+					&incremental->output[next], &incremental->outputSize[next],
+					&incremental->scratch, &incremental->scratchSize,
+					&state, NULL,
+					incremental->options, incremental->eol,
+					incremental->outputFormat, incremental->fontSize,
+					&output, &outputLen, NULL));
+			if (!(state.dependencies & kDependFollowing) || state.last)
 				break;
-			case kNMEStateHeading:
-				switch (token)
-				{
-					case kNMETokenChar:
-						if (outputFormat->charHookFun)
-							CheckError(outputFormat->charHookFun(i0 + context.srcIndexOffset,
-									&context,
-									outputFormat->charHookData));
-						if (outputFormat->encodeCharFun)
-						{
-							context.srcIndex--;
-							CheckError(outputFormat->encodeCharFun(context.src, context.srcLen, &context.srcIndex,
-									&context,
-									outputFormat->encodeCharData));
-						}
-						else
-						{
-							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
-							context.col++;
-						}
-						CheckError(checkWordwrap(&context, outputFormat));
-						break;
-					case kNMETokenSpace:
-					case kNMETokenTab:
-						if (state == kNMEStatePar)	// pack multiple spaces for par
-							skipBlanks(context.src, context.srcLen, &context.srcIndex);
-						// single space provided not last of line
-						if (context.srcIndex < context.srcLen && !isEol(context.src[context.srcIndex]))
-						{
-							if (!NMEAddString(outputFormat->space, -1,
-									context.ctrlChar, &context))
-								return kNMEErrNotEnoughMemory;
-							CheckError(checkWordwrap(&context, outputFormat));
-						}
-						break;
-					case kNMETokenHeading:
-						// end of heading
-						skipBlanks(context.src, context.srcLen, &context.srcIndex);
-					case kNMETokenEOL:
-						context.level = headingLevel;
-						CheckError(flushStyleTags(styleStack, &styleNesting,
-								i0,
-								outputFormat, &context));
-						if (!NMEAddString(outputFormat->endHeading, -1,
-									context.ctrlChar, &context))
-							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						HOOK(parHookFun, context.level, 0, FALSE, "=");
-						context.level = 0;
-						state = kNMEStateBetweenPar;
-						break;
-					case kNMETokenLineBreak:
-						if (!NMEAddString(outputFormat->lineBreak, -1,
-								context.ctrlChar, &context))
-							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						break;
-					case kNMETokenStyle:
-					case kNMETokenLinkEnd:
-					case kNMETokenImageEnd:
-						CheckError(processStyleTag(styleStack, &styleNesting,
-								token == kNMETokenLinkEnd
-									? kNMEStyleLink
-									: token == kNMETokenImageEnd
-										? kNMEStyleImage : newStyle,
-								i0,
-								outputFormat, &context));
-						break;
-					case kNMETokenLinkBegin:
-					case kNMETokenImageBegin:
-						CheckError(addLinkBegin(token == kNMETokenImageBegin,
-								styleStack, &styleNesting,
-								i0, outputFormat, &context));
-						break;
-					case kNMETokenPlugin:
-					case kNMETokenPluginBlock:
-					case kNMETokenPlaceholder:
-					case kNMETokenPlaceholderBlock:
-						destLenTmp = context.destLen;
-						CheckError(addPlugin(token == kNMETokenPluginBlock
-										|| token == kNMETokenPlaceholderBlock,
-									token == kNMETokenPlaceholder
-										|| token == kNMETokenPlaceholderBlock,
-								options, outputFormat, &context,
-								&reparseOutput));
-						if (reparseOutput)
-						{
-							CheckError(swapBuffers(&context.src, &context.srcLen,
-									&context,
-									&commonLen,
-									destLenTmp));
-							// noAutoOrPluginLen = context.destLen;
-						}
-						break;
-					case kNMETokenLI:
-					case kNMETokenDD:
-					case kNMETokenTableCell:
-					case kNMETokenTableHCell:
-					case kNMETokenHR:
-					case kNMETokenPre:
-						// should never occur in a heading
-						return kNMEErrInternal;
-				}
+		}
+		block.dependencies = state.dependencies;
+		blocks[count++] = block;
+		converting = TRUE;
+		i = end;
+	}
+	if (converting)
+	{
+		changedOldEnd = incremental->end.outputLen;
+		changedNewEnd = state.outputLen;
+	}
+	
+	// null byte after output
+	CheckError(growSinkBuffer(&incremental->sink, &incremental->output[next],
+			&incremental->outputSize[next], state.outputLen + 1));
+	incremental->output[next][state.outputLen] = '\0';
+	
+	incremental->current = next;
+	incremental->blockCount = count;
+	incremental->end = state;
+	*changedRemovedLen = changedOldEnd - *changedIndex;
+	*changedInsertedLen = changedNewEnd - *changedIndex;
+	
+	return kNMEErrOk;
+}
+
+NMEErr NMEIncrementalBegin(NMEIncremental *incremental,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMEText *output,
+		NMEInt *outputLen)
+{
+	NMEInt changedIndex, changedRemovedLen, changedInsertedLen;
+	NMEErr err;
+	
+	incremental->options = options;
+	incremental->eol = eol;
+	incremental->outputFormat = outputFormat ? outputFormat : &NMEOutputFormatText;
+	incremental->fontSize = fontSize;
+	incremental->sink.growFun = sink->growFun;
+	incremental->sink.flushFun = NULL;
+	incremental->sink.data = sink->data;
+	incremental->output[0] = incremental->output[1] = NULL;
+	incremental->outputSize[0] = incremental->outputSize[1] = 0;
+	incremental->blocks[0] = incremental->blocks[1] = NULL;
+	incremental->blocksSize[0] = incremental->blocksSize[1] = 0;
+	incremental->blockCount = 0;
+	incremental->current = 0;
+	incremental->scratch = NULL;
+	incremental->scratchSize = 0;
+	initSegmentState(&incremental->end);
+	
+	err = convertIncremental(incremental, nmeText, nmeTextLen, 0, 0, nmeTextLen,
+			&changedIndex, &changedRemovedLen, &changedInsertedLen);
+	if (err != kNMEErrOk)
+		return err;
+	
+	*output = incremental->output[incremental->current];
+	*outputLen = incremental->end.outputLen;
+	return kNMEErrOk;
+}
+
+NMEErr NMEIncrementalEdit(NMEIncremental *incremental,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt editIndex, NMEInt removedLen, NMEInt insertedLen,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *changedIndex,
+		NMEInt *changedRemovedLen,
+		NMEInt *changedInsertedLen)
+{
+	NMEInt oldTextLen = incremental->end.srcOffset;
+	NMEInt index, removed, inserted;
+	NMEErr err;
+	
+	// convert everything if the edit doesn't match the previous text
+	if (editIndex < 0 || removedLen < 0 || insertedLen < 0
+			|| editIndex + removedLen > oldTextLen
+			|| oldTextLen - removedLen + insertedLen != nmeTextLen)
+	{
+		editIndex = 0;
+		removedLen = oldTextLen;
+		insertedLen = nmeTextLen;
+	}
+	
+	err = convertIncremental(incremental, nmeText, nmeTextLen,
+			editIndex, removedLen, insertedLen,
+			&index, &removed, &inserted);
+	if (err != kNMEErrOk)
+		return err;
+	
+	*output = incremental->output[incremental->current];
+	*outputLen = incremental->end.outputLen;
+	if (changedIndex)
+		*changedIndex = index;
+	if (changedRemovedLen)
+		*changedRemovedLen = removed;
+	if (changedInsertedLen)
+		*changedInsertedLen = inserted;
+	return kNMEErrOk;
+}
+
+void NMEIncrementalEnd(NMEIncremental *incremental)
+{
+	NMEInt k;
+	
+	for (k = 0; k < 2; k++)
+	{
+		if (incremental->output[k])
+			(void)incremental->sink.growFun(&incremental->output[k],
+					&incremental->outputSize[k], 0, incremental->sink.data);
+		if (incremental->blocks[k])
+			(void)incremental->sink.growFun(&incremental->blocks[k],
+					&incremental->blocksSize[k], 0, incremental->sink.data);
+		incremental->output[k] = incremental->blocks[k] = NULL;
+		incremental->outputSize[k] = incremental->blocksSize[k] = 0;
+	}
+	if (incremental->scratch)
+		(void)incremental->sink.growFun(&incremental->scratch,
+				&incremental->scratchSize, 0, incremental->sink.data);
+	incremental->scratch = NULL;
+	incremental->scratchSize = 0;
+	incremental->blockCount = 0;
+}
+
+/// Kind of hook recorded in a block cache entry
+enum
+{
+	kBlockCacheHookDiv = 0,	///< divHookFun
+	kBlockCacheHookPar,	///< parHookFun
+	kBlockCacheHookSpan	///< spanHookFun
+};
+
+/// Hook call recorded when a block is converted, made again when its output is reused
+typedef struct
+{
+	NMEInt kind;	///< kBlockCacheHookDiv, kBlockCacheHookPar or kBlockCacheHookSpan
+	NMEInt level;	///< level argument
+	NMEInt item;	///< item argument
+	NMEBoolean enter;	///< enter argument
+	NMEConstText markup;	///< markup argument (always a string literal)
+	NMEInt srcIndex;	///< srcIndex argument relative to the beginning of the block
+	NMEInt outputIndex;	///< output index relative to the beginning of the block output
+} BlockCacheHook;
+
+/** Entry of a block cache, allocated with its hooks, eol, output before
+	the block, source and output (in that order) */
+typedef struct
+{
+	NMEInt hash;	///< hash of the key
+	NMEOutputFormat const *outputFormat;	///< output format
+	NMEInt options;	///< kNMEProcessOptDefault or sum of options
+	NMEInt fontSize;	///< font size
+	NMEInt eolLen;	///< length of eol
+	NMEInt lookbehindLen;	///< length of output before the block
+	NMEInt firstLen;	///< length of the source which is hashed
+	NMEInt srcLen;	///< length of the source of the block
+	NMEInt outputLen;	///< length of the output of the block
+	NMEInt hookCount;	///< number of hooks
+	NMESegmentState entry;	///< state at the beginning of the block
+	NMESegmentState exit;	///< state at the end of the block
+} BlockCacheEntry;
+
+/// Hooks of a block cache entry
+#define blockCacheHooks(e) ((BlockCacheHook const *)((e) + 1))
+
+/// Bytes of a block cache entry (eol, lookbehind, source and output)
+#define blockCacheBytes(e) ((NMEText)(blockCacheHooks(e) + (e)->hookCount))
+
+/// Key of a block looked up in a block cache
+typedef struct
+{
+	NMEInt hash;	///< hash of the other fields
+	NMEOutputFormat const *outputFormat;	///< output format
+	NMEInt options;	///< kNMEProcessOptDefault or sum of options
+	NMEInt fontSize;	///< font size
+	NMEConstText eol;	///< null-terminated string used for end-of-line
+	NMEInt eolLen;	///< length of eol
+	NMEConstText lookbehind;	///< end of output before the block
+	NMEInt lookbehindLen;	///< length of lookbehind
+	NMEConstText src;	///< source of the block
+	NMEInt firstLen;	///< length of the block up to its first boundary
+	NMEInt availLen;	///< length of source from src to the end of the text
+	NMESegmentState const *entry;	///< state at the beginning of the block
+} BlockCacheKey;
+
+/// Hooks recorded during the conversion of a block by NMEProcessCached
+typedef struct
+{
+	NMEOutputFormat const *outputFormat;	///< format with the hooks which are recorded
+	NMEOutputSink const *sink;	///< sink used to grow hooks
+	NMEText hooks;	///< recorded hooks (array of BlockCacheHook)
+	NMEInt hooksSize;	///< size of hooks
+	NMEInt hookCount;	///< number of recorded hooks
+	NMEInt srcOffset;	///< index in source of the beginning of the block
+	NMEInt outputOffset;	///< index in output of the beginning of the block
+	NMEBoolean addedOutput;	///< TRUE if a hook has added output
+} BlockCacheRecorder;
+
+/** Compute the hash of a block cache key.
+	@param[in,out] key key whose hash is set
+*/
+static void hashBlockCacheKey(BlockCacheKey *key)
+{
+	unsigned long hash = 2166136261UL;
+	unsigned long format = (unsigned long)key->outputFormat;
+	
+	hash = hashBytes(hash, key->src, key->firstLen);
+	hash = hashBytes(hash, key->eol, key->eolLen);
+	hash = hashBytes(hash, key->lookbehind, key->lookbehindLen);
+	hash = hashBytes(hash, &format, (NMEInt)sizeof(format));
+	hash = hashBytes(hash, &key->options, (NMEInt)sizeof(NMEInt));
+	hash = hashBytes(hash, &key->fontSize, (NMEInt)sizeof(NMEInt));
+	hash = hashBytes(hash, &key->entry->col, (NMEInt)sizeof(NMEInt));
+	hash = hashBytes(hash, key->entry->headingNum,
+			kMaxNumberedHeadingLevels * (NMEInt)sizeof(NMEInt));
+	hash = hashBytes(hash, &key->entry->headingFlags, (NMEInt)sizeof(NMEInt));
+	hash = hashBytes(hash, &key->entry->headingLevel, (NMEInt)sizeof(NMEInt));
+	hash = hashBytes(hash, &key->entry->begun, (NMEInt)sizeof(NMEBoolean));
+	hash = hashBytes(hash, &key->entry->last, (NMEInt)sizeof(NMEBoolean));
+	key->hash = (NMEInt)(hash & 0x7fffffffUL);
+}
+
+/** Compare bytes.
+	@param[in] a first bytes
+	@param[in] b second bytes
+	@param[in] len number of bytes
+	@return TRUE if a and b are equal
+*/
+static NMEBoolean equalBytes(NMEConstText a, NMEConstText b, NMEInt len)
+{
+	NMEInt i;
+	
+	for (i = 0; i < len; i++)
+		if (a[i] != b[i])
+			return FALSE;
+	return TRUE;
+}
+
+/** Check if a block cache entry matches a key.
+	@param[in] entry block cache entry
+	@param[in] key key
+	@return TRUE if entry's output can be reused for the block of key
+*/
+static NMEBoolean isBlockCacheEntryMatch(BlockCacheEntry const *entry,
+		BlockCacheKey const *key)
+{
+	NMEConstText bytes = blockCacheBytes(entry);
+	NMEInt i;
+	
+	// entry.last is in the key; exit.last if the block was extended to the end
+	if (entry->hash != key->hash
+			|| entry->outputFormat != key->outputFormat
+			|| entry->options != key->options
+			|| entry->fontSize != key->fontSize
+			|| entry->eolLen != key->eolLen
+			|| entry->lookbehindLen != key->lookbehindLen
+			|| entry->firstLen != key->firstLen
+			|| entry->srcLen > key->availLen
+			|| entry->exit.last != (entry->srcLen == key->availLen)
+			|| entry->entry.col != key->entry->col
+			|| entry->entry.headingFlags != key->entry->headingFlags
+			|| entry->entry.headingLevel != key->entry->headingLevel
+			|| entry->entry.begun != key->entry->begun
+			|| entry->entry.last != key->entry->last)
+		return FALSE;
+	for (i = 0; i < kMaxNumberedHeadingLevels; i++)
+		if (entry->entry.headingNum[i] != key->entry->headingNum[i])
+			return FALSE;
+	return equalBytes(bytes, key->eol, key->eolLen)
+			&& equalBytes(bytes + key->eolLen, key->lookbehind, key->lookbehindLen)
+			&& equalBytes(bytes + key->eolLen + key->lookbehindLen, key->src, entry->srcLen);
+}
+
+/** Find an entry in a block cache.
+	@param[in] cache block cache
+	@param[in] key key of the block
+	@return index of the entry, or -1 if not found
+*/
+static NMEInt findBlockCacheEntry(NMEBlockCache const *cache, BlockCacheKey const *key)
+{
+	BlockCacheEntry * const *entries = (BlockCacheEntry * const *)cache->entries;
+	NMEInt const *table = (NMEInt const *)cache->table;
+	NMEInt i;
+	
+	if (cache->count == 0)
+		return -1;
+	for (i = key->hash & (cache->tableSlots - 1);
+			table[i] > 0;
+			i = (i + 1) & (cache->tableSlots - 1))
+		if (isBlockCacheEntryMatch(entries[table[i] - 1], key))
+			return table[i] - 1;
+	return -1;
+}
+
+/** Add an entry to the hash table of a block cache.
+	@param[in,out] cache block cache (hash table with a free slot)
+	@param[in] k index of the entry
+*/
+static void insertBlockCacheEntry(NMEBlockCache *cache, NMEInt k)
+{
+	BlockCacheEntry * const *entries = (BlockCacheEntry * const *)cache->entries;
+	NMEInt *table = (NMEInt *)cache->table;
+	NMEInt i;
+	
+	for (i = entries[k]->hash & (cache->tableSlots - 1);
+			table[i] > 0;
+			i = (i + 1) & (cache->tableSlots - 1))
+		;
+	table[i] = k + 1;
+}
+
+/** Remove an entry from a block cache, replacing it with the last one
+	(the hash table must be rebuilt).
+	@param[in,out] cache block cache
+	@param[in] k index of the entry
+*/
+static void removeBlockCacheEntry(NMEBlockCache *cache, NMEInt k)
+{
+	NMEText *entries = (NMEText *)cache->entries;
+	NMEBlockCacheEntryInfo *info = (NMEBlockCacheEntryInfo *)cache->info;
+	NMEInt size = info[k].size;
+	
+	(void)cache->sink.growFun(&entries[k], &size, 0, cache->sink.data);
+	cache->size -= info[k].size;
+	cache->count--;
+	entries[k] = entries[cache->count];
+	info[k] = info[cache->count];
+}
+
+/** Rebuild the hash table of a block cache; if memory can't be allocated,
+	remove all entries.
+	@param[in,out] cache block cache
+	@param[in] slots number of slots (power of 2 larger than the number of entries)
+*/
+static void rebuildBlockCacheTable(NMEBlockCache *cache, NMEInt slots)
+{
+	NMEInt k;
+	
+	if (growSinkBuffer(&cache->sink, &cache->table, &cache->tableSize,
+			slots * (NMEInt)sizeof(NMEInt)) != kNMEErrOk)
+	{
+		while (cache->count > 0)
+			removeBlockCacheEntry(cache, cache->count - 1);
+		return;
+	}
+	cache->tableSlots = slots;
+	for (k = 0; k < slots; k++)
+		((NMEInt *)cache->table)[k] = 0;
+	for (k = 0; k < cache->count; k++)
+		insertBlockCacheEntry(cache, k);
+}
+
+/** Store the output of a block in a block cache, evicting other entries if
+	needed; the block isn't stored if memory can't be allocated.
+	@param[in,out] cache block cache
+	@param[in] key key of the block
+	@param[in] exit state at the end of the block
+	@param[in] output output of the block
+	@param[in] recorder hooks called during the conversion of the block
+*/
+static void storeBlockCacheEntry(NMEBlockCache *cache,
+		BlockCacheKey const *key,
+		NMESegmentState const *exit,
+		NMEConstText output,
+		BlockCacheRecorder const *recorder)
+{
+	NMEInt srcLen = exit->srcOffset - key->entry->srcOffset;
+	NMEInt outputLen = exit->outputLen - key->entry->outputLen;
+	NMEInt size = (NMEInt)sizeof(BlockCacheEntry)
+			+ recorder->hookCount * (NMEInt)sizeof(BlockCacheHook)
+			+ key->eolLen + key->lookbehindLen + srcLen + outputLen;
+	NMEInt slots = cache->tableSlots;
+	NMEText buf = NULL;
+	NMEInt bufSize = 0;
+	BlockCacheEntry *entry;
+	NMEBlockCacheEntryInfo *info;
+	NMEText bytes;
+	NMEInt i, k;
+	NMEBoolean evicted = FALSE;
+	
+	if (size > cache->maxSize)
+		return;
+	
+	// evict entries until the new one fits
+	while (cache->count > 0 && cache->size + size > cache->maxSize)
+	{
+		k = cache->evictFun((NMEBlockCacheEntryInfo const *)cache->info, cache->count,
+				cache->evictData);
+		removeBlockCacheEntry(cache, k >= 0 && k < cache->count ? k : 0);
+		evicted = TRUE;
+	}
+	
+	// allocate the entry and make room for it
+	if (evicted || 2 * (cache->count + 1) > slots)
+	{
+		while (2 * (cache->count + 1) > slots)
+			slots = slots > 0 ? 2 * slots : 64;
+		rebuildBlockCacheTable(cache, slots);
+		if (cache->tableSlots != slots)
+			return;
+	}
+	if (growSinkBuffer(&cache->sink, &cache->entries, &cache->entriesSize,
+				(cache->count + 1) * (NMEInt)sizeof(NMEText)) != kNMEErrOk
+			|| growSinkBuffer(&cache->sink, &cache->info, &cache->infoSize,
+				(cache->count + 1) * (NMEInt)sizeof(NMEBlockCacheEntryInfo)) != kNMEErrOk
+			|| cache->sink.growFun(&buf, &bufSize, size, cache->sink.data) != kNMEErrOk
+			|| bufSize < size)
+	{
+		if (buf)
+			(void)cache->sink.growFun(&buf, &bufSize, 0, cache->sink.data);
+		return;
+	}
+	
+	// fill it
+	entry = (BlockCacheEntry *)buf;
+	entry->hash = key->hash;
+	entry->outputFormat = key->outputFormat;
+	entry->options = key->options;
+	entry->fontSize = key->fontSize;
+	entry->eolLen = key->eolLen;
+	entry->lookbehindLen = key->lookbehindLen;
+	entry->firstLen = key->firstLen;
+	entry->srcLen = srcLen;
+	entry->outputLen = outputLen;
+	entry->hookCount = recorder->hookCount;
+	entry->entry = *key->entry;
+	entry->exit = *exit;
+	for (i = 0; i < recorder->hookCount; i++)
+		((BlockCacheHook *)(entry + 1))[i] = ((BlockCacheHook const *)recorder->hooks)[i];
+	bytes = blockCacheBytes(entry);
+	for (i = 0; i < key->eolLen; i++)
+		*bytes++ = key->eol[i];
+	for (i = 0; i < key->lookbehindLen; i++)
+		*bytes++ = key->lookbehind[i];
+	for (i = 0; i < srcLen; i++)
+		*bytes++ = key->src[i];
+	for (i = 0; i < outputLen; i++)
+		*bytes++ = output[i];
+	
+	// add it
+	k = cache->count++;
+	((NMEText *)cache->entries)[k] = buf;
+	info = (NMEBlockCacheEntryInfo *)cache->info + k;
+	info->size = size;
+	info->hits = 0;
+	info->lastUse = ++cache->clock;
+	cache->size += size;
+	insertBlockCacheEntry(cache, k);
+}
+
+/** Record a hook call and call the hook.
+	@param[in] kind kBlockCacheHookDiv, kBlockCacheHookPar or kBlockCacheHookSpan
+	@param[in] level heading or list level (1 = topmost)
+	@param[in] item list item or heading counter
+	@param[in] enter TRUE when entering construct, FALSE when exiting
+	@param[in] markup null-terminated string for initial markup
+	@param[in] srcIndex current index in source code
+	@param[in,out] context current context
+	@param[in,out] recorder hook recorder
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr recordHook(NMEInt kind,
+		NMEInt level,
+		NMEInt item,
+		NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex,
+		NMEContext *context,
+		BlockCacheRecorder *recorder)
+{
+	NMEOutputFormat const *outputFormat = recorder->outputFormat;
+	NMEInt outputIndex = context->destOffset + context->destLen;
+	BlockCacheHook *hook;
+	NMEErr err;
+	
+	CheckError(growSinkBuffer(recorder->sink, &recorder->hooks, &recorder->hooksSize,
+			(recorder->hookCount + 1) * (NMEInt)sizeof(BlockCacheHook)));
+	hook = (BlockCacheHook *)recorder->hooks + recorder->hookCount++;
+	hook->kind = kind;
+	hook->level = level;
+	hook->item = item;
+	hook->enter = enter;
+	hook->markup = markup;
+	hook->srcIndex = srcIndex - recorder->srcOffset;
+	hook->outputIndex = outputIndex - recorder->outputOffset;
+	
+	CheckError((kind == kBlockCacheHookDiv ? outputFormat->divHookFun
+				: kind == kBlockCacheHookPar ? outputFormat->parHookFun
+				: outputFormat->spanHookFun)(level, item, enter, markup, srcIndex,
+			context, outputFormat->hookData));
+	if (context->destOffset + context->destLen != outputIndex)
+		recorder->addedOutput = TRUE;
+	return kNMEErrOk;
+}
+
+/// Div hook which records calls to the div hook of the recorder's format
+static NMEErr divHookRecord(NMEInt level, NMEInt item, NMEBoolean enter,
+		NMEConstText markup, NMEInt srcIndex, NMEContext *context, void *data)
+{
+	return recordHook(kBlockCacheHookDiv, level, item, enter, markup, srcIndex,
+			context, (BlockCacheRecorder *)data);
+}
+
+/// Par hook which records calls to the par hook of the recorder's format
+static NMEErr parHookRecord(NMEInt level, NMEInt item, NMEBoolean enter,
+		NMEConstText markup, NMEInt srcIndex, NMEContext *context, void *data)
+{
+	return recordHook(kBlockCacheHookPar, level, item, enter, markup, srcIndex,
+			context, (BlockCacheRecorder *)data);
+}
+
+/// Span hook which records calls to the span hook of the recorder's format
+static NMEErr spanHookRecord(NMEInt level, NMEInt item, NMEBoolean enter,
+		NMEConstText markup, NMEInt srcIndex, NMEContext *context, void *data)
+{
+	return recordHook(kBlockCacheHookSpan, level, item, enter, markup, srcIndex,
+			context, (BlockCacheRecorder *)data);
+}
+
+/** Reuse the output of a block cache entry and call its hooks again.
+	@param[in,out] cache block cache
+	@param[in] k index of the entry
+	@param[in] nmeText source text
+	@param[in] sink output sink
+	@param[in,out] buf address of output buffer
+	@param[in,out] bufSize address of size of buf
+	@param[in] outputFormat format strings
+	@param[in,out] state state at the beginning of the block, replaced with
+	the state at its end
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr reuseBlockCacheEntry(NMEBlockCache *cache, NMEInt k,
+		NMEConstText nmeText,
+		NMEOutputSink const *sink,
+		NMEText *buf, NMEInt *bufSize,
+		NMEOutputFormat const *outputFormat,
+		NMESegmentState *state)
+{
+	BlockCacheEntry const *entry = ((BlockCacheEntry * const *)cache->entries)[k];
+	NMEBlockCacheEntryInfo *info = (NMEBlockCacheEntryInfo *)cache->info + k;
+	BlockCacheHook const *hook = blockCacheHooks(entry);
+	NMEConstText output = blockCacheBytes(entry)
+			+ entry->eolLen + entry->lookbehindLen + entry->srcLen;
+	NMEProcessHookFun hookFun;
+	NMEContext context;
+	NMEInt i;
+	NMEErr err;
+	
+	info->hits++;
+	info->lastUse = ++cache->clock;
+	
+	// headroom for the segments which follow, like checkDestSize
+	CheckError(growSinkBuffer(sink, buf, bufSize,
+			state->outputLen + entry->outputLen + kNMESinkMinSize));
+	for (i = 0; i < entry->outputLen; i++)
+		(*buf)[state->outputLen + i] = output[i];
+	
+	// call hooks with a context where output can be queried but not added
+	context.outputFormat = outputFormat;
+	context.options = entry->options;
+	context.eol = blockCacheBytes(entry);
+	context.ctrlChar = outputFormat->ctrlChar;
+	context.fontSize = entry->fontSize > 0 ? entry->fontSize : outputFormat->defFontSize;
+	context.xref = (entry->options & kNMEProcessOptXRef) != 0;
+	context.dest = *buf + state->outputLen;
+	context.destOffset = state->outputLen;
+	context.destOffsetUCS16 = state->outputUCS16Len;
+	context.countedLen = context.countedUCS16 = 0;
+	context.countFlushedUCS16 = TRUE;
+	context.src = (NMEText)nmeText + state->srcOffset;
+	context.srcLen = entry->srcLen;
+	context.srcIndexOffset = state->srcOffset;
+	context.sink = NULL;
+	context.sinkBuf = context.scratch = NULL;
+	context.sinkBufSize = context.scratchSize = NULL;
+	context.peakSize = 0;
+	context.destFull = FALSE;
+	context.currentIndent = context.col = 0;
+	context.wrapLine = context.wrapScanned = 0;
+	context.wrapPoint = -1;
+	context.nesting = 0;
+	context.level = context.item = 0;
+	context.linkOffset = context.linkLength = 0;
+	context.dependencies = NULL;
+	context.deferredCount = kMaxDeferred;	// no slot can be reserved
+	for (i = 0; i < entry->hookCount; i++, hook++)
+	{
+		context.destLen = context.bufSize = hook->outputIndex;
+		if (context.destLen < context.countedLen)
+			context.countedLen = context.countedUCS16 = 0;
+		context.srcIndex = hook->srcIndex;
+		hookFun = hook->kind == kBlockCacheHookDiv ? outputFormat->divHookFun
+				: hook->kind == kBlockCacheHookPar ? outputFormat->parHookFun
+				: outputFormat->spanHookFun;
+		if (hookFun)
+			CheckError(hookFun(hook->level, hook->item, hook->enter, hook->markup,
+					state->srcOffset + hook->srcIndex,
+					&context, outputFormat->hookData));
+	}
+	
+	// state at the end of the block, at its new position
+	*state = entry->exit;
+	state->srcOffset = context.srcIndexOffset + entry->srcLen;
+	state->outputLen = context.destOffset + entry->outputLen;
+	state->outputUCS16Len = context.destOffsetUCS16
+			+ entry->exit.outputUCS16Len - entry->entry.outputUCS16Len;
+	state->keptLen = state->outputLen;
+	return kNMEErrOk;
+}
+
+/** Convert text block by block, reusing output found in a block cache and
+	storing output of converted blocks.
+	@param[in,out] cache block cache
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen source text length
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings
+	@param[in] recordFormat outputFormat with hooks replaced by recorder's
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] sink output sink (without flushFun)
+	@param[in,out] buf address of output buffer
+	@param[in,out] bufSize address of size of buf
+	@param[in,out] scratch address of buffer for reparsed source
+	@param[in,out] scratchSize address of size of scratch buffer
+	@param[in,out] recorder hook recorder
+	@param[out] state state at the end of the text
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr convertCached(NMEBlockCache *cache,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEOutputFormat const *recordFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMEText *buf, NMEInt *bufSize,
+		NMEText *scratch, NMEInt *scratchSize,
+		BlockCacheRecorder *recorder,
+		NMESegmentState *state)
+{
+	NMESegmentState entry;
+	BlockCacheKey key;
+	NMEText output;
+	NMEInt i, end, k, outputLen;
+	NMEBoolean first, cacheable;
+	NMEErr err;
+	
+	initSegmentState(state);
+	for (i = 0, first = TRUE; i < nmeTextLen || first; i = end, first = FALSE)
+	{
+		end = findBlockEnd(nmeText, nmeTextLen, i, options, outputFormat);
+		state->last = end >= nmeTextLen;
+		state->keptLen = state->outputLen;
+		state->dependencies = 0;
+		entry = *state;
+		
+		// output before the block, which can be read back by reparsing or to
+		// the beginning of the last line by encoders, must end with a line
+		cacheable = state->outputLen == 0
+				|| state->outputLen >= kNMEReparseLookbehind
+					&& isEol((*buf)[state->outputLen - 1]);
+		if (cacheable)
+		{
+			key.outputFormat = outputFormat;
+			key.options = options;
+			key.fontSize = fontSize;
+			key.eol = eol;
+			for (key.eolLen = 0; eol[key.eolLen]; key.eolLen++)
+				;
+			key.lookbehindLen = state->outputLen > 0 ? kNMEReparseLookbehind : 0;
+			key.lookbehind = key.lookbehindLen > 0
+					? *buf + state->outputLen - key.lookbehindLen : NULL;
+			key.src = nmeText + i;
+			key.firstLen = end - i;
+			key.availLen = nmeTextLen - i;
+			key.entry = &entry;
+			hashBlockCacheKey(&key);
+			k = findBlockCacheEntry(cache, &key);
+			if (k >= 0)
+			{
+				CheckError(reuseBlockCacheEntry(cache, k, nmeText, sink, buf, bufSize,
+						outputFormat, state));
+				end = state->srcOffset;
+				continue;
+			}
+		}
+		
+		// convert block, extended until its end is a block boundary
+		for (;;)
+		{
+			*state = entry;
+			state->last = end >= nmeTextLen;
+			recorder->hookCount = 0;
+			recorder->srcOffset = i;
+			recorder->outputOffset = entry.outputLen;
+			recorder->addedOutput = FALSE;
+			CheckError(processText(nmeText + i, end - i, NULL, 0,
+					sink, buf, bufSize, scratch, scratchSize,
+					state, NULL,
+					options, eol, recordFormat, fontSize,
+					&output, &outputLen, NULL));
+			if (!(state->dependencies & kDependFollowing) || state->last)
 				break;
+			end = findBlockEnd(nmeText, nmeTextLen, end, options, outputFormat);
+		}
+		
+		if (cacheable && !recorder->addedOutput
+				&& !(state->dependencies & (kDependOutput | kDependOutputIndex
+					| kDependSrcIndex | kDependPlugin | kDependContext)))
+		{
+			key.lookbehind = key.lookbehindLen > 0
+					? *buf + entry.outputLen - key.lookbehindLen : NULL;	// buf may have moved
+			storeBlockCacheEntry(cache, &key, state, *buf + entry.outputLen, recorder);
 		}
 	}
 	
-	// end: flush pending constructs
-	switch (state)
+	// null byte after output
+	return growSinkBuffer(sink, buf, bufSize, state->outputLen + 1);
+}
+
+NMEInt NMEBlockCacheEvictLRU(NMEBlockCacheEntryInfo const entries[],
+		NMEInt count,
+		void *data)
+{
+	NMEInt i, k;
+	(void)data;
+	
+	for (i = 1, k = 0; i < count; i++)
+		if (entries[i].lastUse < entries[k].lastUse)
+			k = i;
+	return k;
+}
+
+NMEInt NMEBlockCacheEvictLFU(NMEBlockCacheEntryInfo const entries[],
+		NMEInt count,
+		void *data)
+{
+	NMEInt i, k;
+	(void)data;
+	
+	for (i = 1, k = 0; i < count; i++)
+		if (entries[i].hits < entries[k].hits
+				|| entries[i].hits == entries[k].hits
+					&& entries[i].lastUse < entries[k].lastUse)
+			k = i;
+	return k;
+}
+
+void NMEBlockCacheBegin(NMEBlockCache *cache,
+		NMEInt maxSize,
+		NMEBlockCacheEvictFun evictFun,
+		void *evictData,
+		NMEOutputSink const *sink)
+{
+	cache->sink.growFun = sink->growFun;
+	cache->sink.flushFun = NULL;
+	cache->sink.data = sink->data;
+	cache->maxSize = maxSize;
+	cache->evictFun = evictFun ? evictFun : NMEBlockCacheEvictLRU;
+	cache->evictData = evictData;
+	cache->entries = cache->info = cache->table = NULL;
+	cache->entriesSize = cache->infoSize = cache->tableSize = 0;
+	cache->tableSlots = 0;
+	cache->count = 0;
+	cache->size = 0;
+	cache->clock = 0;
+}
+
+void NMEBlockCacheEnd(NMEBlockCache *cache)
+{
+	while (cache->count > 0)
+		removeBlockCacheEntry(cache, cache->count - 1);
+	if (cache->entries)
+		(void)cache->sink.growFun(&cache->entries, &cache->entriesSize, 0,
+				cache->sink.data);
+	if (cache->info)
+		(void)cache->sink.growFun(&cache->info, &cache->infoSize, 0, cache->sink.data);
+	if (cache->table)
+		(void)cache->sink.growFun(&cache->table, &cache->tableSize, 0, cache->sink.data);
+	cache->entries = cache->info = cache->table = NULL;
+	cache->entriesSize = cache->infoSize = cache->tableSize = 0;
+	cache->tableSlots = 0;
+}
+
+NMEErr NMEMakeInterwikiTrie(NMEInterwikiTrie *trie,
+		NMEInterwiki const *interwikis,
+		NMEOutputSink const *sink)
+{
+	InterwikiTrieEdge *edges;
+	NMEInt *nodes;
+	NMEInt i, iw, n, node, nodeCount, slot;
+	NMEErr err;
+	
+	trie->interwikis = interwikis;
+	trie->sink = *sink;
+	trie->nodes = trie->edges = NULL;
+	trie->nodesSize = trie->edgesSize = 0;
+	
+	// at most one node per char of aliases, and edge table at most half full
+	for (iw = n = 0; interwikis[iw].alias; iw++)
+		for (i = 0; interwikis[iw].alias[i]; i++)
+			n++;
+	for (trie->edgeSlots = 16; trie->edgeSlots < 2 * n; trie->edgeSlots *= 2)
+		;
+	err = growSinkBuffer(sink, &trie->nodes, &trie->nodesSize,
+			(n + 1) * (NMEInt)sizeof(NMEInt));
+	if (err == kNMEErrOk)
+		err = growSinkBuffer(sink, &trie->edges, &trie->edgesSize,
+				trie->edgeSlots * (NMEInt)sizeof(InterwikiTrieEdge));
+	if (err != kNMEErrOk)
 	{
-		case kNMEStatePar:
-		case kNMEStateParAfterEol:
-			CheckError(flushStyleTags(styleStack, &styleNesting,
-					i0,
-					outputFormat, &context));
-			CheckError(addEndPar(TRUE, outputFormat, &context));
-			break;
-		case kNMEStatePre:
-			if (!NMEAddString(outputFormat->endPre, -1,
-					context.ctrlChar, &context))
-				return kNMEErrNotEnoughMemory;
-			HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "{{{");
-			break;
-		case kNMEStateHeading:
-			context.level = headingLevel;
-			CheckError(flushStyleTags(styleStack, &styleNesting,
-					i0,
-					outputFormat, &context));
-			if (!NMEAddString(outputFormat->endHeading, -1,
-							context.ctrlChar, &context))
-				return kNMEErrNotEnoughMemory;
-			CheckError(checkWordwrap(&context, outputFormat));
-			HOOK(parHookFun, context.level, 0, FALSE, "=");
-			context.level = 0;
-			break;
-		default:
-			break;
+		NMEInterwikiTrieEnd(trie);
+		return err;
 	}
+	nodes = (NMEInt *)trie->nodes;
+	edges = (InterwikiTrieEdge *)trie->edges;
+	for (i = 0; i < trie->edgeSlots; i++)
+		edges[i].parent = -1;
 	
-	// end of doc
-	if (!(options & kNMEProcessOptNoPreAndPost)
-			&& !NMEAddString(outputFormat->endDoc, -1,
-					context.ctrlChar, &context))
-		return kNMEErrNotEnoughMemory;
-	if (context.destLen + 1 >= context.bufSize)
-		return kNMEErrNotEnoughMemory;
-	context.dest[context.destLen] = '\0';
+	// add aliases, keeping the first interwiki of duplicates
+	nodes[0] = -1;
+	nodeCount = 1;
+	for (iw = 0; interwikis[iw].alias; iw++)
+	{
+		for (i = node = 0; interwikis[iw].alias[i]; i++)
+		{
+			slot = findInterwikiTrieEdge(edges, trie->edgeSlots,
+					node, interwikis[iw].alias[i]);
+			if (edges[slot].parent < 0)
+			{
+				edges[slot].parent = node;
+				edges[slot].ch = interwikis[iw].alias[i];
+				edges[slot].child = nodeCount;
+				nodes[nodeCount++] = -1;
+			}
+			node = edges[slot].child;
+		}
+		if (nodes[node] < 0)
+			nodes[node] = iw;
+	}
 	
-	// set result
-	*output = context.dest;
-	*outputLen = context.destLen;
+	return kNMEErrOk;
+}
+
+void NMEInterwikiTrieEnd(NMEInterwikiTrie *trie)
+{
+	if (trie->nodes)
+		(void)trie->sink.growFun(&trie->nodes, &trie->nodesSize, 0, trie->sink.data);
+	if (trie->edges)
+		(void)trie->sink.growFun(&trie->edges, &trie->edgesSize, 0, trie->sink.data);
+	trie->nodes = trie->edges = NULL;
+	trie->nodesSize = trie->edgesSize = 0;
+}
+
+NMEErr NMEProcessCached(NMEBlockCache *cache,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText *buf, NMEInt *bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEOutputFormat recordFormat;
+	BlockCacheRecorder recorder;
+	NMEOutputSink outputSink;
+	NMESegmentState state;
+	NMEText scratch = NULL;
+	NMEInt scratchSize = 0;
+	NMEErr err, err1;
+	
+	if (!outputFormat)
+		outputFormat = &NMEOutputFormatText;
+	if (!cache || outputFormat->charHookFun)
+		return NMEProcessToSink(nmeText, nmeTextLen, buf, bufSize,
+				options, eol, outputFormat, fontSize,
+				sink, output, outputLen, outputUCS16Len);
+	
+	// output is kept in buf to be stored in the cache
+	outputSink.growFun = sink->growFun;
+	outputSink.flushFun = NULL;
+	outputSink.data = sink->data;
+	
+	// hooks are recorded to be called again when output is reused
+	recorder.outputFormat = outputFormat;
+	recorder.sink = &outputSink;
+	recorder.hooks = NULL;
+	recorder.hooksSize = 0;
+	recordFormat = *outputFormat;
+	if (outputFormat->divHookFun)
+		recordFormat.divHookFun = divHookRecord;
+	if (outputFormat->parHookFun)
+		recordFormat.parHookFun = parHookRecord;
+	if (outputFormat->spanHookFun)
+		recordFormat.spanHookFun = spanHookRecord;
+	recordFormat.hookData = (void *)&recorder;
+	
+	err = convertCached(cache, nmeText, nmeTextLen,
+			options, eol, outputFormat, &recordFormat, fontSize,
+			&outputSink, buf, bufSize, &scratch, &scratchSize,
+			&recorder, &state);
+	
+	if (scratch)
+	{
+		err1 = sink->growFun(&scratch, &scratchSize, 0, sink->data);
+		if (err == kNMEErrOk)
+			err = err1;
+	}
+	if (recorder.hooks)
+		(void)sink->growFun(&recorder.hooks, &recorder.hooksSize, 0, sink->data);
+	if (err != kNMEErrOk)
+		return err;
+	
+	(*buf)[state.outputLen] = '\0';
+	*output = *buf;
+	*outputLen = state.outputLen;
 	if (outputUCS16Len)
-		*outputUCS16Len = context.destLenUCS16;
+		*outputUCS16Len = state.outputUCS16Len;
 	return kNMEErrOk;
 }
 
+NMEBoolean NMEAddDeferred(NMEDeferredFun fun,
+		NMEInt id,
+		void *data,
+		NMEContext *context)
+{
+	NMEDeferredSlot *slot;
+	
+	if (context->deferredCount >= kMaxDeferred)
+		return FALSE;
+	addDependency(context, kDependPlugin);
+	slot = &context->deferred[context->deferredCount++];
+	slot->outputIndex = context->destOffset + context->destLen;
+	slot->fun = fun;
+	slot->id = id;
+	slot->data = data;
+	return TRUE;
+}
+
 void NMEGetTempMemory(NMEContext const *context,
 		NMEText *addr,
 		NMEInt *len)
 {
-	*addr = context->src + context->srcLen;
-	*len = context->bufSize - context->srcLen;
+	addDependency(context, kDependContext);
+	if (context->sink)
+	{
+		// upper half of free space in dest
+		*addr = context->dest + (context->bufSize + context->destLen) / 2;
+		*len = context->dest + context->bufSize - *addr;
+	}
+	else
+	{
+		*addr = context->src + context->srcLen;
+		*len = context->bufSize - context->srcLen;
+	}
 }
 
 void NMEGetFormat(NMEContext const *context,
@@ -3803,17 +7868,78 @@ void NMEGetFormat(NMEContext const *context,
 
 NMEInt NMECurrentOutputIndex(NMEContext const *context)
 {
-	return context->destLen;
+	addDependency(context, kDependIndexQuery);
+	return context->destOffset + context->destLen;
 }
 
 NMEInt NMECurrentOutputIndexUCS16(NMEContext const *context)
 {
-	return context->destLenUCS16;
+	addDependency(context, kDependIndexQuery);
+	// only the count cache is updated
+	return outputIndexUCS16((NMEContext *)context);
+}
+
+NMEInt NMEIndexUCS16(NMEConstText str, NMEInt index, NMEBoolean *valid)
+{
+	NMEInt i, k, n;
+	unsigned char c, min, max;
+	
+	if (valid)
+	{
+		*valid = TRUE;
+		for (i = 0; i < index; i++)
+		{
+			c = (unsigned char)str[i];
+			if (c < 0x80)
+				continue;
+			// number of continuation bytes and range of the first one
+			// (overlong forms, surrogates and codes above 0x10ffff are invalid)
+			min = 0x80;
+			max = 0xbf;
+			if (c >= 0xc2 && c <= 0xdf)
+				n = 1;
+			else if (c >= 0xe0 && c <= 0xef)
+			{
+				n = 2;
+				if (c == 0xe0)
+					min = 0xa0;
+				else if (c == 0xed)
+					max = 0x9f;
+			}
+			else if (c >= 0xf0 && c <= 0xf4)
+			{
+				n = 3;
+				if (c == 0xf0)
+					min = 0x90;
+				else if (c == 0xf4)
+					max = 0x8f;
+			}
+			else
+			{
+				*valid = FALSE;
+				break;
+			}
+			for (k = 1; k <= n; k++)
+				if (i + k >= index
+						|| (unsigned char)str[i + k] < (k == 1 ? min : 0x80)
+						|| (unsigned char)str[i + k] > (k == 1 ? max : 0xbf))
+					break;
+			if (k <= n)
+			{
+				*valid = FALSE;
+				break;
+			}
+			i += n;
+		}
+	}
+	
+	return countUCS16(str, index);
 }
 
 void NMECurrentLink(NMEContext const *context,
 		NMEInt *linkOffset, NMEInt *linkLength)
 {
+	addDependency(context, kDependContext);
 	*linkOffset = context->srcIndexOffset + context->linkOffset;
 	*linkLength = context->linkLength;
 }
@@ -3821,22 +7947,30 @@ void NMECurrentLink(NMEContext const *context,
 void NMECurrentOutput(NMEContext const *context,
 		NMEConstText *output, NMEInt *outputLength)
 {
+	addDependency(context, kDependContext);
 	if (output)
 		*output = context->dest;
 	if (outputLength)
 		*outputLength = context->destLen;
 }
 
+NMEOutputSink const *NMEGetOutputSink(NMEContext const *context)
+{
+	addDependency(context, kDependContext);
+	// sinks with fixed memory can't grow other buffers
+	return context->sink && context->sink->growFun != fixedSinkGrow
+			? context->sink : NULL;
+}
+
 NMEConstText NMECurrentListNesting(NMEContext const *context)
 {
+	// string is stored in the context to be reentrant
+	NMEText str = ((NMEContext *)context)->listNesting;
 	NMEInt i;
-	static NMEChar str[kMaxNesting + 1];
 	
+	addDependency(context, kDependContext);
 	for (i = 0; i < context->level; i++)
-		str[i] = context->listNum[i] == kNMEListNumUL ? '*'
-				: context->listNum[i] == kNMEListNumDT ? ';'
-				: context->listNum[i] == kNMEListNumDD ? ':'
-				: context->listNum[i] == kNMEListIndented ? ':' : '#';
+		str[i] = listNestingChar(context, i);
 	str[i] = '\0';
 	return str;
 }
@@ -77,7 +77,8 @@
  *			&output, &outputLength);
  *		if (err == kNMEErrNotEnoughMemory)	// unlikely
  *		{
- *			(increase size)
+ *			(set size to outputLength (required size) if it isn't 0,
+ *				else increase it)
  *			(realloc buf)
  *		}
  *		else
@@ -90,6 +91,56 @@
  *	free(buf);
  *	@endcode
  *
+ *	Alternatively, NMEProcessToSink lets NME grow its buffers itself with
+ *	a realloc-like callback and optionally pass the output by chunks of
+ *	complete lines to a flush callback, so that no retry loop is needed:
+ *
+ *	@code
+ *	static NMEErr grow(NMEText *buf, NMEInt *size, NMEInt minSize, void *data)
+ *	{
+ *		NMEText b;
+ *		if (minSize == 0)
+ *		{
+ *			free(*buf);
+ *			*buf = NULL;
+ *			*size = 0;
+ *			return kNMEErrOk;
+ *		}
+ *		b = realloc(*buf, minSize);
+ *		if (!b)
+ *			return kNMEErrNotEnoughMemory;
+ *		*buf = b;
+ *		*size = minSize;
+ *		return kNMEErrOk;
+ *	}
+ *
+ *	static NMEErr flush(NMEConstText output, NMEInt outputLen, void *data)
+ *	{
+ *		fwrite(output, 1, outputLen, (FILE *)data);
+ *		return kNMEErrOk;
+ *	}
+ *
+ *	NMEOutputSink sink = {grow, flush, stdout};
+ *	NMEText buf = NULL;
+ *	NMEInt size = 0;
+ *	err = NMEProcessToSink(input, inputLength,
+ *			&buf, &size,
+ *			kNMEProcessOptDefault, "\n", &NMEOutputFormatHTML, 0,
+ *			&sink, &output, &outputLength, NULL);
+ *	grow(&buf, &size, 0, NULL);
+ *	@endcode
+ *
+ *	@section Threads Thread safety
+ *
+ *	NME has no global or static state: everything specific to a conversion
+ *	is in its NMEContext or in memory provided by the caller. Different
+ *	conversions can run at the same time in different threads, provided
+ *	that they don't share buffers, sinks or user data of hooks, plugins and
+ *	autoconverts which are modified. Output formats (including their
+ *	NMECompiledOutputFormat once NMECompileOutputFormat has returned),
+ *	plugin and interwiki tables (including NMEInterwikiTrie) are only read
+ *	during conversions and can be shared.
+ *
  *	@section Security Security
  *
  *	Inline images are subject to cross site scripting if links to
@@ -185,6 +236,9 @@ typedef enum
 	kNMEErr1stUser = 10000	///< first error code reserved to user for plugins etc.
 } NMEErr;
 
+/// Maximum number of numbered heading levels
+#define kNMEMaxNumberedHeadingLevels 2
+
 /// Options for NMEProcess (change the way input is parsed)
 enum
 {
@@ -216,6 +270,14 @@ enum
 */
 typedef struct NMEContextStruct NMEContext;
 
+/** Output format strings precompiled by NMECompileOutputFormat
+*/
+typedef struct NMECompiledOutputFormatStruct NMECompiledOutputFormat;
+
+/** Interwikis indexed by NMEMakeInterwikiTrie
+*/
+typedef struct NMEInterwikiTrieStruct NMEInterwikiTrie;
+
 /** Callback to encode a single character (typically UTF-8)
 	@param[in] src input characters
 	@param[in] srcLen size of src in bytes
@@ -230,6 +292,23 @@ typedef NMEErr (*NMEEncodeCharFun)(NMEConstText src, NMEInt srcLen, NMEInt *srcI
 		NMEContext *context,
 		void *data);
 
+/** Callback to encode a run of characters, with the same result as the
+	corresponding NMEEncodeCharFun called for each character. Runs are parts
+	of text without markup; in preformatted blocks, they may contain spaces.
+	@param[in] src input characters
+	@param[in] srcLen size of src in bytes
+	@param[in,out] srcIx index in src (should be updated to runEnd, or after it
+	if the last character is longer)
+	@param[in] runEnd index in src of the end of the run
+	@param[in,out] context current context
+	@param[in,out] data value specific to the callback (same as for NMEEncodeCharFun)
+	@return error code (kNMEErrOk for success)
+*/
+typedef NMEErr (*NMEEncodeRunFun)(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
+		NMEInt runEnd,
+		NMEContext *context,
+		void *data);
+
 /// Wordwrap permission
 typedef enum
 {
@@ -245,6 +324,8 @@ typedef enum
 	push to next line)
 	@param[in,out] data value specific to the callback
 	@return wordwrap kind (kNMEWordwrapNo if not permitted here)
+	@note The result should depend only on txt[0..i+1], because wordwrap
+	points are checked once, as soon as the next character is written.
 */
 typedef NMEWordwrapPermission (*NMEWordwrapCheckFun)(NMEConstText txt,
 		NMEInt len, NMEInt i,
@@ -302,6 +383,21 @@ typedef NMEErr (*NMEProcessHookFun)(NMEInt level,
 		NMEContext *context,
 		void *data);
 
+/** Callback which fills a slot reserved with NMEAddDeferred, when the rest
+	of the document has been converted; typically used with data collected
+	by hooks. Output is added with NMEAddString; with an output sink which
+	has a flush callback, it's passed to it in order without moving the
+	output which follows the slot, else it's moved once to the slot (this
+	requires temporary memory for a copy of the output of all callbacks).
+	@param[in] id value passed to NMEAddDeferred
+	@param[in,out] context current context
+	@param[in,out] data value passed to NMEAddDeferred
+	@return error code (kNMEErrOk for success)
+*/
+typedef NMEErr (*NMEDeferredFun)(NMEInt id,
+		NMEContext *context,
+		void *data);
+
 /** Callback for plugins
 	@param[in] name plugin identifier, such as "calendar"
 	@param[in] nameLen length of name
@@ -361,13 +457,36 @@ typedef NMEBoolean (*NMEAutoconvertFun)(NMEConstText src, NMEInt srcLen,
 		NMEContext *context,
 		void *userData);
 
+/** Function which finds where an autoconvert can match, so that plain text
+	can be copied at once up to there.
+	@param[in] src source text with markup
+	@param[in] srcLen source text length
+	@param[in] i index in src where to begin
+	@param[in] userData pointer passed from the parser, as specified in NMEAutoconvert
+	@return first index >= i where the callback of the autoconvert can return
+	TRUE (it may return FALSE there), or srcLen if there is none
+*/
+typedef NMEInt (*NMEAutoconvertScanFun)(NMEConstText src, NMEInt srcLen,
+		NMEInt i,
+		void *userData);
+
 /// Structure for autoconvert
 typedef struct
 {
 	NMEAutoconvertFun cb;	///< callback
 	void *userData;	///< pointer passed to cb
+	NMEConstText triggers;	/**< null-terminated string of the characters
+		where cb can match, so that it's called only there and at the
+		beginning of the source (NULL to call it everywhere) */
+	NMEAutoconvertScanFun scan;	/**< function which finds where cb can
+		match, used instead of triggers by the first kNMEMaxScannedAutoconverts
+		autoconverts (NULL to use triggers) */
+	NMEBoolean notInLinks;	/**< TRUE if cb isn't called in the text of
+		links and images, e.g. because its output is a link itself */
 } NMEAutoconvert;
 
+#define kNMEMaxScannedAutoconverts 16	///< number of autoconverts whose scan can be used
+
 /**	Callback for application-specific variables with uppercase name
 	@param[in] name variable name ('A'-'Z')
 	@param[in] userData pointer passed to the function,
@@ -376,8 +495,8 @@ typedef struct
 */
 typedef NMEInt (*NMEGetVarFun)(NMEChar name, void *userData);
 
-/// End-of-table marker for table of interwikis
-#define NMEAutoconvertTableEnd {NULL, NULL}
+/// End-of-table marker for table of autoconverts
+#define NMEAutoconvertTableEnd {NULL, NULL, NULL, NULL, FALSE}
 
 /// Structure for interwiki
 typedef struct
@@ -421,8 +540,8 @@ typedef struct
 	- s font size of normal text in points (nonpositive values should be
 	  considered as the default value, but they can be filtered out if the
 	  defFontSize field of NMEOutputFormat is positive)
-	- o current offset in source code (can be used as a unique identifier for
-	  hyperlinks)
+	- o current offset in original source code (can be used as a unique
+	  identifier for hyperlinks)
 	- p current offset in output
 	
 	Operators by increasing priority:
@@ -529,6 +648,14 @@ typedef struct
 	NMEAutoconvert const *autoconverts;	///< array of autoconverts, terminated by cb=NULL (NULL if none)
 	NMEGetVarFun getVarFun;	///< function which gets custom variable values ('A'-'Z') in expressions
 	void *getVarData;	///< data passed to getVarFun
+	NMEEncodeRunFun encodeRunFun;	/**< run encoder matching encodeCharFun, called
+		with encodeCharData (NULL if none; must be reset if encodeCharFun is changed) */
+	NMEEncodeRunFun encodeRunPreFun;	/**< run encoder matching encodeCharPreFun, called
+		with encodeCharPreData (NULL if none; must be reset if encodeCharPreFun is changed) */
+	NMECompiledOutputFormat const *compiled;	/**< precompiled format strings
+		(NULL if none; set by NMECompileOutputFormat) */
+	NMEInterwikiTrie const *interwikiTrie;	/**< interwikis indexed by
+		NMEMakeInterwikiTrie, used if made from interwikis (NULL if none) */
 } NMEOutputFormat;
 
 /** Structure for elements of table used by NMEEncodeCharFunDict.
@@ -556,6 +683,56 @@ typedef struct
 NMEErr NMEEncodeCharFunDict(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 		NMEContext *context, void *data);
 
+/** Table of character substitutions used by NMEEncodeCharFunTable, indexed
+	by character code (as unsigned char). Typically initialized statically
+	with the entries up to the last substituted character (the remaining
+	ones are NULL), or with NMEMakeEncodeCharTable.
+	@see NMEEncodeCharFunTable
+*/
+typedef struct
+{
+	NMEConstText str[256];	///< replacement string, or NULL to copy character
+} NMEEncodeCharTable;
+
+/** Make a table of character substitutions from a NMEEncodeCharDict array.
+	@param[in] dict substitution array ending with {0,NULL}
+	@param[out] table substitution table
+*/
+void NMEMakeEncodeCharTable(NMEEncodeCharDict const *dict,
+		NMEEncodeCharTable *table);
+
+/** NMEEncodeCharFun function which replaces characters with strings found
+	in a table in constant time. It gives the same result as
+	NMEEncodeCharFunDict, but should be preferred. Its address should be stored
+	in the encodeCharFun field of NMEOutputFormat, while the address of a
+	table of type NMEEncodeCharTable should be stored in the encodeCharData field.
+	@param[in] src input characters
+	@param[in] srcLen size of src in bytes
+	@param[in,out] srcIx index in src (updated by one character)
+	@param[in,out] context context for embedded expressions
+	@param[in,out] data address of substitution table, of type NMEEncodeCharTable
+	@return error code (kNMEErrOk for success)
+	@see NMEOutputFormat
+*/
+NMEErr NMEEncodeCharFunTable(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
+		NMEContext *context, void *data);
+
+/** NMEEncodeRunFun function matching NMEEncodeCharFunTable, which copies
+	spans of characters without substitution at once. Its address should be
+	stored in the encodeRunFun field of NMEOutputFormat.
+	@param[in] src input characters
+	@param[in] srcLen size of src in bytes
+	@param[in,out] srcIx index in src (updated to runEnd)
+	@param[in] runEnd index in src of the end of the run
+	@param[in,out] context context for embedded expressions
+	@param[in,out] data address of substitution table, of type NMEEncodeCharTable
+	@return error code (kNMEErrOk for success)
+	@see NMEOutputFormat
+*/
+NMEErr NMEEncodeRunFunTable(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
+		NMEInt runEnd,
+		NMEContext *context, void *data);
+
 /// Format strings for plain text output
 extern NMEOutputFormat const NMEOutputFormatText;
 
@@ -583,6 +760,65 @@ extern NMEOutputFormat const NMEOutputFormatLaTeX;
 */
 extern NMEOutputFormat const NMEOutputFormatMan;
 
+#define kNMECompiledFormatSlots 128	///< max. number of strings in NMECompiledOutputFormat
+#define kNMECompiledFormatCodeSize 4096	///< size of code in NMECompiledOutputFormat
+#define kNMECompiledPluginSlots 1024	/**< size of hash table of plugin names in
+	NMECompiledOutputFormat (max. number of plugins: half of it) */
+#define kNMECompiledPluginNodes 512	/**< max. number of nodes for partial plugin
+	names in NMECompiledOutputFormat */
+
+/** Precompiled output format (opaque, typically allocated as a static
+	variable and initialized with NMECompileOutputFormat)
+*/
+struct NMECompiledOutputFormatStruct
+{
+	NMEChar ctrlChar;	///< private
+	NMEInt fontSize;	///< private
+	NMEBoolean xref;	///< private
+	struct
+	{
+		NMEConstText str;	///< private
+		NMEInt code;	///< private
+	} slot[kNMECompiledFormatSlots];	///< private
+	NMEInt codeLen;	///< private
+	NMEInt code[kNMECompiledFormatCodeSize];	///< private
+	NMEPlugin const *plugins;	///< private
+	NMEInt pluginSlot[kNMECompiledPluginSlots];	///< private
+	struct
+	{
+		NMEChar ch;	///< private
+		NMEInt child;	///< private
+		NMEInt next;	///< private
+		NMEInt plugin;	///< private
+	} pluginNode[kNMECompiledPluginNodes];	///< private
+	NMEInt pluginNodeCount;	///< private
+};
+
+/** Compile the format strings of an output format, so that NMEProcess and
+	NMEAddString don't have to parse them again each time they are output.
+	Literal text is copied as a whole, expressions are stored in postfix order,
+	and parameters s and x are replaced with their value. Strings are
+	identified by their address: format strings which are modified afterwards
+	are interpreted as usual. Compiled strings are used only when fontSize and
+	options match those of the conversion. The table of plugins is indexed
+	by name (hash table for names, trie for partial names), as long as
+	field plugins isn't changed; if it's too large, plugins are searched
+	linearly.
+	@param[in,out] outputFormat format strings (field compiled is set to
+	compiled, or to NULL if an error occurs)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default),
+	as passed to NMEProcess
+	@param[in] options kNMEProcessOptDefault or sum of options, as passed to NMEProcess
+	@param[out] compiled compiled format strings (must remain valid as long as
+	outputFormat is used)
+	@return error code (kNMEErrOk for success, or kNMEErrNotEnoughMemory if
+	format strings are too large)
+*/
+NMEErr NMECompileOutputFormat(NMEOutputFormat *outputFormat,
+		NMEInt fontSize,
+		NMEInt options,
+		NMECompiledOutputFormat *compiled);
+
 /** Transform text by interpreting markup.
 	This is the main and only required extern function of the parser.
 	@param[in] nmeText source text with markup
@@ -595,10 +831,18 @@ extern NMEOutputFormat const NMEOutputFormatMan;
 	(NMEOutputFormatText)
 	@param[in] fontSize font size of plain text in points (nonpositive -> default)
 	@param[out] output formatted text (in buf), followed by null byte
-	@param[out] outputLen formatted text length, excluding final null byte
+	@param[out] outputLen formatted text length, excluding final null byte;
+	or, if kNMEErrNotEnoughMemory is returned, size of buf required for the
+	conversion (like snprintf), or 0 if it could not be determined
 	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
-	assuming input is in UTF-8,	excluding final null byte (may be NULL)
+	assuming input is in UTF-8,	excluding final null byte (may be NULL; it's
+	counted only if requested)
 	@return error code (kNMEErrOk for success)
+	@note To find the required size when buf is too small, text is converted
+	again without storing output, with buf as working memory; hooks and
+	plugins are called again. The size doesn't depend on bufSize, and a
+	retry with it succeeds, but it doesn't take into account the
+	temporary memory of plugins (see NMEGetTempMemory).
 	@bug Links are copied verbatim, without processing the escape character
 	(this means that pipes and double-closing-brackets cannot be included
 	in a link).
@@ -613,6 +857,534 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 		NMEInt *outputLen,
 		NMEInt *outputUCS16Len);
 
+/** Transform text by interpreting markup, like NMEProcess, but reading
+	nmeText in place and writing output to a separate buffer. Source text is
+	copied to scratch only when plugin (kNMEPluginOptReparseOutput) or
+	autoconvert output must be parsed again.
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen source text length
+	@param[out] buf buffer for output
+	@param[in] bufSize size of buf
+	@param[out] scratch buffer for reparsing, which must hold the remaining
+	source text and the text to be reparsed (can be NULL if the output format
+	has neither plugins nor autoconverts which reparse their output)
+	@param[in] scratchSize size of scratch
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[out] output formatted text (in buf), followed by null byte
+	@param[out] outputLen formatted text length, excluding final null byte
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
+	assuming input is in UTF-8,	excluding final null byte (may be NULL)
+	@return error code (kNMEErrOk for success, kNMEErrNotEnoughMemory if
+	buf or scratch is too small)
+	@see NMEProcess
+*/
+NMEErr NMEProcessInPlace(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText buf, NMEInt bufSize,
+		NMEText scratch, NMEInt scratchSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Function which grows (or releases) a buffer used by NMEProcessToSink,
+	with the semantics of realloc. It may be called for different buffers.
+	@param[in,out] buf address of buffer (NULL if not allocated yet)
+	@param[in,out] bufSize address of size of buffer in bytes
+	@param[in] minSize new minimum size in bytes, or 0 to release buffer
+	@param[in] data user data (NMEOutputSink's data field)
+	@return error code (kNMEErrOk for success)
+*/
+typedef NMEErr (*NMESinkGrowFun)(NMEText *buf,
+		NMEInt *bufSize,
+		NMEInt minSize,
+		void *data);
+
+/** Function which receives a chunk of output from NMEProcessToSink.
+	@param[in] output chunk of output (complete lines, except for the last chunk)
+	@param[in] outputLen length of output in bytes
+	@param[in] data user data (NMEOutputSink's data field)
+	@return error code (kNMEErrOk for success)
+*/
+typedef NMEErr (*NMESinkFlushFun)(NMEConstText output,
+		NMEInt outputLen,
+		void *data);
+
+/// Output sink for NMEProcessToSink
+typedef struct
+{
+	NMESinkGrowFun growFun;	///< function called to grow buffers (required)
+	NMESinkFlushFun flushFun;	///< function called to flush output (NULL to keep it in buffer)
+	void *data;	///< user data passed to growFun and flushFun
+} NMEOutputSink;
+
+/** Transform text by interpreting markup, with buffers which are grown as
+	needed and output which can be flushed by chunks.
+	@param[in] nmeText source text with markup (not modified, must remain
+	valid during the whole conversion)
+	@param[in] nmeTextLen source text length
+	@param[in,out] buf address of buffer (may be NULL), grown by sink->growFun;
+	must be released by the caller with sink->growFun
+	@param[in,out] bufSize address of size of buf
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] sink output sink
+	@param[out] output formatted text (in *buf), followed by null byte, if
+	sink->flushFun is NULL; undefined otherwise
+	@param[out] outputLen total formatted text length, excluding final null byte
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
+	assuming input is in UTF-8,	excluding final null byte (may be NULL)
+	@return error code (kNMEErrOk for success)
+	@see NMEProcess
+*/
+NMEErr NMEProcessToSink(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText *buf, NMEInt *bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Interwikis indexed for lookup in a time proportional to the length of
+	links (opaque, initialized with NMEMakeInterwikiTrie and released with
+	NMEInterwikiTrieEnd; only read during conversions)
+*/
+struct NMEInterwikiTrieStruct
+{
+	NMEInterwiki const *interwikis;	///< private
+	NMEOutputSink sink;	///< private
+	NMEText nodes;	///< private
+	NMEInt nodesSize;	///< private
+	NMEText edges;	///< private
+	NMEInt edgesSize;	///< private
+	NMEInt edgeSlots;	///< private
+};
+
+/** Index a table of interwikis in a trie of their aliases. When an output
+	format's field interwikiTrie is set to trie and its field interwikis to
+	the same table, the first interwiki (in table order) whose alias begins
+	a link is found in a time proportional to the length of the link
+	instead of the size of the table.
+	@param[out] trie interwiki trie
+	@param[in] interwikis array of interwikis, terminated by alias=NULL
+	(must remain valid as long as trie is used)
+	@param[in] sink output sink whose growFun allocates memory (flushFun is
+	ignored)
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEMakeInterwikiTrie(NMEInterwikiTrie *trie,
+		NMEInterwiki const *interwikis,
+		NMEOutputSink const *sink);
+
+/** Release the memory of an interwiki trie.
+	@param[in,out] trie interwiki trie
+*/
+void NMEInterwikiTrieEnd(NMEInterwikiTrie *trie);
+
+/** State carried between consecutive segments of a document split at
+	block boundaries (opaque, used by NMEStream, NMEProcessParallel and
+	NMEIncremental)
+*/
+typedef struct
+{
+	NMEInt srcOffset;	///< private
+	NMEInt outputLen;	///< private
+	NMEInt outputUCS16Len;	///< private
+	NMEInt keptLen;	///< private
+	NMEInt col;	///< private
+	NMEInt headingNum[kNMEMaxNumberedHeadingLevels];	///< private
+	NMEInt headingFlags;	///< private
+	NMEInt headingLevel;	///< private
+	NMEBoolean begun;	///< private
+	NMEBoolean last;	///< private
+	NMEInt dependencies;	///< private
+} NMESegmentState;
+
+/** Streaming conversion (opaque, typically allocated as an automatic (local)
+	variable and passed by address to NMEStreamBegin, NMEStreamFeed and
+	NMEStreamEnd)
+*/
+typedef struct
+{
+	NMEText *buf;	///< private
+	NMEInt *bufSize;	///< private
+	NMEInt options;	///< private
+	NMEConstText eol;	///< private
+	NMEOutputFormat const *outputFormat;	///< private
+	NMEInt fontSize;	///< private
+	NMEOutputSink const *sink;	///< private
+	NMEText input;	///< private
+	NMEInt inputLen;	///< private
+	NMEInt inputSize;	///< private
+	NMEText scratch;	///< private
+	NMEInt scratchSize;	///< private
+	NMEText line;	///< private
+	NMEInt lineSize;	///< private
+	NMEInt scanIndex;	///< private
+	NMEInt scanLineEnd;	///< private
+	NMEInt blockEnd;	///< private
+	NMEBoolean inPre;	///< private
+	NMEInt plugin;	///< private
+	NMEErr err;	///< private
+	NMESegmentState segment;	///< private
+} NMEStream;
+
+/** Begin a streaming conversion, where input is provided by chunks of any size
+	with NMEStreamFeed and output is produced as soon as complete blocks
+	(paragraphs, lists, tables, preformatted blocks etc. followed by an empty
+	line) have been received. With a sink which has a flush function, memory
+	is proportional to the largest block, not to the whole document.
+	Arguments are the same as for NMEProcessToSink; they must remain valid
+	until NMEStreamEnd.
+	@param[out] stream stream state
+	@param[in,out] buf address of output buffer (may be NULL), grown by sink->growFun;
+	must be released by the caller with sink->growFun
+	@param[in,out] bufSize address of size of buf
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] sink output sink
+	@return error code (kNMEErrOk for success)
+	@note Plugins receive only the current block as source text (this matters
+	e.g. for NMEPluginTOC).
+*/
+NMEErr NMEStreamBegin(NMEStream *stream,
+		NMEText *buf, NMEInt *bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink);
+
+/** Feed a chunk of input to a streaming conversion. After an error, the
+	stream should only be ended with NMEStreamEnd.
+	@param[in,out] stream stream state
+	@param[in] input chunk of source text with markup (can be discarded after
+	the call)
+	@param[in] inputLen length of input in bytes
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEStreamFeed(NMEStream *stream,
+		NMEConstText input, NMEInt inputLen);
+
+/** End a streaming conversion, converting all remaining input and
+	releasing memory (except for the output buffer).
+	@param[in,out] stream stream state
+	@param[out] output formatted text (in *buf), followed by null byte, if
+	sink->flushFun is NULL; undefined otherwise (not set if NULL)
+	@param[out] outputLen total formatted text length (not set if NULL)
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode
+	characters (not set if NULL)
+	@return error code (kNMEErrOk for success, or error of previous calls)
+*/
+NMEErr NMEStreamEnd(NMEStream *stream,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Job function called by NMERunJobsFun.
+	@param[in] job index of job (0 to jobCount-1)
+	@param[in,out] jobData data passed to NMERunJobsFun
+*/
+typedef void (*NMEJobFun)(NMEInt job, void *jobData);
+
+/** Function which runs jobs, typically on a pool of threads, and returns
+	when all of them are done.
+	@param[in] jobCount number of jobs
+	@param[in] jobFun function to call once for each job, in any order
+	and from any thread
+	@param[in,out] jobData data to pass to jobFun
+	@param[in,out] data user data
+	@return error code (kNMEErrOk for success)
+*/
+typedef NMEErr (*NMERunJobsFun)(NMEInt jobCount,
+		NMEJobFun jobFun, void *jobData,
+		void *data);
+
+/** Convert NME text with an output sink, converting segments split at block
+	boundaries as parallel jobs. The state which depends on previous segments
+	(heading numbers) is predicted by a quick scan of the source; segments
+	whose prediction was wrong, or whose output depends on the output of
+	previous segments (%{p}, NMECurrentOutputIndex etc.), are converted again
+	sequentially, so that the result is the same as NMEProcessToSink's.
+	@param[in] nmeText source text with markup (must remain valid during the
+	whole conversion)
+	@param[in] nmeTextLen source text length
+	@param[in] segmentSize approximate size of segments in bytes
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] sink output sink, with a flush function; sink->growFun is called
+	from jobs
+	@param[in] runJobsFun function which runs jobs
+	@param[in,out] runJobsData user data passed to runJobsFun
+	@param[out] outputLen total formatted text length (not set if NULL)
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode
+	characters (not set if NULL)
+	@return error code (kNMEErrOk for success)
+	@note Hooks, plugins and autoconverts are called from jobs, possibly at
+	the same time; they receive only the current segment as source text,
+	like with NMEStreamBegin, and NMECurrentOutput doesn't include the output
+	of previous segments. Chunks passed to sink->flushFun aren't always made
+	of complete lines.
+*/
+NMEErr NMEProcessParallel(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt segmentSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMERunJobsFun runJobsFun, void *runJobsData,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Incremental conversion for live editors, where output is updated after
+	each edit by converting again only the blocks which have changed (opaque,
+	typically allocated as a member of the editor's data and passed by
+	address to NMEIncrementalBegin, NMEIncrementalEdit and NMEIncrementalEnd)
+*/
+typedef struct
+{
+	NMEInt options;	///< private
+	NMEConstText eol;	///< private
+	NMEOutputFormat const *outputFormat;	///< private
+	NMEInt fontSize;	///< private
+	NMEOutputSink sink;	///< private
+	NMEText output[2];	///< private
+	NMEInt outputSize[2];	///< private
+	NMEText blocks[2];	///< private
+	NMEInt blocksSize[2];	///< private
+	NMEInt blockCount;	///< private
+	NMEInt current;	///< private
+	NMEText scratch;	///< private
+	NMEInt scratchSize;	///< private
+	NMESegmentState end;	///< private
+} NMEIncremental;
+
+/** Begin an incremental conversion by converting the whole text. Output is
+	the same as NMEProcessToSink's.
+	@param[out] incremental incremental conversion state
+	@param[in] nmeText source text with markup (not kept after the call)
+	@param[in] nmeTextLen source text length
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] sink output sink, whose growFun is used for all the memory of
+	the incremental conversion (flushFun is ignored)
+	@param[out] output formatted text, followed by null byte (valid until the
+	next call to NMEIncrementalEdit or NMEIncrementalEnd)
+	@param[out] outputLen formatted text length
+	@return error code (kNMEErrOk for success)
+	@note NMEIncrementalEnd must be called even after an error.
+*/
+NMEErr NMEIncrementalBegin(NMEIncremental *incremental,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMEText *output,
+		NMEInt *outputLen);
+
+/** Update the output of an incremental conversion after an edit. The text is
+	converted again from the block (paragraph, list, table etc. followed by
+	an empty line) before the edit, until the state of the conversion is the
+	same as before for a block after the edit; output of the following blocks
+	is reused. The changed part of output is returned as a replacement of
+	the previous output.
+	@param[in,out] incremental incremental conversion state
+	@param[in] nmeText whole source text after the edit
+	@param[in] nmeTextLen source text length
+	@param[in] editIndex index in source of the edit
+	@param[in] removedLen number of bytes which have been removed at editIndex
+	@param[in] insertedLen number of bytes which have been inserted at editIndex
+	@param[out] output formatted text, followed by null byte (valid until the
+	next call to NMEIncrementalEdit or NMEIncrementalEnd)
+	@param[out] outputLen formatted text length
+	@param[out] changedIndex index in output of the first change (may be NULL)
+	@param[out] changedRemovedLen number of bytes of previous output replaced
+	at changedIndex (may be NULL)
+	@param[out] changedInsertedLen number of bytes of output which replace them
+	(may be NULL)
+	@return error code (kNMEErrOk for success); after an error, the previous
+	state is kept, and the conversion should be begun again
+	@note Hooks and plugins are called only for blocks which are converted
+	again, with their new source and output indices; positions recorded for
+	other blocks must be moved by the caller according to the edit and to
+	changedIndex, changedRemovedLen and changedInsertedLen.
+*/
+NMEErr NMEIncrementalEdit(NMEIncremental *incremental,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt editIndex, NMEInt removedLen, NMEInt insertedLen,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *changedIndex,
+		NMEInt *changedRemovedLen,
+		NMEInt *changedInsertedLen);
+
+/** End an incremental conversion and release its memory.
+	@param[in,out] incremental incremental conversion state
+*/
+void NMEIncrementalEnd(NMEIncremental *incremental);
+
+/// Usage of an entry of a block cache, passed to eviction functions
+typedef struct
+{
+	NMEInt size;	///< size of the entry in bytes
+	NMEInt hits;	///< number of times the entry has been reused
+	NMEInt lastUse;	///< cache clock when the entry was last stored or reused
+} NMEBlockCacheEntryInfo;
+
+/** Eviction policy of a block cache, which selects the entry to remove
+	when the memory cap would be exceeded.
+	@param[in] entries usage of all entries
+	@param[in] count number of entries (at least 1)
+	@param[in,out] data value specific to the callback
+	@return index in entries of the entry to remove
+*/
+typedef NMEInt (*NMEBlockCacheEvictFun)(NMEBlockCacheEntryInfo const entries[],
+		NMEInt count,
+		void *data);
+
+/** Eviction policy which removes the least recently used entry.
+	@param[in] entries usage of all entries
+	@param[in] count number of entries (at least 1)
+	@param[in,out] data unused
+	@return index in entries of the entry to remove
+*/
+NMEInt NMEBlockCacheEvictLRU(NMEBlockCacheEntryInfo const entries[],
+		NMEInt count,
+		void *data);
+
+/** Eviction policy which removes the least frequently used entry (the
+	least recently used one among those with the fewest hits).
+	@param[in] entries usage of all entries
+	@param[in] count number of entries (at least 1)
+	@param[in,out] data unused
+	@return index in entries of the entry to remove
+*/
+NMEInt NMEBlockCacheEvictLFU(NMEBlockCacheEntryInfo const entries[],
+		NMEInt count,
+		void *data);
+
+/** Cache of the output of top-level blocks, reused by NMEProcessCached
+	across conversions and documents (opaque, typically allocated once per
+	process and passed by address to NMEBlockCacheBegin, NMEProcessCached
+	and NMEBlockCacheEnd)
+*/
+typedef struct
+{
+	NMEOutputSink sink;	///< private
+	NMEInt maxSize;	///< private
+	NMEBlockCacheEvictFun evictFun;	///< private
+	void *evictData;	///< private
+	NMEText entries;	///< private
+	NMEInt entriesSize;	///< private
+	NMEText info;	///< private
+	NMEInt infoSize;	///< private
+	NMEText table;	///< private
+	NMEInt tableSize;	///< private
+	NMEInt tableSlots;	///< private
+	NMEInt count;	///< private
+	NMEInt size;	///< private
+	NMEInt clock;	///< private
+} NMEBlockCache;
+
+/** Begin a block cache (no memory is allocated yet).
+	@param[out] cache block cache
+	@param[in] maxSize maximum size in bytes of the cached entries
+	@param[in] evictFun eviction policy, or NULL for NMEBlockCacheEvictLRU
+	@param[in,out] evictData value passed to evictFun
+	@param[in] sink sink whose growFun is used for all the memory of the
+	cache (flushFun is ignored)
+*/
+void NMEBlockCacheBegin(NMEBlockCache *cache,
+		NMEInt maxSize,
+		NMEBlockCacheEvictFun evictFun,
+		void *evictData,
+		NMEOutputSink const *sink);
+
+/** End a block cache and release its memory.
+	@param[in,out] cache block cache
+*/
+void NMEBlockCacheEnd(NMEBlockCache *cache);
+
+/** Process NME text like NMEProcessToSink, reusing the output of top-level
+	blocks (paragraphs, lists, tables etc. followed by an empty line) found
+	in a block cache. Blocks are identified by their source, options, eol,
+	output format address, font size, headings and output before them.
+	Hooks are called for reused blocks too, with the same arguments as if
+	the block had been converted.
+	@param[in,out] cache block cache, or NULL to convert without cache
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen source text length
+	@param[in,out] buf address of output buffer (may be NULL), grown by sink->growFun;
+	must be released by the caller with sink->growFun
+	@param[in,out] bufSize address of size of buf
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] sink output sink (flushFun is ignored)
+	@param[out] output address of formatted text (in *buf), followed by null byte
+	@param[out] outputLen formatted text length
+	@param[out] outputUCS16Len formatted text length in UCS16 (may be NULL)
+	@return error code (kNMEErrOk for success)
+	@note The contents of outputFormat must not change while it is used
+	with the cache. Blocks whose output contains source or output indices
+	(%{o} or %{p}), depends on output further back, or comes partly from
+	plugins or hooks, are not stored; hooks which query the list nesting,
+	link, output or temporary memory also prevent storage. With a
+	charHookFun, the cache isn't used. As with NMEStream, plugins receive
+	only the current block as source text.
+*/
+NMEErr NMEProcessCached(NMEBlockCache *cache,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText *buf, NMEInt *bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEOutputSink const *sink,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Reserve a slot at the current output position, to be filled when the
+	rest of the document has been converted (e.g. table of contents); output
+	from the first slot is kept in memory until then. In conversions by
+	segments (NMEStream, NMEProcessParallel, NMEIncremental and
+	NMEProcessCached), slots are filled at the end of the current segment.
+	@param[in] fun callback which fills the slot
+	@param[in] id value passed to fun
+	@param[in,out] data value passed to fun
+	@param[in,out] context current context
+	@return TRUE for success, FALSE if too many slots have been reserved
+*/
+NMEBoolean NMEAddDeferred(NMEDeferredFun fun,
+		NMEInt id,
+		void *data,
+		NMEContext *context);
+
 /** Add a string to output, converting eol and embedded expressions.
 	@param[in] str null-terminated string to append
 	@param[in] strLen length of str, or -1 for null-terminated string
@@ -638,7 +1410,8 @@ NMEErr NMECopySource(NMEInt length,
 		NMEContext *context);
 
 /** Get temporary memory which can be used in plugin, autolink and
-	hook functions.
+	hook functions. With NMEProcessToSink, it is taken from the free part
+	of the output buffer and is invalidated when output is added.
 	@param[in] context current context
 	@param[out] addr memory address
 	@param[out] len number of bytes
@@ -660,16 +1433,33 @@ void NMEGetFormat(NMEContext const *context,
 
 /** Accessor for output index.
 	@param[in] context current context
-	@return current output index
+	@return current output index (including output already flushed to a sink)
 */
 NMEInt NMECurrentOutputIndex(NMEContext const *context);
 
 /** Accessor for output index in unicode characters, assuming UTF-8 input.
 	@param[in] context current context
 	@return current output index
+	@note Output is counted lazily, when this function is called; with an
+	output sink, flushed output is counted only if outputUCS16Len is requested
+	or if there are hooks, plugins or autoconverts, which can call it.
 */
 NMEInt NMECurrentOutputIndexUCS16(NMEContext const *context);
 
+/** Convert an index in UTF-8 text, such as the output of NMEProcess, to
+	unicode characters, counted like NMECurrentOutputIndexUCS16, and
+	optionally check that the text is valid UTF-8.
+	@param[in] str UTF-8 text
+	@param[in] index index in str
+	@param[out] valid TRUE if str[0..index-1] is a sequence of complete and
+	valid UTF-8 characters, else FALSE (not set if pointer is null)
+	@return index in unicode characters
+	@note No index of output is kept during conversion, and the time is
+	proportional to index. To convert increasing indices, call it for each
+	range between consecutive ones (str + i0, i1 - i0) and add the results.
+*/
+NMEInt NMEIndexUCS16(NMEConstText str, NMEInt index, NMEBoolean *valid);
+
 /** Accessor for current link or image (can be called from hook "[["
 	or "{{"), before any processing by NMEEncodeURLFun
 	@param[in] context current context
@@ -684,13 +1474,22 @@ void NMECurrentLink(NMEContext const *context,
 	@param[in] context current context
 	@param[out] output address of output (not provided if NULL)
 	@param[out] outputLength current length of output in bytes (not provided if NULL)
+	@note With NMEProcessToSink, output which has already been flushed is
+	not included.
 */
 void NMECurrentOutput(NMEContext const *context,
 		NMEConstText *output, NMEInt *outputLength);
 
+/** Accessor for output sink.
+	@param[in] context current context
+	@return output sink, or NULL if processing with NMEProcess
+*/
+NMEOutputSink const *NMEGetOutputSink(NMEContext const *context);
+
 /**	Accessor for current list nesting as a string of NME markup characters.
 	@param[in] context current context
-	@return string (constant, valid until next call)
+	@return string (constant, stored in context and valid until next call
+	with the same context)
 */
 NMEConstText NMECurrentListNesting(NMEContext const *context);
 
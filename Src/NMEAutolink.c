@@ -14,6 +14,12 @@
 /// Test whether character is alphabetic.
 #define isAlpha(c) ((c) >= 'a' && (c) <= 'z' || (c) >= 'A' && (c) <= 'Z')
 
+/// Test whether character is a lowercase letter.
+#define isLower(c) ((c) >= 'a' && (c) <= 'z')
+
+/// Test whether character is an uppercase letter.
+#define isUpper(c) ((c) >= 'A' && (c) <= 'Z')
+
 NMEBoolean NMEAutoconvertCamelCase(NMEConstText src, NMEInt srcLen,
 		NMEInt *i,
 		NMEContext *context,
@@ -29,7 +35,7 @@ NMEBoolean NMEAutoconvertCamelCase(NMEConstText src, NMEInt srcLen,
 	else
 		i1 = *i + 1;
 	
-	if (isAlpha(src[i1]))
+	if (i1 < srcLen && isAlpha(src[i1]))
 		for (j = 1; i1 + j < srcLen && isAlpha(src[i1 + j]); j++)
 			if (src[i1 + j] <= 'Z' && src[i1 + j - 1] >= 'a')
 			{
@@ -49,37 +55,53 @@ NMEBoolean NMEAutoconvertCamelCase(NMEConstText src, NMEInt srcLen,
 	return FALSE;
 }
 
-NMEBoolean NMEAutoconvertURL(NMEConstText src, NMEInt srcLen,
-		NMEInt *i,
-		NMEContext *context,
+NMEInt NMEAutoconvertCamelCaseScan(NMEConstText src, NMEInt srcLen,
+		NMEInt i,
 		void *userData)
 {
-	NMEInt i1, j, k, p;
+	NMEInt j, k;
+	
+	// find lowercase followed by uppercase, then beginning of word
+	for (j = i + 1; j < srcLen; j++)
+		if (isUpper(src[j]) && isLower(src[j - 1]))
+		{
+			for (k = j - 1; k > i && isAlpha(src[k - 1]); k--)
+				;
+			if (k > i && isBlank(src[k - 1]))
+				return k - 1;
+			
+			// skip end of word
+			for (; j + 1 < srcLen && isAlpha(src[j + 1]); j++)
+				;
+		}
+	return srcLen;
+}
+
+/** Find the length of the URL at the beginning of a string.
+	@param[in] src text
+	@param[in] srcLen text length
+	@return length of URL without trailing punctuation, or 0 if none
+*/
+static NMEInt urlLength(NMEConstText src, NMEInt srcLen)
+{
+	NMEInt j, k, p;
 	static char const * const prefix[] =
 	{
 		"http://", "https://", "ftp://", "mailto:", NULL
 	};
 	static char const punctuation[] = ",.?!:;'";
 	
-	// no match if first character is not a blank
-	if (*i == 0)
-		i1 = isBlank(src[*i]) ? *i + 1 : *i;
-	else if (!isBlank(src[*i]))
-		return FALSE;
-	else
-		i1 = *i + 1;
-	
 	// find prefix
 	for (j = 0; prefix[j]; j++)
 	{
-		for (k = 0; prefix[j][k] && i1 + k < srcLen && src[i1 + k] == prefix[j][k]; k++)
+		for (k = 0; prefix[j][k] && k < srcLen && src[k] == prefix[j][k]; k++)
 			;
 		if (prefix[j][k])
 			continue;	// end of prefix not reached
 		
 		// continue until next blank/control or double-quote
-		for (p = k; i1 + p < srcLen && src[i1 + p] != '"'
-				&& !(src[i1 + p] >= '\0' && src[i1 + p] <= ' '); p++)
+		for (p = k; p < srcLen && src[p] != '"'
+				&& !(src[p] >= '\0' && src[p] <= ' '); p++)
 			;
 		
 		// give up if nothing more than prefix
@@ -88,20 +110,57 @@ NMEBoolean NMEAutoconvertURL(NMEConstText src, NMEInt srcLen,
 		
 		// remove trailing punctuation character
 		for (j = 0; punctuation[j]; j++)
-			if (src[i1 + p - 1] == punctuation[j])
+			if (src[p - 1] == punctuation[j])
 			{
 				p--;
 				break;
 			}
 		
-		// copy link, including blank src[*i] if any
-		NMEAddString(&src[*i], i1 - *i, '\0', context);	// blank
-		NMEAddString("[[", -1, '\0', context);
-		NMEAddString(&src[i1], p, '\0', context);
-		NMEAddString("]]", -1, '\0', context);
-		*i = i1 + p;
-		return TRUE;
+		return p;
 	}
 	
-	return FALSE;
+	return 0;
+}
+
+NMEBoolean NMEAutoconvertURL(NMEConstText src, NMEInt srcLen,
+		NMEInt *i,
+		NMEContext *context,
+		void *userData)
+{
+	NMEInt i1, p;
+	
+	// no match if first character is not a blank
+	if (*i == 0)
+		i1 = isBlank(src[*i]) ? *i + 1 : *i;
+	else if (!isBlank(src[*i]))
+		return FALSE;
+	else
+		i1 = *i + 1;
+	
+	p = urlLength(&src[i1], srcLen - i1);
+	if (p == 0)
+		return FALSE;
+	
+	// copy link, including blank src[*i] if any
+	NMEAddString(&src[*i], i1 - *i, '\0', context);	// blank
+	NMEAddString("[[", -1, '\0', context);
+	NMEAddString(&src[i1], p, '\0', context);
+	NMEAddString("]]", -1, '\0', context);
+	*i = i1 + p;
+	return TRUE;
+}
+
+NMEInt NMEAutoconvertURLScan(NMEConstText src, NMEInt srcLen,
+		NMEInt i,
+		void *userData)
+{
+	NMEInt j, k;
+	
+	// all prefixes end with a colon 4 to 7 characters after the blank
+	for (j = i + 4; j < srcLen; j++)
+		if (src[j] == ':')
+			for (k = j - 7 > i ? j - 7 : i; k <= j - 4; k++)
+				if (isBlank(src[k]) && urlLength(&src[k + 1], srcLen - k - 1) > 0)
+					return k;
+	return srcLen;
 }
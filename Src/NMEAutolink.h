@@ -37,6 +37,9 @@ extern "C" {
 
 #include "NME.h"
 
+/// Characters where autolinks can begin (triggers of NMEAutoconvert)
+#define kNMEAutolinkTriggers " \t\r\n"
+
 /** Autoconvert implementation for camelCase words
 	@param[in] src source text with markup
 	@param[in] srcLen source text length
@@ -50,9 +53,21 @@ NMEBoolean NMEAutoconvertCamelCase(NMEConstText src, NMEInt srcLen,
 		NMEContext *context,
 		void *userData);
 
+/** Scan function of NMEAutoconvertCamelCase
+	@param[in] src source text with markup
+	@param[in] srcLen source text length
+	@param[in] i index in src where to begin
+	@param[in] userData pointer passed from the parser, as specified in NMEAutoconvert
+	@return index of the first blank >= i followed by a camelCase word, or srcLen
+*/
+NMEInt NMEAutoconvertCamelCaseScan(NMEConstText src, NMEInt srcLen,
+		NMEInt i,
+		void *userData);
+
 /// NMEAutoconvertCamelCase entry for table of NMEAutoconvert
 #define NMEAutoconvertCamelCaseEntry \
-	{NMEAutoconvertCamelCase, NULL}
+	{NMEAutoconvertCamelCase, NULL, kNMEAutolinkTriggers, \
+		NMEAutoconvertCamelCaseScan, FALSE}
 
 /** Autoconvert implementation for URLs
 	@param[in] src source text with markup
@@ -67,9 +82,21 @@ NMEBoolean NMEAutoconvertURL(NMEConstText src, NMEInt srcLen,
 		NMEContext *context,
 		void *userData);
 
+/** Scan function of NMEAutoconvertURL
+	@param[in] src source text with markup
+	@param[in] srcLen source text length
+	@param[in] i index in src where to begin
+	@param[in] userData pointer passed from the parser, as specified in NMEAutoconvert
+	@return index of the first blank >= i followed by a URL, or srcLen
+*/
+NMEInt NMEAutoconvertURLScan(NMEConstText src, NMEInt srcLen,
+		NMEInt i,
+		void *userData);
+
 /// NMEAutoconvertURL entry for table of NMEAutoconvert
 #define NMEAutoconvertURLEntry \
-	{NMEAutoconvertURL, NULL}
+	{NMEAutoconvertURL, NULL, kNMEAutolinkTriggers, NMEAutoconvertURLScan, \
+		FALSE}
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,386 @@
+/**
+ *	@file NMEAutolinkDict.c
+ *	@brief NME optional automatic link recognition (dictionary of terms)
+ *	@author Yves Piguet. Copyright 2007-2008, Yves Piguet.
+ */
+
+/* License: new BSD license (see NME.h) */
+
+#include "NMEAutolinkDict.h"
+
+/// Test whether character is a space/tab/cr/lf.
+#define isBlank(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+/// Test whether character can be part of a word (non-ASCII bytes included).
+#define isWordChar(c) ((c) >= 'a' && (c) <= 'z' || (c) >= 'A' && (c) <= 'Z' \
+		|| (c) >= '0' && (c) <= '9' || (c) == '_' || (c) & 0x80)
+
+/// Edge of NMEAutolinkDict, in a hash table indexed by parent node and char
+typedef struct
+{
+	NMEInt parent;	///< parent node (-1 for empty slot)
+	NMEInt child;	///< child node
+	NMEChar ch;	///< character
+} DictEdge;
+
+/** Node of NMEAutolinkDict, for the prefix of one or more terms. Since terms
+	begin only after a blank, suffixes considered by the failure and output
+	links are those which begin after a blank.
+*/
+typedef struct
+{
+	NMEInt parent;	///< parent node (-1 for root)
+	NMEInt depth;	///< length of the prefix
+	NMEInt fail;	///< node of the longest proper suffix of the prefix, or 0
+	NMEInt output;	///< node of the longest proper suffix which is a term, or 0
+	NMEChar ch;	///< last character of the prefix
+	NMEBoolean term;	///< TRUE if the prefix is a term
+} DictNode;
+
+/** Find the slot of an edge of a dictionary trie.
+	@param[in] edges hash table of edges
+	@param[in] edgeSlots number of slots in edges (power of 2)
+	@param[in] parent parent node
+	@param[in] ch character
+	@return index of slot of edge, or of empty slot where it should be stored
+*/
+static NMEInt findDictEdge(DictEdge const *edges,
+		NMEInt edgeSlots,
+		NMEInt parent, NMEChar ch)
+{
+	NMEInt i;
+	
+	for (i = (NMEInt)(((unsigned long)parent * 257 + (unsigned char)ch)
+				* 2654435761UL >> 8 & (edgeSlots - 1));
+			edges[i].parent >= 0
+				&& (edges[i].parent != parent || edges[i].ch != ch);
+			i = (i + 1) & (edgeSlots - 1))
+		;
+	return i;
+}
+
+/** Double the size of the hash table of edges of a dictionary.
+	@param[in,out] dict dictionary
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr growDictEdges(NMEAutolinkDict *dict)
+{
+	NMEText edges = NULL;
+	NMEInt edgesSize = 0;
+	NMEInt edgeSlots = dict->edgeSlots > 0 ? 2 * dict->edgeSlots : 1024;
+	DictEdge const *oldEdges = (DictEdge const *)dict->edges;
+	DictEdge *newEdges;
+	NMEInt i, slot;
+	
+	if (dict->sink.growFun(&edges, &edgesSize,
+				edgeSlots * (NMEInt)sizeof(DictEdge), dict->sink.data) != kNMEErrOk
+			|| edgesSize < edgeSlots * (NMEInt)sizeof(DictEdge))
+	{
+		if (edges)
+			(void)dict->sink.growFun(&edges, &edgesSize, 0, dict->sink.data);
+		return kNMEErrNotEnoughMemory;
+	}
+	
+	// move edges to their new slot
+	newEdges = (DictEdge *)edges;
+	for (i = 0; i < edgeSlots; i++)
+		newEdges[i].parent = -1;
+	for (i = 0; i < dict->edgeSlots; i++)
+		if (oldEdges[i].parent >= 0)
+		{
+			slot = findDictEdge(newEdges, edgeSlots,
+					oldEdges[i].parent, oldEdges[i].ch);
+			newEdges[slot] = oldEdges[i];
+		}
+	
+	if (dict->edges)
+		(void)dict->sink.growFun(&dict->edges, &dict->edgesSize, 0, dict->sink.data);
+	dict->edges = edges;
+	dict->edgesSize = edgesSize;
+	dict->edgeSlots = edgeSlots;
+	return kNMEErrOk;
+}
+
+/** Find the child of a node of a dictionary trie.
+	@param[in] dict dictionary
+	@param[in] node parent node
+	@param[in] ch character
+	@return child node, or -1 if none
+*/
+static NMEInt findDictChild(NMEAutolinkDict const *dict,
+		NMEInt node, NMEChar ch)
+{
+	DictEdge const *edges = (DictEdge const *)dict->edges;
+	NMEInt slot = findDictEdge(edges, dict->edgeSlots, node, ch);
+	
+	return edges[slot].parent >= 0 ? edges[slot].child : -1;
+}
+
+/** Add the failure and output links of Aho-Corasick to a dictionary trie,
+	node by node in order of increasing depth.
+	@param[in,out] dict dictionary
+	@param[in] maxDepth length of the longest term
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr linkDictNodes(NMEAutolinkDict *dict, NMEInt maxDepth)
+{
+	DictNode *nodes = (DictNode *)dict->nodes;
+	NMEText buf = NULL;
+	NMEInt bufSize = 0;
+	NMEInt *first, *order;
+	NMEInt i, d, node, parent, f, g;
+	
+	// sort nodes by depth (counting sort)
+	if (dict->sink.growFun(&buf, &bufSize,
+				(maxDepth + 2 + dict->nodeCount) * (NMEInt)sizeof(NMEInt),
+				dict->sink.data) != kNMEErrOk
+			|| bufSize < (maxDepth + 2 + dict->nodeCount) * (NMEInt)sizeof(NMEInt))
+	{
+		if (buf)
+			(void)dict->sink.growFun(&buf, &bufSize, 0, dict->sink.data);
+		return kNMEErrNotEnoughMemory;
+	}
+	first = (NMEInt *)buf;
+	order = first + maxDepth + 2;
+	for (d = 0; d < maxDepth + 2; d++)
+		first[d] = 0;
+	for (i = 0; i < dict->nodeCount; i++)
+		first[nodes[i].depth + 1]++;
+	for (d = 1; d < maxDepth + 2; d++)
+		first[d] += first[d - 1];
+	for (i = 0; i < dict->nodeCount; i++)
+		order[first[nodes[i].depth]++] = i;
+	
+	// failure link: longest proper suffix which is in the trie, found from
+	// the failure link of the parent (which is shallower); the suffix made
+	// of the last character alone only if it follows a blank
+	nodes[0].fail = nodes[0].output = 0;
+	for (i = 1; i < dict->nodeCount; i++)
+	{
+		node = order[i];
+		parent = nodes[node].parent;
+		f = 0;
+		if (parent != 0)
+			for (f = nodes[parent].fail; ; f = nodes[f].fail)
+			{
+				g = f != 0 || isBlank(nodes[parent].ch)
+						? findDictChild(dict, f, nodes[node].ch) : -1;
+				if (g >= 0)
+				{
+					f = g;
+					break;
+				}
+				if (f == 0)
+					break;
+			}
+		nodes[node].fail = f;
+		nodes[node].output = nodes[f].term ? f : nodes[f].output;
+	}
+	
+	(void)dict->sink.growFun(&buf, &bufSize, 0, dict->sink.data);
+	return kNMEErrOk;
+}
+
+NMEErr NMEMakeAutolinkDict(NMEAutolinkDict *dict,
+		NMEConstText const *terms,
+		NMEOutputSink const *sink)
+{
+	DictEdge *edges;
+	DictNode *nodes;
+	NMEInt i, t, node, slot, maxDepth = 0;
+	NMEErr err;
+	
+	dict->sink = *sink;
+	dict->nodes = dict->edges = NULL;
+	dict->nodesSize = dict->edgesSize = 0;
+	dict->edgeSlots = 0;
+	
+	// root node, which doesn't end a term
+	err = growDictEdges(dict);
+	if (err == kNMEErrOk
+			&& (sink->growFun(&dict->nodes, &dict->nodesSize,
+						1024 * (NMEInt)sizeof(DictNode), sink->data) != kNMEErrOk
+				|| dict->nodesSize < 1024 * (NMEInt)sizeof(DictNode)))
+		err = kNMEErrNotEnoughMemory;
+	if (err != kNMEErrOk)
+	{
+		NMEAutolinkDictEnd(dict);
+		return err;
+	}
+	nodes = (DictNode *)dict->nodes;
+	nodes[0].parent = -1;
+	nodes[0].depth = 0;
+	nodes[0].ch = '\0';
+	nodes[0].term = FALSE;
+	dict->nodeCount = 1;
+	
+	for (t = 0; terms[t]; t++)
+	{
+		if (!terms[t][0])
+			continue;
+		for (i = node = 0; terms[t][i]; i++)
+		{
+			edges = (DictEdge *)dict->edges;
+			slot = findDictEdge(edges, dict->edgeSlots, node, terms[t][i]);
+			if (edges[slot].parent < 0)
+			{
+				// keep edge table at most half full and room for the new node
+				if (2 * dict->nodeCount >= dict->edgeSlots)
+				{
+					err = growDictEdges(dict);
+					if (err != kNMEErrOk)
+						break;
+					edges = (DictEdge *)dict->edges;
+					slot = findDictEdge(edges, dict->edgeSlots, node, terms[t][i]);
+				}
+				if ((dict->nodeCount + 1) * (NMEInt)sizeof(DictNode) > dict->nodesSize
+						&& (sink->growFun(&dict->nodes, &dict->nodesSize,
+									(dict->nodeCount + dict->nodeCount / 2)
+										* (NMEInt)sizeof(DictNode),
+									sink->data) != kNMEErrOk
+								|| (dict->nodeCount + 1) * (NMEInt)sizeof(DictNode)
+									> dict->nodesSize))
+				{
+					err = kNMEErrNotEnoughMemory;
+					break;
+				}
+				nodes = (DictNode *)dict->nodes;
+				edges[slot].parent = node;
+				edges[slot].ch = terms[t][i];
+				edges[slot].child = dict->nodeCount;
+				nodes[dict->nodeCount].parent = node;
+				nodes[dict->nodeCount].depth = i + 1;
+				nodes[dict->nodeCount].ch = terms[t][i];
+				nodes[dict->nodeCount].term = FALSE;
+				dict->nodeCount++;
+			}
+			node = edges[slot].child;
+		}
+		if (err != kNMEErrOk)
+		{
+			NMEAutolinkDictEnd(dict);
+			return err;
+		}
+		nodes[node].term = TRUE;
+		if (i > maxDepth)
+			maxDepth = i;
+	}
+	
+	err = linkDictNodes(dict, maxDepth);
+	if (err != kNMEErrOk)
+		NMEAutolinkDictEnd(dict);
+	return err;
+}
+
+void NMEAutolinkDictEnd(NMEAutolinkDict *dict)
+{
+	if (dict->nodes)
+		(void)dict->sink.growFun(&dict->nodes, &dict->nodesSize, 0, dict->sink.data);
+	if (dict->edges)
+		(void)dict->sink.growFun(&dict->edges, &dict->edgesSize, 0, dict->sink.data);
+	dict->nodes = dict->edges = NULL;
+	dict->nodesSize = dict->edgesSize = 0;
+	dict->nodeCount = dict->edgeSlots = 0;
+}
+
+/** Find the length of the longest term which begins a string and ends a word.
+	@param[in] dict dictionary
+	@param[in] src text
+	@param[in] srcLen text length
+	@return length of term, or 0 if none
+*/
+static NMEInt termLength(NMEAutolinkDict const *dict,
+		NMEConstText src, NMEInt srcLen)
+{
+	DictNode const *nodes = (DictNode const *)dict->nodes;
+	NMEInt j, len, node;
+	
+	if (dict->edgeSlots == 0)
+		return 0;
+	
+	// walk the trie along src, keeping the longest term which ends a word
+	for (j = len = node = 0; j < srcLen; )
+	{
+		node = findDictChild(dict, node, src[j]);
+		if (node < 0)
+			break;
+		j++;
+		if (nodes[node].term && (j >= srcLen || !isWordChar(src[j])))
+			len = j;
+	}
+	return len;
+}
+
+NMEBoolean NMEAutoconvertDict(NMEConstText src, NMEInt srcLen,
+		NMEInt *i,
+		NMEContext *context,
+		void *userData)
+{
+	NMEInt i1, len;
+	
+	// no match if first character is not a blank
+	if (*i == 0)
+		i1 = isBlank(src[*i]) ? *i + 1 : *i;
+	else if (!isBlank(src[*i]))
+		return FALSE;
+	else
+		i1 = *i + 1;
+	
+	len = termLength((NMEAutolinkDict const *)userData, &src[i1], srcLen - i1);
+	if (len == 0)
+		return FALSE;
+	
+	// copy link, including blank src[*i] if any
+	NMEAddString(&src[*i], i1 - *i, '\0', context);	// blank
+	NMEAddString("[[", -1, '\0', context);
+	NMEAddString(&src[i1], len, '\0', context);
+	NMEAddString("]]", -1, '\0', context);
+	*i = i1 + len;
+	return TRUE;
+}
+
+NMEInt NMEAutoconvertDictScan(NMEConstText src, NMEInt srcLen,
+		NMEInt i,
+		void *userData)
+{
+	NMEAutolinkDict const *dict = (NMEAutolinkDict const *)userData;
+	DictNode const *nodes = (DictNode const *)dict->nodes;
+	NMEInt j, node, next, t, begin, best = -1;
+	
+	if (dict->edgeSlots == 0)
+		return srcLen;
+	
+	// single pass of the Aho-Corasick automaton, where node is the longest
+	// suffix of src[i+1..j] which begins after a blank and is in the trie
+	for (j = i + 1, node = 0; j < srcLen; j++)
+	{
+		while (node != 0 && (next = findDictChild(dict, node, src[j])) < 0)
+			node = nodes[node].fail;
+		if (node == 0)
+		{
+			// skip to the beginning of the next word
+			while (j < srcLen && !isBlank(src[j - 1]))
+				j++;
+			if (j >= srcLen)
+				break;
+			next = findDictChild(dict, 0, src[j]);
+		}
+		node = next >= 0 ? next : 0;
+		
+		// terms which end here at the end of a word (they begin after a blank)
+		if (j + 1 >= srcLen || !isWordChar(src[j + 1]))
+			for (t = nodes[node].term ? node : nodes[node].output;
+					t != 0;
+					t = nodes[t].output)
+			{
+				begin = j + 1 - nodes[t].depth;
+				if (best < 0 || begin < best)
+					best = begin;
+			}
+		
+		// terms which end further begin after src[j-depth]
+		if (best >= 0 && j + 1 - nodes[node].depth >= best)
+			break;
+	}
+	return best >= 0 ? best - 1 : srcLen;
+}
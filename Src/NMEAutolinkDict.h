@@ -0,0 +1,116 @@
+/**
+ *	@file NMEAutolinkDict.h
+ *	@brief NME optional automatic link recognition (dictionary of terms)
+ *	@author Yves Piguet. Copyright 2007-2008, Yves Piguet.
+ *
+ *	To convert all the occurrences of known terms, such as page titles or
+ *	glossary entries, to links (as if they were enclosed between
+ *	double-brackets), index them once with NMEMakeAutolinkDict and add
+ *	NMEAutoconvertDictEntry to the table autoconverts[] in NMEOutputFormat.
+ *	Terms are matched at the beginning of the source or after a blank, up
+ *	to the end of a word (i.e. a character which isn't a letter, a digit,
+ *	an underscore or a non-ASCII byte, or the end of the source); the
+ *	longest term is linked. Terms are indexed in an Aho-Corasick automaton
+ *	(a trie whose nodes have failure links to the longest suffix, beginning
+ *	after a blank, which is also a prefix of a term), so that finding the
+ *	next term takes a single pass over the source, in a time independent of
+ *	the size of the dictionary. Indexing costs about 20 bytes per node
+ *	(one node per distinct prefix) plus a hash table of edges, and a second
+ *	pass over the nodes to compute the links. Terms can contain blanks and
+ *	non-ASCII characters; they're compared byte by byte (case-sensitive) and shouldn't
+ *	contain link markup.
+ *	@code
+ *	static NMEConstText const terms[] = {"Paris", "New York", NULL};
+ *	NMEOutputSink const sink = {growFun, NULL, NULL};
+ *	NMEAutolinkDict dict;
+ *	NMEMakeAutolinkDict(&dict, terms, &sink);
+ *	NMEAutoconvert const autoconverts[] =
+ *	{
+ *		NMEAutoconvertDictEntry(&dict),
+ *		NMEAutoconvertTableEnd
+ *	};
+ *	NMEOutputFormat f = NMEOutputFormatHTML;
+ *	f.autoconverts = autoconverts;
+ *	... NMEProcess(..., &f, ...);
+ *	NMEAutolinkDictEnd(&dict);
+ *	@endcode
+ */
+
+/* License: new BSD license (see NME.h) */
+
+#ifndef __NMEAutolinkDict__
+#define __NMEAutolinkDict__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "NME.h"
+#include "NMEAutolink.h"
+
+/** Terms indexed in an Aho-Corasick automaton for NMEAutoconvertDict (opaque, initialized with
+	NMEMakeAutolinkDict and released with NMEAutolinkDictEnd; only read
+	during conversions, hence shared by concurrent conversions)
+*/
+typedef struct
+{
+	NMEOutputSink sink;	///< private
+	NMEText nodes;	///< private
+	NMEInt nodesSize;	///< private
+	NMEInt nodeCount;	///< private
+	NMEText edges;	///< private
+	NMEInt edgesSize;	///< private
+	NMEInt edgeSlots;	///< private
+} NMEAutolinkDict;
+
+/** Index terms in an Aho-Corasick automaton for NMEAutoconvertDict.
+	@param[out] dict dictionary
+	@param[in] terms array of null-terminated terms, terminated by NULL
+	(empty terms are ignored; terms aren't referenced once dict is made)
+	@param[in] sink output sink whose growFun allocates memory (flushFun is
+	ignored)
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEMakeAutolinkDict(NMEAutolinkDict *dict,
+		NMEConstText const *terms,
+		NMEOutputSink const *sink);
+
+/** Release the memory of a dictionary.
+	@param[in,out] dict dictionary
+*/
+void NMEAutolinkDictEnd(NMEAutolinkDict *dict);
+
+/** Autoconvert implementation for terms of a dictionary
+	@param[in] src source text with markup
+	@param[in] srcLen source text length
+	@param[in,out] i index in src (token to parse on input, next token on output)
+	@param[in,out] context current context
+	@param[in] userData dictionary (NMEAutolinkDict const *)
+	@return TRUE for conversion, else FALSE
+*/
+NMEBoolean NMEAutoconvertDict(NMEConstText src, NMEInt srcLen,
+		NMEInt *i,
+		NMEContext *context,
+		void *userData);
+
+/** Scan function of NMEAutoconvertDict
+	@param[in] src source text with markup
+	@param[in] srcLen source text length
+	@param[in] i index in src where to begin
+	@param[in] userData dictionary (NMEAutolinkDict const *)
+	@return index of the first blank >= i followed by a term, or srcLen
+*/
+NMEInt NMEAutoconvertDictScan(NMEConstText src, NMEInt srcLen,
+		NMEInt i,
+		void *userData);
+
+/// NMEAutoconvertDict entry for table of NMEAutoconvert
+#define NMEAutoconvertDictEntry(dict) \
+	{NMEAutoconvertDict, (void *)(dict), kNMEAutolinkTriggers, \
+		NMEAutoconvertDictScan, TRUE}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
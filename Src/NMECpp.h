@@ -14,6 +14,7 @@
 #include "NME.h"
 #include "NMEErrorCpp.h"
 #include <string.h>
+#include <new>
 
 /** @brief NME parser class (objects can be used for multiple
 conversions, by changing input and/or output format before getting
@@ -152,49 +153,69 @@ class NME
 					*outputLength = 0;
 			}
 			
+			NMEErr err = kNMEErrOk;
 			if (!buf)
 			{
-				bufSize = 1024 + 2 * inputLength;
-				buf = new NMEChar[bufSize];
+				bufSize = 0;
+				err = growBuf(&buf, &bufSize, 1024 + 2 * inputLength, NULL);
 			}
 			
-			for (;;)
-			{
-				NMEErr err = NMEProcess(input, inputLength,
-						buf, bufSize,
+			NMEOutputSink sink = {growBuf, NULL, NULL};
+			if (err == kNMEErrOk)
+				err = NMEProcessToSink(input, inputLength,
+						&buf, &bufSize,
 						kNMEProcessOptDefault, "\n", &format, fontSize,
+						&sink,
 						&this->output, &this->outputLength, NULL);
-				if (err == kNMEErrOk)
-				{
-					if (output)
-						*output = this->output;
-					if (outputLength)
-						*outputLength = this->outputLength;
-					return kNMEErrOk;
-				}
-				else if (err == kNMEErrNotEnoughMemory)
-				{
-					if (bufSize >= 65536 + 10 * inputLength)
-#if defined(UseNMECppException)
-						throw NMEError(kNMEErrNotEnoughMemory);
-#else
-						return kNMEErrNotEnoughMemory;
-#endif
-					delete [] buf;
-					bufSize *= 2;
-					buf = new NMEChar[bufSize];
-				}
-				else
+			if (err != kNMEErrOk)
+			{
+				this->output = NULL;
 #if defined(UseNMECppException)
-					throw NMEError(err);
+				throw NMEError(err);
 #else
-					return err;
+				return err;
 #endif
 			}
+			
+			if (output)
+				*output = this->output;
+			if (outputLength)
+				*outputLength = this->outputLength;
+			return kNMEErrOk;
 		}
 		
 	protected:
 		
+		/** Grow or release a buffer with C++ operators new and delete
+		(NMESinkGrowFun for NMEProcessToSink).
+		@param[in,out] buf address of buffer
+		@param[in,out] bufSize address of size of buffer
+		@param[in] minSize new size, or 0 to release buffer
+		@param[in] data unused
+		@return error code (kNMEErrOk for success, kNMEErrNotEnoughMemory if
+		new fails, leaving the buffer unchanged)
+		*/
+		static NMEErr growBuf(NMEText *buf, NMEInt *bufSize, NMEInt minSize,
+				void *data)
+		{
+			NMEText b = NULL;
+			(void)data;
+			
+			if (minSize > 0)
+			{
+				b = new (std::nothrow) NMEChar[minSize];
+				if (!b)
+					return kNMEErrNotEnoughMemory;
+				if (*buf)
+					memcpy(b, *buf, *bufSize < minSize ? *bufSize : minSize);
+			}
+			if (*buf)
+				delete [] *buf;
+			*buf = b;
+			*bufSize = minSize;
+			return kNMEErrOk;
+		}
+		
 		NMEConstText input;	///< NME text input (belong to caller)
 		NMEInt inputLength;	///< length of input in bytes
 		
@@ -217,15 +217,44 @@ void NMEGtkApplyStyle(NMEGtk const *nmegtk,
 	}
 }
 
+/** Grow or release buffer with realloc (NMESinkGrowFun).
+	@param[in,out] buf address of buffer
+	@param[in,out] bufSize address of size of buffer
+	@param[in] minSize new size, or 0 to release buffer
+	@param[in] data unused
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr growBuffer(NMEText *buf, NMEInt *bufSize, NMEInt minSize,
+		void *data)
+{
+	NMEText b;
+	(void)data;
+	
+	if (minSize == 0)
+	{
+		free((void *)*buf);
+		*buf = NULL;
+		*bufSize = 0;
+		return kNMEErrOk;
+	}
+	b = realloc(*buf, minSize);
+	if (!b)
+		return kNMEErrNotEnoughMemory;
+	*buf = b;
+	*bufSize = minSize;
+	return kNMEErrOk;
+}
+
 NMEErr NMEGtkInsert(GtkTextBuffer *textBuffer,
 		NMEGtk const *nmegtk,
 		NMEConstText str, NMEInt len,
 		NMEBoolean replaceSel,
 		NMEBoolean links)
 {
-	NMEText buf, dest;
-	NMEInt bufSize, destLen, destLenUCS16;
+	NMEText buf = NULL, dest;
+	NMEInt bufSize = 0, styleSize, destLen, destLenUCS16;
 	NMEOutputFormat f;
+	NMEOutputSink sink = {growBuffer, NULL, NULL};
 	NMEErr err;
 	int length;
 	GtkTextIter iter;
@@ -233,37 +262,35 @@ NMEErr NMEGtkInsert(GtkTextBuffer *textBuffer,
 	if (len < 0)
 		len = strlen(str);
 	
-	bufSize = 1024 + 2 * len;
+	styleSize = 1024 + 2 * len;
 	f = NMEOutputFormatBasicText;
 	f.spanHookFun = NMEStyleSpanHook;
 	f.parHookFun = NMEStyleSpanHook;
 	
 tryAgain:
-	buf = malloc(bufSize);
-	if (!buf)
-		return kNMEErrNotEnoughMemory;
-	f.hookData = malloc(bufSize);
+	f.hookData = malloc(styleSize);
 	if (!f.hookData)
 	{
-		free((void *)buf);
+		growBuffer(&buf, &bufSize, 0, NULL);
 		return kNMEErrNotEnoughMemory;
 	}
-	NMEStyleInit((NMEStyleTable *)f.hookData, bufSize, TRUE);
+	NMEStyleInit((NMEStyleTable *)f.hookData, styleSize, TRUE);
 	
-	err = NMEProcess(str, len, buf, bufSize,
+	err = NMEProcessToSink(str, len, &buf, &bufSize,
 			kNMEProcessOptDefault, "\n", &f, 0,
+			&sink,
 			&dest, &destLen, &destLenUCS16);
-	if (err == kNMEErrNotEnoughMemory || err == kNMEErrStyleTableTooSmall)
+	if (err != kNMEErrOk)
 	{
-		free((void *)buf);
 		free((void *)f.hookData);
-		if (bufSize < 65536 + 10 * len)
+		if (err == kNMEErrStyleTableTooSmall && styleSize < 65536 + 10 * len)
 		{
-			bufSize *= 2;
+			// only the style table must be enlarged; buf is reused
+			styleSize *= 2;
 			goto tryAgain;
 		}
-		else
-			return kNMEErrNotEnoughMemory;
+		growBuffer(&buf, &bufSize, 0, NULL);
+		return err;
 	}
 	
 	if (replaceSel)
@@ -281,7 +308,7 @@ tryAgain:
 				0, destLenUCS16, links ? str : NULL);
 	}
 	
-	free((void *)buf);
+	growBuffer(&buf, &bufSize, 0, NULL);
 	free((void *)f.hookData);
 	
 	return kNMEErrOk;
@@ -10,12 +10,33 @@
  *	@code
  *	./nme <readme.nme >readme.html
  *	@endcode
+ *	or, with file names as arguments (regular input files are mapped in
+ *	memory instead of being read):
+ *	@code
+ *	./nme readme.nme readme.html
+ *	@endcode
+ *	It can also convert all the .nme files of directory wiki to directory
+ *	site with 8 threads, skipping files which haven't changed since the
+ *	last build (with the same options) and removing the output of deleted
+ *	files:
+ *	@code
+ *	./nme --build wiki site --jobs 8
+ *	@endcode
  *	Here is the list of options it supports:
  *	- \c --1eol           single eol as paragraph breaks
  *	- \c --2eol           double eol as paragraph breaks (default)
  *	- \c --autocclink     automatic conversion of camelCase words to links
+ *	- \c --autolinkdict \e file
+ *                        automatic conversion to links of the terms read
+ *                        from \e file, one per line (empty lines and lines
+ *                        beginning with # are ignored)
  *	- \c --autourl        automatic conversion of URLs to links
  *	- \c --body           naked body without header and footer
+ *	- \c --build \e src \e out
+ *                        convert all .nme files in directory \e src which
+ *                        have changed since the last build to directory
+ *                        \e out (the state of the build is kept in file
+ *                        .nme-build in \e out)
  *	- \c --checkhooks     check hooks
  *	- \c --easylink \e format
  *                        links are converted as follows: letters, digits,
@@ -36,6 +57,12 @@
  *	- \c --fontsize \e s  font size (0=default)
  *	- \c --help           this help message
  *	- \c --html           HTML output (default)
+ *	- \c --interwikis \e file
+ *                        interwikis read from \e file, one per line: alias
+ *                        (including ending colon if any) and URL prefix
+ *                        separated by blanks (lines beginning with # are
+ *                        ignored)
+ *	- \c --jobs \e n       number of threads with \c --build
  *	- \c --jspwiki        JSPWiki output
  *	- \c --latex          LaTeX output
  *	- \c --man            man page output
@@ -46,20 +73,35 @@
  *  - \c --structdiv      display division structure
  *  - \c --structpar      display paragraph structure
  *	- \c --rtf            RTF output
+ *	- \c --stream         convert input block by block as it is read, with
+ *                        little memory (tables of contents are empty)
  *	- \c --text           plain text output
  *	- \c --textc          compact plain text output
+ *	- \c --threads \e n    convert whole input in segments with \e n threads
+ *                        (sequentially with hooks)
  *	- \c --xref           headings have hyperlink target labels
  */
 
 /* License: new BSD license (see NME.h) */
 
-// To compile: gcc -o nme NME.c NMEAutolink.c NMEMain.c
+// To compile (POSIX required: pthread for --threads and --jobs, dirent for
+// --build, mmap for input files):
+// gcc -o nme NME.c NMEAutolink.c NMEAutolinkDict.c NMEPluginCalendar.c \
+//	NMEPluginRaw.c NMEPluginReverse.c NMEPluginRot13.c NMEPluginTOC.c \
+//	NMEPluginUppercase.c NMEMain.c -lpthread
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "NME.h"
 #include "NMEAutolink.h"
+#include "NMEAutolinkDict.h"
 #include "NMEPluginRot13.h"
 #include "NMEPluginReverse.h"
 #include "NMEPluginUppercase.h"
@@ -67,18 +109,55 @@
 #include "NMEPluginRaw.h"
 #include "NMEPluginTOC.h"
 
-/// Fixed size allocated for source :-(
-#define SIZE (128 * 1024)
+/// Minimum size of the output buffer, in addition to twice the input size
+#define kMinOutputSize (128 * 1024)
+
+/// Size of chunks read from stdin with --stream
+#define kStreamChunkSize (16 * 1024)
+
+/// Maximum number of threads with --threads
+#define kMaxThreads 64
+
+/// Minimum size of segments converted in parallel with --threads
+#define kMinSegmentSize (16 * 1024)
+
+/// Maximum length of paths with --build
+#define kMaxPath 4096
+
+/// Maximum length of the suffix of output files with --build, including null byte
+#define kMaxExt 32
+
+/// Maximum number of plugins in a table
+#define kMaxPlugins 32
+
+/// Maximum number of headings collected for tables of contents
+#define kMaxTocHeadings 1024
+
+/// Name of the manifest file written in the output directory by --build
+#define kBuildManifest ".nme-build"
+
+/// Initial value of hashText (64-bit FNV-1a offset basis)
+#define kHashSeed 0xcbf29ce484222325ULL
+
+/// Error code for write errors on stdout
+#define kErrWrite kNMEErr1stUser
+/// Error code for read errors
+#define kErrRead (kNMEErr1stUser + 1)
 
 // Cf. www.wikimatrix.org
 
-/** Table of character substitutions for HTML or XML */
-static NMEEncodeCharDict const xmlCharDict[] =
-{
-	{'<', "&lt;"},
-	{'&', "&amp;"},
-	{0, NULL}
-};
+/** Table of character substitutions for HTML or XML (entries after '<' are NULL) */
+static NMEEncodeCharTable const xmlCharTable =
+{{
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x00
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x08
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x10
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x18
+	NULL, NULL, NULL, NULL, NULL, NULL, "&amp;", NULL,	// 0x20
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x28
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x30
+	NULL, NULL, NULL, NULL, "&lt;"	// 0x38
+}};
 
 /// Format strings for slides in HTML
 static NMEOutputFormat const NMEOutputFormatSlidesHTML =
@@ -151,14 +230,15 @@ static NMEOutputFormat const NMEOutputFormatSlidesHTML =
 	"<img src=\"", "\" />", "\" alt=\"", FALSE, TRUE,	// image
 	NULL,	// interwiki
 	NULL, NULL,	// encodeURLFun
-	NMEEncodeCharFunDict, (void *)xmlCharDict,	// char encoder
-	NMEEncodeCharFunDict, (void *)xmlCharDict,	// char pre encoder
+	NMEEncodeCharFunTable, (void *)&xmlCharTable,	// char encoder
+	NMEEncodeCharFunTable, (void *)&xmlCharTable,	// char pre encoder
 	70, NULL, NULL,	// wordwrap
 	NULL, NULL,	// char hook
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	NMEEncodeRunFunTable, NMEEncodeRunFunTable	// run encoders
 };
 
 /// Format strings for Mediawiki output (NOT FINISHED!)
@@ -208,22 +288,30 @@ static NMEOutputFormat const NMEOutputFormatMediawiki =
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
+	NULL, NULL,	// getVar
+	NULL, NULL	// run encoders
 };
 
-/** Table of character substitutions for JSPWiki */
-static NMEEncodeCharDict const jspwikiCharDict[] =
-{
-	{'*', "~*"},
-	{'#', "~#"},
-	{'\\', "~\\"},
-	{'_', "~_"},
-	{'!', "~!"},
-	{'{', "~{"},
-	{'}', "~}"},
-	{'~', "~~"},
-	{0, NULL}
-};
+/** Table of character substitutions for JSPWiki (entries after '~' are NULL) */
+static NMEEncodeCharTable const jspwikiCharTable =
+{{
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x00
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x08
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x10
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x18
+	NULL, "~!", NULL, "~#", NULL, NULL, NULL, NULL,	// 0x20
+	NULL, NULL, "~*", NULL, NULL, NULL, NULL, NULL,	// 0x28
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x30
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x38
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x40
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x48
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x50
+	NULL, NULL, NULL, NULL, "~\\", NULL, NULL, "~_",	// 0x58
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x60
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x68
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,	// 0x70
+	NULL, NULL, NULL, "~{", NULL, "~}", "~~"	// 0x78
+}};
 
 /// Format strings for JSPWiki output
 static NMEOutputFormat const NMEOutputFormatJSPWiki =
@@ -265,31 +353,15 @@ static NMEOutputFormat const NMEOutputFormatJSPWiki =
 	"", "", NULL, FALSE, FALSE,	// image
 	NULL,	// interwiki
 	NULL, NULL,	// encodeURLFun
-	NMEEncodeCharFunDict, (void *)jspwikiCharDict,	// char encoder
+	NMEEncodeCharFunTable, (void *)&jspwikiCharTable,	// char encoder
 	NULL, NULL,	// char pre encoder
 	65, NULL, NULL,	// wordwrap
 	NULL, NULL,	// char hook
 	NULL, NULL, NULL, NULL,	// process hooks
 	NULL,	// plugins
 	NULL,	// autoconverts
-	NULL, NULL	// getVar
-};
-
-/// User data of NMEPluginTOCEntry
-static NMEPluginTocData tocData;
-
-/// Table of plugins for conversion to HTML
-static NMEPlugin const pluginsHTML[] =
-{
-	NMEPluginReverseEntry,
-	NMEPluginRot13Entry,
-	NMEPluginUppercaseEntry,
-	NMEPluginRawEntry("rawinpar", kNMEPluginOptDefault),
-	NMEPluginRawEntry("rawoutpar", kNMEPluginOptBetweenPar),
-	NMEPluginCalendarEntry,
-	NMEPluginTOCEntry(&tocData),
-	
-	NMEPluginTableEnd
+	NULL, NULL,	// getVar
+	NMEEncodeRunFunTable, NULL	// run encoders
 };
 
 /// Table of plugins for conversion to all formats but HTML/XML
@@ -303,9 +375,6 @@ static NMEPlugin const plugins[] =
 	NMEPluginTableEnd
 };
 
-/// Table of autoconvert functions
-static NMEAutoconvert autoconverts[16];
-
 /// Table of interwiki definitions
 static NMEInterwiki const interwikis[] =
 {
@@ -550,23 +619,861 @@ NMEErr encodeURLEasylink(NMEConstText link, NMEInt linkLen,
 	return kNMEErrOk;
 }
 
+/// Output sink callback for growing buffers with realloc
+static NMEErr growBuffer(NMEText *buf, NMEInt *size, NMEInt minSize, void *data)
+{
+	NMEText b;
+	
+	(void)data;
+	
+	if (minSize == 0)
+	{
+		free((void *)*buf);
+		*buf = NULL;
+		*size = 0;
+		return kNMEErrOk;
+	}
+	
+	// grow by at least 50% to avoid too many reallocations
+	if (minSize < *size + *size / 2)
+		minSize = *size + *size / 2;
+	b = realloc(*buf, minSize);
+	if (!b)
+		return kNMEErrNotEnoughMemory;
+	*buf = b;
+	*size = minSize;
+	return kNMEErrOk;
+}
+
+/** Write data to a file descriptor directly, without stdio buffering.
+	@param[in] fd file descriptor
+	@param[in] data data
+	@param[in] len length of data
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr writeAll(int fd, NMEConstText data, NMEInt len)
+{
+	ssize_t n;
+	
+	while (len > 0)
+	{
+		n = write(fd, data, len);
+		if (n < 0 && errno != EINTR)
+			return kErrWrite;
+		if (n > 0)
+		{
+			data += n;
+			len -= n;
+		}
+	}
+	return kNMEErrOk;
+}
+
+/// Output sink callback for writing complete lines to stdout
+static NMEErr flushStdout(NMEConstText output, NMEInt outputLen, void *data)
+{
+	(void)data;
+	
+	return writeAll(fileno(stdout), output, outputLen);
+}
+
+/** Convert stdin to stdout block by block.
+	@param[in] options sum of options
+	@param[in] outputFormat format strings
+	@param[in] fontSize default font size
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr processStream(NMEInt options,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize)
+{
+	static NMEOutputSink const sink = {growBuffer, flushStdout, NULL};
+	NMEStream stream;
+	NMEText buf = NULL, chunk;
+	NMEInt bufSize = 0;
+	size_t n;
+	NMEErr err;
+	
+	chunk = malloc(kStreamChunkSize);
+	if (!chunk)
+		return kNMEErrNotEnoughMemory;
+	
+	err = NMEStreamBegin(&stream, &buf, &bufSize,
+			options, "\n", outputFormat, fontSize, &sink);
+	if (err == kNMEErrOk)
+	{
+		while (err == kNMEErrOk
+				&& (n = fread(chunk, 1, kStreamChunkSize, stdin)) > 0)
+			err = NMEStreamFeed(&stream, chunk, (NMEInt)n);
+		err = NMEStreamEnd(&stream, NULL, NULL, NULL);
+	}
+	
+	if (buf)
+		(void)growBuffer(&buf, &bufSize, 0, NULL);
+	free((void *)chunk);
+	
+	return err;
+}
+
+/** Read a whole file.
+	@param[in] f file
+	@param[out] src address of source, allocated with growBuffer
+	@param[out] srcLen length of source
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr readFile(FILE *f, NMEText *src, NMEInt *srcLen)
+{
+	NMEInt size = 0;
+	size_t n;
+	NMEErr err;
+	
+	*src = NULL;
+	*srcLen = 0;
+	do
+	{
+		err = growBuffer(src, &size, *srcLen + kStreamChunkSize, NULL);
+		if (err != kNMEErrOk)
+			return err;
+		n = fread(*src + *srcLen, 1, size - *srcLen, f);
+		*srcLen += (NMEInt)n;
+	} while (n > 0);
+	
+	return ferror(f) ? kErrRead : kNMEErrOk;
+}
+
+/** Load a whole file, mapping it in memory if it's a regular file read from
+	its beginning, or reading it by chunks otherwise (pipes or terminals).
+	@param[in] f file
+	@param[out] src address of source
+	@param[out] srcLen length of source
+	@param[out] mapped TRUE if src is mapped, FALSE if it's allocated
+	@return error code (kNMEErrOk for success)
+	@see releaseFile
+*/
+static NMEErr loadFile(FILE *f, NMEText *src, NMEInt *srcLen, NMEBoolean *mapped)
+{
+	struct stat st;
+	void *p;
+	
+	*mapped = FALSE;
+	if (!fstat(fileno(f), &st) && S_ISREG(st.st_mode)
+			&& st.st_size > 0 && st.st_size < 0x7fffffff
+			&& lseek(fileno(f), 0, SEEK_CUR) == 0)
+	{
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (p != MAP_FAILED)
+		{
+			(void)posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+			*src = (NMEText)p;
+			*srcLen = (NMEInt)st.st_size;
+			*mapped = TRUE;
+			return kNMEErrOk;
+		}
+	}
+	return readFile(f, src, srcLen);
+}
+
+/** Release a file loaded by loadFile.
+	@param[in] src source
+	@param[in] srcLen length of source
+	@param[in] mapped TRUE if src is mapped, FALSE if it's allocated
+*/
+static void releaseFile(NMEText src, NMEInt srcLen, NMEBoolean mapped)
+{
+	if (mapped)
+		munmap((void *)src, srcLen);
+	else
+		free((void *)src);
+}
+
+/// Job queue shared by the threads of runJobs
+typedef struct
+{
+	NMEInt jobCount;	///< number of jobs
+	NMEInt nextJob;	///< index of next job to run
+	pthread_mutex_t mutex;	///< mutex for nextJob
+	NMEJobFun jobFun;	///< job function
+	void *jobData;	///< data passed to jobFun
+} JobQueue;
+
+/// Thread function which runs jobs until there is none left
+static void *runJobThread(void *data)
+{
+	JobQueue *queue = (JobQueue *)data;
+	NMEInt job;
+	
+	for (;;)
+	{
+		pthread_mutex_lock(&queue->mutex);
+		job = queue->nextJob++;
+		pthread_mutex_unlock(&queue->mutex);
+		if (job >= queue->jobCount)
+			return NULL;
+		queue->jobFun(job, queue->jobData);
+	}
+}
+
+/// NMERunJobsFun callback which runs jobs on *(int *)data threads,
+/// including the current one
+static NMEErr runJobs(NMEInt jobCount, NMEJobFun jobFun, void *jobData, void *data)
+{
+	int threadCount = *(int *)data;
+	pthread_t threads[kMaxThreads];
+	JobQueue queue;
+	int i, n;
+	
+	queue.jobCount = jobCount;
+	queue.nextJob = 0;
+	queue.jobFun = jobFun;
+	queue.jobData = jobData;
+	if (pthread_mutex_init(&queue.mutex, NULL))
+		return kNMEErrNotEnoughMemory;
+	
+	for (n = 0; n + 1 < threadCount && n + 1 < jobCount; n++)
+		if (pthread_create(&threads[n], NULL, runJobThread, &queue))
+			break;	// fewer threads
+	(void)runJobThread(&queue);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	
+	pthread_mutex_destroy(&queue.mutex);
+	return kNMEErrOk;
+}
+
+/// Output sink callback for writing complete lines to the file in data
+static NMEErr flushFile(NMEConstText output, NMEInt outputLen, void *data)
+{
+	return fwrite(output, 1, outputLen, (FILE *)data) == (size_t)outputLen
+			? kNMEErrOk : kErrWrite;
+}
+
+/** Read a table of interwikis from a file, one per line: alias (including
+	ending colon if any) and URL prefix separated by blanks (empty if the
+	line has only an alias); empty lines and lines beginning with # are
+	ignored.
+	@param[in] path file path
+	@param[out] interwikis table allocated with malloc, terminated by alias=NULL
+	@param[out] text contents of the file, referenced by interwikis
+	(allocated with growBuffer)
+	@param[out] textLen length of text
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr readInterwikis(char const *path,
+		NMEInterwiki **interwikis,
+		NMEText *text, NMEInt *textLen)
+{
+	FILE *f;
+	NMEInt i, j, k, n;
+	NMEErr err;
+	
+	*interwikis = NULL;
+	f = fopen(path, "rb");
+	if (!f)
+		return kErrRead;
+	err = readFile(f, text, textLen);
+	fclose(f);
+	if (err != kNMEErrOk)
+		return err;
+	
+	// at most one interwiki per line
+	for (i = 0, n = 1; i < *textLen; i++)
+		if ((*text)[i] == '\n')
+			n++;
+	*interwikis = malloc((n + 1) * sizeof(NMEInterwiki));
+	if (!*interwikis)
+		return kNMEErrNotEnoughMemory;
+	
+	// split lines in place (readFile leaves room for a null byte at the end)
+	(*text)[*textLen] = '\0';
+	for (i = n = 0; i < *textLen; )
+	{
+		for (; i < *textLen && ((*text)[i] == ' ' || (*text)[i] == '\t'); i++)
+			;
+		for (j = i; j < *textLen && (*text)[j] != '\n' && (*text)[j] != '\r'; j++)
+			;
+		if (j > i && (*text)[i] != '#')
+		{
+			(*text)[j] = '\0';	// empty URL prefix if the line has only an alias
+			(*interwikis)[n].alias = *text + i;
+			for (; i < j && (*text)[i] != ' ' && (*text)[i] != '\t'; i++)
+				;
+			k = i;	// end of alias
+			for (; i < j && ((*text)[i] == ' ' || (*text)[i] == '\t'); i++)
+				;
+			(*interwikis)[n++].urlPrefix = *text + i;
+			for (i = j; (*text)[i - 1] == ' ' || (*text)[i - 1] == '\t'; i--)
+				;
+			(*text)[i] = '\0';
+			(*text)[k] = '\0';
+		}
+		i = j + 1;	// skip eol
+	}
+	(*interwikis)[n].alias = (*interwikis)[n].urlPrefix = NULL;
+	
+	return kNMEErrOk;
+}
+
+/** Read a list of terms from a file, one per line; empty lines and lines
+	beginning with # are ignored.
+	@param[in] path file path
+	@param[out] terms array allocated with malloc, terminated by NULL
+	@param[out] text contents of the file, referenced by terms
+	(allocated with growBuffer)
+	@param[out] textLen length of text
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr readTerms(char const *path,
+		NMEConstText **terms,
+		NMEText *text, NMEInt *textLen)
+{
+	FILE *f;
+	NMEInt i, j, n;
+	NMEErr err;
+	
+	*terms = NULL;
+	f = fopen(path, "rb");
+	if (!f)
+		return kErrRead;
+	err = readFile(f, text, textLen);
+	fclose(f);
+	if (err != kNMEErrOk)
+		return err;
+	
+	// at most one term per line
+	for (i = 0, n = 1; i < *textLen; i++)
+		if ((*text)[i] == '\n')
+			n++;
+	*terms = malloc((n + 1) * sizeof(NMEConstText));
+	if (!*terms)
+		return kNMEErrNotEnoughMemory;
+	
+	// split lines in place (readFile leaves room for a null byte at the end)
+	(*text)[*textLen] = '\0';
+	for (i = n = 0; i < *textLen; i = j + 1)
+	{
+		for (j = i; j < *textLen && (*text)[j] != '\n' && (*text)[j] != '\r'; j++)
+			;
+		if (j > i && (*text)[i] != '#')
+		{
+			(*terms)[n++] = *text + i;
+			(*text)[j] = '\0';
+		}
+	}
+	(*terms)[n] = NULL;
+	
+	return kNMEErrOk;
+}
+
+/** Hash data (64-bit FNV-1a).
+	@param[in] data data
+	@param[in] len length of data
+	@param[in] hash initial value (kHashSeed, or hash of preceding data)
+	@return hash value
+*/
+static unsigned long long hashText(NMEConstText data, NMEInt len,
+		unsigned long long hash)
+{
+	NMEInt i;
+	
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+/// State of a source file recorded in the manifest of --build
+typedef struct
+{
+	char *path;	///< path relative to the source directory (malloc)
+	unsigned long long hash;	///< hash of contents
+	long long mtime;	///< modification time
+	long long size;	///< size in bytes
+} BuildEntry;
+
+/// Page converted by --build
+typedef struct
+{
+	BuildEntry entry;	///< current state
+	BuildEntry const *old;	///< state in previous manifest, or NULL
+	NMEBoolean converted;	///< TRUE if converted, FALSE if up to date
+	NMEErr err;	///< result of conversion
+} BuildPage;
+
+/// Static site build (--build)
+typedef struct
+{
+	char const *srcDir;	///< source directory
+	char const *outDir;	///< output directory
+	char const *ext;	///< suffix of output files, replacing .nme
+	NMEInt options;	///< kNMEProcessOptDefault or sum of options
+	NMEOutputFormat const *outputFormat;	///< format strings
+	NMEInt fontSize;	///< font size
+	NMEPluginTocData *tocData;	/**< data of the TOC plugin in outputFormat,
+		which is used in place by a single thread because of hooks (NULL to
+		convert pages with their own plugins) */
+	NMEBoolean sameOptions;	///< TRUE if manifest was built with the same options
+	char oldExt[kMaxExt];	///< suffix of output files of the pages in manifest
+	struct stat outDirStat;	///< to skip output directory in source directory
+	BuildPage *pages;	///< pages sorted by path
+	int pageCount;	///< number of pages
+	BuildEntry *manifest;	///< previous manifest sorted by path
+	int manifestCount;	///< number of entries in manifest
+} Build;
+
+/// Comparison function for sorting BuildEntry or BuildPage by path with qsort
+static int compareBuildPath(void const *a, void const *b)
+{
+	return strcmp(((BuildEntry const *)a)->path, ((BuildEntry const *)b)->path);
+}
+
+/** Make the path of the output file of a page.
+	@param[in] build build
+	@param[in] path path relative to the source directory
+	@param[in] ext suffix of output file, replacing .nme
+	@param[out] outPath output path (kMaxPath bytes)
+	@return TRUE for success, FALSE if too long
+*/
+static NMEBoolean makeOutputPath(Build const *build, char const *path,
+		char const *ext,
+		char *outPath)
+{
+	int len = strlen(path);
+	
+	if (len > 4 && !strcmp(path + len - 4, ".nme"))
+		len -= 4;
+	return snprintf(outPath, kMaxPath, "%s/%.*s%s",
+			build->outDir, len, path, ext) < kMaxPath;
+}
+
+/** Create the missing directories of a path.
+	@param[in] path path of file
+	@return TRUE for success, FALSE for failure
+*/
+static NMEBoolean makeParentDirs(char const *path)
+{
+	char dir[kMaxPath];
+	int i;
+	
+	for (i = 0; path[i] && i < kMaxPath - 1; i++)
+	{
+		if (i > 0 && path[i] == '/')
+		{
+			dir[i] = '\0';
+			if (mkdir(dir, 0777) && errno != EEXIST)
+				return FALSE;
+		}
+		dir[i] = path[i];
+	}
+	return TRUE;
+}
+
+/** Add the .nme files found in a directory and its subdirectories to a
+	build, skipping hidden files and the output directory.
+	@param[in,out] build build
+	@param[in] dirPath path of directory relative to the source directory
+	(empty for the source directory itself)
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr listBuildPages(Build *build, char const *dirPath)
+{
+	char path[kMaxPath], relPath[kMaxPath];
+	DIR *dir;
+	struct dirent *d;
+	struct stat st;
+	BuildPage *pages;
+	int len;
+	NMEErr err = kNMEErrOk;
+	
+	snprintf(path, kMaxPath, "%s/%s", build->srcDir, dirPath);
+	dir = opendir(path);
+	if (!dir)
+		return kErrRead;
+	while (err == kNMEErrOk && (d = readdir(dir)) != NULL)
+	{
+		if (d->d_name[0] == '.')
+			continue;
+		if (snprintf(relPath, kMaxPath, "%s%s%s", dirPath, dirPath[0] ? "/" : "",
+					d->d_name) >= kMaxPath
+				|| snprintf(path, kMaxPath, "%s/%s", build->srcDir, relPath)
+					>= kMaxPath
+				|| stat(path, &st))
+			continue;
+		len = strlen(d->d_name);
+		if (S_ISDIR(st.st_mode))
+		{
+			if (st.st_dev != build->outDirStat.st_dev
+					|| st.st_ino != build->outDirStat.st_ino)
+				err = listBuildPages(build, relPath);
+		}
+		else if (S_ISREG(st.st_mode) && len > 4
+				&& !strcmp(d->d_name + len - 4, ".nme"))
+		{
+			if ((build->pageCount & 1023) == 0)
+			{
+				pages = realloc(build->pages,
+						(build->pageCount + 1024) * sizeof(BuildPage));
+				if (!pages)
+				{
+					err = kNMEErrNotEnoughMemory;
+					break;
+				}
+				build->pages = pages;
+			}
+			build->pages[build->pageCount].entry.path = strdup(relPath);
+			if (!build->pages[build->pageCount].entry.path)
+			{
+				err = kNMEErrNotEnoughMemory;
+				break;
+			}
+			build->pages[build->pageCount].entry.hash = 0;
+			build->pages[build->pageCount].entry.mtime = (long long)st.st_mtime;
+			build->pages[build->pageCount].entry.size = (long long)st.st_size;
+			build->pages[build->pageCount].old = NULL;
+			build->pages[build->pageCount].converted = FALSE;
+			build->pages[build->pageCount].err = kNMEErrOk;
+			build->pageCount++;
+		}
+	}
+	closedir(dir);
+	
+	return err;
+}
+
+/** Read the manifest of a previous build, if any.
+	@param[in,out] build build
+	@param[in] signature hash of options and output format
+*/
+static void readBuildManifest(Build *build, unsigned long long signature)
+{
+	char path[kMaxPath], line[kMaxPath + 64], ext[kMaxExt];
+	FILE *f;
+	BuildEntry entry, *manifest;
+	unsigned long long s;
+	int n, len;
+	
+	snprintf(path, kMaxPath, "%s/%s", build->outDir, kBuildManifest);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fgets(line, sizeof(line), f)
+			&& (n = sscanf(line, "nme-build %llx %31s", &s, ext)) >= 1)
+	{
+		build->sameOptions = s == signature;
+		if (n == 2)
+			strcpy(build->oldExt, ext);
+	}
+	while (fgets(line, sizeof(line), f))
+	{
+		len = strlen(line);
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (sscanf(line, "%llx %lld %lld %n",
+				&entry.hash, &entry.mtime, &entry.size, &n) < 3 || !line[n])
+			continue;	// bad line
+		if ((build->manifestCount & 1023) == 0)
+		{
+			manifest = realloc(build->manifest,
+					(build->manifestCount + 1024) * sizeof(BuildEntry));
+			if (!manifest)
+				break;
+			build->manifest = manifest;
+		}
+		entry.path = strdup(line + n);
+		if (!entry.path)
+			break;
+		build->manifest[build->manifestCount++] = entry;
+	}
+	fclose(f);
+	
+	qsort(build->manifest, build->manifestCount, sizeof(BuildEntry),
+			compareBuildPath);
+}
+
+/** Write the manifest of a build, with pages converted successfully.
+	@param[in] build build
+	@param[in] signature hash of options and output format
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr writeBuildManifest(Build const *build, unsigned long long signature)
+{
+	char path[kMaxPath], tmpPath[kMaxPath];
+	FILE *f;
+	int i;
+	
+	snprintf(path, kMaxPath, "%s/%s", build->outDir, kBuildManifest);
+	snprintf(tmpPath, kMaxPath, "%s/%s.tmp", build->outDir, kBuildManifest);
+	f = fopen(tmpPath, "w");
+	if (!f)
+		return kErrWrite;
+	fprintf(f, "nme-build %016llx %s\n", signature, build->ext);
+	for (i = 0; i < build->pageCount; i++)
+		if (build->pages[i].err == kNMEErrOk)
+			fprintf(f, "%016llx %lld %lld %s\n",
+					build->pages[i].entry.hash,
+					build->pages[i].entry.mtime,
+					build->pages[i].entry.size,
+					build->pages[i].entry.path);
+	if (fclose(f) || rename(tmpPath, path))
+		return kErrWrite;
+	return kNMEErrOk;
+}
+
+/** Convert a page of a build if it has changed (NMEJobFun).
+	@param[in] job index of page
+	@param[in,out] jobData build
+*/
+static void buildPage(NMEInt job, void *jobData)
+{
+	Build *build = (Build *)jobData;
+	BuildPage *page = &build->pages[job];
+	char srcPath[kMaxPath], outPath[kMaxPath];
+	NMEPlugin plugins[kMaxPlugins];
+	NMEPluginTocData tocData;
+	NMEPluginTocHeading tocHeadings[kMaxTocHeadings];
+	NMEOutputFormat outputFormat;
+	NMEOutputFormat const *format;
+	NMEOutputSink sink = {growBuffer, flushFile, NULL};
+	NMEText src = NULL, buf = NULL, output;
+	NMEInt srcLen, bufSize = 0, outputLen, i;
+	NMEBoolean upToDate;
+	struct stat st;
+	FILE *f;
+	
+	if (snprintf(srcPath, kMaxPath, "%s/%s", build->srcDir, page->entry.path)
+				>= kMaxPath
+			|| !makeOutputPath(build, page->entry.path, build->ext, outPath))
+	{
+		page->err = kErrRead;
+		return;
+	}
+	
+	// unchanged file: same size and modification time
+	upToDate = build->sameOptions && page->old && !stat(outPath, &st);
+	if (upToDate
+			&& page->old->mtime == page->entry.mtime
+			&& page->old->size == page->entry.size)
+	{
+		page->entry.hash = page->old->hash;
+		return;
+	}
+	
+	// read source and compare its hash (e.g. file touched or restored)
+	f = fopen(srcPath, "rb");
+	if (!f)
+	{
+		page->err = kErrRead;
+		return;
+	}
+	page->err = readFile(f, &src, &srcLen);
+	fclose(f);
+	if (page->err != kNMEErrOk)
+	{
+		free((void *)src);
+		return;
+	}
+	page->entry.hash = hashText(src, srcLen, kHashSeed);
+	if (upToDate && page->old->hash == page->entry.hash)
+	{
+		free((void *)src);
+		return;
+	}
+	
+	// plugins with the source of this page for the table of contents
+	outputFormat = *build->outputFormat;
+	format = &outputFormat;
+	if (build->tocData)
+	{
+		// hooks may change the output format in place
+		build->tocData->src = src;
+		build->tocData->srcLen = srcLen;
+		format = build->outputFormat;
+	}
+	else if (outputFormat.plugins)
+	{
+		tocData.src = src;
+		tocData.srcLen = srcLen;
+		for (i = 0; i < kMaxPlugins - 1 && outputFormat.plugins[i].name; i++)
+		{
+			plugins[i] = outputFormat.plugins[i];
+			if (plugins[i].cb == NMEPluginTOC)
+				plugins[i].userData = (void *)&tocData;
+		}
+		plugins[i] = outputFormat.plugins[i];
+		outputFormat.plugins = plugins;
+		
+		// whole page is converted at once: headings collected in one pass
+		tocData.headings = tocHeadings;
+		tocData.maxHeadings = kMaxTocHeadings;
+		NMEPluginTOCCollectHeadings(&outputFormat, &tocData);
+	}
+	
+	if (!makeParentDirs(outPath) || !(f = fopen(outPath, "wb")))
+		page->err = kErrWrite;
+	else
+	{
+		sink.data = (void *)f;
+		page->err = NMEProcessToSink(src, srcLen, &buf, &bufSize,
+				build->options, "\n", format, build->fontSize,
+				&sink, &output, &outputLen, NULL);
+		if (fclose(f) && page->err == kNMEErrOk)
+			page->err = kErrWrite;
+		page->converted = TRUE;
+	}
+	
+	if (buf)
+		(void)growBuffer(&buf, &bufSize, 0, NULL);
+	free((void *)src);
+}
+
+/** Convert all the .nme files of a directory which have changed since the
+	previous build, in parallel.
+	@param[in] srcDir source directory
+	@param[in] outDir output directory
+	@param[in] ext suffix of output files, replacing .nme
+	@param[in] signature hash of options and output format
+	@param[in] options sum of options
+	@param[in] outputFormat format strings
+	@param[in] fontSize default font size
+	@param[in,out] tocData data of the TOC plugin in outputFormat if
+	outputFormat must be used in place by a single thread, or NULL
+	@param[in] jobCount number of threads
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr buildSite(char const *srcDir, char const *outDir,
+		char const *ext, unsigned long long signature,
+		NMEInt options,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEPluginTocData *tocData,
+		int jobCount)
+{
+	Build build;
+	char outPath[kMaxPath];
+	int i, j, cmp, converted = 0, removed = 0, failed = 0;
+	NMEErr err;
+	
+	build.srcDir = srcDir;
+	build.outDir = outDir;
+	build.ext = ext;
+	build.options = options;
+	build.outputFormat = outputFormat;
+	build.fontSize = fontSize;
+	build.tocData = tocData;
+	build.sameOptions = FALSE;
+	snprintf(build.oldExt, kMaxExt, "%s", ext);	// if not in manifest
+	build.pages = NULL;
+	build.pageCount = 0;
+	build.manifest = NULL;
+	build.manifestCount = 0;
+	
+	if ((mkdir(outDir, 0777) && errno != EEXIST) || stat(outDir, &build.outDirStat))
+		return kErrWrite;
+	err = listBuildPages(&build, "");
+	if (err == kNMEErrOk)
+	{
+		qsort(build.pages, build.pageCount, sizeof(BuildPage), compareBuildPath);
+		readBuildManifest(&build, signature);
+		
+		// match pages with manifest; remove output of deleted pages, and
+		// all the previous output if the suffix has changed (other format)
+		for (i = j = 0; j < build.manifestCount; j++)
+		{
+			for (cmp = -1;
+					i < build.pageCount
+						&& (cmp = strcmp(build.pages[i].entry.path,
+							build.manifest[j].path)) < 0;
+					i++)
+				;
+			if (cmp == 0)
+				build.pages[i].old = &build.manifest[j];
+			if ((cmp != 0 || strcmp(build.oldExt, ext))
+					&& makeOutputPath(&build, build.manifest[j].path, build.oldExt,
+						outPath)
+					&& !unlink(outPath))
+				removed++;
+		}
+		
+		err = runJobs(build.pageCount, buildPage, &build, &jobCount);
+	}
+	
+	if (err == kNMEErrOk)
+	{
+		for (i = 0; i < build.pageCount; i++)
+			if (build.pages[i].err != kNMEErrOk)
+			{
+				fprintf(stderr, "Error %d in %s\n",
+						build.pages[i].err, build.pages[i].entry.path);
+				failed++;
+			}
+			else if (build.pages[i].converted)
+				converted++;
+		err = writeBuildManifest(&build, signature);
+		printf("%d converted, %d up to date, %d removed, %d failed\n",
+				converted, build.pageCount - converted - failed, removed, failed);
+	}
+	
+	for (i = 0; i < build.pageCount; i++)
+		free((void *)build.pages[i].entry.path);
+	free((void *)build.pages);
+	for (j = 0; j < build.manifestCount; j++)
+		free((void *)build.manifest[j].path);
+	free((void *)build.manifest);
+	
+	return err;
+}
+
 /// Application entry point
 int main(int argc, char **argv)
 {
 	NMEText src = NULL, buf, dest;
-	NMEInt srcLen, destLen;
+	NMEInt srcLen, destLen, size;
 	NMEOutputFormat outputFormat = NMEOutputFormatHTML;
 	NMEInt options = kNMEProcessOptDefault;
 	NMEBoolean autoURLLink = FALSE, autoCCLink = FALSE;
+	NMEBoolean stream = FALSE;
+	NMEBoolean mapped;
+	char const *inputPath = NULL, *outputPath = NULL;
+	int threadCount = 0;
+	char const *buildSrcDir = NULL, *buildOutDir = NULL;
+	char const *ext = ".html";	// suffix of output files with --build
+	int jobCount = 1;
+	char const *interwikiPath = NULL;
+	NMEInterwiki *interwikiTable = NULL;	// read from interwikiPath
+	NMEText interwikiText = NULL;	// contents of interwikiPath
+	NMEInt interwikiTextLen = 0;
+	NMEInterwikiTrie interwikiTrie;
+	NMEOutputSink const trieSink = {growBuffer, NULL, NULL};
+	char const *dictPath = NULL;
+	NMEConstText *dictTerms = NULL;	// read from dictPath
+	NMEText dictText = NULL;	// contents of dictPath
+	NMEInt dictTextLen = 0;
+	NMEAutolinkDict dict;
+	unsigned long long signature;
 	int i;
 	int fontSize = 0;
 	HookDumpData hookDumpData;
 	HookTOCData hookTOCData;
 	HookEditData hookEditData;
 	HookCheckData hookCheckData;
+	NMEPluginTocData tocData;	// user data of NMEPluginTOCEntry
+	NMEPluginTocHeading tocHeadings[kMaxTocHeadings];
+	NMEPlugin const pluginsHTML[] =	// plugins for conversion to HTML
+	{
+		NMEPluginReverseEntry,
+		NMEPluginRot13Entry,
+		NMEPluginUppercaseEntry,
+		NMEPluginRawEntry("rawinpar", kNMEPluginOptDefault),
+		NMEPluginRawEntry("rawoutpar", kNMEPluginOptBetweenPar),
+		NMEPluginCalendarEntry,
+		NMEPluginTOCEntry(&tocData),
+		
+		NMEPluginTableEnd
+	};
+	NMEAutoconvert autoconverts[4] = {{NULL, NULL, NULL, NULL, FALSE}};	// terminated by cb=NULL
+	NMECompiledOutputFormat compiledFormat;	// format strings compiled once
 	NMEErr err;
 	
 	outputFormat.plugins = pluginsHTML;
+	tocData.headings = NULL;	// whole source converted again by default
 	
 	for (i = 1; i < argc; i++)
 		if (!strcmp(argv[i], "--body"))
@@ -581,44 +1488,54 @@ int main(int argc, char **argv)
 			autoCCLink = TRUE;
 		else if (!strcmp(argv[i], "--autourllink"))
 			autoURLLink = TRUE;
+		else if (!strcmp(argv[i], "--autolinkdict") && i + 1 < argc)
+			dictPath = argv[++i];
 		else if (!strcmp(argv[i], "--nme"))
 		{
 			outputFormat = NMEOutputFormatNME;
+			ext = ".nme";
 			outputFormat.plugins = plugins;
 		}
 		else if (!strcmp(argv[i], "--html"))
 		{
 			outputFormat = NMEOutputFormatHTML;
+			ext = ".html";
 			outputFormat.plugins = pluginsHTML;
 		}
 		else if (!strcmp(argv[i], "--slides"))
 		{
 			outputFormat = NMEOutputFormatSlidesHTML;
+			ext = ".html";
 			outputFormat.plugins = pluginsHTML;
 		}
 		else if (!strcmp(argv[i], "--jspwiki"))
 		{
 			outputFormat = NMEOutputFormatJSPWiki;
+			ext = ".txt";
 			outputFormat.plugins = plugins;
 		}
 		else if (!strcmp(argv[i], "--latex"))
 		{
 			outputFormat = NMEOutputFormatLaTeX;
+			ext = ".tex";
 			outputFormat.plugins = plugins;
 		}
 		else if (!strcmp(argv[i], "--mediawiki"))
 		{
 			outputFormat = NMEOutputFormatMediawiki;
+			ext = ".txt";
 			outputFormat.plugins = plugins;
 		}
 		else if (!strcmp(argv[i], "--null"))
 		{
 			outputFormat = NMEOutputFormatNull;
+			ext = ".txt";
 			outputFormat.plugins = NULL;
 		}
 		else if (!strcmp(argv[i], "--rtf"))
 		{
 			outputFormat = NMEOutputFormatRTF;
+			ext = ".rtf";
 			outputFormat.plugins = plugins;
 		}
 		else if (!strcmp(argv[i], "--editfrag") && i + 4 < argc)
@@ -634,6 +1551,7 @@ int main(int argc, char **argv)
 		else if (!strcmp(argv[i], "--structpar"))
 		{
 			outputFormat = NMEOutputFormatNull;
+			ext = ".txt";
 			outputFormat.parHookFun = hookDump;
 			outputFormat.divHookFun = NULL;
 			hookDumpData.nesting = 0;
@@ -642,6 +1560,7 @@ int main(int argc, char **argv)
 		else if (!strcmp(argv[i], "--structdiv"))
 		{
 			outputFormat = NMEOutputFormatNull;
+			ext = ".txt";
 			outputFormat.parHookFun = NULL;
 			outputFormat.divHookFun = hookDump;
 			hookDumpData.nesting = 0;
@@ -650,6 +1569,7 @@ int main(int argc, char **argv)
 		else if (!strcmp(argv[i], "--checkhooks"))
 		{
 			outputFormat = NMEOutputFormatNull;
+			ext = ".txt";
 			outputFormat.divHookFun = divHookCheck;
 			outputFormat.parHookFun = parHookCheck;
 			outputFormat.spanHookFun = spanHookCheck;
@@ -665,16 +1585,19 @@ int main(int argc, char **argv)
 		else if (!strcmp(argv[i], "--text"))
 		{
 			outputFormat = NMEOutputFormatText;
+			ext = ".txt";
 			outputFormat.plugins = plugins;
 		}
 		else if (!strcmp(argv[i], "--textc"))
 		{
 			outputFormat = NMEOutputFormatTextCompact;
+			ext = ".txt";
 			outputFormat.plugins = plugins;
 		}
 		else if (!strcmp(argv[i], "--man"))
 		{
 			outputFormat = NMEOutputFormatMan;
+			ext = ".man";
 			outputFormat.plugins = plugins;
 		}
 		else if (!strcmp(argv[i], "--fontsize") && i + 1 < argc)
@@ -689,17 +1612,57 @@ int main(int argc, char **argv)
 					| kNMEProcessOptNoDL | kNMEProcessOptVerbatimMono;
 		else if (!strcmp(argv[i], "--toc"))
 			NMESetTOCOutputFormat(&outputFormat, &hookTOCData);
+		else if (!strcmp(argv[i], "--stream"))
+			stream = TRUE;
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+		{
+			threadCount = strtol(argv[++i], NULL, 0);
+			if (threadCount < 1)
+				threadCount = 1;
+			else if (threadCount > kMaxThreads)
+				threadCount = kMaxThreads;
+		}
+		else if (!strcmp(argv[i], "--build") && i + 2 < argc)
+		{
+			buildSrcDir = argv[++i];
+			buildOutDir = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--interwikis") && i + 1 < argc)
+			interwikiPath = argv[++i];
+		else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+		{
+			jobCount = strtol(argv[++i], NULL, 0);
+			if (jobCount < 1)
+				jobCount = 1;
+			else if (jobCount > kMaxThreads)
+				jobCount = kMaxThreads;
+		}
+		else if ((argv[i][0] != '-' || !strcmp(argv[i], "-")) && !outputPath)
+		{
+			// input and output files ("-" for stdin or stdout)
+			if (!inputPath)
+				inputPath = argv[i];
+			else
+				outputPath = argv[i];
+		}
 		else
 		{
 			if (strcmp(argv[i], "--help"))
 				fprintf(stderr, "Unknown option %s\n", argv[i]);
-			fprintf(stderr, "Usage: %s [options]\n"
-					"Filter NME stdin and renders it to another format.\n"
+			fprintf(stderr, "Usage: %s [options] [input [output]]\n"
+					"Filter NME input (default: stdin) and renders it to another\n"
+					"format in output (default: stdout).\n"
 					"--1eol            single eol as paragraph breaks\n"
 					"--2eol            double eol as paragraph breaks (default)\n"
 					"--autocclink      automatic conversion of camelCase words to links\n"
 					"--autourllink     automatic conversion of URLs to links\n"
+					"--autolinkdict file automatic conversion to links of the terms\n"
+					"                  read from file, one per line (empty lines and\n"
+					"                  lines beginning with # are ignored)\n"
 					"--body            naked body without header and footer\n"
+					"--build src out   convert all .nme files in directory src which\n"
+					"                  have changed since the last build to directory\n"
+					"                  out (state of the build kept in out/.nme-build)\n"
 					"--checkhooks      check hooks\n"
 					"--easylink format links are converted as follows: letters, digits,\n"
 					"                  hyphens commas, dots, apostrophes, parentheses,\n"
@@ -719,6 +1682,11 @@ int main(int argc, char **argv)
 					"--fontsize s      font size (0=default)\n"
 					"--help            this help message\n"
 					"--html            HTML output (default)\n"
+					"--interwikis file interwikis read from file, one per line: alias\n"
+					"                  (including ending colon if any) and URL prefix\n"
+					"                  separated by blanks (lines beginning with # are\n"
+					"                  ignored)\n"
+					"--jobs n          number of threads with --build\n"
 					"--jspwiki         JSPWiki output\n"
 					"--latex           LaTeX output\n"
 					"--man             man page output\n"
@@ -732,55 +1700,203 @@ int main(int argc, char **argv)
 					"--structpar       display paragraph structure\n"
 					"--rtf             RTF output\n"
 					"--slides          HTML slides output\n"
+					"--stream          convert input block by block as it is read,\n"
+					"                  with little memory (tables of contents are empty)\n"
 					"--text            plain text output\n"
 					"--textc           compact plain text output\n"
+					"--threads n       convert whole input in segments with n threads\n"
+					"                  (sequentially with hooks)\n"
 					"--xref            headings have hyperlink target labels\n",
 				argv[0]);
 			exit(0);
 		}
 	
-	outputFormat.interwikis = interwikis;
-	if (autoCCLink || autoURLLink)
+	if (inputPath && strcmp(inputPath, "-") && !freopen(inputPath, "rb", stdin))
+	{
+		fprintf(stderr, "Cannot open %s\n", inputPath);
+		exit(2);
+	}
+	if (outputPath && strcmp(outputPath, "-") && !freopen(outputPath, "wb", stdout))
+	{
+		fprintf(stderr, "Cannot create %s\n", outputPath);
+		exit(2);
+	}
+	
+	if (interwikiPath
+			&& readInterwikis(interwikiPath, &interwikiTable,
+					&interwikiText, &interwikiTextLen) != kNMEErrOk)
+	{
+		fprintf(stderr, "Cannot read %s\n", interwikiPath);
+		exit(2);
+	}
+	
+	outputFormat.interwikis = interwikiTable ? interwikiTable : interwikis;
+	// on error, interwikis are searched linearly
+	if (NMEMakeInterwikiTrie(&interwikiTrie, outputFormat.interwikis, &trieSink)
+			== kNMEErrOk)
+		outputFormat.interwikiTrie = &interwikiTrie;
+	if (dictPath
+			&& (readTerms(dictPath, &dictTerms, &dictText, &dictTextLen) != kNMEErrOk
+				|| NMEMakeAutolinkDict(&dict, dictTerms, &trieSink) != kNMEErrOk))
+	{
+		fprintf(stderr, "Cannot read %s\n", dictPath);
+		exit(2);
+	}
+	if (autoCCLink || autoURLLink || dictPath)
 	{
 		int n = 0;
 		
 		if (autoCCLink)
-			autoconverts[n++].cb = NMEAutoconvertCamelCase;
+		{
+			autoconverts[n].cb = NMEAutoconvertCamelCase;
+			autoconverts[n].scan = NMEAutoconvertCamelCaseScan;
+			autoconverts[n++].triggers = kNMEAutolinkTriggers;
+		}
 		if (autoURLLink)
-			autoconverts[n++].cb = NMEAutoconvertURL;
+		{
+			autoconverts[n].cb = NMEAutoconvertURL;
+			autoconverts[n].scan = NMEAutoconvertURLScan;
+			autoconverts[n++].triggers = kNMEAutolinkTriggers;
+		}
+		if (dictPath)
+		{
+			autoconverts[n].cb = NMEAutoconvertDict;
+			autoconverts[n].userData = &dict;
+			autoconverts[n].scan = NMEAutoconvertDictScan;
+			autoconverts[n].notInLinks = TRUE;
+			autoconverts[n++].triggers = kNMEAutolinkTriggers;
+		}
 
 		outputFormat.autoconverts = autoconverts;
 	}
 	
-	src = malloc(SIZE);
-	if (!src)
-		exit(1);
-	srcLen = fread(src, 1, SIZE, stdin);
-	if (srcLen < 0)
+	// on error, format strings are just interpreted
+	(void)NMECompileOutputFormat(&outputFormat, fontSize, options, &compiledFormat);
+	
+	if (buildSrcDir)
+	{
+		// options and output format which affect output (nme itself included)
+		signature = hashText(__DATE__ " " __TIME__, sizeof(__DATE__ " " __TIME__),
+				kHashSeed);
+		for (i = 1; i < argc; i++)
+			if (!strcmp(argv[i], "--build"))
+				i += 2;
+			else if (!strcmp(argv[i], "--jobs"))
+				i++;
+			else
+				signature = hashText(argv[i], strlen(argv[i]) + 1, signature);
+		if (interwikiText)
+			signature = hashText(interwikiText, interwikiTextLen, signature);
+		if (dictText)
+			signature = hashText(dictText, dictTextLen, signature);
+		
+		// hooks of NMEMain have a state and can change outputFormat
+		if (outputFormat.divHookFun || outputFormat.parHookFun
+				|| outputFormat.spanHookFun)
+			err = buildSite(buildSrcDir, buildOutDir, ext, signature,
+					options, &outputFormat, fontSize, &tocData, 1);
+		else
+			err = buildSite(buildSrcDir, buildOutDir, ext, signature,
+					options, &outputFormat, fontSize, NULL, jobCount);
+		if (err != kNMEErrOk)
+			printf("Error %d\n", err);
+		
+		return 0;
+	}
+	
+	if (stream)
+	{
+		// whole source isn't available for the table of contents
+		tocData.src = "";
+		tocData.srcLen = 0;
+		
+		err = processStream(options, &outputFormat, fontSize);
+		if (err != kNMEErrOk)
+			printf("Error %d\n", err);
+		
+		return 0;
+	}
+	
+	if (threadCount > 0)
+	{
+		static NMEOutputSink const sink = {growBuffer, flushStdout, NULL};
+		
+		// hooks of NMEMain have a state
+		if (outputFormat.divHookFun || outputFormat.parHookFun
+				|| outputFormat.spanHookFun)
+			threadCount = 1;
+		
+		err = loadFile(stdin, &src, &srcLen, &mapped);
+		if (err == kNMEErrOk)
+		{
+			tocData.src = src;
+			tocData.srcLen = srcLen;
+			size = srcLen / (4 * threadCount);
+			err = NMEProcessParallel(src, srcLen,
+					size > kMinSegmentSize ? size : kMinSegmentSize,
+					options, "\n", &outputFormat, fontSize,
+					&sink, runJobs, &threadCount,
+					NULL, NULL);
+		}
+		if (err != kNMEErrOk)
+			printf("Error %d\n", err);
+		releaseFile(src, srcLen, mapped);
+		
+		return 0;
+	}
+	
+	if (loadFile(stdin, &src, &srcLen, &mapped) != kNMEErrOk)
 	{
-		free(src);
+		releaseFile(src, srcLen, mapped);
 		exit(2);
 	}
 	
-	buf = malloc(SIZE);
+	// output is usually not much larger than input
+	size = srcLen < 0x3fffffff - kMinOutputSize
+			? 2 * srcLen + kMinOutputSize : 0x7fffffff;
+	buf = malloc(size);
 	if (!buf)
 		exit(1);
 	
 	tocData.src = src;
 	tocData.srcLen = srcLen;
 	
-	err = NMEProcess(src, srcLen,
-			buf, SIZE,
-			options, "\n", &outputFormat, fontSize,
-			&dest, &destLen, NULL);
+	// hooks of NMEMain have a state: collect headings only without them
+	if (!outputFormat.divHookFun && !outputFormat.parHookFun
+			&& !outputFormat.spanHookFun)
+	{
+		tocData.headings = tocHeadings;
+		tocData.maxHeadings = kMaxTocHeadings;
+		NMEPluginTOCCollectHeadings(&outputFormat, &tocData);
+	}
+	
+	for (;;)
+	{
+		tocData.headingCount = 0;
+		err = NMEProcess(src, srcLen,
+				buf, size,
+				options, "\n", &outputFormat, fontSize,
+				&dest, &destLen, NULL);
+		if (err != kNMEErrNotEnoughMemory)
+			break;
+		
+		// try again with the required size; it may be too small if hooks
+		// have a state (--editfrag), because it's counted in a second pass
+		size = destLen > size ? destLen : 2 * size;
+		free((void *)buf);
+		buf = malloc(size);
+		if (!buf)
+			exit(1);
+		hookEditData.done = FALSE;
+	}
 	
 	if (err == kNMEErrOk)
-		printf("%.*s", destLen, dest);
-	else
+		err = writeAll(fileno(stdout), dest, destLen);
+	if (err != kNMEErrOk)
 		printf("Error %d\n", err);
 	
 	free((void *)buf);
-	free((void *)src);
+	releaseFile(src, srcLen, mapped);
 	
 	return 0;
 }
@@ -7,6 +7,7 @@
 /* License: new BSD license (see NME.h) */
 
 #include "NMEPluginTOC.h"
+#include <stdio.h>
 
 /// Test if a character is a space, tab, cr or lf
 #define isBlankOrEol(c) ((c) == ' ' || (c) == '\t' || (c) == 10 || (c) == 13)
@@ -82,30 +83,309 @@ void NMESetTOCOutputFormat(NMEOutputFormat *f, HookTOCData *d)
 	switchOutputFormatTOC(d, FALSE);
 }
 
+/** Div hook forwarding to the hook set before NMEPluginTOCCollectHeadings
+	@param[in] level heading or list level (1 = topmost)
+	@param[in] item list item or heading counter
+	@param[in] enter TRUE when entering construct, FALSE when exiting
+	@param[in] markup null-terminated string for initial markup
+	@param[in] srcIndex current index in source code
+	@param[in,out] context current context
+	@param[in,out] data NMEPluginTocData
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr divHookCollect(NMEInt level,
+		NMEInt item,
+		NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex,
+		NMEContext *context,
+		void *data)
+{
+	NMEPluginTocData *d = (NMEPluginTocData *)data;
+	
+	return d->divHookFun
+			? d->divHookFun(level, item, enter, markup, srcIndex, context, d->hookData)
+			: kNMEErrOk;
+}
+
+/** Paragraph hook collecting headings, then forwarding to the hook set
+	before NMEPluginTOCCollectHeadings
+	@param[in] level heading or list level (1 = topmost)
+	@param[in] item list item or heading counter
+	@param[in] enter TRUE when entering construct, FALSE when exiting
+	@param[in] markup null-terminated string for initial markup
+	@param[in] srcIndex current index in source code
+	@param[in,out] context current context
+	@param[in,out] data NMEPluginTocData
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr parHookCollect(NMEInt level,
+		NMEInt item,
+		NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex,
+		NMEContext *context,
+		void *data)
+{
+	NMEPluginTocData *d = (NMEPluginTocData *)data;
+	
+	// headings of reparsed plugin output aren't in src
+	if (enter && markup[0] == '=' && d->headingCount <= d->maxHeadings
+			&& srcIndex >= 0 && srcIndex < d->srcLen && d->src[srcIndex] == '=')
+	{
+		// headingCount > maxHeadings if some headings have been dropped
+		if (d->headingCount < d->maxHeadings)
+		{
+			d->headings[d->headingCount].level = level;
+			d->headings[d->headingCount].item = item;
+			d->headings[d->headingCount].srcIndex = srcIndex;
+		}
+		d->headingCount++;
+	}
+	
+	return d->parHookFun
+			? d->parHookFun(level, item, enter, markup, srcIndex, context, d->hookData)
+			: kNMEErrOk;
+}
+
+/** Span hook forwarding to the hook set before NMEPluginTOCCollectHeadings
+	@param[in] level kNMEHookLevelSpan
+	@param[in] item 0
+	@param[in] enter TRUE when entering construct, FALSE when exiting
+	@param[in] markup null-terminated string for initial markup
+	@param[in] srcIndex current index in source code
+	@param[in,out] context current context
+	@param[in,out] data NMEPluginTocData
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr spanHookCollect(NMEInt level,
+		NMEInt item,
+		NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex,
+		NMEContext *context,
+		void *data)
+{
+	NMEPluginTocData *d = (NMEPluginTocData *)data;
+	
+	return d->spanHookFun
+			? d->spanHookFun(level, item, enter, markup, srcIndex, context, d->hookData)
+			: kNMEErrOk;
+}
+
+void NMEPluginTOCCollectHeadings(NMEOutputFormat *f, NMEPluginTocData *d)
+{
+	d->divHookFun = f->divHookFun;
+	d->parHookFun = f->parHookFun;
+	d->spanHookFun = f->spanHookFun;
+	d->hookData = f->hookData;
+	d->headingCount = 0;
+	f->divHookFun = d->divHookFun ? divHookCollect : NULL;
+	f->parHookFun = parHookCollect;
+	f->spanHookFun = d->spanHookFun ? spanHookCollect : NULL;
+	f->hookData = (void *)d;
+}
+
+/** Convert the text of a heading for a table of contents
+	@param[in] d plugin's data
+	@param[in] heading heading in d->src
+	@param[in] options options of the main conversion
+	@param[in] fontSize font size of the main conversion
+	@param[in,out] context current context
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addHeadingTOC(NMEPluginTocData const *d,
+		NMEPluginTocHeading const *heading,
+		NMEInt options, NMEInt fontSize,
+		NMEContext *context)
+{
+	NMEOutputFormat outputFormat;
+	NMEOutputSink const *outerSink;
+	NMEOutputSink sink;
+	NMEText buf, dest;
+	NMEInt bufLen, destLen, i, n;
+	char str[32];
+	NMEErr err;
+	
+	// link to the heading, whose target label is after markup
+	for (i = 0; i < heading->level; i++)
+		if (!NMEAddString("&nbsp;", -1, '\0', context))
+			return kNMEErrNotEnoughMemory;
+	for (n = heading->srcIndex; n < d->srcLen && d->src[n] == '='; n++)
+		;
+	sprintf(str, "%d", (int)n);
+	if (!NMEAddString("<a href=\"#h", -1, '\0', context)
+			|| !NMEAddString(str, -1, '\0', context)
+			|| !NMEAddString("\">", -1, '\0', context))
+		return kNMEErrNotEnoughMemory;
+	if (heading->item > 0)
+	{
+		sprintf(str, "%d. ", (int)heading->item);
+		if (!NMEAddString(str, -1, '\0', context))
+			return kNMEErrNotEnoughMemory;
+	}
+	
+	// heading text (single line), without links and images
+	for (n = heading->srcIndex;
+			n < d->srcLen && d->src[n] != '\n' && d->src[n] != '\r';
+			n++)
+		;
+	outputFormat = NMEOutputFormatHTML;
+	outputFormat.beginHeading = "";
+	outputFormat.endHeading = "";
+	outputFormat.lineBreak = " ";
+	outputFormat.beginLink = "";
+	outputFormat.endLink = "";
+	outputFormat.sepLink = NULL;
+	outputFormat.beginImage = "";
+	outputFormat.endImage = "";
+	outputFormat.sepImage = NULL;
+	options = options & ~(kNMEProcessOptH1Num | kNMEProcessOptH2Num)
+			| kNMEProcessOptNoPreAndPost;
+	outerSink = NMEGetOutputSink(context);
+	if (outerSink)
+	{
+		// temp memory would be invalidated by NMEAddString: use own buffer
+		sink.growFun = outerSink->growFun;
+		sink.flushFun = NULL;
+		sink.data = outerSink->data;
+		buf = NULL;
+		bufLen = 0;
+		err = NMEProcessToSink(d->src + heading->srcIndex, n - heading->srcIndex,
+				&buf, &bufLen,
+				options, "\n", &outputFormat, fontSize,
+				&sink, &dest, &destLen, NULL);
+	}
+	else
+	{
+		NMEGetTempMemory(context, &buf, &bufLen);
+		err = NMEProcessInPlace(d->src + heading->srcIndex, n - heading->srcIndex,
+				buf, bufLen,
+				NULL, 0,
+				options, "\n", &outputFormat, fontSize,
+				&dest, &destLen, NULL);
+	}
+	
+	if (err == kNMEErrOk
+			&& (!NMEAddString(dest, destLen, '\0', context)
+				|| !NMEAddString("</a><br />\n", -1, '\0', context)))
+		err = kNMEErrNotEnoughMemory;
+	
+	if (outerSink && buf)
+		(void)sink.growFun(&buf, &bufLen, 0, sink.data);
+	
+	return err;
+}
+
+/** Make a table of contents by converting the whole source again
+	@param[in] d plugin's data
+	@param[in] level1 lowest heading level (1 = topmost)
+	@param[in] level2 highest heading level
+	@param[in,out] context current context
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addReparsedTOC(NMEPluginTocData const *d,
+		NMEInt level1, NMEInt level2,
+		NMEContext *context)
+{
+	HookTOCData hookData;
+	NMEText buf, dest;
+	NMEInt bufLen, destLen;
+	NMEOutputFormat outputFormat;
+	NMEInt options, fontSize;
+	NMEOutputSink const *outerSink;
+	NMEOutputSink sink;
+	NMEErr err;
+	
+	NMESetTOCOutputFormat(&outputFormat, &hookData);
+	hookData.level1 = level1;
+	hookData.level2 = level2;
+	
+	NMEGetFormat(context, NULL, &options, &fontSize);
+	outerSink = NMEGetOutputSink(context);
+	if (outerSink)
+	{
+		// temp memory would be invalidated by NMEAddString: use own buffer
+		sink.growFun = outerSink->growFun;
+		sink.flushFun = NULL;
+		sink.data = outerSink->data;
+		buf = NULL;
+		bufLen = 0;
+		err = NMEProcessToSink(d->src, d->srcLen,
+				&buf, &bufLen,
+				options | kNMEProcessOptNoPreAndPost, "\n", &outputFormat, fontSize,
+				&sink, &dest, &destLen, NULL);
+	}
+	else
+	{
+		// no plugin or autoconvert in outputFormat: no scratch required
+		NMEGetTempMemory(context, &buf, &bufLen);
+		err = NMEProcessInPlace(d->src, d->srcLen,
+				buf, bufLen,
+				NULL, 0,
+				options | kNMEProcessOptNoPreAndPost, "\n", &outputFormat, fontSize,
+				&dest, &destLen, NULL);
+	}
+	
+	if (err == kNMEErrOk && !NMEAddString(dest, destLen, '\0', context))
+		err = kNMEErrNotEnoughMemory;
+	
+	if (outerSink && buf)
+		(void)sink.growFun(&buf, &bufLen, 0, sink.data);
+	
+	return err;
+}
+
+/** Fill a table of contents with the headings collected during the
+	conversion (NMEDeferredFun)
+	@param[in] id 256 * level1 + level2
+	@param[in,out] context current context
+	@param[in] data NMEPluginTocData
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr fillTOC(NMEInt id, NMEContext *context, void *data)
+{
+	NMEPluginTocData const *d = (NMEPluginTocData const *)data;
+	NMEInt level1 = id / 256, level2 = id % 256;
+	NMEInt options, fontSize, i;
+	NMEErr err;
+	
+	// some headings have been dropped
+	if (d->headingCount > d->maxHeadings)
+		return addReparsedTOC(d, level1, level2, context);
+	
+	NMEGetFormat(context, NULL, &options, &fontSize);
+	for (i = 0; i < d->headingCount; i++)
+		if (d->headings[i].level >= level1 && d->headings[i].level <= level2)
+		{
+			err = addHeadingTOC(d, &d->headings[i], options, fontSize, context);
+			if (err != kNMEErrOk)
+				return err;
+		}
+	
+	return kNMEErrOk;
+}
+
 NMEErr NMEPluginTOC(NMEConstText name, NMEInt nameLen,
 		NMEConstText data, NMEInt dataLen,
 		NMEContext *context,
 		void *userData)
 {
+	NMEPluginTocData *d = (NMEPluginTocData *)userData;
 	char *endp;
-	HookTOCData hookData;
-	NMEText title, buf, dest;
-	NMEInt titleLen, bufLen, destLen;
-	NMEOutputFormat outputFormat;
-	NMEInt options, fontSize;
+	NMEText title;
+	NMEInt titleLen, level1, level2;
 	NMEErr err;
 	(void)name;
 	(void)nameLen;
 	
-	NMESetTOCOutputFormat(&outputFormat, &hookData);
-	
 	// read levels in data
-	hookData.level1 = strtol(data, &endp, 0);
-	hookData.level2 = strtol(endp, &endp, 0);
-	if (hookData.level1 < 1)
+	level1 = strtol(data, &endp, 0);
+	level2 = strtol(endp, &endp, 0);
+	if (level1 < 1)
 		return kNMEErrOk;
-	if (hookData.level2 < hookData.level1)
-		hookData.level2 = hookData.level1;
+	if (level2 < level1)
+		level2 = level1;
 	
 	// read TOC title
 	for (title = endp; title < data + dataLen && isBlankOrEol(title[0]); title++)
@@ -115,17 +395,6 @@ NMEErr NMEPluginTOC(NMEConstText name, NMEInt nameLen,
 			titleLen--)
 		;
 	
-	// make TOC
-	NMEGetTempMemory(context, &buf, &bufLen);
-	NMEGetFormat(context, NULL, &options, &fontSize);
-	err = NMEProcess(((NMEPluginTocData *)userData)->src,
-			((NMEPluginTocData *)userData)->srcLen,
-			buf, bufLen,
-			options | kNMEProcessOptNoPreAndPost, "\n", &outputFormat, fontSize,
-			&dest, &destLen, NULL);
-	if (err != kNMEErrOk)
-		return err;
-	
 	// write TOC title, if any
 	if (titleLen > 0)
 		if (!NMEAddString("<h2%%{s>0} style=\"font-size:%{2*s}pt\"%%>", -1, '%', context)
@@ -133,10 +402,17 @@ NMEErr NMEPluginTOC(NMEConstText name, NMEInt nameLen,
 				|| !NMEAddString("</h2>\n", -1, '%', context))
 			return kNMEErrNotEnoughMemory;
 	
-	// write TOC to output
-	if (!NMEAddString("<p%%{s>0} style=\"font-size:%{s}pt\"%%>\n", -1, '%', context)
-			|| !NMEAddString(dest, destLen, '\0', context)
-			|| !NMEAddString("</p>\n", -1, '%', context))
+	// write TOC: filled at the end with collected headings, or made now
+	if (!NMEAddString("<p%%{s>0} style=\"font-size:%{s}pt\"%%>\n", -1, '%', context))
+		return kNMEErrNotEnoughMemory;
+	if (!d->headings || level2 > 255
+			|| !NMEAddDeferred(fillTOC, 256 * level1 + level2, (void *)d, context))
+	{
+		err = addReparsedTOC(d, level1, level2, context);
+		if (err != kNMEErrOk)
+			return err;
+	}
+	if (!NMEAddString("</p>\n", -1, '%', context))
 		return kNMEErrNotEnoughMemory;
 	
 	return kNMEErrOk;
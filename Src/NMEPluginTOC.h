@@ -32,14 +32,44 @@ typedef struct
 */
 void NMESetTOCOutputFormat(NMEOutputFormat *f, HookTOCData *d);
 
+/** Heading collected by NMEPluginTOCCollectHeadings
+*/
+typedef struct
+{
+	NMEInt level;	///< heading level (1 = topmost)
+	NMEInt item;	///< heading number, or 0 if headings aren't numbered
+	NMEInt srcIndex;	///< index of the heading markup in src
+} NMEPluginTocHeading;
+
 /** User data of NMEPluginTOCEntry
 */
 typedef struct
 {
 	NMEConstText src;	///< original NME source code
 	NMEInt srcLen;	///< length of src
+	NMEPluginTocHeading *headings;	/**< headings collected during the
+		conversion, or NULL to convert src again for each table of contents */
+	NMEInt maxHeadings;	///< size of array headings
+	NMEInt headingCount;	/**< number of headings in array headings, to be
+		reset to 0 with src before each conversion */
+	NMEProcessHookFun divHookFun;	///< private
+	NMEProcessHookFun parHookFun;	///< private
+	NMEProcessHookFun spanHookFun;	///< private
+	void *hookData;	///< private
 } NMEPluginTocData;
 
+/** Set hooks of an output format to collect headings during the conversion,
+	so that tables of contents are filled at the end of the document in a
+	single pass instead of converting src again (hooks already set in f are
+	still called)
+	@param[in,out] f output format with NMEPluginTOCEntry(d)
+	@param[in,out] d plugin's data, with headings and maxHeadings set
+	@note Tables of contents are filled at the end of the segment with
+	NMEStream, NMEProcessParallel, NMEIncremental and NMEProcessCached:
+	headings should be collected only for whole-document conversions.
+*/
+void NMEPluginTOCCollectHeadings(NMEOutputFormat *f, NMEPluginTocData *d);
+
 /** Plugin implementation for calendar using table markup (plugin's data:
 	year month)
 	@param[in] name plugin name, such as "calendar"
@@ -0,0 +1,1182 @@
+/**
+ *	@file NMERegressTest.c
+ *	@brief Regression tests of NME (run with "make check").
+ *	@author Yves Piguet. Copyright 2007-2008, Yves Piguet.
+ */
+
+/* License: new BSD license (see NME.h) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "NME.h"
+#include "NMEAutolink.h"
+#include "NMEAutolinkDict.h"
+#include "NMEPluginReverse.h"
+
+/// Number of failed checks
+static int failures = 0;
+
+/// Report a failure if a condition is false
+#define Check(test, cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s: %s failed (line %d)\n", test, #cond, __LINE__); \
+			failures++; \
+		} \
+	} while (0)
+
+/// Dictionary of terms of the tests (made in main)
+static NMEAutolinkDict dict;
+
+/// Terms of dict
+static NMEConstText const dictTerms[] =
+{
+	"Paris", "New York", "New York City", "York", "x x x end", NULL
+};
+
+/// Autoconverts of the tests
+static NMEAutoconvert const autoconverts[] =
+{
+	NMEAutoconvertCamelCaseEntry,
+	NMEAutoconvertURLEntry,
+	NMEAutoconvertDictEntry(&dict),
+	NMEAutoconvertTableEnd
+};
+
+/// Size of the guard after buffers allocated by growGuardedBuf
+#define kGuardSize 16
+
+/// Byte stored in the guard after buffers allocated by growGuardedBuf
+#define kGuardByte 0xa5
+
+/// Output collected by flushOutput
+typedef struct
+{
+	NMEText text;	///< output (malloc)
+	NMEInt len;	///< length of output
+	NMEInt size;	///< size of text
+} Output;
+
+/** Grow or release a buffer with realloc and free (NMESinkGrowFun).
+	@param[in,out] buf address of buffer
+	@param[in,out] bufSize address of size of buffer
+	@param[in] minSize new size, or 0 to release buffer
+	@param[in] data unused
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr growBuf(NMEText *buf, NMEInt *bufSize, NMEInt minSize,
+		void *data)
+{
+	NMEText b;
+	(void)data;
+	
+	if (minSize <= 0)
+	{
+		free(*buf);
+		*buf = NULL;
+		*bufSize = 0;
+		return kNMEErrOk;
+	}
+	b = realloc(*buf, minSize);
+	if (!b)
+		return kNMEErrNotEnoughMemory;
+	*buf = b;
+	*bufSize = minSize;
+	return kNMEErrOk;
+}
+
+/** Grow or release a buffer like growBuf, with a guard after it to catch
+	writes past its end (NMESinkGrowFun).
+	@param[in,out] buf address of buffer
+	@param[in,out] bufSize address of size of buffer
+	@param[in] minSize new size, or 0 to release buffer
+	@param[in] data unused
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr growGuardedBuf(NMEText *buf, NMEInt *bufSize, NMEInt minSize,
+		void *data)
+{
+	NMEText b;
+	NMEInt i;
+	(void)data;
+	
+	if (*buf)
+		for (i = 0; i < kGuardSize; i++)
+			if ((unsigned char)(*buf)[*bufSize + i] != kGuardByte)
+			{
+				fprintf(stderr, "growGuardedBuf: write past end of buffer\n");
+				failures++;
+				break;
+			}
+	if (minSize <= 0)
+	{
+		free(*buf);
+		*buf = NULL;
+		*bufSize = 0;
+		return kNMEErrOk;
+	}
+	b = realloc(*buf, minSize + kGuardSize);
+	if (!b)
+		return kNMEErrNotEnoughMemory;
+	for (i = 0; i < kGuardSize; i++)
+		b[minSize + i] = (NMEChar)kGuardByte;
+	*buf = b;
+	*bufSize = minSize;
+	return kNMEErrOk;
+}
+
+/** Append output to an Output (NMESinkFlushFun).
+	@param[in] output output
+	@param[in] outputLen length of output
+	@param[in,out] data address of Output
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr flushOutput(NMEConstText output, NMEInt outputLen, void *data)
+{
+	Output *o = (Output *)data;
+	NMEInt i;
+	
+	if (o->len + outputLen > o->size
+			&& growBuf(&o->text, &o->size, 2 * (o->len + outputLen), NULL) != kNMEErrOk)
+		return kNMEErrNotEnoughMemory;
+	for (i = 0; i < outputLen; i++)
+		o->text[o->len + i] = output[i];
+	o->len += outputLen;
+	return kNMEErrOk;
+}
+
+/** Check that output is the same as expected.
+	@param[in] test name of test
+	@param[in] what name of conversion
+	@param[in] expected expected output
+	@param[in] expectedLen length of expected
+	@param[in] output output
+	@param[in] outputLen length of output
+*/
+static void checkSameOutput(char const *test, char const *what,
+		NMEConstText expected, NMEInt expectedLen,
+		NMEConstText output, NMEInt outputLen)
+{
+	if (outputLen != expectedLen || memcmp(output, expected, expectedLen))
+	{
+		fprintf(stderr, "%s: %s output differs\n", test, what);
+		failures++;
+	}
+}
+
+/** Output format with autoconverts, whose output is reparsed.
+	@param[in] format output format
+	@return output format with autoconverts
+*/
+static NMEOutputFormat withAutoconverts(NMEOutputFormat const *format)
+{
+	NMEOutputFormat f = *format;
+	
+	f.autoconverts = autoconverts;
+	return f;
+}
+
+/** Check that the size NMEProcess reports when buf is too small doesn't
+	depend on the size of buf, and that a single retry with it succeeds.
+*/
+static void testRequiredBufSize(void)
+{
+	static NMEConstText const src[] =
+	{
+		"** CamelCase *\n\n:~[[",
+		"==----||<{{{ CamelCase {{{|}},,~ CamelCase }}}}]]\n"
+			"See http://www.example.com/ and WikiWord, OtherWord.\n",
+		NULL
+	};
+	NMEOutputFormat formats[3];
+	NMEText buf, output;
+	NMEInt i, f, len, bufSize, required, firstRequired, outputLen;
+	NMEErr err;
+	
+	formats[0] = withAutoconverts(&NMEOutputFormatLaTeX);
+	formats[1] = withAutoconverts(&NMEOutputFormatMan);
+	formats[2] = withAutoconverts(&NMEOutputFormatRTF);
+	for (i = 0; src[i]; i++)
+		for (f = 0; f < 3; f++)
+		{
+			len = strlen(src[i]);
+			firstRequired = 0;
+			for (bufSize = 2 * len + 2; ; bufSize++)
+			{
+				buf = malloc(bufSize);
+				err = NMEProcess(src[i], len, buf, bufSize,
+						kNMEProcessOptDefault, "\n", &formats[f], 0,
+						&output, &outputLen, NULL);
+				free(buf);
+				if (err == kNMEErrOk)
+					break;
+				Check("requiredBufSize", err == kNMEErrNotEnoughMemory);
+				if (err != kNMEErrNotEnoughMemory)
+					break;
+				required = outputLen;
+				if (required == 0)
+					continue;	// buf too small to find it
+				if (firstRequired == 0)
+					firstRequired = required;
+				Check("requiredBufSize", required == firstRequired);
+				
+				buf = malloc(required);
+				err = NMEProcess(src[i], len, buf, required,
+						kNMEProcessOptDefault, "\n", &formats[f], 0,
+						&output, &outputLen, NULL);
+				free(buf);
+				Check("requiredBufSize", err == kNMEErrOk);
+			}
+			Check("requiredBufSize", firstRequired == 0 || bufSize <= firstRequired);
+		}
+}
+
+/** Check that conversions by segments (streams and incremental
+	conversions) give the same output as NMEProcessToSink when a block
+	boundary is mispredicted (the parser doesn't end between paragraphs).
+*/
+static void testMispredictedBoundaries(void)
+{
+	static NMEConstText const src[] =
+	{
+		"{{\n}}}\n}}}\n\n>",
+		"}}}}{\n}}}\n}}}\n\n<",
+		"Text {{\n}}}\n}}}\n\npar\n\n{{{\npre\n}}}\n\nend",
+		NULL
+	};
+	NMEOutputFormat const *formats[] =
+	{
+		&NMEOutputFormatText, &NMEOutputFormatLaTeX, &NMEOutputFormatRTF,
+		&NMEOutputFormatHTML, NULL
+	};
+	NMEOutputSink const sink = {growBuf, NULL, NULL};
+	NMEOutputSink flushSink = {growBuf, flushOutput, NULL};
+	Output expected, output;
+	NMEStream stream;
+	NMEIncremental incremental;
+	NMEText buf, out, edited;
+	NMEInt i, f, k, len, chunk, bufSize, outLen;
+	
+	for (i = 0; src[i]; i++)
+		for (f = 0; formats[f]; f++)
+		{
+			len = strlen(src[i]);
+			
+			expected.text = NULL;
+			expected.len = expected.size = 0;
+			flushSink.data = &expected;
+			buf = NULL;
+			bufSize = 0;
+			Check("mispredicted", NMEProcessToSink(src[i], len, &buf, &bufSize,
+					kNMEProcessOptNoPreAndPost, "\n", formats[f], 0, &flushSink,
+					&out, &outLen, NULL) == kNMEErrOk);
+			free(buf);
+			
+			// stream fed by chunks of various sizes
+			for (chunk = 1; chunk <= len; chunk += 3)
+			{
+				output.text = NULL;
+				output.len = output.size = 0;
+				flushSink.data = &output;
+				buf = NULL;
+				bufSize = 0;
+				NMEStreamBegin(&stream, &buf, &bufSize,
+						kNMEProcessOptNoPreAndPost, "\n", formats[f], 0, &flushSink);
+				for (k = 0; k < len; k += chunk)
+					NMEStreamFeed(&stream, src[i] + k, k + chunk <= len ? chunk : len - k);
+				Check("mispredicted", NMEStreamEnd(&stream, NULL, &outLen, NULL)
+						== kNMEErrOk);
+				free(buf);
+				checkSameOutput("mispredicted", "stream",
+						expected.text, expected.len, output.text, output.len);
+				free(output.text);
+			}
+			
+			// incremental conversion, with a character inserted then removed
+			Check("mispredicted", NMEIncrementalBegin(&incremental, src[i], len,
+					kNMEProcessOptNoPreAndPost, "\n", formats[f], 0, &sink,
+					&out, &outLen) == kNMEErrOk);
+			checkSameOutput("mispredicted", "incremental",
+					expected.text, expected.len, out, outLen);
+			edited = malloc(len + 1);
+			for (k = 0; k <= len; k++)
+			{
+				memcpy(edited, src[i], k);
+				edited[k] = 'x';
+				memcpy(edited + k + 1, src[i] + k, len - k);
+				Check("mispredicted", NMEIncrementalEdit(&incremental, edited, len + 1,
+						k, 0, 1, &out, &outLen, NULL, NULL, NULL) == kNMEErrOk);
+				Check("mispredicted", NMEIncrementalEdit(&incremental, src[i], len,
+						k, 1, 0, &out, &outLen, NULL, NULL, NULL) == kNMEErrOk);
+				checkSameOutput("mispredicted", "incremental edit",
+						expected.text, expected.len, out, outLen);
+			}
+			free(edited);
+			NMEIncrementalEnd(&incremental);
+			
+			free(expected.text);
+		}
+}
+
+/** Check that NMEProcessCached doesn't write past the end of its buffer
+	when it converts text after reused blocks, and that it gives the same
+	output as the first conversion.
+*/
+static void testCachedHeadroom(void)
+{
+	static NMEConstText const src = "\r\n:{\n\n##=\n>>\n\n>>\nd<<reverse";
+	static NMEPlugin const plugins[] =
+	{
+		NMEPluginReverseEntry,
+		NMEPluginTableEnd
+	};
+	NMEOutputSink const sink = {growGuardedBuf, NULL, NULL};
+	NMEOutputFormat format = withAutoconverts(&NMEOutputFormatMan);
+	NMEBlockCache cache;
+	NMEText buf, out, first = NULL;
+	NMEInt r, len, bufSize, outLen, firstLen = 0;
+	
+	format.plugins = plugins;
+	len = strlen(src);
+	NMEBlockCacheBegin(&cache, 1 << 20, NULL, NULL, &sink);
+	for (r = 0; r < 2; r++)
+	{
+		buf = NULL;
+		bufSize = 0;
+		Check("cachedHeadroom", NMEProcessCached(&cache, src, len, &buf, &bufSize,
+				kNMEProcessOptNoMultilinePar, "\n", &format, 0, &sink,
+				&out, &outLen, NULL) == kNMEErrOk);
+		if (r == 0)
+		{
+			first = malloc(outLen);
+			memcpy(first, out, outLen);
+			firstLen = outLen;
+		}
+		else
+			checkSameOutput("cachedHeadroom", "cached",
+					first, firstLen, out, outLen);
+		(void)growGuardedBuf(&buf, &bufSize, 0, NULL);
+	}
+	NMEBlockCacheEnd(&cache);
+	free(first);
+}
+
+/** Check that a link or image left unterminated at the end of a paragraph
+	doesn't disable autoconverts in the next paragraph, whether the text is
+	converted at once or by a stream.
+*/
+static void testUnterminatedLink(void)
+{
+	static NMEConstText const src[] =
+	{
+		"[[abc\n\nhttp://x.com y", "[[abc]]\n\nhttp://x.com y",
+		"{{abc\n\nSee WikiWord", "{{abc}}\n\nSee WikiWord",
+		"[[abc\n\n Paris", "[[abc]]\n\n Paris",
+		"{{abc\n\nParis", "{{abc}}\n\nParis",
+		NULL
+	};
+	NMEOutputFormat formats[3];
+	NMEOutputSink flushSink = {growBuf, flushOutput, NULL};
+	Output expected, output;
+	NMEStream stream;
+	NMEText buf, out;
+	NMEInt i, f, k, len, bufSize, outLen;
+	
+	formats[0] = withAutoconverts(&NMEOutputFormatHTML);
+	formats[1] = withAutoconverts(&NMEOutputFormatLaTeX);
+	formats[2] = withAutoconverts(&NMEOutputFormatText);
+	for (i = 0; src[i]; i += 2)
+		for (f = 0; f < 3; f++)
+		{
+			// same output as with terminated link or image
+			expected.text = NULL;
+			expected.len = expected.size = 0;
+			flushSink.data = &expected;
+			buf = NULL;
+			bufSize = 0;
+			Check("unterminatedLink", NMEProcessToSink(src[i + 1], strlen(src[i + 1]),
+					&buf, &bufSize, kNMEProcessOptNoPreAndPost, "\n", &formats[f], 0,
+					&flushSink, &out, &outLen, NULL) == kNMEErrOk);
+			free(buf);
+			output.text = NULL;
+			output.len = output.size = 0;
+			flushSink.data = &output;
+			buf = NULL;
+			bufSize = 0;
+			len = strlen(src[i]);
+			Check("unterminatedLink", NMEProcessToSink(src[i], len,
+					&buf, &bufSize, kNMEProcessOptNoPreAndPost, "\n", &formats[f], 0,
+					&flushSink, &out, &outLen, NULL) == kNMEErrOk);
+			free(buf);
+			checkSameOutput("unterminatedLink", "serial",
+					expected.text, expected.len, output.text, output.len);
+			free(output.text);
+			
+			// stream fed by single characters
+			output.text = NULL;
+			output.len = output.size = 0;
+			buf = NULL;
+			bufSize = 0;
+			NMEStreamBegin(&stream, &buf, &bufSize,
+					kNMEProcessOptNoPreAndPost, "\n", &formats[f], 0, &flushSink);
+			for (k = 0; k < len; k++)
+				NMEStreamFeed(&stream, src[i] + k, 1);
+			Check("unterminatedLink", NMEStreamEnd(&stream, NULL, &outLen, NULL)
+					== kNMEErrOk);
+			free(buf);
+			checkSameOutput("unterminatedLink", "stream",
+					expected.text, expected.len, output.text, output.len);
+			free(output.text);
+			free(expected.text);
+		}
+}
+
+/** Check that NMEProcessToSink gives the same output with and without a
+	flush function for a long output line (where flushOutput used to scan
+	the pending output again at each token, with a quadratic cost).
+*/
+static void testFlushLongLine(void)
+{
+	NMEOutputSink const sink = {growBuf, NULL, NULL};
+	NMEOutputSink flushSink = {growBuf, flushOutput, NULL};
+	NMEOutputFormat format = NMEOutputFormatHTML;
+	Output output;
+	NMEText src, buf, out;
+	NMEInt i, len, bufSize, outLen;
+	
+	len = 1 << 18;
+	src = malloc(len);
+	for (i = 0; i < len; i++)
+		src[i] = "word //italic// "[i % 16];
+	format.textWidth = 0;	// no wordwrap
+	
+	output.text = NULL;
+	output.len = output.size = 0;
+	flushSink.data = &output;
+	buf = NULL;
+	bufSize = 0;
+	Check("flushLongLine", NMEProcessToSink(src, len, &buf, &bufSize,
+			kNMEProcessOptDefault, "\n", &format, 0, &flushSink,
+			&out, &outLen, NULL) == kNMEErrOk);
+	free(buf);
+	
+	buf = NULL;
+	bufSize = 0;
+	Check("flushLongLine", NMEProcessToSink(src, len, &buf, &bufSize,
+			kNMEProcessOptDefault, "\n", &format, 0, &sink,
+			&out, &outLen, NULL) == kNMEErrOk);
+	checkSameOutput("flushLongLine", "flushed",
+			out, outLen, output.text, output.len);
+	free(buf);
+	
+	free(output.text);
+	free(src);
+}
+
+/** Check that a stream fed a long line by small chunks gives the same
+	output as NMEProcessToSink (the line used to be scanned again from its
+	beginning at each chunk, with a cost quadratic in its length).
+*/
+static void testStreamLongLine(void)
+{
+	NMEOutputSink flushSink = {growBuf, flushOutput, NULL};
+	Output expected, output;
+	NMEStream stream;
+	NMEText src, buf, out;
+	NMEInt i, len, bufSize, outLen;
+	
+	len = 1 << 18;
+	src = malloc(len);
+	for (i = 0; i < len; i++)
+		src[i] = "word **bold** "[i % 14];
+	
+	expected.text = NULL;
+	expected.len = expected.size = 0;
+	flushSink.data = &expected;
+	buf = NULL;
+	bufSize = 0;
+	Check("streamLongLine", NMEProcessToSink(src, len, &buf, &bufSize,
+			kNMEProcessOptDefault, "\n", &NMEOutputFormatHTML, 0, &flushSink,
+			&out, &outLen, NULL) == kNMEErrOk);
+	free(buf);
+	
+	output.text = NULL;
+	output.len = output.size = 0;
+	flushSink.data = &output;
+	buf = NULL;
+	bufSize = 0;
+	NMEStreamBegin(&stream, &buf, &bufSize,
+			kNMEProcessOptDefault, "\n", &NMEOutputFormatHTML, 0, &flushSink);
+	for (i = 0; i < len; i += 8)
+		Check("streamLongLine", NMEStreamFeed(&stream, src + i,
+				i + 8 <= len ? 8 : len - i) == kNMEErrOk);
+	Check("streamLongLine", NMEStreamEnd(&stream, NULL, &outLen, NULL)
+			== kNMEErrOk);
+	free(buf);
+	checkSameOutput("streamLongLine", "stream",
+			expected.text, expected.len, output.text, output.len);
+	
+	free(output.text);
+	free(expected.text);
+	free(src);
+}
+
+/** Check the terms linked by NMEAutoconvertDict (longest term at the
+	beginning of a word, up to the end of a word, not in links), that its
+	scan function finds the same terms as the callback alone, and that
+	streams give the same output.
+*/
+static void testAutolinkDict(void)
+{
+	static NMEConstText const src[] =
+	{
+		"Paris, Parisian Paris_ Paris", "[[Paris]], Parisian Paris_ [[Paris]]",
+		"New York City and New York Cityscape", "[[New York City]] and [[New York]] Cityscape",
+		"New New York, Newyork", "New [[New York]], Newyork",
+		"x x x x end x x x", "x [[x x x end]] x x x",
+		"[[Paris]] [[In Paris]] [[x|to Paris]]", "[[Paris]] [[In Paris]] [[x|to Paris]]",
+		"{{img.png|Paris}} Paris", "{{img.png|Paris}} [[Paris]]",
+		"New\nYork Paris", "New\n[[York]] [[Paris]]",
+		NULL
+	};
+	NMEAutoconvert scanless[2] =
+	{
+		NMEAutoconvertDictEntry(&dict),
+		NMEAutoconvertTableEnd
+	};
+	NMEOutputFormat format = withAutoconverts(&NMEOutputFormatHTML);
+	NMEOutputFormat noAutoconvert = NMEOutputFormatHTML;
+	NMEOutputSink const sink = {growBuf, NULL, NULL};
+	NMEOutputSink flushSink = {growBuf, flushOutput, NULL};
+	Output output;
+	NMEStream stream;
+	NMEText buf, out, expected;
+	NMEInt i, k, len, bufSize, outLen, expectedLen;
+	
+	scanless[0].scan = NULL;
+	for (i = 0; src[i]; i += 2)
+	{
+		// same output as with explicit links
+		buf = NULL;
+		bufSize = 0;
+		Check("autolinkDict", NMEProcessToSink(src[i + 1], strlen(src[i + 1]),
+				&buf, &bufSize, kNMEProcessOptNoPreAndPost, "\n", &noAutoconvert, 0,
+				&sink, &out, &outLen, NULL) == kNMEErrOk);
+		expected = malloc(outLen);
+		memcpy(expected, out, outLen);
+		expectedLen = outLen;
+		free(buf);
+		
+		len = strlen(src[i]);
+		buf = NULL;
+		bufSize = 0;
+		Check("autolinkDict", NMEProcessToSink(src[i], len,
+				&buf, &bufSize, kNMEProcessOptNoPreAndPost, "\n", &format, 0,
+				&sink, &out, &outLen, NULL) == kNMEErrOk);
+		checkSameOutput("autolinkDict", "serial",
+				expected, expectedLen, out, outLen);
+		free(buf);
+		
+		// callback called at each trigger instead of scan
+		format.autoconverts = scanless;
+		buf = NULL;
+		bufSize = 0;
+		Check("autolinkDict", NMEProcessToSink(src[i], len,
+				&buf, &bufSize, kNMEProcessOptNoPreAndPost, "\n", &format, 0,
+				&sink, &out, &outLen, NULL) == kNMEErrOk);
+		checkSameOutput("autolinkDict", "scanless",
+				expected, expectedLen, out, outLen);
+		free(buf);
+		format.autoconverts = autoconverts;
+		
+		// stream fed by single characters
+		output.text = NULL;
+		output.len = output.size = 0;
+		flushSink.data = &output;
+		buf = NULL;
+		bufSize = 0;
+		NMEStreamBegin(&stream, &buf, &bufSize,
+				kNMEProcessOptNoPreAndPost, "\n", &format, 0, &flushSink);
+		for (k = 0; k < len; k++)
+			NMEStreamFeed(&stream, src[i] + k, 1);
+		Check("autolinkDict", NMEStreamEnd(&stream, NULL, &outLen, NULL)
+				== kNMEErrOk);
+		free(buf);
+		checkSameOutput("autolinkDict", "stream",
+				expected, expectedLen, output.text, output.len);
+		free(output.text);
+		free(expected);
+	}
+}
+
+/** Check that NMEIndexUCS16 counts the output like outputUCS16Len, and
+	that it detects invalid UTF-8.
+*/
+static void testIndexUCS16(void)
+{
+	static NMEConstText const src = "= Caf\xc3\xa9 =\n\n\xe2\x82\xac **\xc3\xa0** x";
+	static NMEConstText const invalid[] =
+	{
+		"\x80", "\xc3", "\xc0\xa0", "\xe0\x80\x80", "\xed\xa0\x80",
+		"\xf4\x90\x80\x80", "\xf8\x88\x80\x80\x80", "a\xc3\xa9\xe2\x82",
+		NULL
+	};
+	NMEText buf, out;
+	NMEInt i, bufSize, outLen, outLenUCS16;
+	NMEBoolean valid;
+	
+	bufSize = 1024;
+	buf = malloc(bufSize);
+	Check("indexUCS16", NMEProcess(src, strlen(src), buf, bufSize,
+			kNMEProcessOptDefault, "\n", &NMEOutputFormatHTML, 0,
+			&out, &outLen, &outLenUCS16) == kNMEErrOk);
+	Check("indexUCS16", NMEIndexUCS16(out, outLen, &valid) == outLenUCS16);
+	Check("indexUCS16", valid);
+	for (i = 0; i < outLen && out[i] != '\xc3'; i++)
+		;
+	Check("indexUCS16", NMEIndexUCS16(out, i, NULL)
+			+ NMEIndexUCS16(out + i, outLen - i, NULL) == outLenUCS16);
+	Check("indexUCS16", NMEIndexUCS16(out, i + 1, &valid) == i + 1 && !valid);
+	free(buf);
+	
+	for (i = 0; invalid[i]; i++)
+	{
+		NMEIndexUCS16(invalid[i], strlen(invalid[i]), &valid);
+		Check("indexUCS16", !valid);
+	}
+	NMEIndexUCS16("a\xf0\x9f\x98\x80\xf4\x8f\xbf\xbf", 9, &valid);
+	Check("indexUCS16", valid);
+}
+
+/** Check that NMEProcessInPlace gives the same output as NMEProcess
+	without modifying the source, that it needs scratch only when output is
+	reparsed, and that it reports buffers which are too small.
+*/
+static void testProcessInPlace(void)
+{
+	static NMEConstText const src[] =
+	{
+		"= Title =\n\nPlain **bold** text.\n\n* item\n* item\n",
+		"See WikiWord and http://www.example.com/ here.\n\n"
+			"<<reverse\n**abc** WikiWord\n>>\n",
+		NULL
+	};
+	static NMEPlugin const plugins[] =
+	{
+		NMEPluginReverseEntry,
+		NMEPluginTableEnd
+	};
+	NMEOutputFormat formats[2];
+	NMEText buf, srcCopy, out, expected, outBuf, scratch;
+	NMEInt i, f, len, outLen, expectedLen, outUCS16Len, expectedUCS16Len;
+	NMEInt const bufSize = 4096;
+	
+	formats[0] = withAutoconverts(&NMEOutputFormatHTML);
+	formats[1] = withAutoconverts(&NMEOutputFormatText);
+	buf = malloc(bufSize);
+	outBuf = malloc(bufSize);
+	scratch = malloc(bufSize);
+	for (i = 0; src[i]; i++)
+		for (f = 0; f < 2; f++)
+		{
+			formats[f].plugins = plugins;
+			len = strlen(src[i]);
+			srcCopy = malloc(len);
+			memcpy(srcCopy, src[i], len);
+			Check("processInPlace", NMEProcess(srcCopy, len, buf, bufSize,
+					kNMEProcessOptDefault, "\n", &formats[f], 0,
+					&expected, &expectedLen, &expectedUCS16Len) == kNMEErrOk);
+			
+			// with scratch
+			Check("processInPlace", NMEProcessInPlace(srcCopy, len,
+					outBuf, bufSize, scratch, bufSize,
+					kNMEProcessOptDefault, "\n", &formats[f], 0,
+					&out, &outLen, &outUCS16Len) == kNMEErrOk);
+			checkSameOutput("processInPlace", "in place",
+					expected, expectedLen, out, outLen);
+			Check("processInPlace", outUCS16Len == expectedUCS16Len);
+			Check("processInPlace", memcmp(srcCopy, src[i], len) == 0);
+			
+			// output buffer too small
+			Check("processInPlace", NMEProcessInPlace(srcCopy, len,
+					outBuf, expectedLen / 2, scratch, bufSize,
+					kNMEProcessOptDefault, "\n", &formats[f], 0,
+					&out, &outLen, NULL) == kNMEErrNotEnoughMemory);
+			
+			// without scratch: only if nothing is reparsed
+			formats[f].plugins = NULL;
+			formats[f].autoconverts = NULL;
+			Check("processInPlace", NMEProcess(srcCopy, len, buf, bufSize,
+					kNMEProcessOptDefault, "\n", &formats[f], 0,
+					&expected, &expectedLen, NULL) == kNMEErrOk);
+			Check("processInPlace", NMEProcessInPlace(srcCopy, len,
+					outBuf, bufSize, NULL, 0,
+					kNMEProcessOptDefault, "\n", &formats[f], 0,
+					&out, &outLen, NULL) == kNMEErrOk);
+			checkSameOutput("processInPlace", "without scratch",
+					expected, expectedLen, out, outLen);
+			formats[f].autoconverts = autoconverts;
+			if (i > 0)
+				Check("processInPlace", NMEProcessInPlace(srcCopy, len,
+						outBuf, bufSize, NULL, 0,
+						kNMEProcessOptDefault, "\n", &formats[f], 0,
+						&out, &outLen, NULL) == kNMEErrNotEnoughMemory);
+			
+			free(srcCopy);
+		}
+	
+	// source larger than half the buffer NMEProcess would need
+	len = 3 * bufSize / 4;
+	srcCopy = malloc(len);
+	for (i = 0; i < len; i++)
+		srcCopy[i] = "word "[i % 5];
+	Check("processInPlace", NMEProcess(srcCopy, len, buf, bufSize,
+			kNMEProcessOptNoPreAndPost, "\n", &NMEOutputFormatText, 0,
+			&out, &outLen, NULL) == kNMEErrNotEnoughMemory);
+	Check("processInPlace", NMEProcessInPlace(srcCopy, len,
+			outBuf, bufSize, NULL, 0,
+			kNMEProcessOptNoPreAndPost, "\n", &NMEOutputFormatText, 0,
+			&out, &outLen, NULL) == kNMEErrOk);
+	free(srcCopy);
+	
+	free(buf);
+	free(outBuf);
+	free(scratch);
+}
+
+/** Wordwrap permission at blanks, counting its calls (NMEWordwrapCheckFun).
+	@param[in] txt output text
+	@param[in] len length of output text
+	@param[in] i line break to check
+	@param[in,out] data address of number of calls (NMEInt)
+	@return kNMEWordwrapReplaceChar at blanks, else kNMEWordwrapNo
+*/
+static NMEWordwrapPermission countWordwrapPerm(NMEConstText txt, NMEInt len,
+		NMEInt i, void *data)
+{
+	(void)len;
+	(*(NMEInt *)data)++;
+	return txt[i] == ' ' ? kNMEWordwrapReplaceChar : kNMEWordwrapNo;
+}
+
+/** Check that wordwrap breaks lines at the last blank before textWidth,
+	that each byte of output is checked about once even in long unbreakable
+	words, and that flushed and stream output are wrapped the same way.
+*/
+static void testWordwrap(void)
+{
+	static NMEOutputFormat const *formats[] =
+	{
+		&NMEOutputFormatText, &NMEOutputFormatMan, &NMEOutputFormatRTF, NULL
+	};
+	NMEOutputSink const sink = {growBuf, NULL, NULL};
+	NMEOutputSink flushSink = {growBuf, flushOutput, NULL};
+	NMEOutputFormat format = NMEOutputFormatText;
+	Output output;
+	NMEStream stream;
+	NMEText src, buf, out, wrapped, flushBuf, flushedOut;
+	NMEInt i, j, k, f, len, bufSize, outLen, wrappedLen, flushBufSize, flushedLen;
+	NMEInt calls;
+	
+	// words of 1 to 6 letters, and a long word in the middle
+	len = 30000;
+	src = malloc(len);
+	for (i = 0; i < len; i++)
+		src[i] = i % 7 == 0 || i % 9 == 0 ? ' ' : 'a' + i % 26;
+	for (i = 10000; i < 20000; i++)
+		src[i] = 'a' + i % 26;
+	
+	// lines shorter than textWidth, except the long word, and as long as
+	// possible; each byte checked about once
+	format.wordwrapPermFun = countWordwrapPerm;
+	format.wordwrapPermData = &calls;
+	calls = 0;
+	buf = NULL;
+	bufSize = 0;
+	Check("wordwrap", NMEProcessToSink(src, len, &buf, &bufSize,
+			kNMEProcessOptNoPreAndPost, "\n", &format, 0, &sink,
+			&out, &outLen, NULL) == kNMEErrOk);
+	Check("wordwrap", calls <= 2 * outLen);
+	for (i = 0; i < outLen; i = j + 1)
+	{
+		for (j = i; j < outLen && out[j] != '\n'; j++)
+			;
+		Check("wordwrap", j - i < format.textWidth || j - i >= 10000);
+		// first word of next line didn't fit
+		for (k = j + 1; k < outLen && out[k] != ' ' && out[k] != '\n'; k++)
+			;
+		Check("wordwrap", k == j + 1 || j - i + k - j >= format.textWidth);
+	}
+	wrapped = malloc(outLen);
+	memcpy(wrapped, out, outLen);
+	wrappedLen = outLen;
+	format.textWidth = -1;
+	Check("wordwrap", NMEProcessToSink(src, len, &buf, &bufSize,
+			kNMEProcessOptNoPreAndPost, "\n", &format, 0, &sink,
+			&out, &outLen, NULL) == kNMEErrOk);
+	// same text with blanks instead of line breaks
+	Check("wordwrap", outLen == wrappedLen);
+	for (i = 0; i < outLen && i < wrappedLen; i++)
+		Check("wordwrap", wrapped[i] == out[i] || wrapped[i] == '\n' && out[i] == ' ');
+	free(wrapped);
+	free(buf);
+	
+	// same output when flushed or fed to a stream by chunks
+	for (f = 0; formats[f]; f++)
+	{
+		buf = NULL;
+		bufSize = 0;
+		Check("wordwrap", NMEProcessToSink(src, len, &buf, &bufSize,
+				kNMEProcessOptDefault, "\n", formats[f], 0, &sink,
+				&out, &outLen, NULL) == kNMEErrOk);
+		
+		output.text = NULL;
+		output.len = output.size = 0;
+		flushSink.data = &output;
+		flushBuf = NULL;
+		flushBufSize = 0;
+		Check("wordwrap", NMEProcessToSink(src, len, &flushBuf, &flushBufSize,
+				kNMEProcessOptDefault, "\n", formats[f], 0, &flushSink,
+				&flushedOut, &flushedLen, NULL) == kNMEErrOk);
+		free(flushBuf);
+		checkSameOutput("wordwrap", "flushed", out, outLen, output.text, output.len);
+		free(output.text);
+		
+		output.text = NULL;
+		output.len = output.size = 0;
+		flushBuf = NULL;
+		flushBufSize = 0;
+		NMEStreamBegin(&stream, &flushBuf, &flushBufSize,
+				kNMEProcessOptDefault, "\n", formats[f], 0, &flushSink);
+		for (i = 0; i < len; i += 7)
+			NMEStreamFeed(&stream, src + i, i + 7 <= len ? 7 : len - i);
+		Check("wordwrap", NMEStreamEnd(&stream, NULL, NULL, NULL) == kNMEErrOk);
+		free(flushBuf);
+		checkSameOutput("wordwrap", "stream", out, outLen, output.text, output.len);
+		free(output.text);
+		free(buf);
+	}
+	
+	free(src);
+}
+
+/** Run jobs in reverse order, in the calling thread (NMERunJobsFun).
+	@param[in] jobCount number of jobs
+	@param[in] jobFun job function
+	@param[in,out] jobData data passed to jobFun
+	@param[in,out] data address of total number of jobs (NMEInt)
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr runJobsReversed(NMEInt jobCount,
+		NMEJobFun jobFun, void *jobData,
+		void *data)
+{
+	NMEInt job;
+	
+	for (job = jobCount - 1; job >= 0; job--)
+		jobFun(job, jobData);
+	*(NMEInt *)data += jobCount;
+	return kNMEErrOk;
+}
+
+/** Paragraph hook which writes the output and source indices, so that the
+	output of a segment depends on previous ones (NMEHookFun).
+	@param[in] level nesting level
+	@param[in] item item number
+	@param[in] enter TRUE when entering, FALSE when exiting
+	@param[in] markup markup
+	@param[in] srcIndex index in source
+	@param[in,out] context current context
+	@param[in] data unused
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr parHookIndex(NMEInt level,
+		NMEInt item,
+		NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex,
+		NMEContext *context,
+		void *data)
+{
+	char str[32];
+	(void)level;
+	(void)item;
+	(void)markup;
+	(void)data;
+	
+	if (enter)
+	{
+		sprintf(str, "[%ld %ld]", (long)NMECurrentOutputIndex(context),
+				(long)srcIndex);
+		if (!NMEAddString(str, -1, '\0', context))
+			return kNMEErrNotEnoughMemory;
+	}
+	return kNMEErrOk;
+}
+
+/** Check that NMEProcessParallel gives the same output as NMEProcessToSink,
+	with segments converted in any order, across lists, tables, preformatted
+	blocks, plugins and numbered headings, and with hooks which depend on
+	the output of previous segments.
+*/
+static void testProcessParallel(void)
+{
+	static NMEConstText const src =
+		"= Title =\n\nIntro with **bold\n\ncontinued** and WikiWord.\n\n"
+		"== Section ==\n\n* item\n\n* item\n** sub\n\n"
+		"|= a |= b\n| 1 | 2\n\n| 3 | 4\n\n"
+		"{{{\npre\n\nblock\n}}}\n\n"
+		"<<reverse\nplugin\n\ntext\n>>\n\n"
+		"== Other ==\n\n; term\n: definition\n\n"
+		"=== Sub ===\n\nLast //par//.\n";
+	static NMEPlugin const plugins[] =
+	{
+		NMEPluginReverseEntry,
+		NMEPluginTableEnd
+	};
+	static NMEInt const options[] =
+	{
+		kNMEProcessOptDefault,
+		kNMEProcessOptH1Num | kNMEProcessOptH2Num | kNMEProcessOptXRef,
+		kNMEProcessOptNoMultilinePar | kNMEProcessOptNoPreAndPost,
+		-1
+	};
+	NMEOutputSink flushSink = {growBuf, flushOutput, NULL};
+	NMEOutputFormat formats[4];
+	Output expected, output;
+	NMEText buf, out;
+	NMEInt f, o, size, len, bufSize, outLen, outUCS16Len;
+	NMEInt expectedLen, expectedUCS16Len, jobs;
+	
+	formats[0] = withAutoconverts(&NMEOutputFormatHTML);
+	formats[1] = withAutoconverts(&NMEOutputFormatText);
+	formats[2] = withAutoconverts(&NMEOutputFormatLaTeX);
+	formats[3] = NMEOutputFormatHTML;
+	formats[3].parHookFun = parHookIndex;
+	len = strlen(src);
+	for (f = 0; f < 4; f++)
+		for (o = 0; options[o] >= 0; o++)
+		{
+			formats[f].plugins = plugins;
+			
+			expected.text = NULL;
+			expected.len = expected.size = 0;
+			flushSink.data = &expected;
+			buf = NULL;
+			bufSize = 0;
+			Check("processParallel", NMEProcessToSink(src, len, &buf, &bufSize,
+					options[o], "\n", &formats[f], 0, &flushSink,
+					&out, &expectedLen, &expectedUCS16Len) == kNMEErrOk);
+			free(buf);
+			
+			for (size = 1; size <= 64; size *= 4)
+			{
+				output.text = NULL;
+				output.len = output.size = 0;
+				flushSink.data = &output;
+				jobs = 0;
+				Check("processParallel", NMEProcessParallel(src, len, size,
+						options[o], "\n", &formats[f], 0, &flushSink,
+						runJobsReversed, &jobs, &outLen, &outUCS16Len) == kNMEErrOk);
+				Check("processParallel", jobs > 1);
+				checkSameOutput("processParallel", "parallel",
+						expected.text, expected.len, output.text, output.len);
+				Check("processParallel", outLen == expectedLen);
+				Check("processParallel", outUCS16Len == expectedUCS16Len);
+				free(output.text);
+			}
+			free(expected.text);
+		}
+}
+
+/// Calls of hooks, logged by parHookLog
+typedef struct
+{
+	NMEInt count;	///< number of calls
+	NMEInt sum;	///< checksum of the arguments of all the calls
+} HookLog;
+
+/** Paragraph hook which logs its arguments (NMEHookFun).
+	@param[in] level nesting level
+	@param[in] item item number
+	@param[in] enter TRUE when entering, FALSE when exiting
+	@param[in] markup markup
+	@param[in] srcIndex index in source
+	@param[in,out] context current context
+	@param[in,out] data address of HookLog
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr parHookLog(NMEInt level,
+		NMEInt item,
+		NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex,
+		NMEContext *context,
+		void *data)
+{
+	HookLog *log = (HookLog *)data;
+	(void)context;
+	
+	log->count++;
+	log->sum = 31 * log->sum + 1000003 * level + 10007 * item + 101 * enter
+			+ srcIndex + markup[0];
+	return kNMEErrOk;
+}
+
+/// Calls of an eviction function, checked by evictCheck
+typedef struct
+{
+	NMEInt maxSize;	///< maximum size of the cache
+	NMEInt calls;	///< number of calls
+	NMEInt oversize;	///< number of calls where the entries exceeded maxSize
+} EvictLog;
+
+/** Eviction function which checks the size of the entries and removes the
+	least frequently used one (NMEBlockCacheEvictFun).
+	@param[in] entries usage of all entries
+	@param[in] count number of entries
+	@param[in,out] data address of EvictLog
+	@return index in entries of the entry to remove
+*/
+static NMEInt evictCheck(NMEBlockCacheEntryInfo const entries[],
+		NMEInt count,
+		void *data)
+{
+	EvictLog *log = (EvictLog *)data;
+	NMEInt i, size;
+	
+	for (i = size = 0; i < count; i++)
+		size += entries[i].size;
+	log->calls++;
+	if (size > log->maxSize)
+		log->oversize++;
+	return NMEBlockCacheEvictLFU(entries, count, NULL);
+}
+
+/** Check that NMEProcessCached gives the same output and hook calls as
+	NMEProcessToSink after edits which change blocks, heading numbers and
+	offsets, that it reuses unchanged blocks, and that its size is capped.
+*/
+static void testBlockCache(void)
+{
+	static NMEConstText const src[] =
+	{
+		"= One =\n\nFirst par.\n\nSecond **par**.\n\n* list\n* items\n\n"
+			"== Two ==\n\n| a | b\n| c | d\n\nLast par.\n",
+		"= One =\n\nFirst par.\n\nSecond **par**, edited.\n\n* list\n* items\n\n"
+			"== Two ==\n\n| a | b\n| c | d\n\nLast par.\n",
+		"= Zero =\n\n= One =\n\nFirst par.\n\nSecond **par**, edited.\n\n"
+			"* list\n* items\n\n== Two ==\n\n| a | b\n| c | d\n\nLast par.\n",
+		NULL
+	};
+	static NMEInt const options[] =
+	{
+		kNMEProcessOptDefault,
+		kNMEProcessOptH1Num | kNMEProcessOptH2Num | kNMEProcessOptXRef,
+		-1
+	};
+	NMEOutputSink const sink = {growBuf, NULL, NULL};
+	NMEOutputFormat format = NMEOutputFormatHTML;
+	NMEBlockCache cache;
+	HookLog expectedLog, log;
+	EvictLog evictLog;
+	NMEText buf, out, expected;
+	NMEInt i, o, r, len, bufSize, outLen, expectedLen, outUCS16Len, expectedUCS16Len;
+	
+	format.parHookFun = parHookLog;
+	for (o = 0; options[o] >= 0; o++)
+	{
+		evictLog.maxSize = o == 0 ? 1 << 20 : 256;
+		evictLog.calls = evictLog.oversize = 0;
+		NMEBlockCacheBegin(&cache, evictLog.maxSize, evictCheck, &evictLog, &sink);
+		for (r = 0; r < 2; r++)
+			for (i = 0; src[i]; i++)
+			{
+				len = strlen(src[i]);
+				expectedLog.count = expectedLog.sum = 0;
+				format.hookData = &expectedLog;
+				buf = NULL;
+				bufSize = 0;
+				Check("blockCache", NMEProcessToSink(src[i], len, &buf, &bufSize,
+						options[o], "\n", &format, 0, &sink,
+						&out, &outLen, &expectedUCS16Len) == kNMEErrOk);
+				expected = malloc(outLen);
+				memcpy(expected, out, outLen);
+				expectedLen = outLen;
+				free(buf);
+				
+				log.count = log.sum = 0;
+				format.hookData = &log;
+				buf = NULL;
+				bufSize = 0;
+				Check("blockCache", NMEProcessCached(&cache, src[i], len, &buf, &bufSize,
+						options[o], "\n", &format, 0, &sink,
+						&out, &outLen, &outUCS16Len) == kNMEErrOk);
+				checkSameOutput("blockCache", "cached",
+						expected, expectedLen, out, outLen);
+				Check("blockCache", outUCS16Len == expectedUCS16Len);
+				Check("blockCache", log.count == expectedLog.count
+						&& log.sum == expectedLog.sum);
+				free(buf);
+				free(expected);
+			}
+		Check("blockCache", evictLog.oversize == 0);
+		Check("blockCache", o == 0 ? evictLog.calls == 0 : evictLog.calls > 0);
+		NMEBlockCacheEnd(&cache);
+	}
+	
+	// unchanged blocks are reused: they keep the paragraph markup of the
+	// format when they were stored (which a real application mustn't change)
+	format = NMEOutputFormatHTML;
+	NMEBlockCacheBegin(&cache, 1 << 20, NULL, NULL, &sink);
+	buf = NULL;
+	bufSize = 0;
+	Check("blockCache", NMEProcessCached(&cache, src[0], strlen(src[0]),
+			&buf, &bufSize, kNMEProcessOptNoPreAndPost, "\n", &format, 0, &sink,
+			&out, &outLen, NULL) == kNMEErrOk);
+	format.beginPar = "<p class=\"new\">";
+	Check("blockCache", NMEProcessCached(&cache, src[1], strlen(src[1]),
+			&buf, &bufSize, kNMEProcessOptNoPreAndPost, "\n", &format, 0, &sink,
+			&out, &outLen, NULL) == kNMEErrOk);
+	Check("blockCache", strstr(out, "<p>First par.") != NULL);
+	Check("blockCache", strstr(out, "<p class=\"new\">Second") != NULL);
+	Check("blockCache", strstr(out, "<p>Last par.") != NULL);
+	free(buf);
+	NMEBlockCacheEnd(&cache);
+}
+
+int main(void)
+{
+	NMEOutputSink const sink = {growBuf, NULL, NULL};
+	
+	if (NMEMakeAutolinkDict(&dict, dictTerms, &sink) != kNMEErrOk)
+	{
+		fprintf(stderr, "Cannot make dictionary\n");
+		return 1;
+	}
+	
+	testRequiredBufSize();
+	testMispredictedBoundaries();
+	testCachedHeadroom();
+	testUnterminatedLink();
+	testStreamLongLine();
+	testFlushLongLine();
+	testAutolinkDict();
+	testIndexUCS16();
+	testProcessInPlace();
+	testWordwrap();
+	testProcessParallel();
+	testBlockCache();
+	
+	NMEAutolinkDictEnd(&dict);
+	if (failures > 0)
+	{
+		fprintf(stderr, "%d failure(s)\n", failures);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}